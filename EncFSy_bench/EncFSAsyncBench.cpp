@@ -0,0 +1,189 @@
+#include "EncFSBench.h"
+#include "EncFSAsync.h"
+#include "EncFSVolume.h"
+
+#include <stdio.h>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <codecvt>
+
+using namespace std;
+
+// Each reader reads 4 KiB blocks at random offsets of one of the files.
+static const int64_t ASYNC_FILE_SIZE = 4 * 1024 * 1024;
+static const DWORD ASYNC_READ_SIZE = 4096;
+
+struct AsyncRun {
+	atomic<bool> stop{ false };
+	atomic<int> running{ 0 };
+	atomic<uint64_t> bytes{ 0 };
+	atomic<uint64_t> errors{ 0 };
+	HANDLE done = NULL;
+	/** One per reader, a reader runs on one thread at a time. */
+	vector<EncFSLatency> latency;
+};
+
+static EncFS::EncFSDetached asyncReader(AsyncRun &run, EncFS::EncFSAsyncFile &file, int index) {
+	mt19937 random(index + 1);
+	vector<char> buffer(ASYNC_READ_SIZE);
+	EncFSLatency &latency = run.latency[index];
+	while (!run.stop.load(memory_order_relaxed)) {
+		const int64_t offset = (int64_t)(random() % (ASYNC_FILE_SIZE / ASYNC_READ_SIZE)) * ASYNC_READ_SIZE;
+		const int64_t start = benchNow();
+		EncFS::EncFSIoResult result = co_await file.read(offset, span<char>(buffer));
+		latency.add(benchNow() - start);
+		if (result.status == STATUS_SUCCESS) {
+			run.bytes.fetch_add(result.transferred, memory_order_relaxed);
+		}
+		else {
+			run.errors.fetch_add(1, memory_order_relaxed);
+		}
+	}
+	if (run.running.fetch_sub(1) == 1) {
+		SetEvent(run.done);
+	}
+}
+
+/**
+Awaits the task on the calling thread.
+*/
+template<typename T>
+static T asyncWait(EncFS::EncFSTask<T> task) {
+	struct Waiter {
+		static EncFS::EncFSDetached run(EncFS::EncFSTask<T> &task, T &result, HANDLE done) {
+			result = co_await task;
+			SetEvent(done);
+		}
+	};
+	T result{};
+	HANDLE done = CreateEventW(NULL, TRUE, FALSE, NULL);
+	Waiter::run(task, result, done);
+	WaitForSingleObject(done, INFINITE);
+	CloseHandle(done);
+	return result;
+}
+
+static bool asyncPrepare(EncFS::EncFSAsyncFile &file) {
+	if (asyncWait(file.open(FILE_GENERIC_READ | FILE_GENERIC_WRITE, FILE_OPEN_IF)) != STATUS_SUCCESS) {
+		return false;
+	}
+	vector<char> chunk(1024 * 1024);
+	mt19937 random(1);
+	for (char &c : chunk) {
+		c = (char)random();
+	}
+	for (int64_t offset = 0; offset < ASYNC_FILE_SIZE; offset += chunk.size()) {
+		if (asyncWait(file.write(offset, span<const char>(chunk))).status != STATUS_SUCCESS) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void runReaders(vector<unique_ptr<EncFS::EncFSAsyncFile>> &files, int readers, int threads, int duration) {
+	AsyncRun run;
+	run.done = CreateEventW(NULL, TRUE, FALSE, NULL);
+	run.latency.resize(readers);
+	run.running = readers;
+
+	const int64_t start = benchNow();
+	for (int i = 0; i < readers; ++i) {
+		asyncReader(run, *files[i % files.size()], i);
+	}
+	Sleep(duration * 1000);
+	run.stop.store(true);
+	WaitForSingleObject(run.done, INFINITE);
+	const int64_t elapsed = benchNow() - start;
+	CloseHandle(run.done);
+
+	EncFSLatency latency;
+	for (EncFSLatency &l : run.latency) {
+		latency.merge(l);
+	}
+	printf("\n%d readers on %d threads, %zu files, %.3f s\n", readers, threads, files.size(), elapsed / 1e9);
+	printf("  %.0f reads/s, %.2f MiB/s, %llu errors\n",
+		latency.count() / (elapsed / 1e9), run.bytes.load() / (elapsed / 1e9) / (1024 * 1024),
+		(unsigned long long)run.errors.load());
+	printLatencyHeader();
+	printLatency("read", latency);
+}
+
+int asyncMain(int argc, wchar_t* argv[]) {
+	if (argc < 1) {
+		fprintf(stderr, "bench.exe async rootdir [--readers N,N...] [--threads N] [--files N] [--duration Seconds] [--password Password] [--read-only]\n");
+		return EXIT_FAILURE;
+	}
+	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+	const wstring rootDir = argv[0];
+	vector<int> readerCounts = { 1000, 10000 };
+	int threads = 0, fileCount = 16, duration = 10;
+	string password = "bench";
+	bool readOnly = false;
+	for (int i = 1; i < argc; ++i) {
+		if (wcscmp(argv[i], L"--readers") == 0 && i + 1 < argc) {
+			readerCounts.clear();
+			for (const wchar_t* p = argv[++i]; *p; ) {
+				readerCounts.push_back(max(1, _wtoi(p)));
+				const wchar_t* comma = wcschr(p, L',');
+				p = comma ? comma + 1 : p + wcslen(p);
+			}
+		}
+		else if (wcscmp(argv[i], L"--threads") == 0 && i + 1 < argc) {
+			threads = max(1, _wtoi(argv[++i]));
+		}
+		else if (wcscmp(argv[i], L"--files") == 0 && i + 1 < argc) {
+			fileCount = max(1, _wtoi(argv[++i]));
+		}
+		else if (wcscmp(argv[i], L"--duration") == 0 && i + 1 < argc) {
+			duration = max(1, _wtoi(argv[++i]));
+		}
+		else if (wcscmp(argv[i], L"--password") == 0 && i + 1 < argc) {
+			password = strConv.to_bytes(argv[++i]);
+		}
+		else if (wcscmp(argv[i], L"--read-only") == 0) {
+			readOnly = true;
+		}
+		else {
+			fwprintf(stderr, L"unknown option: %s\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	DOKAN_OPERATIONS operations;
+	if (!openBenchVolume(rootDir.c_str(), password.c_str(), STANDARD, false, operations)) {
+		return EXIT_FAILURE;
+	}
+	const int threadCount = threads ? threads : max(1, (int)thread::hardware_concurrency());
+	EncFS::EncFSAsyncVolume volume(benchContext, threadCount);
+
+	vector<unique_ptr<EncFS::EncFSAsyncFile>> files;
+	for (int i = 0; i < fileCount; ++i) {
+		files.emplace_back(new EncFS::EncFSAsyncFile(volume, L"\\async" + to_wstring(i) + L".rnd"));
+		if (!asyncPrepare(*files.back())) {
+			fwprintf(stderr, L"Can't write test file %d\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+	if (readOnly) {
+		// Read the prepared files as a write protected mount does.
+		GetEncFSVolume(benchContext).setReadOnly(true);
+		for (int i = 0; i < fileCount; ++i) {
+			asyncWait(files[i]->close());
+			if (asyncWait(files[i]->open(FILE_GENERIC_READ, FILE_OPEN)) != STATUS_SUCCESS) {
+				fwprintf(stderr, L"Can't open test file %d\n", i);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	EncFS::EncFSListResult listing = asyncWait(volume.list(L"\\"));
+	printf("listed %zu entries of the root\n", listing.entries.size());
+
+	for (int readers : readerCounts) {
+		runReaders(files, readers, threadCount, duration);
+	}
+	for (auto &file : files) {
+		asyncWait(file->close());
+	}
+	return EXIT_SUCCESS;
+}
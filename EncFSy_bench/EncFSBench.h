@@ -0,0 +1,101 @@
+#pragma once
+#include <dokan.h>
+#include <fileinfo.h>
+
+#include "EncFSy.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+/**
+Latency samples of one kind of operation in nanoseconds.
+*/
+class EncFSLatency {
+private:
+	vector<int64_t> samples;
+	bool sorted = true;
+
+public:
+	inline void add(int64_t ns) {
+		this->samples.push_back(ns);
+		this->sorted = false;
+	}
+
+	inline void merge(const EncFSLatency &other) {
+		this->samples.insert(this->samples.end(), other.samples.begin(), other.samples.end());
+		this->sorted = false;
+	}
+
+	inline size_t count() const {
+		return this->samples.size();
+	}
+
+	inline int64_t total() const {
+		int64_t total = 0;
+		for (int64_t sample : this->samples) {
+			total += sample;
+		}
+		return total;
+	}
+
+	/**
+	Nearest rank percentile, p in [0, 1].
+	*/
+	inline int64_t percentile(double p) {
+		if (this->samples.empty()) {
+			return 0;
+		}
+		if (!this->sorted) {
+			sort(this->samples.begin(), this->samples.end());
+			this->sorted = true;
+		}
+		size_t rank = (size_t)(p * this->samples.size());
+		if (rank >= this->samples.size()) {
+			rank = this->samples.size() - 1;
+		}
+		return this->samples[rank];
+	}
+};
+
+/**
+Monotonic clock in nanoseconds.
+*/
+inline int64_t benchNow() {
+	static LARGE_INTEGER frequency = { 0 };
+	if (frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (counter.QuadPart / frequency.QuadPart) * 1000000000LL
+		+ ((counter.QuadPart % frequency.QuadPart) * 1000000000LL) / frequency.QuadPart;
+}
+
+/**
+Volume opened by openBenchVolume.
+*/
+extern EncFSContext* benchContext;
+
+/**
+Unlock the volume of rootDir, creating it first when there is no configuration.
+The operations table drives the engine exactly as Dokan does, without mounting.
+*/
+bool openBenchVolume(LPCWSTR rootDir, const char* password, EncFSMode mode, bool reverse, DOKAN_OPERATIONS &operations);
+
+/**
+A DOKAN_FILE_INFO as Dokan passes it for a request on a handle.
+*/
+void initBenchFileInfo(DOKAN_FILE_INFO &info, ULONG64 context, bool isDirectory);
+
+void printLatencyHeader();
+void printLatency(const char* name, EncFSLatency &latency);
+
+int replayMain(int argc, wchar_t* argv[]);
+int workloadMain(int argc, wchar_t* argv[]);
+int asyncMain(int argc, wchar_t* argv[]);
+int codecMain(int argc, wchar_t* argv[]);
+int kernelsMain(int argc, wchar_t* argv[]);
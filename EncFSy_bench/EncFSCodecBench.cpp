@@ -0,0 +1,272 @@
+#include "EncFSBench.h"
+#include "EncFSVolume.h"
+#include "EncFSStream.h"
+
+#include <stdio.h>
+
+#include <random>
+#include <codecvt>
+#include <vector>
+#include <thread>
+
+/** Size of the file coded by the stream measurements. */
+static const size_t STREAM_SIZE = 64 * 1024 * 1024;
+
+struct CodecProfile {
+	const char* name;
+	EncFS::EncFSMode mode;
+	bool reverse;
+	bool aead;
+};
+
+static const CodecProfile CODEC_PROFILES[] = {
+	{ "standard", EncFS::STANDARD, false, false },
+	{ "paranoia", EncFS::PARANOIA, false, false },
+	{ "reverse", EncFS::STANDARD, true, false },
+	{ "aead", EncFS::STANDARD, false, true },
+};
+
+/**
+MiB/s of coding the block over and over for the duration.
+*/
+static double codecThroughput(EncFS::EncFSVolume &volume, bool encode, const string &block, int64_t duration) {
+	string coded;
+	size_t bytes = 0;
+	const int64_t start = benchNow();
+	int64_t elapsed;
+	int64_t blockNum = 0;
+	do {
+		for (int i = 0; i < 256; ++i) {
+			coded.clear();
+			if (encode) {
+				volume.encodeBlock(1, blockNum++, block, coded);
+			}
+			else {
+				volume.decodeBlock(1, blockNum, block, coded);
+			}
+			bytes += block.size();
+		}
+		elapsed = benchNow() - start;
+	} while (elapsed < duration);
+	return bytes / (elapsed / 1e9) / (1024 * 1024);
+}
+
+/**
+Names per second of decoding a listing where every other name was not encoded by the volume,
+as a directory shared with other programs, by catching the exception or by the returned status.
+*/
+static double nameThroughput(EncFS::EncFSVolume &volume, const vector<string> &names, bool status, int64_t duration) {
+	string plainName;
+	size_t count = 0;
+	const int64_t start = benchNow();
+	int64_t elapsed;
+	do {
+		for (const string &name : names) {
+			plainName.clear();
+			if (status) {
+				volume.tryDecodeFileName(name, "\\bench", plainName);
+			}
+			else {
+				try {
+					volume.decodeFileName(name, "\\bench", plainName);
+				}
+				catch (const EncFS::EncFSInvalidBlockException &ex) {
+				}
+			}
+		}
+		count += names.size();
+		elapsed = benchNow() - start;
+	} while (elapsed < duration);
+	return count / (elapsed / 1e9);
+}
+
+/**
+A temporary file deleted on close, NULL on failure.
+*/
+static HANDLE createTempFile() {
+	WCHAR dir[MAX_PATH], path[MAX_PATH];
+	if (!GetTempPathW(MAX_PATH, dir) || !GetTempFileNameW(dir, L"enc", 0, path)) {
+		return NULL;
+	}
+	HANDLE handle = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	return handle == INVALID_HANDLE_VALUE ? NULL : handle;
+}
+
+static bool rewindFile(HANDLE handle, bool truncate) {
+	LARGE_INTEGER offset;
+	offset.QuadPart = 0;
+	return SetFilePointerEx(handle, offset, NULL, FILE_BEGIN) && (!truncate || SetEndOfFile(handle));
+}
+
+struct StreamRates {
+	const char* profile;
+	int threads;
+	double encode;
+	double decode;
+};
+
+/**
+MiB/s of encoding a plain file with EncFSStream and of decoding it back, as cat and put do, with the threads.
+The files are temporary files which stay in the file cache.
+*/
+static bool streamThroughput(EncFS::EncFSVolume &volume, HANDLE plainFile, HANDLE encodedFile, HANDLE nul, int threads, StreamRates &rates) {
+	rates.threads = threads;
+	EncFS::EncFSStream stream(volume, threads);
+	if (!rewindFile(plainFile, false) || !rewindFile(encodedFile, true)) {
+		return false;
+	}
+	int64_t start = benchNow();
+	if (!stream.encode("\\bench\\stream.bin", plainFile, encodedFile)) {
+		return false;
+	}
+	rates.encode = STREAM_SIZE / ((benchNow() - start) / 1e9) / (1024 * 1024);
+	if (!rewindFile(encodedFile, false)) {
+		return false;
+	}
+	start = benchNow();
+	if (!stream.decode("\\bench\\stream.bin", encodedFile, nul)) {
+		return false;
+	}
+	rates.decode = STREAM_SIZE / ((benchNow() - start) / 1e9) / (1024 * 1024);
+	return true;
+}
+
+static void runStreamProfile(EncFS::EncFSVolume &volume, const char* profileName, vector<StreamRates> &streamRates) {
+	HANDLE plainFile = createTempFile();
+	HANDLE encodedFile = createTempFile();
+	HANDLE nul = CreateFileW(L"NUL", GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (plainFile && encodedFile && nul != INVALID_HANDLE_VALUE) {
+		mt19937 random(1);
+		string data(1024 * 1024, '\0');
+		for (char &c : data) {
+			c = (char)random();
+		}
+		bool written = true;
+		for (size_t i = 0; written && i < STREAM_SIZE / data.size(); ++i) {
+			DWORD writtenLen;
+			written = WriteFile(plainFile, data.data(), (DWORD)data.size(), &writtenLen, NULL) && writtenLen == data.size();
+		}
+		// Once to fill the file cache, then with one thread against all processors.
+		StreamRates rates = { profileName };
+		const int processors = max(1, (int)thread::hardware_concurrency());
+		if (written && streamThroughput(volume, plainFile, encodedFile, nul, 1, rates)) {
+			for (int threads : { 1, processors }) {
+				if (!streamThroughput(volume, plainFile, encodedFile, nul, threads, rates)) {
+					break;
+				}
+				streamRates.push_back(rates);
+			}
+		}
+	}
+	if (nul != INVALID_HANDLE_VALUE) {
+		CloseHandle(nul);
+	}
+	if (encodedFile) {
+		CloseHandle(encodedFile);
+	}
+	if (plainFile) {
+		CloseHandle(plainFile);
+	}
+}
+
+struct NameRates {
+	const char* profile;
+	double thrown;
+	double status;
+};
+
+static void runCodecProfile(const CodecProfile &profile, int64_t duration, vector<NameRates> &nameRates, vector<StreamRates> &streamRates) {
+	// The password buffer is scrubbed by the key derivation.
+	char buff[100];
+	EncFS::EncFSVolume volume;
+	strcpy_s(buff, sizeof buff, "bench");
+	volume.create(buff, profile.mode, profile.reverse, profile.aead);
+	strcpy_s(buff, sizeof buff, "bench");
+	volume.unlock(buff);
+
+	mt19937 random(1);
+	const size_t blockDataSize = volume.getBlockSize() - volume.getHeaderSize();
+	string plainBlock(blockDataSize, '\0'), plainTail(blockDataSize / 2, '\0');
+	for (char &c : plainBlock) {
+		c = (char)random();
+	}
+	for (char &c : plainTail) {
+		c = (char)random();
+	}
+
+	for (int generic = 1; generic >= 0; --generic) {
+		volume.setGenericBlockCodec(generic != 0);
+		string encodedBlock, encodedTail;
+		volume.encodeBlock(1, 0, plainBlock, encodedBlock);
+		volume.encodeBlock(1, 0, plainTail, encodedTail);
+		printf("%-10s %-8s %12.1f %12.1f %12.1f %12.1f\n", profile.name, generic ? "generic" : "fixed",
+			codecThroughput(volume, true, plainBlock, duration),
+			codecThroughput(volume, false, encodedBlock, duration),
+			codecThroughput(volume, true, plainTail, duration),
+			codecThroughput(volume, false, encodedTail, duration));
+	}
+
+	// Foreign names which are not base64 fail at once, the others after the name MAC.
+	vector<string> names;
+	char foreignName[64];
+	for (int i = 0; i < 64; ++i) {
+		string encodedName;
+		volume.encodeFileName("file" + to_string(i) + ".txt", "\\bench", encodedName);
+		names.push_back(encodedName);
+		if (i % 2 == 0) {
+			sprintf_s(foreignName, sizeof foreignName, "IMG_%04d.JPG", i);
+		}
+		else {
+			sprintf_s(foreignName, sizeof foreignName, "ScannedDocument%04dPage%04d", i, i);
+		}
+		names.push_back(foreignName);
+	}
+	nameRates.push_back({ profile.name, nameThroughput(volume, names, false, duration), nameThroughput(volume, names, true, duration) });
+	runStreamProfile(volume, profile.name, streamRates);
+}
+
+int codecMain(int argc, wchar_t* argv[]) {
+	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+	wstring profileName = L"all";
+	int duration = 2;
+	for (int i = 0; i < argc; ++i) {
+		if (wcscmp(argv[i], L"--profile") == 0 && i + 1 < argc) {
+			profileName = argv[++i];
+		}
+		else if (wcscmp(argv[i], L"--duration") == 0 && i + 1 < argc) {
+			duration = max(1, _wtoi(argv[++i]));
+		}
+		else {
+			fwprintf(stderr, L"unknown option: %s\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("%-10s %-8s %12s %12s %12s %12s\n", "profile", "codec", "enc(MiB/s)", "dec(MiB/s)", "enc tail", "dec tail");
+	vector<NameRates> nameRates;
+	vector<StreamRates> streamRates;
+	for (const CodecProfile &profile : CODEC_PROFILES) {
+		if (profileName != L"all" && profileName != strConv.from_bytes(profile.name)) {
+			continue;
+		}
+		runCodecProfile(profile, duration * 1000000000LL, nameRates, streamRates);
+	}
+	if (nameRates.empty()) {
+		fwprintf(stderr, L"unknown profile: %s\n", profileName.c_str());
+		return EXIT_FAILURE;
+	}
+
+	printf("\nHalf foreign directory\n");
+	printf("%-10s %16s %16s\n", "profile", "throw(names/s)", "status(names/s)");
+	for (const NameRates &rates : nameRates) {
+		printf("%-10s %16.0f %16.0f\n", rates.profile, rates.thrown, rates.status);
+	}
+
+	printf("\nWhole file stream of %zu MiB (cat, put)\n", STREAM_SIZE / (1024 * 1024));
+	printf("%-10s %8s %12s %12s\n", "profile", "threads", "enc(MiB/s)", "dec(MiB/s)");
+	for (const StreamRates &rates : streamRates) {
+		printf("%-10s %8d %12.1f %12.1f\n", rates.profile, rates.threads, rates.encode, rates.decode);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,512 @@
+#include "EncFSBench.h"
+#include "EncFSReference.h"
+#include "EncFSVolume.h"
+#include "EncFSUtils.hpp"
+
+#include <stdio.h>
+
+#include <random>
+#include <memory>
+#include <codecvt>
+
+struct KernelProfile {
+	const char* name;
+	EncFS::EncFSMode mode;
+	bool reverse;
+};
+
+static const KernelProfile KERNEL_PROFILES[] = {
+	{ "standard", EncFS::STANDARD, false },
+	{ "paranoia", EncFS::PARANOIA, false },
+	{ "reverse", EncFS::STANDARD, true },
+};
+
+/**
+Random key and data of one call of a kernel.
+*/
+struct KernelInput {
+	EncFSReference::Key key;
+	EncFSReference::BlockFormat format;
+	bool chained;
+	string dirPath;
+	int64_t fileIv;
+	int64_t blockNum;
+	/** Plain data for encode, coded data for decode. */
+	string data;
+};
+
+/**
+Library state the kernels run with, keyed with the key of the input.
+*/
+struct KernelTarget {
+	EncFS::EncFSVolume &volume;
+	string key;
+	HMAC<SHA1> hmac;
+	EncFS::EncFSMutex hmacLock{ "bench::hmacLock" };
+	CFB_Mode<AES>::Encryption cfbEnc;
+	EncFS::EncFSMutex cfbEncLock{ "bench::cfbEncLock" };
+	CFB_Mode<AES>::Decryption cfbDec;
+	EncFS::EncFSMutex cfbDecLock{ "bench::cfbDecLock" };
+	int base64Lookup[256];
+
+	KernelTarget(EncFS::EncFSVolume &volume) : volume(volume) {
+		Base64Decoder::InitializeDecodingLookupArray(this->base64Lookup, EncFS::ALPHABET, 64, false);
+	}
+
+	void setKey(const EncFSReference::Key &key) {
+		if (this->key == key.key + key.iv) {
+			return;
+		}
+		this->key = key.key + key.iv;
+		this->volume.setKey(key.key, key.iv);
+		this->hmac.SetKey((const byte*)key.key.data(), key.key.size());
+	}
+};
+
+typedef void (*KernelEncode)(KernelTarget &target, const KernelInput &input, string &output);
+/** Returns false when the kernel rejects the data. */
+typedef bool (*KernelDecode)(KernelTarget &target, const KernelInput &input, string &output);
+
+/**
+Implementation of an operation. decode is NULL for one way operations.
+*/
+struct Kernel {
+	const char* op;
+	const char* name;
+	KernelEncode encode;
+	KernelDecode decode;
+};
+
+// Frozen references.
+
+static void refMac64(KernelTarget &target, const KernelInput &input, string &output) {
+	byte mac[8];
+	EncFSReference::mac64(input.key.key, input.data, mac);
+	output.assign((const char*)mac, 8);
+}
+
+static void refStreamEncode(KernelTarget &target, const KernelInput &input, string &output) {
+	output = EncFSReference::streamEncrypt(input.key, (uint64_t)(input.blockNum ^ input.fileIv), input.data);
+}
+
+static bool refStreamDecode(KernelTarget &target, const KernelInput &input, string &output) {
+	output = EncFSReference::streamDecrypt(input.key, (uint64_t)(input.blockNum ^ input.fileIv), input.data);
+	return true;
+}
+
+static void refBase64Encode(KernelTarget &target, const KernelInput &input, string &output) {
+	output = EncFSReference::encodeBase64(input.data);
+}
+
+static bool refBase64Decode(KernelTarget &target, const KernelInput &input, string &output) {
+	output = EncFSReference::decodeBase64(input.data);
+	return true;
+}
+
+static void refNameEncode(KernelTarget &target, const KernelInput &input, string &output) {
+	output = EncFSReference::encodeName(input.key, input.chained, input.dirPath, input.data);
+}
+
+static bool refNameDecode(KernelTarget &target, const KernelInput &input, string &output) {
+	return EncFSReference::decodeName(input.key, input.chained, input.dirPath, input.data, output);
+}
+
+static void refBlockEncode(KernelTarget &target, const KernelInput &input, string &output) {
+	output = EncFSReference::encodeBlock(input.key, input.format, input.fileIv, input.blockNum, input.data);
+}
+
+static bool refBlockDecode(KernelTarget &target, const KernelInput &input, string &output) {
+	return EncFSReference::decodeBlock(input.key, input.format, input.fileIv, input.blockNum, input.data, output);
+}
+
+static const Kernel REFERENCE_KERNELS[] = {
+	{ "mac64", "reference", refMac64, NULL },
+	{ "stream", "reference", refStreamEncode, refStreamDecode },
+	{ "base64", "reference", refBase64Encode, refBase64Decode },
+	{ "name", "reference", refNameEncode, refNameDecode },
+	{ "block", "reference", refBlockEncode, refBlockDecode },
+};
+
+// Kernels of the library.
+
+static void libMac64(KernelTarget &target, const KernelInput &input, string &output) {
+	output.resize(8);
+	EncFS::mac64(target.hmac, target.hmacLock, (const byte*)input.data.data(), input.data.size(), &output[0]);
+}
+
+static void libStreamEncode(KernelTarget &target, const KernelInput &input, string &output) {
+	string seed;
+	EncFS::longToBytesByBE(seed, input.blockNum ^ input.fileIv);
+	EncFS::streamEncrypt(target.hmac, target.hmacLock, input.key.key, input.key.iv, seed,
+		target.cfbEnc, target.cfbEncLock, input.data, output);
+}
+
+static bool libStreamDecode(KernelTarget &target, const KernelInput &input, string &output) {
+	string seed;
+	EncFS::longToBytesByBE(seed, input.blockNum ^ input.fileIv);
+	EncFS::streamDecrypt(target.hmac, target.hmacLock, input.key.key, input.key.iv, seed,
+		target.cfbDec, target.cfbDecLock, input.data, output);
+	return true;
+}
+
+static void libBase64Encode(KernelTarget &target, const KernelInput &input, string &output) {
+	EncFS::encodeBase64FileName(input.data, output);
+}
+
+static bool libBase64Decode(KernelTarget &target, const KernelInput &input, string &output) {
+	EncFS::decodeBase64FileName(target.base64Lookup, input.data, output);
+	return true;
+}
+
+static void volumeNameEncode(KernelTarget &target, const KernelInput &input, string &output) {
+	target.volume.encodeFileName(input.data, input.dirPath, output);
+}
+
+static bool volumeNameDecode(KernelTarget &target, const KernelInput &input, string &output) {
+	return target.volume.tryDecodeFileName(input.data, input.dirPath, output);
+}
+
+static void directoryNameEncode(KernelTarget &target, const KernelInput &input, string &output) {
+	EncFS::EncFSVolume::DirectoryContext dir(target.volume, input.dirPath);
+	dir.encodeFileName(input.data, output);
+}
+
+static bool directoryNameDecode(KernelTarget &target, const KernelInput &input, string &output) {
+	EncFS::EncFSVolume::DirectoryContext dir(target.volume, input.dirPath);
+	return dir.tryDecodeFileName(input.data, output);
+}
+
+static void genericBlockEncode(KernelTarget &target, const KernelInput &input, string &output) {
+	target.volume.setGenericBlockCodec(true);
+	target.volume.encodeBlock(input.fileIv, input.blockNum, input.data, output);
+}
+
+static bool genericBlockDecode(KernelTarget &target, const KernelInput &input, string &output) {
+	target.volume.setGenericBlockCodec(true);
+	return target.volume.tryDecodeBlock(input.fileIv, input.blockNum, input.data, output);
+}
+
+static void fixedBlockEncode(KernelTarget &target, const KernelInput &input, string &output) {
+	target.volume.setReadOnly(false);
+	target.volume.encodeBlock(input.fileIv, input.blockNum, input.data, output);
+}
+
+static bool fixedBlockDecode(KernelTarget &target, const KernelInput &input, string &output) {
+	target.volume.setReadOnly(false);
+	return target.volume.tryDecodeBlock(input.fileIv, input.blockNum, input.data, output);
+}
+
+static void localBlockEncode(KernelTarget &target, const KernelInput &input, string &output) {
+	target.volume.setReadOnly(true);
+	target.volume.encodeBlock(input.fileIv, input.blockNum, input.data, output);
+}
+
+static bool localBlockDecode(KernelTarget &target, const KernelInput &input, string &output) {
+	target.volume.setReadOnly(true);
+	return target.volume.tryDecodeBlock(input.fileIv, input.blockNum, input.data, output);
+}
+
+/**
+Kernels checked against the reference of their operation. Register optimized kernels here.
+*/
+static const Kernel KERNELS[] = {
+	{ "mac64", "EncFSUtils", libMac64, NULL },
+	{ "stream", "EncFSUtils", libStreamEncode, libStreamDecode },
+	{ "base64", "EncFSUtils", libBase64Encode, libBase64Decode },
+	{ "name", "volume", volumeNameEncode, volumeNameDecode },
+	{ "name", "directory", directoryNameEncode, directoryNameDecode },
+	{ "block", "generic", genericBlockEncode, genericBlockDecode },
+	{ "block", "fixed", fixedBlockEncode, fixedBlockDecode },
+	{ "block", "fixed-local", localBlockEncode, localBlockDecode },
+};
+
+static string randomBytes(mt19937_64 &random, size_t len) {
+	string data(len, '\0');
+	for (char &c : data) {
+		c = (char)random();
+	}
+	return data;
+}
+
+/**
+Name of any byte but the separators, like the UTF-8 names of Windows.
+*/
+static string randomName(mt19937_64 &random, size_t len) {
+	string name;
+	while (name.size() < len) {
+		const char c = (char)(random() % 255 + 1);
+		if (c != '\\' && c != '/' && c != ':') {
+			name += c;
+		}
+	}
+	return name;
+}
+
+static string randomDirPath(mt19937_64 &random) {
+	string dirPath;
+	const int depth = (int)(random() % 4);
+	for (int i = 0; i < depth; ++i) {
+		dirPath += '\\';
+		dirPath += randomName(random, 1 + random() % 20);
+	}
+	return dirPath;
+}
+
+/**
+Random input for the encoder of the operation.
+*/
+static void randomPlainInput(mt19937_64 &random, const char* op, KernelInput &input) {
+	input.fileIv = (int64_t)random();
+	input.blockNum = (int64_t)(random() % 4 == 0 ? random() : random() % 100000);
+	input.dirPath = randomDirPath(random);
+	const size_t blockDataSize = input.format.blockSize - input.format.macBytes;
+	if (strcmp(op, "name") == 0) {
+		input.data = randomName(random, 1 + random() % 120);
+	}
+	else if (strcmp(op, "base64") == 0) {
+		input.data = randomBytes(random, random() % 200);
+	}
+	else if (strcmp(op, "block") == 0 && random() % 8 == 0) {
+		// A hole.
+		input.data.assign(blockDataSize, '\0');
+	}
+	else if (random() % 2 == 0) {
+		input.data = randomBytes(random, blockDataSize);
+	}
+	else {
+		input.data = randomBytes(random, random() % (blockDataSize + 1));
+	}
+}
+
+/**
+Random input for the decoder of the operation: mostly data coded by the reference,
+else corrupted, truncated or foreign data which must be rejected the same way.
+*/
+static void randomCodedInput(mt19937_64 &random, const Kernel &reference, KernelTarget &target, KernelInput &input) {
+	randomPlainInput(random, reference.op, input);
+	string coded;
+	reference.encode(target, input, coded);
+	const int kind = (int)(random() % 8);
+	if (kind == 0 && !coded.empty()) {
+		coded[random() % coded.size()] ^= (char)(1 << (random() % 8));
+	}
+	else if (kind == 1 && !coded.empty()) {
+		coded.resize(random() % coded.size());
+	}
+	else if (kind == 2) {
+		coded = strcmp(reference.op, "base64") == 0 || strcmp(reference.op, "name") == 0 ?
+			randomName(random, random() % 60) : randomBytes(random, random() % (input.format.blockSize + 1));
+	}
+	input.data = coded;
+}
+
+static string hexPrefix(const string &data) {
+	string hex;
+	char buff[4];
+	for (size_t i = 0; i < data.size() && i < 24; ++i) {
+		sprintf_s(buff, sizeof buff, "%02x", (byte)data[i]);
+		hex += buff;
+	}
+	if (data.size() > 24) {
+		hex += "...";
+	}
+	return hex;
+}
+
+static void reportMismatch(const KernelProfile &profile, const Kernel &kernel, const char* direction, int trial,
+	const KernelInput &input, bool expectedOk, const string &expected, bool actualOk, const string &actual) {
+	printf("MISMATCH %s %s/%s %s trial %d: input %zu bytes %s\n", profile.name, kernel.op, kernel.name, direction,
+		trial, input.data.size(), hexPrefix(input.data).c_str());
+	printf("  reference %s %s\n", expectedOk ? "ok" : "rejected", hexPrefix(expected).c_str());
+	printf("  kernel    %s %s\n", actualOk ? "ok" : "rejected", hexPrefix(actual).c_str());
+}
+
+static const Kernel* findReference(const char* op) {
+	for (const Kernel &reference : REFERENCE_KERNELS) {
+		if (strcmp(reference.op, op) == 0) {
+			return &reference;
+		}
+	}
+	return NULL;
+}
+
+/**
+Check every kernel against its reference on the same random inputs, with a new random key per trial.
+Returns the number of mismatches.
+*/
+static int checkKernels(const KernelProfile &profile, KernelTarget &target, const KernelInput &base, int trials, mt19937_64 &random) {
+	int mismatches = 0;
+	vector<int> kernelMismatches(sizeof KERNELS / sizeof KERNELS[0], 0);
+	for (int trial = 0; trial < trials; ++trial) {
+		KernelInput input = base;
+		input.key.key = randomBytes(random, input.key.key.size());
+		input.key.iv = randomBytes(random, 16);
+		target.setKey(input.key);
+
+		for (const Kernel &reference : REFERENCE_KERNELS) {
+			KernelInput plainInput = input;
+			randomPlainInput(random, reference.op, plainInput);
+			string expected;
+			reference.encode(target, plainInput, expected);
+
+			KernelInput codedInput = input;
+			string decoded;
+			bool decodedOk = false;
+			if (reference.decode) {
+				randomCodedInput(random, reference, target, codedInput);
+				decodedOk = reference.decode(target, codedInput, decoded);
+			}
+
+			for (size_t k = 0; k < sizeof KERNELS / sizeof KERNELS[0]; ++k) {
+				const Kernel &kernel = KERNELS[k];
+				if (strcmp(kernel.op, reference.op) != 0 || kernelMismatches[k] >= 3) {
+					continue;
+				}
+				string actual;
+				kernel.encode(target, plainInput, actual);
+				if (actual != expected) {
+					reportMismatch(profile, kernel, "encode", trial, plainInput, true, expected, true, actual);
+					++kernelMismatches[k];
+					++mismatches;
+					continue;
+				}
+				if (!reference.decode || !kernel.decode) {
+					continue;
+				}
+				actual.clear();
+				const bool actualOk = kernel.decode(target, codedInput, actual);
+				if (actualOk != decodedOk || (decodedOk && actual != decoded)) {
+					reportMismatch(profile, kernel, "decode", trial, codedInput, decodedOk, decoded, actualOk, actual);
+					++kernelMismatches[k];
+					++mismatches;
+				}
+			}
+		}
+	}
+	return mismatches;
+}
+
+/**
+MiB/s of the kernel over the inputs for the duration.
+*/
+static double kernelThroughput(const Kernel &kernel, bool encode, KernelTarget &target, const vector<KernelInput> &inputs, int64_t duration) {
+	string output;
+	size_t bytes = 0;
+	const int64_t start = benchNow();
+	int64_t elapsed;
+	do {
+		for (const KernelInput &input : inputs) {
+			output.clear();
+			if (encode) {
+				kernel.encode(target, input, output);
+			}
+			else {
+				kernel.decode(target, input, output);
+			}
+			bytes += input.data.size();
+		}
+		elapsed = benchNow() - start;
+	} while (elapsed < duration);
+	return bytes / (elapsed / 1e9) / (1024 * 1024);
+}
+
+static void timeKernels(const KernelProfile &profile, KernelTarget &target, const KernelInput &base, int64_t duration, mt19937_64 &random) {
+	KernelInput keyed = base;
+	keyed.key.key = randomBytes(random, keyed.key.key.size());
+	keyed.key.iv = randomBytes(random, 16);
+	target.setKey(keyed.key);
+
+	for (const Kernel &reference : REFERENCE_KERNELS) {
+		// Valid inputs only, rejected ones stop early.
+		vector<KernelInput> plainInputs(64, keyed), codedInputs(64, keyed);
+		for (size_t i = 0; i < plainInputs.size(); ++i) {
+			randomPlainInput(random, reference.op, plainInputs[i]);
+			codedInputs[i] = plainInputs[i];
+			codedInputs[i].data.clear();
+			reference.encode(target, plainInputs[i], codedInputs[i].data);
+		}
+		const double refEncode = kernelThroughput(reference, true, target, plainInputs, duration);
+		const double refDecode = reference.decode ? kernelThroughput(reference, false, target, codedInputs, duration) : 0;
+		printf("%-10s %-8s %-12s %12.1f %12.1f\n", profile.name, reference.op, reference.name, refEncode, refDecode);
+		for (const Kernel &kernel : KERNELS) {
+			if (strcmp(kernel.op, reference.op) != 0) {
+				continue;
+			}
+			const double encode = kernelThroughput(kernel, true, target, plainInputs, duration);
+			const double decode = kernel.decode ? kernelThroughput(kernel, false, target, codedInputs, duration) : 0;
+			printf("%-10s %-8s %-12s %12.1f %12.1f %8.2fx %8.2fx\n", profile.name, kernel.op, kernel.name, encode, decode,
+				encode / refEncode, refDecode > 0 ? decode / refDecode : 0.0);
+		}
+	}
+}
+
+int kernelsMain(int argc, wchar_t* argv[]) {
+	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+	wstring profileName = L"all";
+	int trials = 2000;
+	int duration = 1;
+	uint64_t seed = 1;
+	for (int i = 0; i < argc; ++i) {
+		if (wcscmp(argv[i], L"--profile") == 0 && i + 1 < argc) {
+			profileName = argv[++i];
+		}
+		else if (wcscmp(argv[i], L"--trials") == 0 && i + 1 < argc) {
+			trials = max(1, _wtoi(argv[++i]));
+		}
+		else if (wcscmp(argv[i], L"--duration") == 0 && i + 1 < argc) {
+			duration = max(0, _wtoi(argv[++i]));
+		}
+		else if (wcscmp(argv[i], L"--seed") == 0 && i + 1 < argc) {
+			seed = _wcstoui64(argv[++i], NULL, 10);
+		}
+		else {
+			fwprintf(stderr, L"unknown option: %s\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("seed %llu, %d trials per profile\n", (unsigned long long)seed, trials);
+	mt19937_64 random(seed);
+	bool found = false;
+	int mismatches = 0;
+	for (const KernelProfile &profile : KERNEL_PROFILES) {
+		if (profileName != L"all" && profileName != strConv.from_bytes(profile.name)) {
+			continue;
+		}
+		found = true;
+
+		// The password buffer is scrubbed by the key derivation.
+		char buff[100];
+		EncFS::EncFSVolume volume;
+		strcpy_s(buff, sizeof buff, "bench");
+		volume.create(buff, profile.mode, profile.reverse, false);
+		strcpy_s(buff, sizeof buff, "bench");
+		volume.unlock(buff);
+		unique_ptr<KernelTarget> target(new KernelTarget(volume));
+
+		KernelInput base;
+		base.key.key.resize(volume.getKeySize() / 8);
+		base.format.blockSize = volume.getBlockSize();
+		base.format.macBytes = volume.getHeaderSize();
+		base.format.holes = volume.isAllowHoles();
+		base.chained = volume.isChainedNameIV();
+		base.fileIv = base.blockNum = 0;
+
+		const int profileMismatches = checkKernels(profile, *target, base, trials, random);
+		printf("%s: %s\n", profile.name, profileMismatches == 0 ? "all kernels match the reference" : "MISMATCHES");
+		mismatches += profileMismatches;
+		if (duration > 0) {
+			printf("%-10s %-8s %-12s %12s %12s %9s %9s\n", "profile", "op", "kernel", "enc(MiB/s)", "dec(MiB/s)", "enc", "dec");
+			timeKernels(profile, *target, base, duration * 1000000000LL, random);
+		}
+	}
+	if (!found) {
+		fwprintf(stderr, L"unknown profile: %s\n", profileName.c_str());
+		return EXIT_FAILURE;
+	}
+	if (mismatches > 0) {
+		printf("%d mismatches\n", mismatches);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include <hmac.h>
+#include <sha.h>
+#include <aes.h>
+#include <modes.h>
+
+using namespace std;
+using namespace CryptoPP;
+
+/**
+Frozen scalar implementations of what ssl/aes volumes store on disk: block MACs, the CBC and stream coding of blocks,
+the names and their base64 variant. They are written for clarity, one byte at a time, with fresh ciphers per call.
+bench.exe kernels checks every kernel of the library against them on random inputs.
+Never change them to follow a kernel, a difference means the kernel writes volumes which EncFS can't read.
+*/
+namespace EncFSReference
+{
+	static const char ALPHABET[] = ",-0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+	struct Key {
+		/** AES key of the volume, 24 or 32 bytes. */
+		string key;
+		/** IV of the volume, 16 bytes. */
+		string iv;
+	};
+
+	struct BlockFormat {
+		size_t blockSize;
+		size_t macBytes;
+		bool holes;
+	};
+
+	/**
+	HMAC-SHA1 of the data folded to 8 bytes, from the first 19 bytes of the digest.
+	*/
+	inline void mac64(const string &key, const string &data, byte* mac) {
+		HMAC<SHA1> hmac((const byte*)key.data(), key.size());
+		byte digest[HMAC<SHA1>::DIGESTSIZE];
+		hmac.CalculateDigest(digest, (const byte*)data.data(), data.size());
+		for (int i = 0; i < 8; ++i) {
+			mac[i] = 0;
+		}
+		for (int i = 0; i < 19; ++i) {
+			mac[i % 8] ^= digest[i];
+		}
+	}
+
+	/**
+	mac64 of the data followed by the chain IV in reverse order.
+	*/
+	inline void mac64WithIv(const string &key, const string &data, const byte* chainIv, byte* mac) {
+		string concat(data);
+		for (int i = 7; i >= 0; --i) {
+			concat += (char)chainIv[i];
+		}
+		mac64(key, concat, mac);
+	}
+
+	/**
+	mac64 folded to 2 bytes, with the chain IV of the directory when names are chained, else NULL.
+	*/
+	inline void mac16(const string &key, const string &data, const byte* chainIv, byte* mac) {
+		byte mac8[8];
+		if (chainIv) {
+			mac64WithIv(key, data, chainIv, mac8);
+		}
+		else {
+			mac64(key, data, mac8);
+		}
+		byte mac4[4];
+		for (int i = 0; i < 4; ++i) {
+			mac4[i] = mac8[i + 4] ^ mac8[i];
+		}
+		mac[0] = mac4[2] ^ mac4[0];
+		mac[1] = mac4[3] ^ mac4[1];
+	}
+
+	/**
+	Big endian bytes of the 64 bit seed of a block or a name.
+	*/
+	inline string seedBytes(uint64_t seed) {
+		string bytes;
+		for (int i = 7; i >= 0; --i) {
+			bytes += (char)(byte)(seed >> (i * 8));
+		}
+		return bytes;
+	}
+
+	/**
+	First 16 bytes of the HMAC of the volume IV followed by the 8 byte seed in reverse order.
+	*/
+	inline void ivSpec(const Key &key, const string &seed, byte* spec) {
+		string concat(key.iv);
+		for (int i = 7; i >= 0; --i) {
+			concat += seed[i];
+		}
+		HMAC<SHA1> hmac((const byte*)key.key.data(), key.key.size());
+		byte digest[HMAC<SHA1>::DIGESTSIZE];
+		hmac.CalculateDigest(digest, (const byte*)concat.data(), concat.size());
+		memcpy(spec, digest, 16);
+	}
+
+	inline void shuffle(string &data) {
+		for (size_t i = 1; i < data.size(); ++i) {
+			data[i] ^= data[i - 1];
+		}
+	}
+
+	inline void unshuffle(string &data) {
+		for (size_t i = data.size(); i > 1; --i) {
+			data[i - 1] ^= data[i - 2];
+		}
+	}
+
+	/**
+	Reverse each 64 byte chunk.
+	*/
+	inline void flip(string &data) {
+		for (size_t offset = 0; offset < data.size(); offset += 64) {
+			reverse(data.begin() + offset, data.begin() + min(offset + 64, data.size()));
+		}
+	}
+
+	inline string cfb(const Key &key, const byte* spec, const string &data, bool encrypt) {
+		string result(data.size(), '\0');
+		if (data.empty()) {
+			return result;
+		}
+		if (encrypt) {
+			CFB_Mode<AES>::Encryption cipher((const byte*)key.key.data(), key.key.size(), spec);
+			cipher.ProcessData((byte*)&result[0], (const byte*)data.data(), data.size());
+		}
+		else {
+			CFB_Mode<AES>::Decryption cipher((const byte*)key.key.data(), key.key.size(), spec);
+			cipher.ProcessData((byte*)&result[0], (const byte*)data.data(), data.size());
+		}
+		return result;
+	}
+
+	/**
+	CBC without padding, the data is a multiple of 16 bytes.
+	*/
+	inline string cbc(const Key &key, const byte* spec, const string &data, bool encrypt) {
+		string result(data.size(), '\0');
+		if (data.empty()) {
+			return result;
+		}
+		if (encrypt) {
+			CBC_Mode<AES>::Encryption cipher((const byte*)key.key.data(), key.key.size(), spec);
+			cipher.ProcessData((byte*)&result[0], (const byte*)data.data(), data.size());
+		}
+		else {
+			CBC_Mode<AES>::Decryption cipher((const byte*)key.key.data(), key.key.size(), spec);
+			cipher.ProcessData((byte*)&result[0], (const byte*)data.data(), data.size());
+		}
+		return result;
+	}
+
+	/**
+	Stream coding of the tail block of a file: shuffle, CFB with the IV of the seed, flip, shuffle
+	and CFB again with the IV of the seed plus one.
+	*/
+	inline string streamEncrypt(const Key &key, uint64_t seed, const string &data) {
+		byte spec1[16], spec2[16];
+		ivSpec(key, seedBytes(seed), spec1);
+		ivSpec(key, seedBytes(seed + 1), spec2);
+		string buf(data);
+		shuffle(buf);
+		buf = cfb(key, spec1, buf, true);
+		flip(buf);
+		shuffle(buf);
+		return cfb(key, spec2, buf, true);
+	}
+
+	inline string streamDecrypt(const Key &key, uint64_t seed, const string &data) {
+		byte spec1[16], spec2[16];
+		ivSpec(key, seedBytes(seed), spec1);
+		ivSpec(key, seedBytes(seed + 1), spec2);
+		string buf = cfb(key, spec2, data, false);
+		unshuffle(buf);
+		flip(buf);
+		buf = cfb(key, spec1, buf, false);
+		unshuffle(buf);
+		return buf;
+	}
+
+	/**
+	6 bits per character, least significant bits first.
+	*/
+	inline string encodeBase64(const string &data) {
+		string result;
+		uint32_t work = 0;
+		int bits = 0;
+		for (char c : data) {
+			work |= (uint32_t)(byte)c << bits;
+			bits += 8;
+			while (bits >= 6) {
+				result += ALPHABET[work & 63];
+				work >>= 6;
+				bits -= 6;
+			}
+		}
+		if (bits > 0) {
+			result += ALPHABET[work & 63];
+		}
+		return result;
+	}
+
+	/**
+	Empty when a character is not in the alphabet. Bits left over at the end are dropped.
+	*/
+	inline string decodeBase64(const string &text) {
+		string result;
+		uint32_t work = 0;
+		int bits = 0;
+		for (char c : text) {
+			const char* p = c != '\0' ? strchr(ALPHABET, c) : NULL;
+			if (!p) {
+				return string();
+			}
+			work |= (uint32_t)(p - ALPHABET) << bits;
+			bits += 6;
+			if (bits >= 8) {
+				result += (char)(byte)work;
+				work >>= 8;
+				bits -= 8;
+			}
+		}
+		return result;
+	}
+
+	/**
+	Chain IV of a directory path: mac64 of each name padded to 16 bytes, chained from zeros.
+	*/
+	inline void chainIv(const Key &key, const string &dirPath, byte* iv) {
+		memset(iv, 0, 8);
+		size_t start = 0;
+		while (start <= dirPath.size()) {
+			size_t end = dirPath.find('\\', start);
+			if (end == string::npos) {
+				end = dirPath.size();
+			}
+			if (end > start) {
+				string name = dirPath.substr(start, end - start);
+				const size_t padLen = 16 - name.size() % 16;
+				name.append(padLen, (char)padLen);
+				mac64WithIv(key.key, name, iv, iv);
+			}
+			start = end + 1;
+		}
+	}
+
+	/**
+	Name padded to 16 bytes, encrypted by CBC with the IV of its 2 byte MAC, prefixed with the MAC and base64 encoded.
+	*/
+	inline string encodeName(const Key &key, bool chained, const string &dirPath, const string &name) {
+		byte iv[8] = { 0 };
+		if (chained) {
+			chainIv(key, dirPath, iv);
+		}
+		string padded(name);
+		const size_t padLen = 16 - name.size() % 16;
+		padded.append(padLen, (char)padLen);
+		byte mac[2];
+		mac16(key.key, padded, chained ? iv : NULL, mac);
+
+		string seed((const char*)iv, 8);
+		seed[6] ^= mac[0];
+		seed[7] ^= mac[1];
+		byte spec[16];
+		ivSpec(key, seed, spec);
+		string bin;
+		bin += (char)mac[0];
+		bin += (char)mac[1];
+		bin += cbc(key, spec, padded, true);
+		return encodeBase64(bin);
+	}
+
+	inline bool decodeName(const Key &key, bool chained, const string &dirPath, const string &encodedName, string &name) {
+		const string bin = decodeBase64(encodedName);
+		if (bin.size() < 2 + 16 || (bin.size() - 2) % 16 != 0) {
+			return false;
+		}
+		byte iv[8] = { 0 };
+		if (chained) {
+			chainIv(key, dirPath, iv);
+		}
+		string seed((const char*)iv, 8);
+		seed[6] ^= bin[0];
+		seed[7] ^= bin[1];
+		byte spec[16];
+		ivSpec(key, seed, spec);
+		const string padded = cbc(key, spec, bin.substr(2), false);
+
+		byte mac[2];
+		mac16(key.key, padded, chained ? iv : NULL, mac);
+		if ((byte)bin[0] != mac[0] || (byte)bin[1] != mac[1]) {
+			return false;
+		}
+		const size_t padLen = (byte)padded.back();
+		if (padLen == 0 || padLen > padded.size()) {
+			return false;
+		}
+		for (size_t i = padded.size() - padLen; i < padded.size(); ++i) {
+			if ((byte)padded[i] != padLen) {
+				return false;
+			}
+		}
+		name = padded.substr(0, padded.size() - padLen);
+		return true;
+	}
+
+	/**
+	Block of a file: the MAC of the data in reverse order followed by the data, by CBC when it fills the block
+	and by the stream coding otherwise. A block of zeros is stored as a hole of zeros when holes are allowed.
+	*/
+	inline string encodeBlock(const Key &key, const BlockFormat &format, int64_t fileIv, int64_t blockNum, const string &plain) {
+		if (format.holes && plain.size() + format.macBytes == format.blockSize && plain.find_first_not_of('\0') == string::npos) {
+			return string(format.blockSize, '\0');
+		}
+		byte mac[8];
+		mac64(key.key, plain, mac);
+		string block;
+		for (size_t i = 0; i < format.macBytes; ++i) {
+			block += (char)mac[7 - i];
+		}
+		block += plain;
+
+		const uint64_t seed = (uint64_t)(blockNum ^ fileIv);
+		if (block.size() == format.blockSize) {
+			byte spec[16];
+			ivSpec(key, seedBytes(seed), spec);
+			return cbc(key, spec, block, true);
+		}
+		return streamEncrypt(key, seed, block);
+	}
+
+	inline bool decodeBlock(const Key &key, const BlockFormat &format, int64_t fileIv, int64_t blockNum, const string &encoded, string &plain) {
+		if (format.holes && encoded.size() == format.blockSize && encoded.find_first_not_of('\0') == string::npos) {
+			plain.assign(format.blockSize - format.macBytes, '\0');
+			return true;
+		}
+		if (encoded.size() < format.macBytes) {
+			return false;
+		}
+		const uint64_t seed = (uint64_t)(blockNum ^ fileIv);
+		string block;
+		if (encoded.size() == format.blockSize) {
+			byte spec[16];
+			ivSpec(key, seedBytes(seed), spec);
+			block = cbc(key, spec, encoded, false);
+		}
+		else {
+			block = streamDecrypt(key, seed, encoded);
+		}
+
+		const string data = block.substr(format.macBytes);
+		byte mac[8];
+		mac64(key.key, data, mac);
+		for (size_t i = 0; i < format.macBytes; ++i) {
+			if ((byte)block[i] != mac[7 - i]) {
+				return false;
+			}
+		}
+		plain = data;
+		return true;
+	}
+}
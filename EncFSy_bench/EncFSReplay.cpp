@@ -0,0 +1,393 @@
+#include "EncFSBench.h"
+#include "EncFSTrace.h"
+
+#include <stdio.h>
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <codecvt>
+#include <condition_variable>
+
+using namespace EncFS;
+
+/**
+Contexts of replayed handles by trace handle id.
+*/
+class ReplayHandles {
+private:
+	mutex lock;
+	condition_variable opened;
+	map<uint64_t, ULONG64> contexts;
+
+public:
+	/**
+	Wait until the handle is opened by another thread. Returns false on timeout.
+	*/
+	bool get(uint64_t id, ULONG64 &context) {
+		unique_lock<decltype(this->lock)> lk(this->lock);
+		if (!this->opened.wait_for(lk, chrono::seconds(10), [&] { return this->contexts.count(id) != 0; })) {
+			return false;
+		}
+		context = this->contexts[id];
+		return true;
+	}
+
+	void set(uint64_t id, ULONG64 context) {
+		{
+			// Closed handles are kept with 0, ids are never reused.
+			lock_guard<decltype(this->lock)> lk(this->lock);
+			this->contexts[id] = context;
+		}
+		this->opened.notify_all();
+	}
+};
+
+struct ReplayStats {
+	EncFSLatency replayed[TRACE_OP_COUNT];
+	EncFSLatency recorded[TRACE_OP_COUNT];
+	size_t mismatches[TRACE_OP_COUNT] = { 0 };
+	size_t skipped = 0;
+};
+
+static int WINAPI ReplayFillFindData(PWIN32_FIND_DATAW FindData, PDOKAN_FILE_INFO DokanFileInfo) {
+	UNREFERENCED_PARAMETER(FindData);
+	UNREFERENCED_PARAMETER(DokanFileInfo);
+	return 0;
+}
+
+static BOOL WINAPI ReplayFillFindStreamData(PWIN32_FIND_STREAM_DATA FindStreamData, PVOID FindStreamContext) {
+	UNREFERENCED_PARAMETER(FindStreamData);
+	UNREFERENCED_PARAMETER(FindStreamContext);
+	return TRUE;
+}
+
+static inline const FILETIME* longToFileTime(int64_t time, FILETIME &fileTime) {
+	if (!time) {
+		return NULL;
+	}
+	fileTime.dwLowDateTime = (DWORD)time;
+	fileTime.dwHighDateTime = (DWORD)(time >> 32);
+	return &fileTime;
+}
+
+/**
+Call the operation of the event. Returns false when the op is not replayable.
+*/
+static bool replayEvent(DOKAN_OPERATIONS &operations, const EncFSTraceEvent &event,
+	const wstring &path, const wstring &newPath, vector<char> &buffer, DOKAN_FILE_INFO &info, NTSTATUS &status) {
+	const EncFSTraceRecord &r = event.record;
+	if (buffer.size() < r.length) {
+		buffer.resize(r.length);
+	}
+	DWORD transferred = 0;
+	status = STATUS_SUCCESS;
+	switch (r.op) {
+	case TRACE_CREATE_FILE: {
+		DOKAN_IO_SECURITY_CONTEXT securityContext;
+		ZeroMemory(&securityContext, sizeof securityContext);
+		status = operations.ZwCreateFile(path.c_str(), &securityContext, (ACCESS_MASK)r.args[0], (ULONG)r.args[1],
+			(ULONG)r.args[2], (ULONG)r.args[3], (ULONG)r.args[4], &info);
+		break;
+	}
+	case TRACE_CLEANUP:
+		operations.Cleanup(path.c_str(), &info);
+		break;
+	case TRACE_CLOSE_FILE:
+		operations.CloseFile(path.c_str(), &info);
+		break;
+	case TRACE_READ_FILE:
+		status = operations.ReadFile(path.c_str(), buffer.data(), r.length, &transferred, r.offset, &info);
+		break;
+	case TRACE_WRITE_FILE:
+		status = operations.WriteFile(path.c_str(), buffer.data(), r.length, &transferred, r.offset, &info);
+		break;
+	case TRACE_FLUSH_FILE_BUFFERS:
+		status = operations.FlushFileBuffers(path.c_str(), &info);
+		break;
+	case TRACE_GET_FILE_INFORMATION: {
+		BY_HANDLE_FILE_INFORMATION fileInfo;
+		status = operations.GetFileInformation(path.c_str(), &fileInfo, &info);
+		break;
+	}
+	case TRACE_FIND_FILES:
+		status = operations.FindFiles(path.c_str(), ReplayFillFindData, &info);
+		break;
+	case TRACE_SET_FILE_ATTRIBUTES:
+		status = operations.SetFileAttributes(path.c_str(), (DWORD)r.args[0], &info);
+		break;
+	case TRACE_SET_FILE_TIME: {
+		FILETIME creation, lastAccess, lastWrite;
+		status = operations.SetFileTime(path.c_str(), longToFileTime(r.args[0], creation),
+			longToFileTime(r.args[1], lastAccess), longToFileTime(r.args[2], lastWrite), &info);
+		break;
+	}
+	case TRACE_DELETE_FILE:
+		status = operations.DeleteFile(path.c_str(), &info);
+		break;
+	case TRACE_DELETE_DIRECTORY:
+		status = operations.DeleteDirectory(path.c_str(), &info);
+		break;
+	case TRACE_MOVE_FILE:
+		status = operations.MoveFile(path.c_str(), newPath.c_str(), (BOOL)r.args[0], &info);
+		break;
+	case TRACE_SET_END_OF_FILE:
+		status = operations.SetEndOfFile(path.c_str(), r.offset, &info);
+		break;
+	case TRACE_SET_ALLOCATION_SIZE:
+		status = operations.SetAllocationSize(path.c_str(), r.offset, &info);
+		break;
+	case TRACE_LOCK_FILE:
+		status = operations.LockFile(path.c_str(), r.offset, r.args[0], &info);
+		break;
+	case TRACE_UNLOCK_FILE:
+		status = operations.UnlockFile(path.c_str(), r.offset, r.args[0], &info);
+		break;
+	case TRACE_GET_FILE_SECURITY: {
+		SECURITY_INFORMATION securityInformation = (SECURITY_INFORMATION)r.args[0];
+		ULONG lengthNeeded = 0;
+		status = operations.GetFileSecurity(path.c_str(), &securityInformation, buffer.data(), r.length, &lengthNeeded, &info);
+		break;
+	}
+	case TRACE_GET_DISK_FREE_SPACE: {
+		ULONGLONG freeBytesAvailable, totalNumberOfBytes, totalNumberOfFreeBytes;
+		status = operations.GetDiskFreeSpace(&freeBytesAvailable, &totalNumberOfBytes, &totalNumberOfFreeBytes, &info);
+		break;
+	}
+	case TRACE_GET_VOLUME_INFORMATION: {
+		WCHAR volumeName[MAX_PATH + 1], fileSystemName[MAX_PATH + 1];
+		DWORD serialNumber, maximumComponentLength, fileSystemFlags;
+		status = operations.GetVolumeInformation(volumeName, MAX_PATH + 1, &serialNumber, &maximumComponentLength,
+			&fileSystemFlags, fileSystemName, MAX_PATH + 1, &info);
+		break;
+	}
+	case TRACE_FIND_STREAMS:
+		status = operations.FindStreams(path.c_str(), ReplayFillFindStreamData, NULL, &info);
+		break;
+	default:
+		// SetFileSecurity is not replayed, the recorded descriptor is not in the trace.
+		return false;
+	}
+	return true;
+}
+
+/**
+Create the files and directories which existed before the trace was started,
+so that the opens of the trace find them. Files get the size read by the trace.
+*/
+static void prepareReplay(DOKAN_OPERATIONS &operations, const vector<EncFSTraceEvent> &events) {
+	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+	set<string> seen;
+	map<string, bool> existing; // path to isDirectory
+	map<string, int64_t> sizes;
+	set<string> parents;
+	for (const EncFSTraceEvent &event : events) {
+		const EncFSTraceRecord &r = event.record;
+		if (event.path.empty()) {
+			continue;
+		}
+		for (size_t pos = event.path.find('\\', 1); pos != string::npos; pos = event.path.find('\\', pos + 1)) {
+			parents.insert(event.path.substr(0, pos));
+		}
+		if (r.op == TRACE_READ_FILE) {
+			int64_t end = r.offset + r.transferred;
+			if (sizes[event.path] < end) {
+				sizes[event.path] = end;
+			}
+		}
+		if (r.op != TRACE_CREATE_FILE || !seen.insert(event.path).second) {
+			continue;
+		}
+		// The first open tells whether it existed.
+		if (r.status == STATUS_OBJECT_NAME_COLLISION
+			|| (r.status == STATUS_SUCCESS && (r.args[3] == FILE_OPEN || r.args[3] == FILE_OVERWRITE))) {
+			existing[event.path] = (r.flags & TRACE_IS_DIRECTORY) != 0;
+		}
+	}
+	for (const string &parent : parents) {
+		// Directories made by the trace itself are left to it.
+		if (!seen.count(parent)) {
+			existing[parent] = true;
+		}
+	}
+
+	// map is ordered, so parents come first.
+	vector<char> zero(65536, 0);
+	for (auto &entry : existing) {
+		if (entry.first == "\\") {
+			continue;
+		}
+		const wstring path = strConv.from_bytes(entry.first);
+		const bool isDirectory = entry.second;
+		DOKAN_FILE_INFO info;
+		initBenchFileInfo(info, 0, isDirectory);
+		DOKAN_IO_SECURITY_CONTEXT securityContext;
+		ZeroMemory(&securityContext, sizeof securityContext);
+		NTSTATUS status = operations.ZwCreateFile(path.c_str(), &securityContext,
+			FILE_GENERIC_READ | FILE_GENERIC_WRITE, FILE_ATTRIBUTE_NORMAL,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN_IF,
+			isDirectory ? FILE_DIRECTORY_FILE : FILE_NON_DIRECTORY_FILE, &info);
+		if (status != STATUS_SUCCESS && status != STATUS_OBJECT_NAME_COLLISION) {
+			fprintf(stderr, "Can't prepare %s: 0x%x\n", entry.first.c_str(), status);
+			continue;
+		}
+		if (!isDirectory && status == STATUS_SUCCESS) {
+			const int64_t size = sizes[entry.first];
+			for (int64_t offset = 0; offset < size; offset += zero.size()) {
+				DWORD len = (DWORD)min<int64_t>(zero.size(), size - offset);
+				DWORD written;
+				operations.WriteFile(path.c_str(), zero.data(), len, &written, offset, &info);
+			}
+		}
+		operations.Cleanup(path.c_str(), &info);
+		operations.CloseFile(path.c_str(), &info);
+	}
+}
+
+int replayMain(int argc, wchar_t* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "bench.exe replay traceFile rootdir [--timing] [--no-prepare] [--password Password]\n");
+		return EXIT_FAILURE;
+	}
+	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+	const string traceFile = strConv.to_bytes(argv[0]);
+	const wchar_t* rootDir = argv[1];
+	bool timing = false, prepare = true;
+	string password = "bench";
+	for (int i = 2; i < argc; ++i) {
+		if (wcscmp(argv[i], L"--timing") == 0) {
+			timing = true;
+		}
+		else if (wcscmp(argv[i], L"--no-prepare") == 0) {
+			prepare = false;
+		}
+		else if (wcscmp(argv[i], L"--password") == 0 && i + 1 < argc) {
+			password = strConv.to_bytes(argv[++i]);
+		}
+		else {
+			fwprintf(stderr, L"unknown option: %s\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	EncFSTraceReader reader;
+	if (!reader.open(traceFile)) {
+		fprintf(stderr, "Can't read trace: %s\n", traceFile.c_str());
+		return EXIT_FAILURE;
+	}
+	vector<EncFSTraceEvent> events;
+	EncFSTraceEvent event;
+	while (reader.next(event)) {
+		events.push_back(event);
+	}
+	// Records are written on completion, replay by start.
+	stable_sort(events.begin(), events.end(), [](const EncFSTraceEvent &a, const EncFSTraceEvent &b) {
+		return a.record.start < b.record.start;
+	});
+
+	DOKAN_OPERATIONS operations;
+	if (!openBenchVolume(rootDir, password.c_str(), STANDARD, false, operations)) {
+		return EXIT_FAILURE;
+	}
+	if (prepare) {
+		prepareReplay(operations, events);
+	}
+
+	// Same threads as recorded, each in its recorded order.
+	map<uint32_t, vector<size_t>> threads;
+	set<uint64_t> handleSeen;
+	vector<bool> opensHandle(events.size(), false);
+	for (size_t i = 0; i < events.size(); ++i) {
+		threads[events[i].record.threadId].push_back(i);
+		if (events[i].record.handle && handleSeen.insert(events[i].record.handle).second) {
+			opensHandle[i] = true;
+		}
+	}
+
+	ReplayHandles handles;
+	vector<ReplayStats> stats(threads.size());
+	vector<thread> workers;
+	const int64_t origin = benchNow();
+	size_t t = 0;
+	for (auto &entry : threads) {
+		ReplayStats* threadStats = &stats[t++];
+		const vector<size_t> &indices = entry.second;
+		workers.emplace_back([&, threadStats, indices]() {
+			wstring_convert<codecvt_utf8_utf16<wchar_t>> conv;
+			vector<char> buffer;
+			for (size_t i : indices) {
+				const EncFSTraceEvent &e = events[i];
+				const EncFSTraceRecord &r = e.record;
+				if (timing) {
+					const int64_t wait = r.start - (benchNow() - origin);
+					if (wait > 0) {
+						this_thread::sleep_for(chrono::nanoseconds(wait));
+					}
+				}
+				ULONG64 context = 0;
+				if (r.handle && !opensHandle[i] && !handles.get(r.handle, context)) {
+					++threadStats->skipped;
+					continue;
+				}
+				DOKAN_FILE_INFO info;
+				initBenchFileInfo(info, context, (r.flags & TRACE_IS_DIRECTORY) != 0);
+				info.DeleteOnClose = (r.flags & TRACE_DELETE_ON_CLOSE) != 0;
+				info.PagingIo = (r.flags & TRACE_PAGING_IO) != 0;
+				info.SynchronousIo = (r.flags & TRACE_SYNCHRONOUS_IO) != 0;
+				info.Nocache = (r.flags & TRACE_NOCACHE) != 0;
+				info.WriteToEndOfFile = (r.flags & TRACE_WRITE_TO_END_OF_FILE) != 0;
+
+				const wstring path = conv.from_bytes(e.path);
+				const wstring newPath = conv.from_bytes(e.newPath);
+				NTSTATUS status;
+				const int64_t start = benchNow();
+				if (!replayEvent(operations, e, path, newPath, buffer, info, status)) {
+					++threadStats->skipped;
+					continue;
+				}
+				threadStats->replayed[r.op].add(benchNow() - start);
+				threadStats->recorded[r.op].add(r.duration);
+				if (status != r.status) {
+					++threadStats->mismatches[r.op];
+				}
+				if (r.handle) {
+					handles.set(r.handle, info.Context);
+				}
+			}
+		});
+	}
+	for (thread &worker : workers) {
+		worker.join();
+	}
+	const int64_t elapsed = benchNow() - origin;
+
+	ReplayStats total;
+	for (ReplayStats &s : stats) {
+		for (int op = 0; op < TRACE_OP_COUNT; ++op) {
+			total.replayed[op].merge(s.replayed[op]);
+			total.recorded[op].merge(s.recorded[op]);
+			total.mismatches[op] += s.mismatches[op];
+		}
+		total.skipped += s.skipped;
+	}
+
+	printf("%zu events, %zu threads, %.3f s, %zu skipped\n", events.size(), threads.size(), elapsed / 1e9, total.skipped);
+	printf("\nReplayed\n");
+	printLatencyHeader();
+	for (int op = 1; op < TRACE_OP_COUNT; ++op) {
+		printLatency(getTraceOpName(op), total.replayed[op]);
+	}
+	printf("\nRecorded\n");
+	printLatencyHeader();
+	for (int op = 1; op < TRACE_OP_COUNT; ++op) {
+		printLatency(getTraceOpName(op), total.recorded[op]);
+	}
+	printf("\nStatus different from the trace\n");
+	for (int op = 1; op < TRACE_OP_COUNT; ++op) {
+		if (total.mismatches[op]) {
+			printf("%-22s %10zu\n", getTraceOpName(op), total.mismatches[op]);
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,527 @@
+#include "EncFSBench.h"
+#include "EncFSFile.h"
+#include "EncFSIoStats.h"
+#include "EncFSArena.h"
+
+#include <stdio.h>
+
+#include <atomic>
+#include <random>
+#include <thread>
+#include <codecvt>
+
+enum WorkloadOp {
+	WL_CREATE,
+	WL_OPEN,
+	WL_READ,
+	WL_WRITE,
+	WL_STAT,
+	WL_DELETE,
+	WL_RENAME,
+	WL_CLOSE,
+	WL_OP_COUNT
+};
+
+static const char* WORKLOAD_OP_NAMES[WL_OP_COUNT] = {
+	"create", "open", "read", "write", "stat", "delete", "rename", "close"
+};
+
+/**
+Per thread state of a workload run.
+*/
+struct WorkloadThread {
+	DOKAN_OPERATIONS* operations;
+	bool reverse;
+	int index;
+	mt19937_64 random;
+	vector<char> buffer;
+	EncFSLatency latency[WL_OP_COUNT];
+	uint64_t bytes = 0;
+	uint64_t errors = 0;
+	/** Scenario state. */
+	DOKAN_FILE_INFO info;
+	wstring path;
+	int64_t counter = 0;
+};
+
+/**
+Path as seen through the drive. Reverse volumes show encoded names of the plain root.
+*/
+static wstring viewPath(WorkloadThread &t, const wstring &plainPath) {
+	if (!t.reverse) {
+		return plainPath;
+	}
+	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+	string encodedPath;
+	GetEncFSVolume(benchContext).encodeFilePath(strConv.to_bytes(plainPath), encodedPath);
+	return strConv.from_bytes(encodedPath);
+}
+
+static NTSTATUS wlOpen(WorkloadThread &t, WorkloadOp op, const wstring &path, ACCESS_MASK access,
+	ULONG disposition, bool directory, DOKAN_FILE_INFO &info) {
+	initBenchFileInfo(info, 0, directory);
+	DOKAN_IO_SECURITY_CONTEXT securityContext;
+	ZeroMemory(&securityContext, sizeof securityContext);
+	const int64_t start = benchNow();
+	NTSTATUS status = t.operations->ZwCreateFile(path.c_str(), &securityContext, access, FILE_ATTRIBUTE_NORMAL,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, disposition,
+		directory ? FILE_DIRECTORY_FILE : FILE_NON_DIRECTORY_FILE, &info);
+	t.latency[op].add(benchNow() - start);
+	if (status == STATUS_OBJECT_NAME_COLLISION) {
+		status = STATUS_SUCCESS;
+	}
+	if (status != STATUS_SUCCESS) {
+		++t.errors;
+	}
+	return status;
+}
+
+static void wlClose(WorkloadThread &t, const wstring &path, DOKAN_FILE_INFO &info) {
+	const int64_t start = benchNow();
+	t.operations->Cleanup(path.c_str(), &info);
+	t.operations->CloseFile(path.c_str(), &info);
+	t.latency[WL_CLOSE].add(benchNow() - start);
+}
+
+static NTSTATUS wlRead(WorkloadThread &t, const wstring &path, DOKAN_FILE_INFO &info, DWORD length, int64_t offset) {
+	if (t.buffer.size() < length) {
+		t.buffer.resize(length);
+	}
+	DWORD transferred = 0;
+	const int64_t start = benchNow();
+	NTSTATUS status = t.operations->ReadFile(path.c_str(), t.buffer.data(), length, &transferred, offset, &info);
+	t.latency[WL_READ].add(benchNow() - start);
+	t.bytes += transferred;
+	if (status != STATUS_SUCCESS) {
+		++t.errors;
+	}
+	return status;
+}
+
+static NTSTATUS wlWrite(WorkloadThread &t, const wstring &path, DOKAN_FILE_INFO &info, DWORD length, int64_t offset) {
+	if (t.buffer.size() < length) {
+		t.buffer.resize(length);
+	}
+	// Content changes on every write so holes are never detected.
+	for (DWORD i = 0; i < length; i += 64) {
+		t.buffer[i] = (char)t.random();
+	}
+	DWORD transferred = 0;
+	const int64_t start = benchNow();
+	NTSTATUS status = t.operations->WriteFile(path.c_str(), t.buffer.data(), length, &transferred, offset, &info);
+	t.latency[WL_WRITE].add(benchNow() - start);
+	t.bytes += transferred;
+	if (status != STATUS_SUCCESS) {
+		++t.errors;
+	}
+	return status;
+}
+
+static NTSTATUS wlStat(WorkloadThread &t, const wstring &path, bool directory) {
+	const int64_t start = benchNow();
+	DOKAN_FILE_INFO info;
+	NTSTATUS status = wlOpen(t, WL_OPEN, path, FILE_READ_ATTRIBUTES, FILE_OPEN, directory, info);
+	if (status == STATUS_SUCCESS) {
+		BY_HANDLE_FILE_INFORMATION fileInfo;
+		status = t.operations->GetFileInformation(path.c_str(), &fileInfo, &info);
+		wlClose(t, path, info);
+	}
+	t.latency[WL_STAT].add(benchNow() - start);
+	return status;
+}
+
+static NTSTATUS wlDelete(WorkloadThread &t, const wstring &path, bool directory) {
+	const int64_t start = benchNow();
+	DOKAN_FILE_INFO info;
+	NTSTATUS status = wlOpen(t, WL_OPEN, path, DELETE, FILE_OPEN, directory, info);
+	if (status == STATUS_SUCCESS) {
+		info.DeleteOnClose = TRUE;
+		status = directory ? t.operations->DeleteDirectory(path.c_str(), &info) : t.operations->DeleteFile(path.c_str(), &info);
+		wlClose(t, path, info);
+	}
+	t.latency[WL_DELETE].add(benchNow() - start);
+	return status;
+}
+
+static NTSTATUS wlRename(WorkloadThread &t, const wstring &path, const wstring &newPath, bool directory) {
+	const int64_t start = benchNow();
+	DOKAN_FILE_INFO info;
+	NTSTATUS status = wlOpen(t, WL_OPEN, path, DELETE, FILE_OPEN, directory, info);
+	if (status == STATUS_SUCCESS) {
+		status = t.operations->MoveFile(path.c_str(), newPath.c_str(), FALSE, &info);
+		if (status != STATUS_SUCCESS) {
+			++t.errors;
+		}
+		wlClose(t, newPath, info);
+	}
+	t.latency[WL_RENAME].add(benchNow() - start);
+	return status;
+}
+
+static void wlMakeDirectory(WorkloadThread &t, const wstring &path) {
+	DOKAN_FILE_INFO info;
+	if (wlOpen(t, WL_CREATE, path, FILE_GENERIC_READ, FILE_OPEN_IF, true, info) == STATUS_SUCCESS) {
+		wlClose(t, path, info);
+	}
+}
+
+static void wlMakeFile(WorkloadThread &t, const wstring &path, int64_t size, DWORD chunk) {
+	DOKAN_FILE_INFO info;
+	if (wlOpen(t, WL_CREATE, path, FILE_GENERIC_READ | FILE_GENERIC_WRITE, FILE_OVERWRITE_IF, false, info) != STATUS_SUCCESS) {
+		return;
+	}
+	for (int64_t offset = 0; offset < size; offset += chunk) {
+		wlWrite(t, path, info, (DWORD)min<int64_t>(chunk, size - offset), offset);
+	}
+	wlClose(t, path, info);
+}
+
+/**
+Plain file for reverse volumes, which are read only through the drive.
+*/
+static void wlMakePlainFile(const wstring &rootDir, const wstring &plainPath, int64_t size) {
+	HANDLE handle = CreateFileW((rootDir + plainPath).c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	vector<char> data(1024 * 1024, 'x');
+	for (int64_t offset = 0; offset < size; offset += data.size()) {
+		DWORD written;
+		WriteFile(handle, data.data(), (DWORD)min<int64_t>(data.size(), size - offset), &written, NULL);
+	}
+	CloseHandle(handle);
+}
+
+/**
+A workload: setup runs before the clock starts, step runs until the duration is over.
+*/
+struct Scenario {
+	const char* name;
+	const char* description;
+	bool writes;
+	void(*setup)(WorkloadThread &t, const wstring &rootDir);
+	void(*step)(WorkloadThread &t);
+	void(*teardown)(WorkloadThread &t);
+};
+
+static wstring threadDir(WorkloadThread &t) {
+	return L"\\wl" + to_wstring(t.index);
+}
+
+// Small files: create, write 4 KiB, stat and delete.
+static void smallFilesSetup(WorkloadThread &t, const wstring &rootDir) {
+	UNREFERENCED_PARAMETER(rootDir);
+	wlMakeDirectory(t, threadDir(t));
+}
+
+static void smallFilesStep(WorkloadThread &t) {
+	const wstring path = threadDir(t) + L"\\f" + to_wstring(t.counter++);
+	DOKAN_FILE_INFO info;
+	if (wlOpen(t, WL_CREATE, path, FILE_GENERIC_READ | FILE_GENERIC_WRITE, FILE_CREATE, false, info) != STATUS_SUCCESS) {
+		return;
+	}
+	wlWrite(t, path, info, 4096, 0);
+	wlClose(t, path, info);
+	wlStat(t, path, false);
+	wlDelete(t, path, false);
+}
+
+// Large sequential stream: write 16 MiB in 1 MiB requests, read it back.
+static const int64_t SEQUENTIAL_SIZE = 16 * 1024 * 1024;
+static const DWORD SEQUENTIAL_CHUNK = 1024 * 1024;
+
+static void sequentialSetup(WorkloadThread &t, const wstring &rootDir) {
+	const wstring plainPath = L"\\wl" + to_wstring(t.index) + L".seq";
+	if (t.reverse) {
+		wlMakePlainFile(rootDir, plainPath, SEQUENTIAL_SIZE);
+	}
+	t.path = viewPath(t, plainPath);
+}
+
+static void sequentialStep(WorkloadThread &t) {
+	DOKAN_FILE_INFO info;
+	if (!t.reverse) {
+		wlMakeFile(t, t.path, SEQUENTIAL_SIZE, SEQUENTIAL_CHUNK);
+	}
+	if (wlOpen(t, WL_OPEN, t.path, FILE_GENERIC_READ, FILE_OPEN, false, info) != STATUS_SUCCESS) {
+		return;
+	}
+	for (int64_t offset = 0; offset < SEQUENTIAL_SIZE; offset += SEQUENTIAL_CHUNK) {
+		wlRead(t, t.path, info, SEQUENTIAL_CHUNK, offset);
+	}
+	wlClose(t, t.path, info);
+}
+
+// File tails: rewrite a file with 1 to 1015 bytes and read it back, so every size is coded by the CFB stream kernel.
+static const DWORD TAIL_SIZES = 1015;
+
+static void tailsSetup(WorkloadThread &t, const wstring &rootDir) {
+	UNREFERENCED_PARAMETER(rootDir);
+	t.path = L"\\wl" + to_wstring(t.index) + L".tail";
+}
+
+static void tailsStep(WorkloadThread &t) {
+	const DWORD length = (DWORD)(t.counter++ % TAIL_SIZES) + 1;
+	DOKAN_FILE_INFO info;
+	if (wlOpen(t, WL_CREATE, t.path, FILE_GENERIC_READ | FILE_GENERIC_WRITE, FILE_OVERWRITE_IF, false, info) != STATUS_SUCCESS) {
+		return;
+	}
+	wlWrite(t, t.path, info, length, 0);
+	wlRead(t, t.path, info, length, 0);
+	wlClose(t, t.path, info);
+}
+
+// Random 4 KiB mix: 70% reads, 30% writes on a 64 MiB file kept open.
+static const int64_t RANDOM_SIZE = 64 * 1024 * 1024;
+
+static void randomSetup(WorkloadThread &t, const wstring &rootDir) {
+	const wstring plainPath = L"\\wl" + to_wstring(t.index) + L".rnd";
+	if (t.reverse) {
+		wlMakePlainFile(rootDir, plainPath, RANDOM_SIZE);
+	}
+	else {
+		wlMakeFile(t, plainPath, RANDOM_SIZE, SEQUENTIAL_CHUNK);
+	}
+	t.path = viewPath(t, plainPath);
+	ACCESS_MASK access = t.reverse ? FILE_GENERIC_READ : FILE_GENERIC_READ | FILE_GENERIC_WRITE;
+	wlOpen(t, WL_OPEN, t.path, access, FILE_OPEN, false, t.info);
+}
+
+static void randomStep(WorkloadThread &t) {
+	const int64_t offset = (int64_t)(t.random() % (RANDOM_SIZE / 4096)) * 4096;
+	if (t.reverse || t.random() % 10 < 7) {
+		wlRead(t, t.path, t.info, 4096, offset);
+	}
+	else {
+		wlWrite(t, t.path, t.info, 4096, offset);
+	}
+}
+
+static void randomTeardown(WorkloadThread &t) {
+	wlClose(t, t.path, t.info);
+}
+
+// Directory rename: 100 files under a directory renamed back and forth.
+// With chained name IV every file name under it is encoded again.
+static void renameSetup(WorkloadThread &t, const wstring &rootDir) {
+	UNREFERENCED_PARAMETER(rootDir);
+	wlMakeDirectory(t, threadDir(t));
+	const wstring dir = threadDir(t) + L"\\a";
+	wlMakeDirectory(t, dir);
+	for (int i = 0; i < 100; ++i) {
+		wlMakeFile(t, dir + L"\\f" + to_wstring(i), 1024, 1024);
+	}
+	// Left renamed by a previous run.
+	wlRename(t, threadDir(t) + L"\\b", dir, true);
+}
+
+static void renameStep(WorkloadThread &t) {
+	const wstring a = threadDir(t) + L"\\a";
+	const wstring b = threadDir(t) + L"\\b";
+	if (t.counter++ % 2 == 0) {
+		wlRename(t, a, b, true);
+	}
+	else {
+		wlRename(t, b, a, true);
+	}
+}
+
+// Deep tree: stat a leaf 16 directories down.
+static void deepTreeSetup(WorkloadThread &t, const wstring &rootDir) {
+	wstring plainPath = L"\\wl" + to_wstring(t.index) + L"deep";
+	if (t.reverse) {
+		CreateDirectoryW((rootDir + plainPath).c_str(), NULL);
+	}
+	else {
+		wlMakeDirectory(t, plainPath);
+	}
+	for (int i = 0; i < 16; ++i) {
+		plainPath += L"\\directory" + to_wstring(i);
+		if (t.reverse) {
+			CreateDirectoryW((rootDir + plainPath).c_str(), NULL);
+		}
+		else {
+			wlMakeDirectory(t, plainPath);
+		}
+	}
+	plainPath += L"\\leaf";
+	if (t.reverse) {
+		wlMakePlainFile(rootDir, plainPath, 1024);
+	}
+	else {
+		wlMakeFile(t, plainPath, 1024, 1024);
+	}
+	t.path = viewPath(t, plainPath);
+}
+
+static void deepTreeStep(WorkloadThread &t) {
+	wlStat(t, t.path, false);
+}
+
+static void noTeardown(WorkloadThread &t) {
+	UNREFERENCED_PARAMETER(t);
+}
+
+static const Scenario SCENARIOS[] = {
+	{ "smallfiles", "small file create/stat/delete storm", true, smallFilesSetup, smallFilesStep, noTeardown },
+	{ "sequential", "large sequential write and read", false, sequentialSetup, sequentialStep, noTeardown },
+	{ "random", "random 4 KiB read/write mix", false, randomSetup, randomStep, randomTeardown },
+	{ "tails", "rewrite and read 1 to 1015 byte files", true, tailsSetup, tailsStep, noTeardown },
+	{ "rename", "directory rename", true, renameSetup, renameStep, noTeardown },
+	{ "deeptree", "stat in a deep tree", false, deepTreeSetup, deepTreeStep, noTeardown },
+};
+
+static int64_t processCpuTime() {
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	const int64_t k = ((int64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+	const int64_t u = ((int64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+	// 100ns units
+	return (k + u) * 100;
+}
+
+static void runScenario(const Scenario &scenario, DOKAN_OPERATIONS &operations, const wstring &rootDir,
+	bool reverse, int threadCount, int duration, bool stats) {
+	vector<WorkloadThread> threads(threadCount);
+	for (int i = 0; i < threadCount; ++i) {
+		threads[i].operations = &operations;
+		threads[i].reverse = reverse;
+		threads[i].index = i;
+		threads[i].random.seed(i + 1);
+		scenario.setup(threads[i], rootDir);
+		for (int op = 0; op < WL_OP_COUNT; ++op) {
+			threads[i].latency[op] = EncFSLatency();
+		}
+		threads[i].bytes = 0;
+		threads[i].errors = 0;
+	}
+
+	if (stats) {
+		EncFS::EncFSLockStats::reset();
+		EncFS::EncFSLockStats::setEnabled(true);
+		EncFS::EncFSIoStats::reset();
+		EncFS::EncFSIoStats::setEnabled(true);
+	}
+	atomic<bool> stop(false);
+	vector<thread> workers;
+	const int64_t cpuStart = processCpuTime();
+	const int64_t start = benchNow();
+	for (int i = 0; i < threadCount; ++i) {
+		WorkloadThread* t = &threads[i];
+		workers.emplace_back([&scenario, &stop, t]() {
+			while (!stop.load()) {
+				scenario.step(*t);
+			}
+		});
+	}
+	this_thread::sleep_for(chrono::seconds(duration));
+	stop.store(true);
+	for (thread &worker : workers) {
+		worker.join();
+	}
+	const int64_t elapsed = benchNow() - start;
+	const int64_t cpu = processCpuTime() - cpuStart;
+	EncFS::EncFSLockStats::setEnabled(false);
+	EncFS::EncFSIoStats::setEnabled(false);
+
+	EncFSLatency latency[WL_OP_COUNT];
+	uint64_t bytes = 0, errors = 0;
+	for (WorkloadThread &t : threads) {
+		scenario.teardown(t);
+		for (int op = 0; op < WL_OP_COUNT; ++op) {
+			latency[op].merge(t.latency[op]);
+		}
+		bytes += t.bytes;
+		errors += t.errors;
+	}
+	size_t ops = 0;
+	for (int op = 0; op < WL_OP_COUNT; ++op) {
+		ops += latency[op].count();
+	}
+
+	printf("\n%s: %s, %d threads, %.3f s\n", scenario.name, scenario.description, threadCount, elapsed / 1e9);
+	printf("  %.0f ops/s, %.2f MiB/s, %.2f CPU ns/byte, %llu errors\n",
+		ops / (elapsed / 1e9), bytes / (elapsed / 1e9) / (1024 * 1024),
+		bytes ? (double)cpu / bytes : 0.0, (unsigned long long)errors);
+	printLatencyHeader();
+	for (int op = 0; op < WL_OP_COUNT; ++op) {
+		printLatency(WORKLOAD_OP_NAMES[op], latency[op]);
+	}
+	if (stats) {
+		printf("\n");
+		EncFS::EncFSLockStats::print(stdout);
+		printf("\n");
+		EncFS::EncFSIoStats::print(stdout);
+		printf("\n");
+		EncFS::EncFSArena::print(stdout);
+	}
+}
+
+int workloadMain(int argc, wchar_t* argv[]) {
+	if (argc < 1) {
+		fprintf(stderr, "bench.exe workload rootdir [--scenario Name] [--threads N] [--duration Seconds] [--paranoia] [--reverse] [--stats] [--password Password]\n");
+		return EXIT_FAILURE;
+	}
+	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+	const wstring rootDir = argv[0];
+	wstring scenarioName = L"all";
+	int threadCount = 4, duration = 10;
+	EncFSMode mode = STANDARD;
+	bool reverse = false, stats = false;
+	string password = "bench";
+	for (int i = 1; i < argc; ++i) {
+		if (wcscmp(argv[i], L"--scenario") == 0 && i + 1 < argc) {
+			scenarioName = argv[++i];
+		}
+		else if (wcscmp(argv[i], L"--threads") == 0 && i + 1 < argc) {
+			threadCount = max(1, _wtoi(argv[++i]));
+		}
+		else if (wcscmp(argv[i], L"--duration") == 0 && i + 1 < argc) {
+			duration = max(1, _wtoi(argv[++i]));
+		}
+		else if (wcscmp(argv[i], L"--paranoia") == 0) {
+			mode = PARANOIA;
+		}
+		else if (wcscmp(argv[i], L"--reverse") == 0) {
+			reverse = true;
+		}
+		else if (wcscmp(argv[i], L"--stats") == 0) {
+			stats = true;
+		}
+		else if (wcscmp(argv[i], L"--password") == 0 && i + 1 < argc) {
+			password = strConv.to_bytes(argv[++i]);
+		}
+		else {
+			fwprintf(stderr, L"unknown option: %s\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	DOKAN_OPERATIONS operations;
+	if (!openBenchVolume(rootDir.c_str(), password.c_str(), mode, reverse, operations)) {
+		return EXIT_FAILURE;
+	}
+	// An existing volume keeps its own configuration.
+	EncFS::EncFSVolume &encfs = GetEncFSVolume(benchContext);
+	printf("%svolume: block size %d, chained name IV %d, external IV chaining %d\n",
+		reverse ? "reverse " : "", encfs.getBlockSize(), encfs.isChainedNameIV(), encfs.isExternalIVChaining());
+
+	bool found = false;
+	for (const Scenario &scenario : SCENARIOS) {
+		if (scenarioName != L"all" && scenarioName != strConv.from_bytes(scenario.name)) {
+			continue;
+		}
+		found = true;
+		// Reverse volumes are read only.
+		if (reverse && scenario.writes) {
+			printf("\n%s: skipped on reverse volume\n", scenario.name);
+			continue;
+		}
+		runScenario(scenario, operations, rootDir, reverse, threadCount, duration, stats);
+	}
+	if (!found) {
+		fwprintf(stderr, L"unknown scenario: %s\n", scenarioName.c_str());
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+#include "EncFSBench.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static DOKAN_OPTIONS benchOptions;
+EncFSContext* benchContext = NULL;
+
+static void ShowUsage() {
+	// clang-format off
+	fprintf(stderr, "bench.exe command ...\n"
+		"Commands:\n"
+		"  replay traceFile rootdir [options]\t Re-execute a trace recorded by encfs.exe --trace against rootdir.\n"
+		"    --timing\t\t\t\t Keep the original timing, otherwise as fast as possible.\n"
+		"    --no-prepare\t\t\t Don't create files which existed before the trace started.\n"
+		"    --password Password\t\t\t Password of rootdir. Default to \"bench\".\n"
+		"  workload rootdir [options]\t\t Run synthetic workloads on the engine and report throughput,\n"
+		"\t\t\t\t\t latency percentiles and CPU time per byte.\n"
+		"    --scenario Name\t\t\t smallfiles, sequential, random, tails, rename, deeptree or all. Default to all.\n"
+		"    --threads N\t\t\t Number of threads. Default to 4.\n"
+		"    --duration Seconds\t\t Duration of each scenario. Default to 10.\n"
+		"    --paranoia\t\t\t Create rootdir as paranoia volume.\n"
+		"    --reverse\t\t\t\t Open rootdir as reverse volume. Write scenarios are skipped.\n"
+		"    --stats\t\t\t\t Print lock contention and I/O amplification of each scenario.\n"
+		"    --password Password\t\t\t Password of rootdir. Default to \"bench\".\n"
+		"  async rootdir [options]\t\t Random 4 KiB reads by many coroutines through the awaitable API.\n"
+		"    --readers N,N...\t\t\t Concurrent readers of each run. Default to 1000,10000.\n"
+		"    --threads N\t\t\t Threads of the pool. Default to the number of processors.\n"
+		"    --files N\t\t\t\t Number of files read. Default to 16.\n"
+		"    --duration Seconds\t\t Duration of each run. Default to 10.\n"
+		"    --password Password\t\t\t Password of rootdir. Default to \"bench\".\n"
+		"    --read-only\t\t\t Read the files as a write protected mount does.\n"
+		"  codec [options]\t\t\t Block coding throughput of the generic and the specialized codec in memory,\n"
+		"\t\t\t\t\t name decoding of a half foreign directory by exception and by status,\n"
+		"\t\t\t\t\t and whole file streams with one thread and with all processors.\n"
+		"    --profile Name\t\t\t standard, paranoia, reverse, aead or all. Default to all.\n"
+		"    --duration Seconds\t\t Duration of each measurement. Default to 2.\n"
+		"  kernels [options]\t\t\t Check the block, name, MAC and stream kernels against frozen references\n"
+		"\t\t\t\t\t on random keys and inputs, and compare their speed.\n"
+		"    --profile Name\t\t\t standard, paranoia, reverse or all. Default to all.\n"
+		"    --trials N\t\t\t Random keys checked per profile. Default to 2000.\n"
+		"    --seed N\t\t\t\t Seed of the random inputs. Default to 1.\n"
+		"    --duration Seconds\t\t Duration of each measurement, 0 to only check. Default to 1.\n"
+		"\n"
+		"rootdir is a scratch directory. A new volume is created when it has no .encfs6.xml.\n");
+	// clang-format on
+}
+
+bool openBenchVolume(LPCWSTR rootDir, const char* password, EncFSMode mode, bool reverse, DOKAN_OPERATIONS &operations) {
+	// The password buffer is scrubbed by the key derivation.
+	char buff[100];
+	if (!IsEncFSExists(rootDir)) {
+		strcpy_s(buff, sizeof buff, password);
+		if (CreateEncFS(rootDir, buff, mode, reverse, false) != EXIT_SUCCESS) {
+			fwprintf(stderr, L"Can't create volume: %s\n", rootDir);
+			return false;
+		}
+	}
+
+	static EncFSOptions efo;
+	ZeroMemory(&efo, sizeof(EncFSOptions));
+	wcscpy_s(efo.RootDirectory, sizeof(efo.RootDirectory) / sizeof(WCHAR), rootDir);
+	efo.Reverse = reverse;
+	efo.Timeout = 30000;
+
+	strcpy_s(buff, sizeof buff, password);
+	benchContext = LoadEncFS(efo, buff);
+	if (!benchContext) {
+		fwprintf(stderr, L"Can't unlock volume: %s\n", rootDir);
+		return false;
+	}
+	GetEncFSOperations(operations);
+
+	ZeroMemory(&benchOptions, sizeof(DOKAN_OPTIONS));
+	benchOptions.Version = DOKAN_VERSION;
+	benchOptions.GlobalContext = (ULONG64)benchContext;
+	benchOptions.Options = DOKAN_OPTION_CASE_SENSITIVE;
+	if (reverse) {
+		benchOptions.Options |= DOKAN_OPTION_WRITE_PROTECT;
+	}
+	return true;
+}
+
+void initBenchFileInfo(DOKAN_FILE_INFO &info, ULONG64 context, bool isDirectory) {
+	ZeroMemory(&info, sizeof(DOKAN_FILE_INFO));
+	info.Context = context;
+	info.DokanOptions = &benchOptions;
+	info.ProcessId = GetCurrentProcessId();
+	info.IsDirectory = isDirectory;
+}
+
+void printLatencyHeader() {
+	printf("%-22s %10s %12s %12s %12s %12s\n", "op", "count", "mean(us)", "p50(us)", "p99(us)", "p999(us)");
+}
+
+void printLatency(const char* name, EncFSLatency &latency) {
+	if (latency.count() == 0) {
+		return;
+	}
+	printf("%-22s %10zu %12.1f %12.1f %12.1f %12.1f\n", name, latency.count(),
+		latency.total() / 1000.0 / latency.count(),
+		latency.percentile(0.5) / 1000.0,
+		latency.percentile(0.99) / 1000.0,
+		latency.percentile(0.999) / 1000.0);
+}
+
+int __cdecl wmain(int argc, wchar_t* argv[]) {
+	if (argc < 2) {
+		ShowUsage();
+		return EXIT_FAILURE;
+	}
+
+	DokanInit();
+	int result;
+	if (wcscmp(argv[1], L"replay") == 0) {
+		result = replayMain(argc - 2, argv + 2);
+	}
+	else if (wcscmp(argv[1], L"workload") == 0) {
+		result = workloadMain(argc - 2, argv + 2);
+	}
+	else if (wcscmp(argv[1], L"async") == 0) {
+		result = asyncMain(argc - 2, argv + 2);
+	}
+	else if (wcscmp(argv[1], L"codec") == 0) {
+		result = codecMain(argc - 2, argv + 2);
+	}
+	else if (wcscmp(argv[1], L"kernels") == 0) {
+		result = kernelsMain(argc - 2, argv + 2);
+	}
+	else {
+		ShowUsage();
+		result = EXIT_FAILURE;
+	}
+	DokanShutdown();
+	return result;
+}
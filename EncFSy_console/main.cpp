@@ -26,12 +26,15 @@ THE SOFTWARE.
 #include <iostream>
 #include <windows.h>
 #include <codecvt>
+#include <vector>
 
 using namespace std;
 
 void ShowUsage() {
 	// clang-format off
-	fprintf(stderr, "encfs.exe [options] rootdir mountPoint \n"
+	fprintf(stderr, "encfs.exe [options] rootdir mountPoint [rootdir mountPoint ...]\n"
+		"encfs.exe cat rootdir path\t\t Decrypt the file at path in the volume (ex. \\dir\\file.txt) to stdout.\n"
+		"encfs.exe put rootdir path\t\t Encrypt stdin to the file at path in the volume, replacing it.\n"
 		"  rootdir (ex. c:\\test)\t\t\t Directory source to EncFS.\n"
 		"  mountPoint (ex. m)\t\t\t Mount point. Can be M:\\ (drive letter) or empty NTFS folder C:\\mount\\dokan .\n\n"
 		"Options:\n"
@@ -52,13 +55,24 @@ void ShowUsage() {
 		"  --allocation-unit-size Bytes (ex. 512) Allocation Unit Size of the volume. This will behave on the disk file size.\n"
 		"  --sector-size Bytes (ex. 512)\t\t Sector Size of the volume. This will behave on the disk file size.\n"
 		"  --paranoia AES-256bit / changed name IV / external IV chaining \n"
+		"  --aead Authenticated AES-GCM content encryption for a new volume (not compatible with other EncFS).\n"
 		"  --alt-stream Enable NTFS alternate data stream.\n"
 		"  --case-insensitive Ignore case in filenames.\n"
 		"  --reverse Encrypt rootdir to mountPoint.\n"
+		"  --trace File (ex. C:\\encfs.trace)\t Record every file system call to File for bench.exe replay.\n"
+		"  --stats Print lock contention, cache, large page and I/O amplification statistics on unmount.\n"
+		"  --index Keep decoded file names in rootdir\\.encfs6.index to start warm on the next mount.\n"
+		"  --warm Dirs (ex. \\;\\docs)\t\t List the directories into the index in the background after mounting. Requires --index.\n"
+		"  --warm-depth N \t\t\t Levels listed below the warmed directories. Default to 3.\n"
+		"  --warm-seconds N \t\t\t Time budget of the warming. Default to 60.\n"
+		"  --watch Keep the caches coherent with changes made to rootdir by other programs (sync clients, restores) and show them in Explorer.\n"
+		"  --cache-budget MiB \t\t\t Memory of the block and name caches of all volumes, trimmed on low memory. Default to 512, 0 for no limit.\n"
 		"Examples:\n"
 		"\tencfs.exe C:\\Users M:\t\t\t\t\t # EncFS C:\\Users as RootDirectory into a drive of letter M:\\.\n"
 		"\tencfs.exe C:\\Users C:\\mount\\dokan \t\t\t # EncFS C:\\Users as RootDirectory into NTFS folder C:\\mount\\dokan.\n"
-		"\tencfs.exe C:\\Users M: --dokan-network \\myfs\\myfs1 \t # EncFS C:\\Users as RootDirectory into a network drive M:\\. with UNC \\\\myfs\\myfs1\n\n"
+		"\tencfs.exe C:\\Users M: --dokan-network \\myfs\\myfs1 \t # EncFS C:\\Users as RootDirectory into a network drive M:\\. with UNC \\\\myfs\\myfs1\n"
+		"\tencfs.exe C:\\Work W: D:\\Photos P:\t\t\t # Serve two volumes from one process. Options apply to all of them.\n"
+		"\tencfs.exe cat C:\\Work \\docs\\big.tar > big.tar\t\t # Decrypt one file without mounting the volume.\n\n"
 		"Unmount the drive with CTRL + C in the console or alternatively via \"encfs.exe -u MountPoint\".\n");
 	// clang-format on
 }
@@ -71,12 +85,15 @@ void getpass(const char *prompt, char* password, int size)
 	int ch = 0; // ReadConsole2oCgȏǂݍ܂\邽
 	int a = 0;
 
-	cout << prompt;
+	// stdout and stdin may carry file content.
+	cerr << prompt;
 
 	DWORD con_mode;
 	DWORD dwRead;
 
-	HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE);
+	HANDLE hConsole = CreateFileW(L"CONIN$", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, 0, NULL);
+	HANDLE hIn = hConsole != INVALID_HANDLE_VALUE ? hConsole : GetStdHandle(STD_INPUT_HANDLE);
 
 	GetConsoleMode(hIn, &con_mode);
 	SetConsoleMode(hIn, con_mode & ~(ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT));
@@ -101,8 +118,46 @@ void getpass(const char *prompt, char* password, int size)
 			password[a++] = (char)ch;
 		}
 	}
-	cout << endl;
+	cerr << endl;
 	password[a] = '\0';
+	SetConsoleMode(hIn, con_mode);
+	if (hConsole != INVALID_HANDLE_VALUE) {
+		CloseHandle(hConsole);
+	}
+}
+
+/**
+encfs.exe cat|put rootdir path
+*/
+static int PipeFile(ULONG argc, PWCHAR argv[]) {
+	if (argc != 4) {
+		ShowUsage();
+		return EXIT_FAILURE;
+	}
+	const bool put = wcscmp(argv[1], L"put") == 0;
+	EncFSOptions efo;
+	ZeroMemory(&efo, sizeof(EncFSOptions));
+	wcscpy_s(efo.RootDirectory, sizeof(efo.RootDirectory) / sizeof(WCHAR), argv[2]);
+	efo.Timeout = 30000;
+	if (!IsEncFSExists(efo.RootDirectory)) {
+		fwprintf(stderr, L"EncFS configuration file doesn't exist: %s\n", efo.RootDirectory);
+		return EXIT_FAILURE;
+	}
+
+	char password[100];
+	getpass("Enter password: ", password, sizeof password);
+	EncFSContext* context = LoadEncFS(efo, password);
+	SecureZeroMemory(password, sizeof password);
+	if (!context) {
+		return EXIT_FAILURE;
+	}
+	int result = put ? PutEncFS(context, argv[3], GetStdHandle(STD_INPUT_HANDLE))
+		: CatEncFS(context, argv[3], GetStdHandle(STD_OUTPUT_HANDLE));
+	if (result != EXIT_SUCCESS) {
+		fwprintf(stderr, L"%s: error %lu\n", argv[3], GetLastError());
+	}
+	FreeEncFS(context);
+	return result;
 }
 
 
@@ -110,8 +165,13 @@ void getpass(const char *prompt, char* password, int size)
 int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
 	ULONG command;
 
+	if (argc >= 2 && (wcscmp(argv[1], L"cat") == 0 || wcscmp(argv[1], L"put") == 0)) {
+		return PipeFile(argc, argv);
+	}
+
 	bool unmount = false, list = false;
 	EncFSMode mode = STANDARD;
+	bool aead = false;
 	EncFSOptions efo;
 	ZeroMemory(&efo, sizeof(EncFSOptions));
 	efo.AltStream = FALSE;
@@ -119,6 +179,12 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
 	efo.Reverse = FALSE;
 	efo.Timeout = 30000;
 	efo.SingleThread = FALSE;
+	efo.WarmDepth = 3;
+	efo.WarmSeconds = 60;
+	efo.Watch = FALSE;
+	efo.CacheBudget = 512;
+	// Pairs of rootdir and mountPoint.
+	vector<PWCHAR> paths;
 
 	for (command = 1; command < argc; command++) {
 		if (argv[command][0] == L'-') {
@@ -183,6 +249,9 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
 				else if (wcscmp(argv[command], L"--paranoia") == 0) {
 					mode = PARANOIA;
 				}
+				else if (wcscmp(argv[command], L"--aead") == 0) {
+					aead = true;
+				}
 				else if (wcscmp(argv[command], L"--alt-stream") == 0) {
 					efo.AltStream = TRUE;
 				}
@@ -192,6 +261,35 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
 				else if (wcscmp(argv[command], L"--reverse") == 0) {
 					efo.Reverse = TRUE;
 				}
+				else if (wcscmp(argv[command], L"--stats") == 0) {
+					efo.Stats = TRUE;
+				}
+				else if (wcscmp(argv[command], L"--index") == 0) {
+					efo.NameIndex = TRUE;
+				}
+				else if (wcscmp(argv[command], L"--warm") == 0) {
+					command++;
+					efo.WarmDirectories = argv[command];
+				}
+				else if (wcscmp(argv[command], L"--warm-depth") == 0) {
+					command++;
+					efo.WarmDepth = (ULONG)_wtol(argv[command]);
+				}
+				else if (wcscmp(argv[command], L"--warm-seconds") == 0) {
+					command++;
+					efo.WarmSeconds = (ULONG)_wtol(argv[command]);
+				}
+				else if (wcscmp(argv[command], L"--watch") == 0) {
+					efo.Watch = TRUE;
+				}
+				else if (wcscmp(argv[command], L"--cache-budget") == 0) {
+					command++;
+					efo.CacheBudget = (ULONG)_wtol(argv[command]);
+				}
+				else if (wcscmp(argv[command], L"--trace") == 0) {
+					command++;
+					efo.TraceFile = argv[command];
+				}
 				break;
 			default:
 				fwprintf(stderr, L"unknown command: %s\n", argv[command]);
@@ -200,12 +298,7 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
 		}
 		else {
 			// path
-			if (efo.RootDirectory[0] == L'\0') {
-				wcscpy_s(efo.RootDirectory, sizeof(efo.RootDirectory) / sizeof(WCHAR), argv[command]);
-			}
-			else {
-				wcscpy_s(efo.MountPoint, sizeof(efo.MountPoint) / sizeof(WCHAR), argv[command]);
-			}
+			paths.push_back(argv[command]);
 		}
 	}
 
@@ -233,19 +326,34 @@ int __cdecl wmain(ULONG argc, PWCHAR argv[]) {
 	}
 	else {
 		// Mount drive.
-		if (argc < 3) {
+		if (argc < 3 || paths.size() < 2 || paths.size() % 2 != 0) {
 			ShowUsage();
 			return EXIT_FAILURE;
 		}
 
-		char password[100];
-		if (!IsEncFSExists(efo.RootDirectory)) {
-			printf("EncFS configuration file doesn't exist.\n");
-			getpass("Enter new password: ", password, sizeof password);
-			CreateEncFS(efo.RootDirectory, password, mode, efo.Reverse);
+		const size_t count = paths.size() / 2;
+		vector<EncFSOptions> options(count, efo);
+		vector<char*> passwords(count);
+		for (size_t i = 0; i < count; ++i) {
+			wcscpy_s(options[i].RootDirectory, sizeof(options[i].RootDirectory) / sizeof(WCHAR), paths[i * 2]);
+			wcscpy_s(options[i].MountPoint, sizeof(options[i].MountPoint) / sizeof(WCHAR), paths[i * 2 + 1]);
+			if (count > 1) {
+				fwprintf(stdout, L"%s\n", options[i].RootDirectory);
+			}
+
+			passwords[i] = new char[100];
+			if (!IsEncFSExists(options[i].RootDirectory)) {
+				printf("EncFS configuration file doesn't exist.\n");
+				getpass("Enter new password: ", passwords[i], 100);
+				CreateEncFS(options[i].RootDirectory, passwords[i], mode, options[i].Reverse, aead);
+			}
+			getpass("Enter password: ", passwords[i], 100);
 		}
-		getpass("Enter password: ", password, sizeof password);
 
-		return StartEncFS(efo, password);
+		int result = StartEncFSVolumes(options.data(), passwords.data(), (int)count);
+		for (char* password : passwords) {
+			delete[] password;
+		}
+		return result;
 	}
-}
+}
\ No newline at end of file
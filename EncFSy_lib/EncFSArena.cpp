@@ -0,0 +1,240 @@
+#include "EncFSArena.h"
+
+#include <windows.h>
+
+#include <map>
+#include <mutex>
+#include <algorithm>
+
+namespace EncFS
+{
+	struct EncFSArena::Slab {
+		char* base;
+		size_t bytes;
+		size_t slotCount;
+		bool largePages;
+		/** Slots below were taken at least once, the free ones are in freeList. */
+		size_t next;
+		/** Free slots linked through their first bytes. */
+		char* freeList;
+		size_t used;
+		bool available;
+	};
+
+	static mutex& arenasLock() {
+		static mutex* lock = new mutex();
+		return *lock;
+	}
+
+	static map<size_t, EncFSArena*>& arenas() {
+		static map<size_t, EncFSArena*>* arenas = new map<size_t, EncFSArena*>();
+		return *arenas;
+	}
+
+	/**
+	Enable SeLockMemoryPrivilege in the token of the process, which has it only when
+	the user was granted "Lock pages in memory". Returns the large page size, 0 without the privilege.
+	**/
+	static size_t enableLargePages() {
+		const size_t largePageSize = GetLargePageMinimum();
+		if (largePageSize == 0) {
+			return 0;
+		}
+		HANDLE token;
+		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+			return 0;
+		}
+		TOKEN_PRIVILEGES privileges;
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		bool enabled = false;
+		if (LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)) {
+			// Succeeds without enabling anything when the privilege is not held.
+			enabled = AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+		}
+		CloseHandle(token);
+		return enabled ? largePageSize : 0;
+	}
+
+	static size_t getLargePageSize() {
+		static const size_t largePageSize = enableLargePages();
+		return largePageSize;
+	}
+
+	EncFSArena::EncFSArena(size_t slotSize) : slotSize(max(slotSize, sizeof(char*))), usedSlots(0) {
+	}
+
+	EncFSArena& EncFSArena::get(size_t slotSize) {
+		lock_guard<mutex> lock(arenasLock());
+		EncFSArena* &arena = arenas()[slotSize];
+		if (!arena) {
+			arena = new EncFSArena(slotSize);
+		}
+		return *arena;
+	}
+
+	EncFSArena::Slab* EncFSArena::newSlab() {
+		Slab* slab = new Slab();
+		const size_t largePageSize = getLargePageSize();
+		if (largePageSize) {
+			// Large pages may be unavailable when physical memory is fragmented.
+			slab->bytes = (SLAB_SIZE + largePageSize - 1) / largePageSize * largePageSize;
+			slab->base = (char*)VirtualAlloc(NULL, slab->bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			slab->largePages = slab->base != NULL;
+		}
+		if (!slab->base) {
+			slab->bytes = SLAB_SIZE;
+			slab->base = (char*)VirtualAlloc(NULL, slab->bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			if (!slab->base) {
+				delete slab;
+				return NULL;
+			}
+		}
+		slab->slotCount = slab->bytes / this->slotSize;
+		this->slabs.push_back(slab);
+		slab->available = true;
+		this->available.push_back(slab);
+		return slab;
+	}
+
+	void EncFSArena::releaseSlab(Slab* slab) {
+		this->slabs.erase(find(this->slabs.begin(), this->slabs.end(), slab));
+		if (slab->available) {
+			this->available.erase(find(this->available.begin(), this->available.end(), slab));
+		}
+		VirtualFree(slab->base, 0, MEM_RELEASE);
+		delete slab;
+	}
+
+	size_t EncFSArena::allocate(Slot* slots, size_t count) {
+		lock_guard<decltype(this->lock)> lock(this->lock);
+		size_t taken = 0;
+		while (taken < count) {
+			Slab* slab = this->available.empty() ? this->newSlab() : this->available.back();
+			if (!slab) {
+				break;
+			}
+			while (taken < count && slab->used < slab->slotCount) {
+				char* data;
+				if (slab->freeList) {
+					data = slab->freeList;
+					slab->freeList = *(char**)data;
+				}
+				else {
+					data = slab->base + slab->next++ * this->slotSize;
+				}
+				++slab->used;
+				slots[taken++] = Slot{ slab, data };
+			}
+			if (slab->used == slab->slotCount) {
+				slab->available = false;
+				this->available.pop_back();
+			}
+		}
+		this->usedSlots += taken;
+		return taken;
+	}
+
+	void EncFSArena::release(const Slot* slots, size_t count) {
+		lock_guard<decltype(this->lock)> lock(this->lock);
+		for (size_t i = 0; i < count; ++i) {
+			Slab* slab = slots[i].slab;
+			*(char**)slots[i].data = slab->freeList;
+			slab->freeList = slots[i].data;
+			--slab->used;
+			if (slab->used == 0 && this->slabs.size() > 1) {
+				this->releaseSlab(slab);
+			}
+			else if (!slab->available) {
+				slab->available = true;
+				this->available.push_back(slab);
+			}
+		}
+		this->usedSlots -= count;
+	}
+
+	void EncFSArena::print(FILE* out) {
+		lock_guard<mutex> lock(arenasLock());
+		fprintf(out, "%-28s %8s %14s %14s %14s\n", "arena", "slabs", "slabs(KiB)", "used(KiB)", "large pages %");
+		for (auto &entry : arenas()) {
+			EncFSArena &arena = *entry.second;
+			lock_guard<decltype(arena.lock)> arenaLock(arena.lock);
+			size_t bytes = 0, largeBytes = 0;
+			for (Slab* slab : arena.slabs) {
+				bytes += slab->bytes;
+				if (slab->largePages) {
+					largeBytes += slab->bytes;
+				}
+			}
+			char name[32];
+			sprintf_s(name, sizeof name, "%zu byte slots", arena.slotSize);
+			fprintf(out, "%-28s %8zu %14.1f %14.1f %14.2f\n", name, arena.slabs.size(), bytes / 1024.0,
+				arena.usedSlots * arena.slotSize / 1024.0, bytes ? 100.0 * largeBytes / bytes : 0.0);
+		}
+		fprintf(out, "%-28s %s\n", "large pages", getLargePageSize() ? "enabled" : "not held (SeLockMemoryPrivilege)");
+	}
+
+	bool EncFSArenaBlocks::reserve(size_t bytes) {
+		const size_t needed = (bytes + this->blockDataSize - 1) / this->blockDataSize;
+		if (needed <= this->slots.size()) {
+			return true;
+		}
+		const size_t count = this->slots.size();
+		this->slots.resize(needed);
+		const size_t taken = this->arena.allocate(&this->slots[count], needed - count);
+		if (taken < needed - count) {
+			this->slots.resize(count + taken);
+			return false;
+		}
+		return true;
+	}
+
+	bool EncFSArenaBlocks::assign(const string &data) {
+		const size_t needed = (data.size() + this->blockDataSize - 1) / this->blockDataSize;
+		if (needed < this->slots.size()) {
+			this->arena.release(&this->slots[needed], this->slots.size() - needed);
+			this->slots.resize(needed);
+		}
+		this->length = 0;
+		if (!this->append(data.data(), data.size())) {
+			this->clear();
+			return false;
+		}
+		return true;
+	}
+
+	bool EncFSArenaBlocks::append(const char* data, size_t len) {
+		if (!this->reserve(this->length + len)) {
+			return false;
+		}
+		while (len > 0) {
+			const size_t offset = this->length % this->blockDataSize;
+			const size_t chunk = min(len, this->blockDataSize - offset);
+			memcpy(this->slots[this->length / this->blockDataSize].data + offset, data, chunk);
+			data += chunk;
+			len -= chunk;
+			this->length += chunk;
+		}
+		return true;
+	}
+
+	void EncFSArenaBlocks::copy(size_t pos, size_t len, char* dest) const {
+		while (len > 0) {
+			const size_t offset = pos % this->blockDataSize;
+			const size_t chunk = min(len, this->blockDataSize - offset);
+			memcpy(dest, this->slots[pos / this->blockDataSize].data + offset, chunk);
+			dest += chunk;
+			pos += chunk;
+			len -= chunk;
+		}
+	}
+
+	void EncFSArenaBlocks::clear() {
+		if (!this->slots.empty()) {
+			this->arena.release(this->slots.data(), this->slots.size());
+			this->slots.clear();
+			this->slots.shrink_to_fit();
+		}
+		this->length = 0;
+	}
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "EncFSLock.h"
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+
+using namespace std;
+
+namespace EncFS
+{
+	/**
+	Fixed size slots for the plain blocks cached by the file states, one arena per block size.
+	Slots are carved from slabs of large pages when the process holds SeLockMemoryPrivilege,
+	which keeps TLB misses down when the caches reach gigabytes, else from slabs of normal pages.
+	A slab is given back to Windows when all of its slots are free, except the last one.
+	**/
+	class EncFSArena {
+	public:
+		/** Bytes of a slab of normal pages, rounded up to the large page size for large pages. */
+		static const size_t SLAB_SIZE = 2 * 1024 * 1024;
+
+		struct Slab;
+
+		struct Slot {
+			Slab* slab;
+			char* data;
+		};
+
+	private:
+		const size_t slotSize;
+		EncFSMutex lock{ "EncFSArena::lock" };
+		vector<Slab*> slabs;
+		/** Slabs with free slots, the last one is used first. */
+		vector<Slab*> available;
+		size_t usedSlots;
+
+		EncFSArena(size_t slotSize);
+		~EncFSArena() {};
+
+		Slab* newSlab();
+		void releaseSlab(Slab* slab);
+
+	public:
+		EncFSArena(const EncFSArena&) = delete;
+		EncFSArena& operator=(const EncFSArena&) = delete;
+
+		/**
+		Arena of the slot size, shared by the volumes of the process. Never destructed.
+		**/
+		static EncFSArena& get(size_t slotSize);
+
+		/**
+		Take up to count slots. Returns the number taken, fewer when Windows is out of memory.
+		**/
+		size_t allocate(Slot* slots, size_t count);
+		void release(const Slot* slots, size_t count);
+
+		inline size_t getSlotSize() {
+			return this->slotSize;
+		}
+
+		/**
+		Print the slabs of the arenas and the share of the slots on large pages.
+		**/
+		static void print(FILE* out);
+	};
+
+	/**
+	Consecutive plain blocks in slots of an arena, one block per slot, with a string like interface.
+	All blocks are full but the last one.
+	**/
+	class EncFSArenaBlocks {
+	private:
+		EncFSArena &arena;
+		/** Plain bytes of a block, stored at the start of its slot. */
+		const size_t blockDataSize;
+		vector<EncFSArena::Slot> slots;
+		size_t length;
+
+	public:
+		EncFSArenaBlocks(size_t blockSize, size_t blockDataSize) : arena(EncFSArena::get(blockSize)),
+			blockDataSize(blockDataSize), length(0) {
+		}
+		~EncFSArenaBlocks() {
+			this->clear();
+		}
+
+		EncFSArenaBlocks(const EncFSArenaBlocks&) = delete;
+		EncFSArenaBlocks& operator=(const EncFSArenaBlocks&) = delete;
+
+		inline size_t size() const {
+			return this->length;
+		}
+
+		inline bool empty() const {
+			return this->length == 0;
+		}
+
+		/**
+		Take slots until the bytes fit. Returns false when Windows is out of memory.
+		**/
+		bool reserve(size_t bytes);
+
+		/**
+		Replace the blocks, keeping the slots which are still needed.
+		Returns false and holds nothing when Windows is out of memory.
+		**/
+		bool assign(const string &data);
+
+		/**
+		Append bytes. Returns false and keeps the former blocks when Windows is out of memory.
+		**/
+		bool append(const char* data, size_t len);
+
+		/**
+		Copy len bytes at the position, which must be within the blocks.
+		**/
+		void copy(size_t pos, size_t len, char* dest) const;
+
+		/**
+		Give the slots back to the arena.
+		**/
+		void clear();
+	};
+}
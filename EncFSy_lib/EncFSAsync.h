@@ -0,0 +1,339 @@
+#pragma once
+#include <dokan.h>
+
+#include "EncFSy.h"
+
+#include <coroutine>
+#include <exception>
+#include <span>
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdint>
+
+#if !defined(__cpp_impl_coroutine)
+#error EncFSAsync.h requires C++20 (/std:c++20).
+#endif
+
+using namespace std;
+
+/**
+Awaitable operations on a loaded volume, for applications which embed the engine without mounting it.
+The engine calls block, so they run on a thread pool of a few threads. Any number of operations
+can be in flight as suspended coroutines without a thread each.
+*/
+namespace EncFS
+{
+	struct EncFSIoResult {
+		NTSTATUS status;
+		DWORD transferred;
+	};
+
+	struct EncFSListResult {
+		NTSTATUS status;
+		vector<WIN32_FIND_DATAW> entries;
+	};
+
+	/**
+	Coroutine returning T. It starts when it's awaited and resumes the awaiting coroutine when it returns.
+	**/
+	template<typename T>
+	class EncFSTask {
+	public:
+		struct promise_type {
+			T value{};
+			exception_ptr error;
+			coroutine_handle<> continuation;
+
+			EncFSTask get_return_object() {
+				return EncFSTask(coroutine_handle<promise_type>::from_promise(*this));
+			}
+
+			suspend_always initial_suspend() noexcept {
+				return {};
+			}
+
+			auto final_suspend() noexcept {
+				struct FinalAwaiter {
+					bool await_ready() noexcept {
+						return false;
+					}
+					coroutine_handle<> await_suspend(coroutine_handle<promise_type> handle) noexcept {
+						coroutine_handle<> continuation = handle.promise().continuation;
+						return continuation ? continuation : noop_coroutine();
+					}
+					void await_resume() noexcept {}
+				};
+				return FinalAwaiter{};
+			}
+
+			void return_value(T value) {
+				this->value = move(value);
+			}
+
+			void unhandled_exception() {
+				this->error = current_exception();
+			}
+		};
+
+	private:
+		coroutine_handle<promise_type> handle;
+
+	public:
+		explicit EncFSTask(coroutine_handle<promise_type> handle) : handle(handle) {}
+		EncFSTask(EncFSTask &&other) noexcept : handle(other.handle) {
+			other.handle = nullptr;
+		}
+		~EncFSTask() {
+			if (this->handle) {
+				this->handle.destroy();
+			}
+		}
+
+		EncFSTask(const EncFSTask&) = delete;
+		EncFSTask& operator=(const EncFSTask&) = delete;
+
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept {
+			this->handle.promise().continuation = awaiting;
+			return this->handle;
+		}
+
+		T await_resume() {
+			if (this->handle.promise().error) {
+				rethrow_exception(this->handle.promise().error);
+			}
+			return move(this->handle.promise().value);
+		}
+	};
+
+	/**
+	Coroutine which runs on its own and frees itself when it returns, for starting concurrent operations.
+	**/
+	struct EncFSDetached {
+		struct promise_type {
+			EncFSDetached get_return_object() {
+				return {};
+			}
+			suspend_never initial_suspend() noexcept {
+				return {};
+			}
+			suspend_never final_suspend() noexcept {
+				return {};
+			}
+			void return_void() {}
+			void unhandled_exception() {
+				terminate();
+			}
+		};
+	};
+
+	/**
+	Windows thread pool which runs the engine calls of the awaitable operations.
+	The destructor waits for the submitted callbacks.
+	**/
+	class EncFSAsyncPool {
+	private:
+		PTP_POOL pool;
+		PTP_CLEANUP_GROUP cleanupGroup;
+		TP_CALLBACK_ENVIRON environment;
+
+		static void CALLBACK run(PTP_CALLBACK_INSTANCE instance, PVOID context) {
+			UNREFERENCED_PARAMETER(instance);
+			coroutine_handle<>::from_address(context).resume();
+		}
+
+	public:
+		/**
+		threads is the maximum number of threads, 0 for the number of processors.
+		**/
+		explicit EncFSAsyncPool(DWORD threads) {
+			if (threads == 0) {
+				threads = thread::hardware_concurrency();
+			}
+			if (threads == 0) {
+				threads = 1;
+			}
+			InitializeThreadpoolEnvironment(&this->environment);
+			this->pool = CreateThreadpool(NULL);
+			this->cleanupGroup = CreateThreadpoolCleanupGroup();
+			if (this->pool) {
+				SetThreadpoolThreadMaximum(this->pool, threads);
+				SetThreadpoolThreadMinimum(this->pool, 1);
+				SetThreadpoolCallbackPool(&this->environment, this->pool);
+			}
+			if (this->cleanupGroup) {
+				SetThreadpoolCallbackCleanupGroup(&this->environment, this->cleanupGroup, NULL);
+			}
+		}
+		~EncFSAsyncPool() {
+			if (this->cleanupGroup) {
+				CloseThreadpoolCleanupGroupMembers(this->cleanupGroup, FALSE, NULL);
+				CloseThreadpoolCleanupGroup(this->cleanupGroup);
+			}
+			DestroyThreadpoolEnvironment(&this->environment);
+			if (this->pool) {
+				CloseThreadpool(this->pool);
+			}
+		}
+
+		EncFSAsyncPool(const EncFSAsyncPool&) = delete;
+		EncFSAsyncPool& operator=(const EncFSAsyncPool&) = delete;
+
+		/**
+		Continue the awaiting coroutine on the pool.
+		**/
+		auto schedule() {
+			struct Awaiter {
+				EncFSAsyncPool &pool;
+				bool await_ready() noexcept {
+					return false;
+				}
+				bool await_suspend(coroutine_handle<> handle) noexcept {
+					// Continue on the calling thread when the pool can't take the callback.
+					return TrySubmitThreadpoolCallback(run, handle.address(), &this->pool.environment) != FALSE;
+				}
+				void await_resume() noexcept {}
+			};
+			return Awaiter{ *this };
+		}
+	};
+
+	/**
+	Volume loaded by LoadEncFS, driven through its Dokan operations as Dokan does.
+	It must outlive the operations started on it.
+	**/
+	class EncFSAsyncVolume {
+		friend class EncFSAsyncFile;
+
+	private:
+		DOKAN_OPERATIONS operations;
+		DOKAN_OPTIONS options;
+		EncFSAsyncPool pool;
+
+		void initFileInfo(DOKAN_FILE_INFO &info, ULONG64 context, bool isDirectory) {
+			ZeroMemory(&info, sizeof(DOKAN_FILE_INFO));
+			info.Context = context;
+			info.DokanOptions = &this->options;
+			info.ProcessId = GetCurrentProcessId();
+			info.IsDirectory = isDirectory;
+		}
+
+		static vector<WIN32_FIND_DATAW>*& listing() {
+			static thread_local vector<WIN32_FIND_DATAW>* entries = nullptr;
+			return entries;
+		}
+
+		static int WINAPI fillFindData(PWIN32_FIND_DATAW findData, PDOKAN_FILE_INFO info) {
+			UNREFERENCED_PARAMETER(info);
+			listing()->push_back(*findData);
+			return 0;
+		}
+
+	public:
+		EncFSAsyncVolume(EncFSContext* context, DWORD threads = 0) : pool(threads) {
+			GetEncFSOperations(this->operations);
+			ZeroMemory(&this->options, sizeof(DOKAN_OPTIONS));
+			this->options.Version = DOKAN_VERSION;
+			this->options.GlobalContext = (ULONG64)context;
+			this->options.Options = DOKAN_OPTION_CASE_SENSITIVE;
+		}
+
+		EncFSAsyncVolume(const EncFSAsyncVolume&) = delete;
+		EncFSAsyncVolume& operator=(const EncFSAsyncVolume&) = delete;
+
+		/**
+		Entries of the directory as Dokan lists them, "." and ".." included except in the root.
+		**/
+		EncFSTask<EncFSListResult> list(wstring path) {
+			co_await this->pool.schedule();
+			EncFSListResult result;
+			DOKAN_FILE_INFO info;
+			this->initFileInfo(info, 0, true);
+			listing() = &result.entries;
+			result.status = this->operations.FindFiles(path.c_str(), fillFindData, &info);
+			listing() = nullptr;
+			co_return result;
+		}
+	};
+
+	/**
+	File of an EncFSAsyncVolume. Reads and writes may overlap each other once it's open.
+	**/
+	class EncFSAsyncFile {
+	private:
+		EncFSAsyncVolume &volume;
+		const wstring path;
+		DOKAN_FILE_INFO info;
+		bool opened;
+
+	public:
+		EncFSAsyncFile(EncFSAsyncVolume &volume, const wstring &path) : volume(volume), path(path), opened(false) {
+			volume.initFileInfo(this->info, 0, false);
+		}
+		~EncFSAsyncFile() {
+			// Closed without awaiting close().
+			if (this->opened) {
+				this->volume.operations.Cleanup(this->path.c_str(), &this->info);
+				this->volume.operations.CloseFile(this->path.c_str(), &this->info);
+			}
+		}
+
+		EncFSAsyncFile(const EncFSAsyncFile&) = delete;
+		EncFSAsyncFile& operator=(const EncFSAsyncFile&) = delete;
+
+		/**
+		Open the file with an access mask and an NT create disposition (FILE_OPEN, FILE_OPEN_IF, FILE_OVERWRITE_IF...),
+		as ZwCreateFile takes them, not the CreateFile ones (OPEN_EXISTING, CREATE_ALWAYS...).
+		**/
+		EncFSTask<NTSTATUS> open(ACCESS_MASK access, ULONG disposition) {
+			co_await this->volume.pool.schedule();
+			DOKAN_IO_SECURITY_CONTEXT securityContext;
+			ZeroMemory(&securityContext, sizeof securityContext);
+			NTSTATUS status = this->volume.operations.ZwCreateFile(this->path.c_str(), &securityContext, access,
+				FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, disposition,
+				FILE_NON_DIRECTORY_FILE, &this->info);
+			if (status == STATUS_OBJECT_NAME_COLLISION) {
+				// Opened an existing file with FILE_OPEN_IF, FILE_OVERWRITE_IF or FILE_SUPERSEDE.
+				status = STATUS_SUCCESS;
+			}
+			this->opened = status == STATUS_SUCCESS;
+			co_return status;
+		}
+
+		EncFSTask<EncFSIoResult> read(int64_t offset, span<char> buffer) {
+			co_await this->volume.pool.schedule();
+			// Dokan gives each request its own copy of the file info.
+			DOKAN_FILE_INFO info = this->info;
+			EncFSIoResult result = { STATUS_SUCCESS, 0 };
+			result.status = this->volume.operations.ReadFile(this->path.c_str(), buffer.data(), (DWORD)buffer.size(),
+				&result.transferred, offset, &info);
+			co_return result;
+		}
+
+		EncFSTask<EncFSIoResult> write(int64_t offset, span<const char> buffer) {
+			co_await this->volume.pool.schedule();
+			DOKAN_FILE_INFO info = this->info;
+			EncFSIoResult result = { STATUS_SUCCESS, 0 };
+			result.status = this->volume.operations.WriteFile(this->path.c_str(), buffer.data(), (DWORD)buffer.size(),
+				&result.transferred, offset, &info);
+			co_return result;
+		}
+
+		/**
+		Close the file after the reads and writes on it have completed.
+		**/
+		EncFSTask<NTSTATUS> close() {
+			co_await this->volume.pool.schedule();
+			if (this->opened) {
+				this->volume.operations.Cleanup(this->path.c_str(), &this->info);
+				this->volume.operations.CloseFile(this->path.c_str(), &this->info);
+				this->opened = false;
+			}
+			co_return STATUS_SUCCESS;
+		}
+	};
+}
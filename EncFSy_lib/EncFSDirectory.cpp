@@ -0,0 +1,41 @@
+#include "EncFSDirectory.h"
+
+namespace EncFS
+{
+	EncFSDirectoryReader::EncFSDirectoryReader(const wstring &dirPath) : hasEntry(false), error(ERROR_SUCCESS) {
+		wstring pattern = dirPath;
+		if (pattern.empty() || pattern.back() != L'\\') {
+			pattern += L'\\';
+		}
+		pattern += L'*';
+		ZeroMemory(&this->entry, sizeof(WIN32_FIND_DATAW));
+		this->handle = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &this->entry, FindExSearchNameMatch, NULL,
+			FIND_FIRST_EX_LARGE_FETCH);
+		if (this->handle == INVALID_HANDLE_VALUE) {
+			this->error = GetLastError();
+			return;
+		}
+		this->hasEntry = true;
+	}
+
+	EncFSDirectoryReader::~EncFSDirectoryReader() {
+		if (this->handle != INVALID_HANDLE_VALUE) {
+			FindClose(this->handle);
+		}
+	}
+
+	bool EncFSDirectoryReader::next(vector<WIN32_FIND_DATAW> &batch, size_t maxEntries) {
+		batch.clear();
+		while (this->hasEntry && batch.size() < maxEntries) {
+			batch.push_back(this->entry);
+			if (!FindNextFileW(this->handle, &this->entry)) {
+				this->hasEntry = false;
+				const DWORD error = GetLastError();
+				if (error != ERROR_NO_MORE_FILES) {
+					this->error = error;
+				}
+			}
+		}
+		return !batch.empty();
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <windows.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace EncFS
+{
+	/**
+	Entries of an underlying directory, fetched in large buffers without the 8.3 short names
+	and handed out in batches, so that the names of a batch can be decoded at once.
+	"." and ".." are included as FindFirstFile returns them.
+	**/
+	class EncFSDirectoryReader {
+	public:
+		/** Entries of a batch by default. */
+		static const size_t BATCH_SIZE = 1024;
+
+	private:
+		HANDLE handle;
+		/** Entry fetched and not handed out yet. */
+		WIN32_FIND_DATAW entry;
+		bool hasEntry;
+		DWORD error;
+
+	public:
+		/**
+		dirPath is the path of the directory itself, without a wildcard.
+		**/
+		explicit EncFSDirectoryReader(const wstring &dirPath);
+		~EncFSDirectoryReader();
+
+		EncFSDirectoryReader(const EncFSDirectoryReader&) = delete;
+		EncFSDirectoryReader& operator=(const EncFSDirectoryReader&) = delete;
+
+		inline bool isOpen() {
+			return this->handle != INVALID_HANDLE_VALUE;
+		}
+
+		/**
+		Error which ended the listing, ERROR_SUCCESS when all entries were handed out.
+		**/
+		inline DWORD getError() {
+			return this->error;
+		}
+
+		/**
+		Replace the batch with the next entries, at most maxEntries.
+		Returns false when there are no more entries or on error.
+		**/
+		bool next(vector<WIN32_FIND_DATAW> &batch, size_t maxEntries = BATCH_SIZE);
+
+		static inline bool isDots(const WIN32_FIND_DATAW &findData) {
+			return wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0;
+		}
+	};
+}
@@ -1,343 +1,1003 @@
 
 #include "EncFSFile.h"
+#include "EncFSRandom.h"
+#include "EncFSIoStats.h"
 
-using namespace std;
+#include <map>
+#include <algorithm>
 
-static AutoSeededX917RNG<CryptoPP::AES> random;
+using namespace std;
 
 namespace EncFS {
 	int64_t EncFSFile::counter = 0;
+	EncFSLockStats* EncFSFile::lockStats = EncFSLockStats::get("EncFSFile::mutexLock");
+	EncFSLockStats* EncFSFileState::ivLockStats = EncFSLockStats::get("EncFSFileState::ivLock");
+	EncFSLockStats* EncFSFileState::stateLockStats = EncFSLockStats::get("EncFSFileState::stateLock");
+	atomic<int> EncFSFileState::watchers(0);
+
+	static EncFSMutex statesLock("EncFSFileState::statesLock");
+	static map<EncFSFileKey, weak_ptr<EncFSFileState>> states;
+	/** Plain blocks cached by the states of all volumes. Declared after the states it trims. */
+	static EncFSCache blockCache("EncFSFileState::blocks", [](size_t bytes) { return EncFSFileState::trimCaches(bytes); });
+
+	/*
+	Buffers of a thread for the reads of read only volumes, which don't hold the handle lock.
+	*/
+	struct EncFSReadBuffers {
+		string blockBuffer;
+		string encodeBuffer;
+		string decodeBuffer;
+	};
+
+	static EncFSMutex volumesLock("EncFSFileKey::volumesLock");
+	/** Whether the file IDs of the volume of the serial are persistent. */
+	static map<DWORD, bool> persistentIds;
+
+	/*
+	Key of the underlying file of the handle, without the stream.
+	*/
+	static bool getUnderlyingKey(HANDLE handle, EncFSFileKey &key) {
+		BY_HANDLE_FILE_INFORMATION info;
+		if (!GetFileInformationByHandle(handle, &info)) {
+			return false;
+		}
+		key.volumeSerial = info.dwVolumeSerialNumber;
+		bool persistent = true;
+		{
+			lock_guard<decltype(volumesLock)> lock(volumesLock);
+			auto i = persistentIds.find(key.volumeSerial);
+			if (i != persistentIds.end()) {
+				persistent = i->second;
+			}
+			else {
+				DWORD flags;
+				// Keep the file index when the volume can't be asked, as before.
+				if (GetVolumeInformationByHandleW(handle, NULL, 0, NULL, NULL, &flags, NULL, 0)) {
+					persistent = (flags & FILE_SUPPORTS_OPEN_BY_FILE_ID) != 0;
+					persistentIds[key.volumeSerial] = persistent;
+				}
+			}
+		}
+		if (persistent) {
+			key.fileIndex = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+			key.path.clear();
+			return true;
+		}
+
+		key.fileIndex = 0;
+		const DWORD flags = FILE_NAME_NORMALIZED | VOLUME_NAME_DOS;
+		DWORD len = GetFinalPathNameByHandleW(handle, NULL, 0, flags);
+		if (len == 0) {
+			return false;
+		}
+		key.path.resize(len);
+		len = GetFinalPathNameByHandleW(handle, &key.path[0], len, flags);
+		if (len == 0 || len >= key.path.size()) {
+			return false;
+		}
+		key.path.resize(len);
+		return true;
+	}
+
+	static EncFSReadBuffers& getReadBuffers() {
+		static thread_local EncFSReadBuffers buffers;
+		return buffers;
+	}
+
+	/*
+	Read at the offset without moving the file pointer of the handle, so that reads of the same handle may overlap.
+	Reading at or past the end of file reads 0 bytes.
+	*/
+	static bool readAt(HANDLE handle, size_t offset, char* buff, DWORD len, DWORD &readLen) {
+		OVERLAPPED overlapped;
+		ZeroMemory(&overlapped, sizeof overlapped);
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
+		if (!ReadFile(handle, buff, len, &readLen, &overlapped)) {
+			if (GetLastError() == ERROR_HANDLE_EOF) {
+				readLen = 0;
+				return true;
+			}
+			return false;
+		}
+		EncFSIoStats::count(IO_UNDERLYING_READ, readLen);
+		return true;
+	}
+
+	shared_ptr<EncFSFileState> EncFSFileState::acquire(EncFSVolume &volume, const EncFSFileKey &key, HANDLE handle) {
+		lock_guard<decltype(statesLock)> lock(statesLock);
+		auto i = states.find(key);
+		if (i != states.end()) {
+			shared_ptr<EncFSFileState> state = i->second.lock();
+			if (state) {
+				return state;
+			}
+		}
+		LARGE_INTEGER encodedFileSize;
+		if (!GetFileSizeEx(handle, &encodedFileSize)) {
+			return shared_ptr<EncFSFileState>();
+		}
+		shared_ptr<EncFSFileState> state = make_shared<EncFSFileState>(key, volume.getBlockSize(),
+			volume.getBlockSize() - volume.getHeaderSize(), (size_t)volume.toDecodedLength(encodedFileSize.QuadPart));
+		states[key] = state;
+		return state;
+	}
+
+	EncFSFileState::~EncFSFileState() {
+		shared_ptr<const EncFSBlockSnapshot> snapshot = atomic_load(&this->readOnlyCache);
+		blockCache.charge(-(int64_t)(this->cachedData.size() + (snapshot ? snapshot->data.size() : 0)));
+	}
+
+	void EncFSFileState::release(shared_ptr<EncFSFileState> &state) {
+		if (!state) {
+			return;
+		}
+		lock_guard<decltype(statesLock)> lock(statesLock);
+		if (state.use_count() == 1) {
+			states.erase(state->key);
+		}
+		state.reset();
+	}
+
+	bool EncFSFileState::invalidate(EncFSVolume &volume, HANDLE handle) {
+		EncFSFileKey key;
+		if (!getUnderlyingKey(handle, key)) {
+			return true;
+		}
+		shared_ptr<EncFSFileState> state;
+		{
+			lock_guard<decltype(statesLock)> lock(statesLock);
+			auto i = states.find(key);
+			if (i == states.end() || !(state = i->second.lock())) {
+				return true;
+			}
+		}
+		if (volume.isReadOnly()) {
+			// Reads of read only volumes take the size and the file IV without a lock,
+			// they are taken again when the file is opened with no other handle attached.
+			state->trimCache();
+			return true;
+		}
+
+		// Wait for the reads and writes in progress, then look at the file as they left it.
+		EncFSBlockRange range(*state);
+		range.lock(0, END, true);
+		BY_HANDLE_FILE_INFORMATION info;
+		if (!GetFileInformationByHandle(handle, &info)) {
+			return true;
+		}
+		const int64_t encodedSize = (int64_t)(((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow);
+		const uint64_t lastWriteTime = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+		{
+			lock_guard<decltype(state->stateLock)> lock(state->stateLock);
+			if (encodedSize == state->writtenSize && lastWriteTime == state->writtenTime) {
+				return false;
+			}
+		}
+		{
+			lock_guard<decltype(state->ivLock)> lock(state->ivLock);
+			if (!state->pendingHeader.empty()) {
+				// Created through the mount and not written yet.
+				return false;
+			}
+			state->fileIv = 0L;
+			state->fileIvAvailable = false;
+		}
+		state->setSize((size_t)volume.toDecodedLength(encodedSize));
+		state->trimCache();
+		return true;
+	}
+
+	void EncFSFileState::watch(bool watching) {
+		watchers += watching ? 1 : -1;
+	}
+
+	void EncFSFileState::recordWrite(HANDLE handle) {
+		if (watchers.load(memory_order_relaxed) == 0) {
+			return;
+		}
+		BY_HANDLE_FILE_INFORMATION info;
+		if (!GetFileInformationByHandle(handle, &info)) {
+			return;
+		}
+		lock_guard<decltype(this->stateLock)> lock(this->stateLock);
+		this->writtenSize = (int64_t)(((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow);
+		this->writtenTime = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	}
+
+	void EncFSFileState::getKeys(DWORD volumeSerial, vector<EncFSFileKey> &keys) {
+		lock_guard<decltype(statesLock)> lock(statesLock);
+		for (auto &entry : states) {
+			if (entry.first.volumeSerial == volumeSerial && entry.first.stream.empty() && !entry.second.expired()) {
+				keys.push_back(entry.first);
+			}
+		}
+	}
+
+	size_t EncFSFileState::getSize() {
+		lock_guard<decltype(this->stateLock)> lock(this->stateLock);
+		return this->size;
+	}
+
+	void EncFSFileState::setSize(size_t size) {
+		lock_guard<decltype(this->stateLock)> lock(this->stateLock);
+		this->size = size;
+	}
+
+	void EncFSFileState::extendSize(size_t size) {
+		lock_guard<decltype(this->stateLock)> lock(this->stateLock);
+		if (size > this->size.load(memory_order_relaxed)) {
+			this->size = size;
+		}
+	}
+
+	bool EncFSFileState::copyCachedBlock(int64_t blockNum, string &block) {
+		lock_guard<decltype(this->stateLock)> lock(this->stateLock);
+		if (this->cachedBlockNum < 0 || blockNum < this->cachedBlockNum) {
+			blockCache.miss();
+			return false;
+		}
+		const size_t pos = (size_t)(blockNum - this->cachedBlockNum) * this->blockDataSize;
+		if (pos >= this->cachedData.size()) {
+			blockCache.miss();
+			return false;
+		}
+		blockCache.hit();
+		block.resize(min(this->blockDataSize, this->cachedData.size() - pos));
+		this->cachedData.copy(pos, block.size(), &block[0]);
+		return true;
+	}
+
+	void EncFSFileState::cacheBlocks(int64_t firstBlockNum, const string &data) {
+		lock_guard<decltype(this->stateLock)> lock(this->stateLock);
+		blockCache.charge(-(int64_t)this->cachedData.size());
+		if (!this->cachedData.assign(data)) {
+			// Caching is optional when the arena is out of memory.
+			this->cachedBlockNum = -1;
+			return;
+		}
+		blockCache.charge((int64_t)data.size());
+		this->cachedBlockNum = firstBlockNum;
+		this->cachedTime.store(GetTickCount64(), memory_order_relaxed);
+	}
+
+	void EncFSFileState::clearCache() {
+		lock_guard<decltype(this->stateLock)> lock(this->stateLock);
+		blockCache.charge(-(int64_t)this->cachedData.size());
+		this->cachedBlockNum = -1;
+		this->cachedData.clear();
+	}
+
+	void EncFSFileState::cacheSnapshot(shared_ptr<const EncFSBlockSnapshot> snapshot) {
+		const int64_t size = (int64_t)snapshot->data.size();
+		snapshot = atomic_exchange(&this->readOnlyCache, move(snapshot));
+		blockCache.charge(size - (snapshot ? (int64_t)snapshot->data.size() : 0));
+		this->cachedTime.store(GetTickCount64(), memory_order_relaxed);
+	}
+
+	size_t EncFSFileState::trimCache() {
+		shared_ptr<const EncFSBlockSnapshot> snapshot = atomic_exchange(&this->readOnlyCache, shared_ptr<const EncFSBlockSnapshot>());
+		size_t released = snapshot ? snapshot->data.size() : 0;
+		blockCache.charge(-(int64_t)released);
+		lock_guard<decltype(this->stateLock)> lock(this->stateLock);
+		released += this->cachedData.size();
+		blockCache.charge(-(int64_t)this->cachedData.size());
+		this->cachedBlockNum = -1;
+		this->cachedData.clear();
+		return released;
+	}
+
+	size_t EncFSFileState::trimCaches(size_t bytes) {
+		// The states lock keeps the states alive and is never taken under a state lock.
+		lock_guard<decltype(statesLock)> lock(statesLock);
+		vector<pair<uint64_t, shared_ptr<EncFSFileState>>> cached;
+		for (auto &entry : states) {
+			shared_ptr<EncFSFileState> state = entry.second.lock();
+			if (state) {
+				cached.emplace_back(state->cachedTime.load(memory_order_relaxed), state);
+			}
+		}
+		sort(cached.begin(), cached.end(), [](const pair<uint64_t, shared_ptr<EncFSFileState>> &a,
+			const pair<uint64_t, shared_ptr<EncFSFileState>> &b) {
+			return a.first < b.first;
+		});
+		size_t released = 0;
+		for (auto &entry : cached) {
+			if (released >= bytes) {
+				break;
+			}
+			released += entry.second->trimCache();
+		}
+		return released;
+	}
+
+	void EncFSFileState::lockRange(size_t first, size_t last, bool exclusive) {
+		unique_lock<decltype(this->stateLock)> lock(this->stateLock);
+		for (;;) {
+			bool conflict = false;
+			for (const Range &range : this->ranges) {
+				if (range.first <= last && first <= range.last && (exclusive || range.exclusive)) {
+					conflict = true;
+					break;
+				}
+			}
+			if (!conflict) {
+				break;
+			}
+			this->rangeReleased.wait(lock);
+		}
+		this->ranges.push_back(Range{ first, last, exclusive });
+	}
+
+	void EncFSFileState::unlockRange(size_t first, size_t last, bool exclusive) {
+		{
+			lock_guard<decltype(this->stateLock)> lock(this->stateLock);
+			for (auto i = this->ranges.begin(); i != this->ranges.end(); ++i) {
+				if (i->first == first && i->last == last && i->exclusive == exclusive) {
+					this->ranges.erase(i);
+					break;
+				}
+			}
+		}
+		this->rangeReleased.notify_all();
+	}
+
+	void EncFSFileState::reset() {
+		{
+			lock_guard<decltype(this->ivLock)> lock(this->ivLock);
+			this->fileIv = 0L;
+			this->fileIvAvailable = false;
+			this->pendingHeader.clear();
+		}
+		lock_guard<decltype(this->stateLock)> lock(this->stateLock);
+		this->size = 0;
+		blockCache.charge(-(int64_t)this->cachedData.size());
+		this->cachedBlockNum = -1;
+		this->cachedData.clear();
+	}
+
+	bool EncFSFile::getFileKey(const LPCWSTR FileName, EncFSFileKey &key) {
+		if (!getUnderlyingKey(this->handle, key)) {
+			return false;
+		}
+
+		// Alternate data streams share the file index.
+		const wchar_t* name = wcsrchr(FileName, L'\\');
+		const wchar_t* stream = wcschr(name ? name : FileName, L':');
+		key.stream = stream ? stream + 1 : L"";
+		const wstring type = L":$DATA";
+		if (key.stream.size() >= type.size() &&
+			key.stream.compare(key.stream.size() - type.size(), type.size(), type) == 0) {
+			key.stream.resize(key.stream.size() - type.size());
+		}
+		return true;
+	}
+
+	EncFSFileState* EncFSFile::getState(const LPCWSTR FileName) {
+		if (!this->state) {
+			EncFSFileKey key;
+			if (!this->getFileKey(FileName, key)) {
+				return NULL;
+			}
+			this->state = EncFSFileState::acquire(this->volume, key, this->handle);
+		}
+		return this->state.get();
+	}
+
+	bool EncFSFile::getFileSize(const LPCWSTR FileName, size_t *fileSize) {
+		lock_guard<decltype(this->mutexLock)> lock(this->mutexLock);
+		EncFSFileState* state = this->getState(FileName);
+		if (!state) {
+			return false;
+		}
+		*fileSize = state->getSize();
+		return true;
+	}
+
+	void EncFSFile::invalidateState(const LPCWSTR FileName) {
+		lock_guard<decltype(this->mutexLock)> lock(this->mutexLock);
+		EncFSFileState* state = this->getState(FileName);
+		if (state) {
+			state->reset();
+		}
+	}
 
 	EncFSGetFileIVResult EncFSFile::getFileIV(const LPCWSTR FileName, int64_t *fileIv, bool create) {
-		if (this->fileIvAvailable) {
-			*fileIv = this->fileIv;
+		EncFSFileState* state = this->getState(FileName);
+		if (!state) {
+			return READ_ERROR;
+		}
+		// Writers of an empty file hold the blocks to the end of file, so it stays empty.
+		// Its header, if any, is replaced without reading it since no block depends on it.
+		bool newFile = create && state->getSize() == 0;
+		lock_guard<decltype(state->ivLock)> lock(state->ivLock);
+		if (state->fileIvAvailable) {
+			*fileIv = state->fileIv;
 			return EXISTS;
 		}
-		if (!encfs.isUniqueIV()) {
-			this->fileIv = *fileIv = 0L;
-			this->fileIvAvailable = true;
+		if (!this->volume.isUniqueIV()) {
+			state->fileIv = *fileIv = 0L;
+			state->fileIvAvailable = true;
 			return EXISTS;
 		}
-		// Read file header.
+		string fileHeader;
+		fileHeader.resize(EncFSVolume::HEADER_SIZE);
+		if (!newFile) {
+			// Read file header.
+			LARGE_INTEGER distanceToMove;
+			distanceToMove.QuadPart = 0;
+			if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
+				return READ_ERROR;
+			}
+			DWORD ReadLength;
+			if (!ReadFile(this->handle, &fileHeader[0], (DWORD)fileHeader.size(), (LPDWORD)&ReadLength, NULL)) {
+				return READ_ERROR;
+			}
+			EncFSIoStats::count(IO_UNDERLYING_READ, ReadLength);
+			if (ReadLength != fileHeader.size()) {
+				if (!create) {
+					if (ReadLength == 0) {
+						return EMPTY;
+					}
+					SetLastError(ERROR_READ_FAULT);
+					return READ_ERROR;
+				}
+				newFile = true;
+			}
+		}
+		if (newFile) {
+			// Create file header. It's kept until the first block is written, in the same write.
+			EncFSRandom::generate(&fileHeader[0], EncFSVolume::HEADER_SIZE);
+			state->pendingHeader = fileHeader;
+		}
+	
+		string cFileName = this->strConv.to_bytes(wstring(FileName));
+		state->fileIv = *fileIv = this->volume.decodeFileIv(cFileName, fileHeader);
+		state->fileIvAvailable = true;
+		return EXISTS;
+	}
+
+	EncFSGetFileIVResult EncFSFile::readSmallFile(const LPCWSTR FileName, int64_t *fileIv) {
+		EncFSFileState* state = this->state.get();
+		lock_guard<decltype(state->ivLock)> lock(state->ivLock);
+		if (state->fileIvAvailable) {
+			*fileIv = state->fileIv;
+			return EXISTS;
+		}
+
+		// Read file header and all blocks.
 		LARGE_INTEGER distanceToMove;
 		distanceToMove.QuadPart = 0;
 		if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
 			return READ_ERROR;
 		}
-		string fileHeader;
-		fileHeader.resize(EncFSVolume::HEADER_SIZE);
-		DWORD ReadLength;
-		if (!ReadFile(this->handle, &fileHeader[0], (DWORD)fileHeader.size(), (LPDWORD)&ReadLength, NULL)) {
+		size_t encodedLength = this->volume.toEncodedLength(state->getSize());
+		if (encodedLength < EncFSVolume::HEADER_SIZE) {
+			encodedLength = EncFSVolume::HEADER_SIZE;
+		}
+		DWORD readLen;
+		this->blockBuffer.resize(encodedLength);
+		if (!ReadFile(this->handle, &this->blockBuffer[0], (DWORD)encodedLength, &readLen, NULL)) {
+			this->clearBlockBuffer();
 			return READ_ERROR;
 		}
-		if (ReadLength != fileHeader.size()) {
-			if (!create) {
-				if (ReadLength == 0) {
-					return EMPTY;
-				}
-				SetLastError(ERROR_READ_FAULT);
-				return READ_ERROR;
-			}
-			// Create file header.
-			fileHeader.resize(EncFSVolume::HEADER_SIZE);
-			random.GenerateBlock((byte*)&fileHeader[0], EncFSVolume::HEADER_SIZE);
-			if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
-				return READ_ERROR;
+		EncFSIoStats::count(IO_UNDERLYING_READ, readLen);
+		if (readLen < EncFSVolume::HEADER_SIZE) {
+			this->clearBlockBuffer();
+			if (readLen == 0) {
+				return EMPTY;
 			}
-			DWORD writtenLen;
-			if (!WriteFile(this->handle, fileHeader.data(), (DWORD)fileHeader.size(), &writtenLen, NULL)) {
+			SetLastError(ERROR_READ_FAULT);
+			return READ_ERROR;
+		}
+
+		string cFileName = this->strConv.to_bytes(wstring(FileName));
+		string fileHeader(this->blockBuffer, 0, EncFSVolume::HEADER_SIZE);
+		state->fileIv = *fileIv = this->volume.decodeFileIv(cFileName, fileHeader);
+		state->fileIvAvailable = true;
+
+		// Cache the whole plain data for the following reads of any handle.
+		string data;
+		const size_t blockSize = this->volume.getBlockSize();
+		size_t blockNum = 0;
+		for (size_t i = EncFSVolume::HEADER_SIZE; i < readLen; i += blockSize) {
+			const size_t blockLen = (readLen - i) > blockSize ? blockSize : (readLen - i);
+			this->encodeBuffer.assign((const char*)&this->blockBuffer[i], blockLen);
+			this->decodeBuffer.clear();
+			if (!this->volume.tryDecodeBlock(*fileIv, blockNum++, this->encodeBuffer, this->decodeBuffer)) {
+				this->clearBlockBuffer();
+				SetLastError(ERROR_FILE_CORRUPT);
 				return READ_ERROR;
 			}
+			data.append(this->decodeBuffer);
+		}
+		this->clearBlockBuffer();
+		if (!data.empty()) {
+			state->cacheBlocks(0, data);
 		}
-	
-		string cFileName = this->strConv.to_bytes(wstring(FileName));
-		this->fileIv = *fileIv = encfs.decodeFileIv(cFileName, fileHeader);
-		this->fileIvAvailable = true;
 		return EXISTS;
 	}
 
 	int32_t EncFSFile::read(const LPCWSTR FileName, char* buff, size_t off, DWORD len) {
+		if (this->volume.isReadOnly()) {
+			return this->readOnlyRead(FileName, buff, off, len);
+		}
 		lock_guard<decltype(this->mutexLock)> lock(this->mutexLock);
 		if (!this->canRead) {
 			SetLastError(ERROR_READ_FAULT);
 			return -1;
 		}
 
-		try {
-			int64_t fileIv;
-			EncFSGetFileIVResult ivResult = this->getFileIV(FileName, &fileIv, false);
-			if (ivResult == READ_ERROR) {
+		EncFSFileState* state = this->getState(FileName);
+		if (!state) {
+			return -1;
+		}
+
+		// Calculate block position.
+		const size_t blockSize = this->volume.getBlockSize();
+		const size_t blockHeaderSize = this->volume.getHeaderSize();
+		const size_t blockDataSize = blockSize - blockHeaderSize;
+		size_t shift = off % blockDataSize;
+		size_t blockNum = off / blockDataSize;
+		const size_t lastBlockNum = (off + len - 1) / blockDataSize;
+
+		// On the first read of a small file, the header and the data are fetched by one read.
+		const bool smallFile = this->volume.isUniqueIV() && !state->isFileIvAvailable() &&
+			state->getSize() <= SMALL_FILE_BLOCKS * blockDataSize;
+
+		EncFSBlockRange range(*state);
+		if (smallFile) {
+			range.lock(0, EncFSFileState::END, false);
+		}
+		else {
+			range.lock(blockNum, lastBlockNum, false);
+		}
+
+		int64_t fileIv;
+		EncFSGetFileIVResult ivResult = smallFile ?
+			this->readSmallFile(FileName, &fileIv) : this->getFileIV(FileName, &fileIv, false);
+		if (ivResult == READ_ERROR) {
+			return -1;
+		}
+		if (ivResult == EMPTY) {
+			return 0;
+		}
+
+		//string cFileName = this->strConv.to_bytes(wstring(FileName));
+		//printf("read %s %d %d %d\n", cFileName.c_str(), fileIv, off, len);
+
+		int32_t copiedLen = 0;
+		// Copy from the blocks cached by any handle.
+		while (state->copyCachedBlock(blockNum, this->decodeBuffer)) {
+			if (this->decodeBuffer.size() <= shift) {
+				return copiedLen;
+			}
+			uint32_t blockLen = (uint32_t)(this->decodeBuffer.size() - shift);
+			if (blockLen > len) {
+				blockLen = len;
+			}
+			memcpy(buff + copiedLen, this->decodeBuffer.data() + shift, blockLen);
+			shift = 0;
+			len -= blockLen;
+			copiedLen += blockLen;
+			++blockNum;
+			if (len <= 0 || this->decodeBuffer.size() < blockDataSize) {
+				// The last block of the file.
+				return copiedLen;
+			}
+		}
+
+		size_t blocksOffset = blockNum * blockSize;
+		const size_t blocksLength = (lastBlockNum + 1) * blockSize - blocksOffset;
+		if (this->volume.isUniqueIV()) {
+			blocksOffset += EncFS::EncFSVolume::HEADER_SIZE;
+		}
+
+		if (blocksLength) {
+			// Seek for read.
+			LARGE_INTEGER distanceToMove;
+			distanceToMove.QuadPart = blocksOffset;
+			if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
 				return -1;
 			}
-			if (ivResult == EMPTY) {
-				return 0;
+
+			// Read encrypted data.
+			DWORD readLen;
+			this->blockBuffer.resize(blocksLength);
+			if (!ReadFile(this->handle, &this->blockBuffer[0], (DWORD)blocksLength, &readLen, NULL)) {
+				this->clearBlockBuffer();
+				return -1;
 			}
+			EncFSIoStats::count(IO_UNDERLYING_READ, readLen);
 
-			//string cFileName = this->strConv.to_bytes(wstring(FileName));
-			//printf("read %s %d %d %d %d\n", cFileName.c_str(), fileIv, this->lastBlockNum, off, len);
+			//printf("read2 %d %d %d %d %d\n", shift, blockNum, lastBlockNum, blocksLength, readLen);
 
-			// Calculate block position.
-			const size_t blockSize = encfs.getBlockSize();
-			const size_t blockHeaderSize = encfs.getHeaderSize();
-			const size_t blockDataSize = blockSize - blockHeaderSize;
-			size_t shift = off % blockDataSize;
-			size_t blockNum = off / blockDataSize;
-			const size_t lastBlockNum = (off + len - 1) / blockDataSize;
+			if (readLen > blockHeaderSize + shift) {
+				for (size_t i = 0; i < readLen && len > 0; i += this->volume.getBlockSize()) {
+					size_t blockLen = (readLen - i) > this->volume.getBlockSize() ? this->volume.getBlockSize() : (readLen - i);
 
-			int32_t copiedLen = 0;
-			// Copy from buffer.
-			if (blockNum == this->lastBlockNum) {
-				uint32_t blockLen = (uint32_t)(this->decodeBuffer.size() - shift);
-				if (blockLen > len) {
-					blockLen = len;
-				}
-				memcpy(buff, this->decodeBuffer.data() + shift, blockLen);
-				shift = 0;
-				len -= blockLen;
-				copiedLen += blockLen;
-				++blockNum;
-				if (len <= 0) {
-					return copiedLen;
+					this->encodeBuffer.assign((const char*)&this->blockBuffer[i], blockLen);
+					this->decodeBuffer.clear();
+					if (!this->volume.tryDecodeBlock(fileIv, blockNum, this->encodeBuffer, this->decodeBuffer)) {
+						this->clearBlockBuffer();
+						SetLastError(ERROR_FILE_CORRUPT);
+						return -1;
+					}
+
+					blockLen = this->decodeBuffer.size() - shift;
+					if (blockLen > len) {
+						blockLen = len;
+					}
+					memcpy(buff + copiedLen, this->decodeBuffer.data() + shift, blockLen);
+					shift = 0;
+					len -= (DWORD)blockLen;
+					copiedLen += (int32_t)blockLen;
+					blockNum++;
 				}
+				state->cacheBlocks(blockNum - 1, this->decodeBuffer);
 			}
+			this->clearBlockBuffer();
+		}
+		//printf("readEnd %d\n", copiedLen);
+		return copiedLen;
+	}
 
-			size_t blocksOffset = blockNum * blockSize;
-			const size_t blocksLength = (lastBlockNum + 1) * blockSize - blocksOffset;
-			if (encfs.isUniqueIV()) {
-				blocksOffset += EncFS::EncFSVolume::HEADER_SIZE;
+	/**
+	Nothing writes a read only volume, so the size and the file IV never change once known:
+	reads don't take the handle lock nor the block range locks, and the decoded blocks are
+	published as immutable snapshots. Sequential reads decode READ_AHEAD_BLOCKS at once.
+	**/
+	int32_t EncFSFile::readOnlyRead(const LPCWSTR FileName, char* buff, size_t off, DWORD len) {
+		if (!this->canRead) {
+			SetLastError(ERROR_READ_FAULT);
+			return -1;
+		}
+		EncFSFileState* state = this->readOnlyState.load(memory_order_acquire);
+		if (!state) {
+			lock_guard<decltype(this->mutexLock)> lock(this->mutexLock);
+			state = this->getState(FileName);
+			if (!state) {
+				return -1;
 			}
+			this->readOnlyState.store(state, memory_order_release);
+		}
 
-			if (blocksLength) {
-				// Seek for read.
-				LARGE_INTEGER distanceToMove;
-				distanceToMove.QuadPart = blocksOffset;
-				if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
-					return -1;
-				}
+		const size_t size = state->size.load(memory_order_acquire);
+		if (off >= size || len == 0) {
+			return 0;
+		}
+		if (len > size - off) {
+			len = (DWORD)(size - off);
+		}
+		const bool sequential = state->nextReadOffset.load(memory_order_relaxed) == off;
+		state->nextReadOffset.store(off + len, memory_order_relaxed);
 
-				// Read encrypted data.
+		if (this->volume.isUniqueIV() && !state->fileIvAvailable.load(memory_order_acquire)) {
+			lock_guard<decltype(state->ivLock)> lock(state->ivLock);
+			if (!state->fileIvAvailable) {
+				string fileHeader;
+				fileHeader.resize(EncFSVolume::HEADER_SIZE);
 				DWORD readLen;
-				this->blockBuffer.resize(blocksLength);
-				if (!ReadFile(this->handle, &this->blockBuffer[0], (DWORD)blocksLength, &readLen, NULL)) {
-					this->clearBlockBuffer();
+				if (!readAt(this->handle, 0, &fileHeader[0], (DWORD)fileHeader.size(), readLen)) {
 					return -1;
 				}
+				if (readLen != fileHeader.size()) {
+					SetLastError(ERROR_READ_FAULT);
+					return -1;
+				}
+				wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+				state->fileIv = this->volume.decodeFileIv(strConv.to_bytes(wstring(FileName)), fileHeader);
+				state->fileIvAvailable.store(true, memory_order_release);
+			}
+		}
+		const int64_t fileIv = state->fileIv;
 
-				//printf("read2 %d %d %d %d %d\n", shift, blockNum, lastBlockNum, blocksLength, readLen);
-
-				if (readLen > blockHeaderSize + shift) {
-					for (size_t i = 0; i < readLen && len > 0; i += encfs.getBlockSize()) {
-						size_t blockLen = (readLen - i) > encfs.getBlockSize() ? encfs.getBlockSize() : (readLen - i);
-
-						this->encodeBuffer.assign((const char*)&this->blockBuffer[i], blockLen);
-						this->decodeBuffer.clear();
-						encfs.decodeBlock(fileIv, this->lastBlockNum = blockNum, this->encodeBuffer, this->decodeBuffer);
+		const size_t blockSize = this->volume.getBlockSize();
+		const size_t blockDataSize = state->blockDataSize;
+		DWORD copiedLen = 0;
 
-						blockLen = this->decodeBuffer.size() - shift;
-						if (blockLen > len) {
-							blockLen = len;
-						}
-						memcpy(buff + copiedLen, this->decodeBuffer.data() + shift, blockLen);
-						shift = 0;
-						len -= (DWORD)blockLen;
-						copiedLen += (int32_t)blockLen;
-						blockNum++;
-					}
+		// Copy from the blocks decoded by the last read of any handle.
+		shared_ptr<const EncFSBlockSnapshot> cache = atomic_load(&state->readOnlyCache);
+		if (cache && off / blockDataSize >= (size_t)cache->firstBlockNum) {
+			const size_t pos = off - (size_t)cache->firstBlockNum * blockDataSize;
+			if (pos < cache->data.size()) {
+				copiedLen = (DWORD)min((size_t)len, cache->data.size() - pos);
+				cache->data.copy(pos, copiedLen, buff);
+				if (copiedLen == len) {
+					blockCache.hit();
+					return copiedLen;
 				}
-				this->clearBlockBuffer();
 			}
-			//printf("readEnd %d\n", copiedLen);
-			return copiedLen;
 		}
-		catch (const EncFSInvalidBlockException &ex) {
-			SetLastError(ERROR_FILE_CORRUPT);
+		blockCache.miss();
+		cache.reset();
+
+		// The rest starts at a block boundary when some was cached.
+		const size_t restOff = off + copiedLen;
+		const size_t shift = restOff % blockDataSize;
+		const size_t blockNum = restOff / blockDataSize;
+		size_t lastBlockNum = (off + len - 1) / blockDataSize;
+		if (sequential || copiedLen > 0) {
+			lastBlockNum = max(lastBlockNum, min((size - 1) / blockDataSize, blockNum + READ_AHEAD_BLOCKS - 1));
+		}
+
+		EncFSReadBuffers &buffers = getReadBuffers();
+		size_t blocksOffset = blockNum * blockSize;
+		if (this->volume.isUniqueIV()) {
+			blocksOffset += EncFSVolume::HEADER_SIZE;
+		}
+		const size_t blocksLength = (lastBlockNum + 1 - blockNum) * blockSize;
+		DWORD readLen;
+		buffers.blockBuffer.resize(blocksLength);
+		if (!readAt(this->handle, blocksOffset, &buffers.blockBuffer[0], (DWORD)blocksLength, readLen)) {
 			return -1;
 		}
+
+		shared_ptr<EncFSBlockSnapshot> snapshot = make_shared<EncFSBlockSnapshot>(blockSize, blockDataSize);
+		snapshot->firstBlockNum = blockNum;
+		// The blocks are cached only when the arena has room for all of them.
+		const bool cacheable = snapshot->data.reserve((lastBlockNum + 1 - blockNum) * blockDataSize);
+		const size_t restLen = len - copiedLen;
+		size_t plainPos = 0, copiedRestLen = 0;
+		for (size_t i = 0; i < readLen; i += blockSize) {
+			const size_t blockLen = min(blockSize, (size_t)readLen - i);
+			buffers.encodeBuffer.assign(&buffers.blockBuffer[i], blockLen);
+			buffers.decodeBuffer.clear();
+			if (!this->volume.tryDecodeBlock(fileIv, blockNum + i / blockSize, buffers.encodeBuffer, buffers.decodeBuffer)) {
+				SetLastError(ERROR_FILE_CORRUPT);
+				return -1;
+			}
+			// Copy the part which was asked for as the blocks are decoded.
+			if (copiedRestLen < restLen && plainPos + buffers.decodeBuffer.size() > shift) {
+				const size_t from = shift > plainPos ? shift - plainPos : 0;
+				const size_t partLen = min(restLen - copiedRestLen, buffers.decodeBuffer.size() - from);
+				memcpy(buff + copiedLen + copiedRestLen, buffers.decodeBuffer.data() + from, partLen);
+				copiedRestLen += partLen;
+			}
+			plainPos += buffers.decodeBuffer.size();
+			if (cacheable) {
+				snapshot->data.append(buffers.decodeBuffer.data(), buffers.decodeBuffer.size());
+			}
+		}
+		copiedLen += (DWORD)copiedRestLen;
+		if (cacheable && !snapshot->data.empty()) {
+			state->cacheSnapshot(move(snapshot));
+		}
+		if (buffers.blockBuffer.capacity() > READ_AHEAD_BLOCKS * blockSize) {
+			buffers.blockBuffer.clear();
+			buffers.blockBuffer.shrink_to_fit();
+		}
+		return copiedLen;
 	}
 
-	int32_t EncFSFile::write(const LPCWSTR FileName, size_t fileSize, const char* buff, size_t off, DWORD len) {
+	int32_t EncFSFile::write(const LPCWSTR FileName, const char* buff, size_t off, DWORD len) {
 		lock_guard<decltype(this->mutexLock)> lock(this->mutexLock);
-		try {
-			int64_t fileIv;
-			if (this->getFileIV(FileName, &fileIv, true) == READ_ERROR) {
+		EncFSFileState* state = this->getState(FileName);
+		if (!state) {
+			return -1;
+		}
+
+		// Calculate position.
+		const size_t blockSize = this->volume.getBlockSize();
+		const size_t blockHeaderSize = this->volume.getHeaderSize();
+		const size_t blockDataSize = blockSize - blockHeaderSize;
+		size_t shift = off % blockDataSize;
+		size_t blockNum = off / blockDataSize;
+		const size_t lastBlockNum = (off + len - 1) / blockDataSize;
+
+		// Lock the blocks to write, or up to the end of file when it grows.
+		EncFSBlockRange range(*state);
+		size_t fileSize;
+		for (;;) {
+			fileSize = state->getSize();
+			if (off + len <= fileSize) {
+				range.lock(blockNum, lastBlockNum, true);
+			}
+			else {
+				range.lock(min(blockNum, fileSize / blockDataSize), EncFSFileState::END, true);
+			}
+			if (state->getSize() == fileSize) {
+				break;
+			}
+		}
+
+		int64_t fileIv;
+		if (this->getFileIV(FileName, &fileIv, true) == READ_ERROR) {
+			SetLastError(ERROR_FILE_CORRUPT);
+			return -1;
+		}
+
+		if (off > fileSize) {
+			// Expand file.
+			if (!this->_setLength(FileName, fileSize, off)) {
 				SetLastError(ERROR_FILE_CORRUPT);
 				return -1;
 			}
+		}
 
-			if (off > fileSize) {
-				// Expand file.
-				if (!this->_setLength(FileName, fileSize, off)) {
+		size_t blocksOffset = blockNum * blockSize;
+		const size_t blocksLength = (lastBlockNum + 1) * blockSize - blocksOffset;
+		if (this->volume.isUniqueIV()) {
+			blocksOffset += EncFS::EncFSVolume::HEADER_SIZE;
+		}
+		// wprintf(L"Write %s off=%ld len=%ld blockDataSize=%ld shift=%ld blockNum=%ld lastBlockNum=%ld blocksOffset=%ld blocksLength=%ld\n",
+		//	FileName, off, len, blockDataSize, shift, blockNum, lastBlockNum, blocksOffset, blocksLength);
+
+		// The header of a new file is written in front of its first block.
+		string fileHeader;
+		if (blockNum == 0 && shift == 0) {
+			lock_guard<decltype(state->ivLock)> lock(state->ivLock);
+			fileHeader = state->pendingHeader;
+		}
+		bool headerPending = !fileHeader.empty();
+
+		// Seek for write,
+		LARGE_INTEGER distanceToMove;
+		distanceToMove.QuadPart = headerPending ? 0 : blocksOffset;
+		if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
+			return -1;
+		}
+
+		if (shift != 0) {
+			// Write to a part of block.
+			//printf("write2 %d %d %d\n", blockNum, shift, this->decodeBuffer.size());
+			if (!state->copyCachedBlock(blockNum, this->decodeBuffer)) {
+				DWORD readLen;
+				this->encodeBuffer.resize(this->volume.getBlockSize());
+				if (!ReadFile(this->handle, &this->encodeBuffer[0], (DWORD)this->encodeBuffer.size(), &readLen, NULL)) {
+					return -1;
+				}
+				EncFSIoStats::count(IO_UNDERLYING_READ, readLen);
+				if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
+					return -1;
+				}
+				this->encodeBuffer.resize(readLen);
+				this->decodeBuffer.clear();
+				if (!this->volume.tryDecodeBlock(fileIv, blockNum, this->encodeBuffer, this->decodeBuffer)) {
 					SetLastError(ERROR_FILE_CORRUPT);
 					return -1;
 				}
 			}
-
-			// Calculate position.
-			const size_t blockSize = encfs.getBlockSize();
-			const size_t blockHeaderSize = encfs.getHeaderSize();
-			const size_t blockDataSize = blockSize - blockHeaderSize;
-			size_t shift = off % blockDataSize;
-			size_t blockNum = off / blockDataSize;
-			const size_t lastBlockNum = (off + len - 1) / blockDataSize;
-			size_t blocksOffset = blockNum * blockSize;
-			const size_t blocksLength = (lastBlockNum + 1) * blockSize - blocksOffset;
-			if (encfs.isUniqueIV()) {
-				blocksOffset += EncFS::EncFSVolume::HEADER_SIZE;
+			if (this->decodeBuffer.size() < shift) {
+				this->decodeBuffer.append(shift - this->decodeBuffer.size(), (char)0);
 			}
-			// wprintf(L"Write %s off=%ld len=%ld blockDataSize=%ld shift=%ld blockNum=%ld lastBlockNum=%ld blocksOffset=%ld blocksLength=%ld\n",
-			//	FileName, off, len, blockDataSize, shift, blockNum, lastBlockNum, blocksOffset, blocksLength);
+		}
 
-			// Seek for write,
-			LARGE_INTEGER distanceToMove;
-			distanceToMove.QuadPart = blocksOffset;
-			if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
-				return -1;
-			}
+		// Cached blocks may be overwritten, the last written block is cached on success.
+		state->clearCache();
 
+		size_t blockDataLen = 0;
+		for (size_t i = 0; i < len; i += blockDataLen) {
+			blockDataLen = (len - i) > blockDataSize - shift ? blockDataSize - shift : (len - i);
 			if (shift != 0) {
-				// Write to a part of block.
-				//printf("write2 %d %d %d %d\n", blockNum, this->lastBlockNum, shift, this->decodeBuffer.size());
-				if (blockNum != this->lastBlockNum) {
-					DWORD readLen;
-					this->encodeBuffer.resize(encfs.getBlockSize());
-					if (!ReadFile(this->handle, &this->encodeBuffer[0], (DWORD)this->encodeBuffer.size(), &readLen, NULL)) {
-						return -1;
-					}
-					if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
-						return -1;
-					}
-					this->encodeBuffer.resize(readLen);
-					this->decodeBuffer.clear();
-					encfs.decodeBlock(fileIv, blockNum, this->encodeBuffer, this->decodeBuffer);
-				}
-				if (this->decodeBuffer.size() < shift) {
-					this->decodeBuffer.append(shift - this->decodeBuffer.size(), (char)0);
+				if (this->decodeBuffer.size() < shift + blockDataLen) {
+					this->decodeBuffer.resize(shift + blockDataLen);
 				}
+				memcpy(&this->decodeBuffer[shift], buff, blockDataLen);
+				//printf("A %d\n", this->decodeBuffer.size());
 			}
-
-			size_t blockDataLen = 0;
-			for (size_t i = 0; i < len; i += blockDataLen) {
-				blockDataLen = (len - i) > blockDataSize - shift ? blockDataSize - shift : (len - i);
-				if (shift != 0) {
-					if (this->decodeBuffer.size() < shift + blockDataLen) {
-						this->decodeBuffer.resize(shift + blockDataLen);
-					}
-					memcpy(&this->decodeBuffer[shift], buff, blockDataLen);
-					//printf("A %d\n", this->decodeBuffer.size());
-				}
-				else if (blockDataLen == blockDataSize || off + i + blockDataLen >= fileSize) {
-					this->decodeBuffer.assign(buff + i, blockDataLen);
+			else if (blockDataLen == blockDataSize || off + i + blockDataLen >= fileSize) {
+				this->decodeBuffer.assign(buff + i, blockDataLen);
+			}
+			else {
+				DWORD readLen;
+				this->encodeBuffer.resize(this->volume.getBlockSize());
+				if (!ReadFile(this->handle, &this->encodeBuffer[0], (DWORD)this->encodeBuffer.size(), &readLen, NULL)) {
+					return -1;
 				}
-				else {
-					DWORD readLen;
-					this->encodeBuffer.resize(encfs.getBlockSize());
-					if (!ReadFile(this->handle, &this->encodeBuffer[0], (DWORD)this->encodeBuffer.size(), &readLen, NULL)) {
-						return -1;
-					}
-					distanceToMove.QuadPart = -(LONGLONG)readLen;
-					if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_CURRENT)) {
-						return -1;
-					}
-					this->encodeBuffer.resize(readLen);
-					this->decodeBuffer.clear();
-					encfs.decodeBlock(fileIv, blockNum, this->encodeBuffer, this->decodeBuffer);
-					//printf("B %d %d\n", this->decodeBuffer.size(), readLen);
-					memcpy(&this->decodeBuffer[0], buff + i, blockDataLen);
+				EncFSIoStats::count(IO_UNDERLYING_READ, readLen);
+				distanceToMove.QuadPart = -(LONGLONG)readLen;
+				if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_CURRENT)) {
+					return -1;
 				}
-				this->encodeBuffer.clear();
-				encfs.encodeBlock(fileIv, this->lastBlockNum = blockNum, this->decodeBuffer, this->encodeBuffer);
-				DWORD writtenLen;
-				if (!WriteFile(this->handle, this->encodeBuffer.data(), (DWORD)this->encodeBuffer.size(), &writtenLen, NULL)) {
+				this->encodeBuffer.resize(readLen);
+				this->decodeBuffer.clear();
+				if (!this->volume.tryDecodeBlock(fileIv, blockNum, this->encodeBuffer, this->decodeBuffer)) {
+					SetLastError(ERROR_FILE_CORRUPT);
 					return -1;
 				}
-				//printf("%d %d %d\n", blockNum, blockDataLen, writtenLen);
-				blockNum++;
-				shift = 0;
+				//printf("B %d %d\n", this->decodeBuffer.size(), readLen);
+				memcpy(&this->decodeBuffer[0], buff + i, blockDataLen);
+			}
+			this->encodeBuffer.clear();
+			this->volume.encodeBlock(fileIv, blockNum, this->decodeBuffer, this->encodeBuffer);
+			if (headerPending) {
+				fileHeader.append(this->encodeBuffer);
+				this->encodeBuffer.swap(fileHeader);
+			}
+			DWORD writtenLen;
+			if (!WriteFile(this->handle, this->encodeBuffer.data(), (DWORD)this->encodeBuffer.size(), &writtenLen, NULL)) {
+				return -1;
+			}
+			EncFSIoStats::count(IO_UNDERLYING_WRITTEN, writtenLen);
+			if (headerPending) {
+				lock_guard<decltype(state->ivLock)> lock(state->ivLock);
+				state->pendingHeader.clear();
+				headerPending = false;
 			}
-			//printf("written %d\n", len);
-			return len;
+			//printf("%d %d %d\n", blockNum, blockDataLen, writtenLen);
+			blockNum++;
+			shift = 0;
 		}
-		catch (const EncFSInvalidBlockException &ex) {
-			SetLastError(ERROR_FILE_CORRUPT);
-			return -1;
+		if (len > 0) {
+			state->cacheBlocks(blockNum - 1, this->decodeBuffer);
+			state->extendSize(off + len);
 		}
-
+		state->recordWrite(this->handle);
+		//printf("written %d\n", len);
+		return len;
 	}
 
 
 	int32_t EncFSFile::reverseRead(const LPCWSTR FileName, char* buff, size_t off, DWORD len) {
-		lock_guard<decltype(this->mutexLock)> lock(this->mutexLock);
+		// Reverse volumes are read only, so reads of the handle don't lock each other.
 		if (!this->canRead) {
 			SetLastError(ERROR_READ_FAULT);
 			return -1;
 		}
+		if (len == 0) {
+			return 0;
+		}
 
 		int64_t fileIv = 0; // Cannot use fileIv on reverse mode.
 
 		// Calculate position.
 		// File header and block header sizes are zero on reverse mode.
-		int32_t blockSize = encfs.getBlockSize();
-		int32_t shift = off % blockSize;
+		const size_t blockSize = this->volume.getBlockSize();
+		size_t shift = off % blockSize;
 		int64_t blockNum = off / blockSize;
-		int64_t lastBlockNum = (off + len - 1) / blockSize;
-
-		int64_t blocksOffset = blockNum * blockSize;
-		int64_t blocksLength = (lastBlockNum + 1) * blockSize - blocksOffset;
-
-		int32_t i = 0;
-		int32_t blockDataLen;
+		const int64_t lastBlockNum = (off + len - 1) / blockSize;
 
-		if (blockNum == this->lastBlockNum) {
-			// Copy from buffer.
-			blockDataLen = len > this->encodeBuffer.size() - shift ? this->encodeBuffer.size() - shift : len;
-			memcpy(buff, &this->encodeBuffer[shift], blockDataLen);
-			blocksOffset = blockNum++ * blockSize;
-			shift = 0;
-			i += blockDataLen;
-			if (i >= len || this->encodeBuffer.size() < blockSize) {
-				return i;
-			}
-		}
-
-		// Seek for read.
-		LARGE_INTEGER distanceToMove;
-		distanceToMove.QuadPart = blocksOffset;
-		if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
-			return -1;
-		}
+		const size_t blocksOffset = blockNum * blockSize;
+		const size_t blocksLength = (lastBlockNum + 1) * blockSize - blocksOffset;
 
 		// Read plain data.
+		EncFSReadBuffers &buffers = getReadBuffers();
 		DWORD readLen;
-		this->blockBuffer.resize(blocksLength);
-		if (!ReadFile(this->handle, &this->blockBuffer[0], (DWORD)blocksLength, &readLen, NULL)) {
-			this->clearBlockBuffer(); 
+		buffers.blockBuffer.resize(blocksLength);
+		if (!readAt(this->handle, blocksOffset, &buffers.blockBuffer[0], (DWORD)blocksLength, readLen)) {
 			return -1;
 		}
-		len = readLen;
-		if (i >= len) {
-			this->clearBlockBuffer();
-			return i;
-		}
 
-		int64_t bufferPos = 0;
-		for (; i < len; i += blockDataLen) {
-			blockDataLen = (len - i) > blockSize - shift ? blockSize - shift : (len - i);
-
-			this->decodeBuffer.resize(blockDataLen + shift);
-			memcpy(&this->decodeBuffer[0], &this->blockBuffer[bufferPos * blockSize], this->decodeBuffer.size());
-
-			this->encodeBuffer.clear();
-			encfs.encodeBlock(fileIv, this->lastBlockNum = blockNum, this->decodeBuffer, this->encodeBuffer);
-
-			memcpy(buff + i, &this->encodeBuffer[shift], blockDataLen);
-			// printf("encode %d %d\n", shift, blockDataLen);
+		int32_t copiedLen = 0;
+		for (size_t i = 0; i < readLen && copiedLen < (int32_t)len; i += blockSize) {
+			buffers.decodeBuffer.assign(&buffers.blockBuffer[i], min(blockSize, (size_t)readLen - i));
+			buffers.encodeBuffer.clear();
+			this->volume.encodeBlock(fileIv, blockNum++, buffers.decodeBuffer, buffers.encodeBuffer);
+			if (buffers.encodeBuffer.size() <= shift) {
+				break;
+			}
 
-			blockNum++;
-			bufferPos++;
+			size_t blockLen = min(buffers.encodeBuffer.size() - shift, (size_t)(len - copiedLen));
+			memcpy(buff + copiedLen, &buffers.encodeBuffer[shift], blockLen);
+			copiedLen += (int32_t)blockLen;
 			shift = 0;
 		}
-		this->clearBlockBuffer();
-		return i;
+		if (buffers.blockBuffer.capacity() > READ_AHEAD_BLOCKS * blockSize) {
+			buffers.blockBuffer.clear();
+			buffers.blockBuffer.shrink_to_fit();
+		}
+		return copiedLen;
+	}
+
+	bool EncFSFile::writePendingHeader() {
+		EncFSFileState* state = this->state.get();
+		lock_guard<decltype(state->ivLock)> lock(state->ivLock);
+		if (state->pendingHeader.empty()) {
+			return true;
+		}
+		LARGE_INTEGER distanceToMove;
+		distanceToMove.QuadPart = 0;
+		if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
+			return false;
+		}
+		DWORD writtenLen;
+		if (!WriteFile(this->handle, state->pendingHeader.data(), (DWORD)state->pendingHeader.size(), &writtenLen, NULL)) {
+			return false;
+		}
+		EncFSIoStats::count(IO_UNDERLYING_WRITTEN, writtenLen);
+		state->pendingHeader.clear();
+		return true;
 	}
 
 	bool EncFSFile::flush() {
@@ -346,17 +1006,29 @@ namespace EncFS {
 
 	bool EncFSFile::setLength(const LPCWSTR FileName, const size_t length) {
 		lock_guard<decltype(this->mutexLock)> lock(this->mutexLock);
-
-		LARGE_INTEGER encodedFileSize;
-		if (!GetFileSizeEx(this->handle, &encodedFileSize)) {
+		EncFSFileState* state = this->getState(FileName);
+		if (!state) {
 			return false;
 		}
-		size_t fileSize = encfs.toDecodedLength(encodedFileSize.QuadPart);
+
+		// Lock from the boundary block to the end of file.
+		const size_t blockDataSize = this->volume.getBlockSize() - this->volume.getHeaderSize();
+		EncFSBlockRange range(*state);
+		size_t fileSize;
+		for (;;) {
+			fileSize = state->getSize();
+			range.lock(min(fileSize, length) / blockDataSize, EncFSFileState::END, true);
+			if (state->getSize() == fileSize) {
+				break;
+			}
+		}
 		if (fileSize == length) {
 			return true;
 		}
 
-		return this->_setLength(FileName, fileSize, length);
+		const bool result = this->_setLength(FileName, fileSize, length);
+		state->recordWrite(this->handle);
+		return result;
 	}
 
 	bool EncFSFile::_setLength(const LPCWSTR FileName, const size_t fileSize, const size_t length) {
@@ -371,13 +1043,13 @@ namespace EncFS {
 			if (!SetEndOfFile(this->handle)) {
 				return false;
 			}
-			this->fileIvAvailable = false;
+			this->state->reset();
 			return true;
 		}
 
 		// EfR[h
-		size_t blockHeaderSize = encfs.getHeaderSize();
-		size_t blockDataSize = encfs.getBlockSize() - blockHeaderSize;
+		size_t blockHeaderSize = this->volume.getHeaderSize();
+		size_t blockDataSize = this->volume.getBlockSize() - blockHeaderSize;
 		size_t shift;
 		size_t blockNum;
 		size_t blocksOffset;
@@ -396,14 +1068,18 @@ namespace EncFS {
 		if (this->getFileIV(FileName, &fileIv, true) == READ_ERROR) {
 			return false;
 		}
+		// The file is extended with zeros, which must not replace the header.
+		if (!this->writePendingHeader()) {
+			return false;
+		}
 		if (shift != 0) {
 			// EfR[h
-			blocksOffset = blockNum * encfs.getBlockSize();
-			if (encfs.isUniqueIV()) {
+			blocksOffset = blockNum * this->volume.getBlockSize();
+			if (this->volume.isUniqueIV()) {
 				blocksOffset += EncFS::EncFSVolume::HEADER_SIZE;
 			}
 			DWORD readLen;
-			this->encodeBuffer.resize(encfs.getBlockSize());
+			this->encodeBuffer.resize(this->volume.getBlockSize());
 			distanceToMove.QuadPart = blocksOffset;
 			if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
 				return false;
@@ -411,21 +1087,27 @@ namespace EncFS {
 			if (!ReadFile(this->handle, &this->encodeBuffer[0], (DWORD)this->encodeBuffer.size(), &readLen, NULL)) {
 				return false;
 			}
+			EncFSIoStats::count(IO_UNDERLYING_READ, readLen);
 			this->encodeBuffer.resize(readLen);
 			this->decodeBuffer.clear();
-			encfs.decodeBlock(fileIv, blockNum, this->encodeBuffer, this->decodeBuffer);
+			if (!this->volume.tryDecodeBlock(fileIv, blockNum, this->encodeBuffer, this->decodeBuffer)) {
+				SetLastError(ERROR_FILE_CORRUPT);
+				return false;
+			}
 		}
 
-		size_t encodedLength = encfs.toEncodedLength(length);
+		size_t encodedLength = this->volume.toEncodedLength(length);
 		LARGE_INTEGER offset;
 		offset.QuadPart = encodedLength;
 		if (!SetFilePointerEx(this->handle, offset, NULL, FILE_BEGIN)) {
 			return false;
 		}
 		if (!SetEndOfFile(this->handle)) {
+			this->state->clearCache();
 			return false;
 		}
-		this->lastBlockNum = -1;
+		this->state->setSize(length);
+		this->state->clearCache();
 
 		if (shift != 0) {
 			// EGR[h
@@ -440,7 +1122,7 @@ namespace EncFS {
 				this->decodeBuffer.resize(blockDataLen);
 			}
 			this->encodeBuffer.clear();
-			encfs.encodeBlock(fileIv, this->lastBlockNum = blockNum, this->decodeBuffer, this->encodeBuffer);
+			this->volume.encodeBlock(fileIv, blockNum, this->decodeBuffer, this->encodeBuffer);
 			if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
 				return false;
 			}
@@ -448,6 +1130,8 @@ namespace EncFS {
 			if (!WriteFile(this->handle, this->encodeBuffer.data(), (DWORD)this->encodeBuffer.size(), &writtenLen, NULL)) {
 				return false;
 			}
+			EncFSIoStats::count(IO_UNDERLYING_WRITTEN, writtenLen);
+			this->state->cacheBlocks(blockNum, this->decodeBuffer);
 		}
 
 		// g債GR[h
@@ -457,7 +1141,7 @@ namespace EncFS {
 				blockNum = length / blockDataSize;
 				this->decodeBuffer.assign(shift, (char)0);
 				this->encodeBuffer.clear();
-				encfs.encodeBlock(fileIv, this->lastBlockNum = blockNum, this->decodeBuffer, this->encodeBuffer);
+				this->volume.encodeBlock(fileIv, blockNum, this->decodeBuffer, this->encodeBuffer);
 				distanceToMove.QuadPart = -(int64_t)shift - (int64_t)blockHeaderSize;
 				if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_END)) {
 					return false;
@@ -466,12 +1150,39 @@ namespace EncFS {
 				if (!WriteFile(this->handle, this->encodeBuffer.data(), (DWORD)this->encodeBuffer.size(), &writtenLen, NULL)) {
 					return false;
 				}
+				EncFSIoStats::count(IO_UNDERLYING_WRITTEN, writtenLen);
+				this->state->cacheBlocks(blockNum, this->decodeBuffer);
+			}
+			if (!this->volume.isAllowHoles()) {
+				// The zeros of the extended full blocks are not holes, encode them.
+				const size_t endBlockNum = length / blockDataSize;
+				size_t zeroBlockNum = (fileSize + blockDataSize - 1) / blockDataSize;
+				if (zeroBlockNum < endBlockNum) {
+					distanceToMove.QuadPart = zeroBlockNum * this->volume.getBlockSize();
+					if (this->volume.isUniqueIV()) {
+						distanceToMove.QuadPart += EncFS::EncFSVolume::HEADER_SIZE;
+					}
+					if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
+						return false;
+					}
+					this->decodeBuffer.assign(blockDataSize, (char)0);
+					for (; zeroBlockNum < endBlockNum; ++zeroBlockNum) {
+						this->encodeBuffer.clear();
+						this->volume.encodeBlock(fileIv, zeroBlockNum, this->decodeBuffer, this->encodeBuffer);
+						DWORD writtenLen;
+						if (!WriteFile(this->handle, this->encodeBuffer.data(), (DWORD)this->encodeBuffer.size(), &writtenLen, NULL)) {
+							return false;
+						}
+						EncFSIoStats::count(IO_UNDERLYING_WRITTEN, writtenLen);
+					}
+				}
 			}
 		}
 		return true;
 	}
 
 	bool EncFSFile::changeFileIV(const LPCWSTR FileName, const LPCWSTR NewFileName) {
+		lock_guard<decltype(this->mutexLock)> lock(this->mutexLock);
 		int64_t fileIv;
 		//printf("changeFileIV\n");
 		EncFSGetFileIVResult ivResult = this->getFileIV(FileName, &fileIv, false);
@@ -484,7 +1195,16 @@ namespace EncFS {
 		//printf("changeFileIV A %d\n", fileIv);
 		string cNewFileName = strConv.to_bytes(wstring(NewFileName));
 		string encodedFileHeader;
-		encfs.encodeFileIv(cNewFileName, fileIv, encodedFileHeader);
+		this->volume.encodeFileIv(cNewFileName, fileIv, encodedFileHeader);
+		{
+			EncFSFileState* state = this->state.get();
+			lock_guard<decltype(state->ivLock)> lock(state->ivLock);
+			if (!state->pendingHeader.empty()) {
+				// Not written yet, the first block writes the header of the new name.
+				state->pendingHeader = encodedFileHeader;
+				return true;
+			}
+		}
 		LARGE_INTEGER distanceToMove;
 		distanceToMove.QuadPart = 0;
 		if (!SetFilePointerEx(this->handle, distanceToMove, NULL, FILE_BEGIN)) {
@@ -495,12 +1215,14 @@ namespace EncFS {
 		if (!WriteFile(this->handle, encodedFileHeader.data(), (DWORD)encodedFileHeader.size(), &writtenLen, NULL)) {
 			return false;
 		}
+		EncFSIoStats::count(IO_UNDERLYING_WRITTEN, writtenLen);
+		this->state->recordWrite(this->handle);
 		//printf("changeFileIV C %d\n", fileIv);
 		return true;
 	}
 
 	void EncFSFile::clearBlockBuffer() {
-		if (this->blockBuffer.capacity() > encfs.getBlockSize()) {
+		if (this->blockBuffer.capacity() > this->volume.getBlockSize()) {
 			this->blockBuffer.clear();
 			this->blockBuffer.shrink_to_fit();
 		}
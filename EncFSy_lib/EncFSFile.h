@@ -3,12 +3,16 @@
 #include <winbase.h>
 
 #include "EncFSVolume.h"
+#include "EncFSMemory.h"
+#include "EncFSArena.h"
 
 #include <string>
 #include <codecvt>
 #include <mutex>
-
-extern EncFS::EncFSVolume encfs;
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <condition_variable>
 
 namespace EncFS
 {
@@ -18,37 +22,268 @@ namespace EncFS
 		EMPTY
 	};
 
+	/**
+	Identity of an underlying file stream, stable across renames.
+	FAT and exFAT have no persistent file IDs, the index of a file changes when its directory entry moves.
+	Their files are keyed by the normalized path with a zero index instead, which a rename changes:
+	a handle opened after a rename doesn't share the state of the handles opened before.
+	**/
+	struct EncFSFileKey {
+		DWORD volumeSerial;
+		uint64_t fileIndex;
+		/** \\?\ prefixed path of the underlying file when the volume has no persistent file IDs, empty otherwise. */
+		wstring path;
+		wstring stream;
+
+		inline bool operator<(const EncFSFileKey &other) const {
+			if (this->volumeSerial != other.volumeSerial) {
+				return this->volumeSerial < other.volumeSerial;
+			}
+			if (this->fileIndex != other.fileIndex) {
+				return this->fileIndex < other.fileIndex;
+			}
+			if (this->path != other.path) {
+				return this->path < other.path;
+			}
+			return this->stream < other.stream;
+		}
+	};
+
+	/**
+	Consecutive plain blocks decoded by a read of a read only volume, never modified once published.
+	**/
+	struct EncFSBlockSnapshot {
+		int64_t firstBlockNum;
+		EncFSArenaBlocks data;
+
+		EncFSBlockSnapshot(size_t blockSize, size_t blockDataSize) : firstBlockNum(0), data(blockSize, blockDataSize) {
+		}
+	};
+
+	/**
+	State of an underlying file shared by all handles opened to it:
+	the decoded file IV, the logical size, the last decoded blocks and the block range locks.
+	It lives while at least one handle is attached.
+	**/
+	class EncFSFileState {
+		friend class EncFSFile;
+
+	public:
+		/** Last block of a range which reaches the end of file. */
+		static const size_t END = SIZE_MAX;
+
+	private:
+		struct Range {
+			size_t first;
+			size_t last;
+			bool exclusive;
+		};
+
+		const EncFSFileKey key;
+		/** Plain bytes of a block of the volume. */
+		const size_t blockDataSize;
+
+		EncFSMutex ivLock{ ivLockStats };
+		int64_t fileIv;
+		/** Set after fileIv, read without the lock on read only volumes. */
+		atomic<bool> fileIvAvailable;
+		/** Header of a new file which is not written yet, the first write of a block writes it. */
+		string pendingHeader;
+
+		EncFSMutex stateLock{ stateLockStats };
+		condition_variable_any rangeReleased;
+		vector<Range> ranges;
+		/** Changed under the state lock, read without it on read only volumes. */
+		atomic<size_t> size;
+		int64_t cachedBlockNum;
+		EncFSArenaBlocks cachedData;
+
+		/** Last blocks decoded on a read only volume, replaced as a whole without the state lock. */
+		shared_ptr<const EncFSBlockSnapshot> readOnlyCache;
+		/** End of the last read on a read only volume, to detect sequential reads. */
+		atomic<size_t> nextReadOffset;
+		/** Tick when blocks were last cached, the oldest caches are trimmed first. */
+		atomic<uint64_t> cachedTime;
+		/** Encoded size and last write time of the underlying file after the last write through the mount, -1 if unknown. */
+		int64_t writtenSize;
+		uint64_t writtenTime;
+
+		static EncFSLockStats* ivLockStats;
+		static EncFSLockStats* stateLockStats;
+		/** Watchers of underlying roots, the writes are recorded only while there is any. */
+		static atomic<int> watchers;
+
+	public:
+		EncFSFileState(const EncFSFileKey &key, size_t blockSize, size_t blockDataSize, size_t size) : key(key),
+			blockDataSize(blockDataSize), cachedData(blockSize, blockDataSize) {
+			this->fileIv = 0L;
+			this->fileIvAvailable = false;
+			this->size = size;
+			this->cachedBlockNum = -1;
+			this->nextReadOffset = 0;
+			this->cachedTime = 0;
+			this->writtenSize = -1;
+			this->writtenTime = 0;
+		}
+		~EncFSFileState();
+
+		/**
+		State of the file of the handle, created when no other handle is attached.
+		Returns an empty pointer with the last error set on failure.
+		**/
+		static shared_ptr<EncFSFileState> acquire(EncFSVolume &volume, const EncFSFileKey &key, HANDLE handle);
+
+		/**
+		Detach the state, dropping it when it was the last handle.
+		**/
+		static void release(shared_ptr<EncFSFileState> &state);
+
+		/**
+		Forget the file IV and the cached blocks of the underlying file of the handle and take its size again,
+		if any handle of the mount is attached. Called when the underlying file changed;
+		returns false when it is as the last write through the mount left it.
+		On read only volumes only the cached blocks are forgotten.
+		**/
+		static bool invalidate(EncFSVolume &volume, HANDLE handle);
+
+		/**
+		Count a watcher of an underlying root in or out.
+		**/
+		static void watch(bool watching);
+
+		/**
+		Keys of the files with a handle attached on the volume, without the alternate streams.
+		**/
+		static void getKeys(DWORD volumeSerial, vector<EncFSFileKey> &keys);
+
+		size_t getSize();
+		void setSize(size_t size);
+		void extendSize(size_t size);
+
+		inline bool isFileIvAvailable() {
+			lock_guard<decltype(this->ivLock)> lock(this->ivLock);
+			return this->fileIvAvailable;
+		}
+
+		/**
+		Copy the plain block into the buffer if it is cached.
+		**/
+		bool copyCachedBlock(int64_t blockNum, string &block);
+
+		/**
+		Replace the cache with consecutive plain blocks starting at the block.
+		**/
+		void cacheBlocks(int64_t firstBlockNum, const string &data);
+		void clearCache();
+
+		/**
+		Replace the blocks of a read only volume and count them against the memory budget.
+		**/
+		void cacheSnapshot(shared_ptr<const EncFSBlockSnapshot> snapshot);
+
+		/**
+		Drop the cached blocks of the least recently cached files, called by the memory governor.
+		Returns the bytes released.
+		**/
+		static size_t trimCaches(size_t bytes);
+
+		/**
+		Wait until no other handle holds a conflicting lock on the blocks [first, last].
+		Shared locks conflict only with exclusive ones.
+		**/
+		void lockRange(size_t first, size_t last, bool exclusive);
+		void unlockRange(size_t first, size_t last, bool exclusive);
+
+	private:
+		void reset();
+
+		/**
+		Record the underlying file as a write through the mount left it, when the root is watched.
+		**/
+		void recordWrite(HANDLE handle);
+
+		/**
+		Drop the cached blocks for the memory governor. Returns the bytes released.
+		**/
+		size_t trimCache();
+	};
+
+	/**
+	Block range lock released at the end of the scope.
+	**/
+	class EncFSBlockRange {
+	private:
+		EncFSFileState &state;
+		size_t first;
+		size_t last;
+		bool exclusive;
+		bool locked;
+
+	public:
+		EncFSBlockRange(EncFSFileState &state) : state(state) {
+			this->first = this->last = 0;
+			this->exclusive = false;
+			this->locked = false;
+		}
+		~EncFSBlockRange() {
+			this->unlock();
+		}
+
+		inline void lock(size_t first, size_t last, bool exclusive) {
+			this->unlock();
+			this->state.lockRange(first, last, exclusive);
+			this->first = first;
+			this->last = last;
+			this->exclusive = exclusive;
+			this->locked = true;
+		}
+
+		inline void unlock() {
+			if (this->locked) {
+				this->state.unlockRange(this->first, this->last, this->exclusive);
+				this->locked = false;
+			}
+		}
+	};
+
 	class EncFSFile {
+	public:
+		/** Files up to this number of blocks are read with the header at once on the first read. */
+		static const size_t SMALL_FILE_BLOCKS = 4;
+		/** Blocks decoded at once by sequential reads of a read only volume. */
+		static const size_t READ_AHEAD_BLOCKS = 128;
+
 	private:
+		EncFSVolume &volume;
 		HANDLE handle;
 		bool canRead;
 
-		int64_t fileIv;
-		bool fileIvAvailable;
+		shared_ptr<EncFSFileState> state;
+		/** state once attached, for the reads of a read only volume which don't take mutexLock. */
+		atomic<EncFSFileState*> readOnlyState;
 
 		string blockBuffer;
-		int64_t lastBlockNum;
 		string encodeBuffer;
 		string decodeBuffer;
-		mutex mutexLock;
+		EncFSMutex mutexLock{ lockStats };
 		wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
 
 	public:
 		static int64_t counter;
+		static EncFSLockStats* lockStats;
 
-		EncFSFile(HANDLE handle, bool canRead) {
+		EncFSFile(EncFSVolume &volume, HANDLE handle, bool canRead) : volume(volume) {
 			if (!handle || handle == INVALID_HANDLE_VALUE) {
 				throw EncFSIllegalStateException();
 			}
 			this->handle = handle;
 			this->canRead = canRead;
-			this->fileIvAvailable = false;
-			this->fileIv = 0L;
-			this->lastBlockNum = -1;
+			this->readOnlyState = NULL;
 			++counter;
 		}
 
 		~EncFSFile() {
+			EncFSFileState::release(this->state);
 			CloseHandle(this->handle);
 			this->handle = INVALID_HANDLE_VALUE;
 			--counter;
@@ -59,15 +294,30 @@ namespace EncFS
 		}
 
 		int32_t read(const LPCWSTR FileName, char* buff, size_t off, DWORD len);
-		int32_t write(const LPCWSTR FileName, size_t fileSize, const char* buff, size_t off, DWORD len);
+		int32_t write(const LPCWSTR FileName, const char* buff, size_t off, DWORD len);
 		int32_t reverseRead(const LPCWSTR FileName, char* buff, size_t off, DWORD len);
 		bool flush();
 		bool setLength(const LPCWSTR FileName, const size_t length);
 		bool changeFileIV(const LPCWSTR FileName, const LPCWSTR NewFileName);
 
+		/**
+		Logical size of the file shared by all handles.
+		**/
+		bool getFileSize(const LPCWSTR FileName, size_t *fileSize);
+
+		/**
+		Drop the shared state of the file after it was truncated by CREATE_ALWAYS or TRUNCATE_EXISTING.
+		**/
+		void invalidateState(const LPCWSTR FileName);
+
 	private:
+		bool getFileKey(const LPCWSTR FileName, EncFSFileKey &key);
+		EncFSFileState* getState(const LPCWSTR FileName);
 		EncFSGetFileIVResult getFileIV(const LPCWSTR FileName, int64_t *fileIv, bool create);
+		EncFSGetFileIVResult readSmallFile(const LPCWSTR FileName, int64_t *fileIv);
+		int32_t readOnlyRead(const LPCWSTR FileName, char* buff, size_t off, DWORD len);
 		bool _setLength(const LPCWSTR FileName, const size_t fileSize, const size_t length);
+		bool writePendingHeader();
 		void clearBlockBuffer();
 	};
 }
@@ -0,0 +1,170 @@
+#include "EncFSIoStats.h"
+
+#include <cwchar>
+#include <cwctype>
+
+namespace EncFS
+{
+	atomic<bool> EncFSIoStats::enabled(false);
+	atomic<uint64_t> EncFSIoStats::counters[TRACE_OP_COUNT][EXT_BUCKET_COUNT][IO_COUNTER_COUNT];
+
+	static const char* BUCKET_NAMES[EXT_BUCKET_COUNT] = {
+		"(none)",
+		"text",
+		"source",
+		"document",
+		"image",
+		"media",
+		"archive",
+		"binary",
+		"other"
+	};
+
+	struct EncFSExtension {
+		const wchar_t* extension;
+		EncFSExtensionBucket bucket;
+	};
+
+	static const EncFSExtension EXTENSIONS[] = {
+		{ L"txt", EXT_TEXT }, { L"log", EXT_TEXT }, { L"md", EXT_TEXT }, { L"csv", EXT_TEXT },
+		{ L"json", EXT_TEXT }, { L"xml", EXT_TEXT }, { L"ini", EXT_TEXT }, { L"html", EXT_TEXT },
+		{ L"c", EXT_SOURCE }, { L"cpp", EXT_SOURCE }, { L"h", EXT_SOURCE }, { L"hpp", EXT_SOURCE },
+		{ L"cs", EXT_SOURCE }, { L"java", EXT_SOURCE }, { L"py", EXT_SOURCE }, { L"js", EXT_SOURCE },
+		{ L"ts", EXT_SOURCE }, { L"go", EXT_SOURCE }, { L"rs", EXT_SOURCE },
+		{ L"doc", EXT_DOCUMENT }, { L"docx", EXT_DOCUMENT }, { L"xls", EXT_DOCUMENT }, { L"xlsx", EXT_DOCUMENT },
+		{ L"ppt", EXT_DOCUMENT }, { L"pptx", EXT_DOCUMENT }, { L"pdf", EXT_DOCUMENT },
+		{ L"jpg", EXT_IMAGE }, { L"jpeg", EXT_IMAGE }, { L"png", EXT_IMAGE }, { L"gif", EXT_IMAGE },
+		{ L"bmp", EXT_IMAGE }, { L"heic", EXT_IMAGE }, { L"raw", EXT_IMAGE },
+		{ L"mp3", EXT_MEDIA }, { L"mp4", EXT_MEDIA }, { L"mov", EXT_MEDIA }, { L"mkv", EXT_MEDIA },
+		{ L"avi", EXT_MEDIA }, { L"wav", EXT_MEDIA }, { L"flac", EXT_MEDIA },
+		{ L"zip", EXT_ARCHIVE }, { L"7z", EXT_ARCHIVE }, { L"rar", EXT_ARCHIVE }, { L"gz", EXT_ARCHIVE },
+		{ L"tar", EXT_ARCHIVE }, { L"iso", EXT_ARCHIVE },
+		{ L"exe", EXT_BINARY }, { L"dll", EXT_BINARY }, { L"obj", EXT_BINARY }, { L"o", EXT_BINARY },
+		{ L"lib", EXT_BINARY }, { L"pdb", EXT_BINARY }, { L"pch", EXT_BINARY }, { L"db", EXT_BINARY }
+	};
+
+	void EncFSIoStats::add(EncFSIoCounter counter, uint64_t value) {
+		const Scope &scope = getScope();
+		counters[scope.op][scope.bucket][counter].fetch_add(value, memory_order_relaxed);
+	}
+
+	void EncFSIoStats::setEnabled(bool enable) {
+		enabled.store(enable);
+	}
+
+	void EncFSIoStats::reset() {
+		for (auto &op : counters) {
+			for (auto &bucket : op) {
+				for (auto &counter : bucket) {
+					counter = 0;
+				}
+			}
+		}
+	}
+
+	EncFSExtensionBucket EncFSIoStats::getBucket(LPCWSTR fileName) {
+		if (!fileName) {
+			return EXT_NONE;
+		}
+		const wchar_t* name = wcsrchr(fileName, L'\\');
+		name = name ? name + 1 : fileName;
+		// Streams are counted with their file.
+		const wchar_t* end = wcschr(name, L':');
+		const size_t nameLen = end ? (size_t)(end - name) : wcslen(name);
+		const wchar_t* dot = NULL;
+		for (size_t i = 0; i < nameLen; ++i) {
+			if (name[i] == L'.') {
+				dot = name + i;
+			}
+		}
+		if (!dot || dot == name) {
+			return EXT_NONE;
+		}
+		const size_t extLen = nameLen - (size_t)(dot + 1 - name);
+		for (const EncFSExtension &extension : EXTENSIONS) {
+			if (wcslen(extension.extension) == extLen && _wcsnicmp(extension.extension, dot + 1, extLen) == 0) {
+				return extension.bucket;
+			}
+		}
+		return EXT_OTHER;
+	}
+
+	/**
+	Sum of the counters of the op, or of all ops when op is TRACE_OP_COUNT.
+	Same for the bucket.
+	**/
+	static void sumCounters(atomic<uint64_t> (&counters)[TRACE_OP_COUNT][EXT_BUCKET_COUNT][IO_COUNTER_COUNT],
+		size_t op, size_t bucket, uint64_t (&sums)[IO_COUNTER_COUNT]) {
+		for (size_t i = 0; i < IO_COUNTER_COUNT; ++i) {
+			sums[i] = 0;
+		}
+		for (size_t o = 0; o < TRACE_OP_COUNT; ++o) {
+			if (op != TRACE_OP_COUNT && o != op) {
+				continue;
+			}
+			for (size_t b = 0; b < EXT_BUCKET_COUNT; ++b) {
+				if (bucket != EXT_BUCKET_COUNT && b != bucket) {
+					continue;
+				}
+				for (size_t i = 0; i < IO_COUNTER_COUNT; ++i) {
+					sums[i] += counters[o][b][i].load(memory_order_relaxed);
+				}
+			}
+		}
+	}
+
+	/**
+	Underlying bytes per logical byte, or - when nothing was requested.
+	**/
+	static void printRatio(FILE* out, uint64_t underlying, uint64_t logical) {
+		if (logical == 0) {
+			fprintf(out, " %8s", "-");
+		}
+		else {
+			fprintf(out, " %8.2f", (double)underlying / logical);
+		}
+	}
+
+	static void printRow(FILE* out, const char* name, const uint64_t (&sums)[IO_COUNTER_COUNT]) {
+		fprintf(out, "%-22s %10llu %12.1f %12.1f %12.1f %12.1f", name,
+			(unsigned long long)sums[IO_CALLS],
+			sums[IO_LOGICAL_READ] / 1024.0, sums[IO_UNDERLYING_READ] / 1024.0,
+			sums[IO_LOGICAL_WRITTEN] / 1024.0, sums[IO_UNDERLYING_WRITTEN] / 1024.0);
+		printRatio(out, sums[IO_UNDERLYING_READ], sums[IO_LOGICAL_READ]);
+		printRatio(out, sums[IO_UNDERLYING_WRITTEN], sums[IO_LOGICAL_WRITTEN]);
+		fprintf(out, " %12llu %10llu %10llu %10llu\n",
+			(unsigned long long)sums[IO_AES_BLOCKS], (unsigned long long)sums[IO_HMACS],
+			(unsigned long long)sums[IO_NAME_ENCODES], (unsigned long long)sums[IO_NAME_DECODES]);
+	}
+
+	static void printHeader(FILE* out, const char* title) {
+		fprintf(out, "%-22s %10s %12s %12s %12s %12s %8s %8s %12s %10s %10s %10s\n", title, "calls",
+			"read(KiB)", "disk read", "write(KiB)", "disk write", "read x", "write x",
+			"aes blocks", "hmacs", "name enc", "name dec");
+	}
+
+	void EncFSIoStats::print(FILE* out) {
+		uint64_t sums[IO_COUNTER_COUNT];
+		printHeader(out, "op");
+		for (size_t op = 0; op < TRACE_OP_COUNT; ++op) {
+			sumCounters(counters, op, EXT_BUCKET_COUNT, sums);
+			bool used = false;
+			for (size_t i = 0; i < IO_COUNTER_COUNT; ++i) {
+				used = used || sums[i] != 0;
+			}
+			if (used) {
+				printRow(out, op == 0 ? "(no callback)" : getTraceOpName((uint16_t)op), sums);
+			}
+		}
+		sumCounters(counters, TRACE_OP_COUNT, EXT_BUCKET_COUNT, sums);
+		printRow(out, "total", sums);
+
+		printHeader(out, "extension");
+		for (size_t bucket = 0; bucket < EXT_BUCKET_COUNT; ++bucket) {
+			sumCounters(counters, TRACE_OP_COUNT, bucket, sums);
+			if (sums[IO_CALLS] != 0) {
+				printRow(out, BUCKET_NAMES[bucket], sums);
+			}
+		}
+	}
+}
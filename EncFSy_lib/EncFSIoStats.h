@@ -0,0 +1,122 @@
+#pragma once
+#include <dokan.h>
+
+#include "EncFSTrace.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+
+using namespace std;
+
+namespace EncFS
+{
+	enum EncFSIoCounter {
+		IO_CALLS,
+		/** Bytes applications asked to read and write. */
+		IO_LOGICAL_READ,
+		IO_LOGICAL_WRITTEN,
+		/** Bytes read from and written to the underlying files. */
+		IO_UNDERLYING_READ,
+		IO_UNDERLYING_WRITTEN,
+		/** 16 byte AES blocks of block and name ciphers, each pass counted. */
+		IO_AES_BLOCKS,
+		IO_HMACS,
+		/** Names encrypted and decrypted, not those found in the name index. */
+		IO_NAME_ENCODES,
+		IO_NAME_DECODES,
+		IO_COUNTER_COUNT
+	};
+
+	/**
+	Files by extension, as workloads differ by file type.
+	**/
+	enum EncFSExtensionBucket {
+		EXT_NONE,
+		EXT_TEXT,
+		EXT_SOURCE,
+		EXT_DOCUMENT,
+		EXT_IMAGE,
+		EXT_MEDIA,
+		EXT_ARCHIVE,
+		EXT_BINARY,
+		EXT_OTHER,
+		EXT_BUCKET_COUNT
+	};
+
+	/**
+	Work done by the engine for each Dokan callback and extension bucket of its file,
+	to find where it reads, writes and ciphers more than applications request.
+	Work outside of callbacks, as the warmer and console commands, is counted under op 0.
+	**/
+	class EncFSIoStats {
+	private:
+		static atomic<bool> enabled;
+		static atomic<uint64_t> counters[TRACE_OP_COUNT][EXT_BUCKET_COUNT][IO_COUNTER_COUNT];
+
+		struct Scope {
+			uint16_t op;
+			EncFSExtensionBucket bucket;
+		};
+
+		static Scope& getScope() {
+			static thread_local Scope scope = { 0, EXT_NONE };
+			return scope;
+		}
+
+		static void add(EncFSIoCounter counter, uint64_t value);
+
+	public:
+		static inline bool isEnabled() {
+			return enabled.load(memory_order_relaxed);
+		}
+
+		/**
+		Start or stop counting. Nothing is counted until enabled.
+		**/
+		static void setEnabled(bool enable);
+
+		static void reset();
+
+		/**
+		Print the counters and amplification ratios by op and by extension bucket.
+		**/
+		static void print(FILE* out);
+
+		static EncFSExtensionBucket getBucket(LPCWSTR fileName);
+
+		inline static void count(EncFSIoCounter counter, uint64_t value = 1) {
+			if (isEnabled()) {
+				add(counter, value);
+			}
+		}
+
+		/**
+		Count the work of the calling thread under the callback until the end of the scope.
+		**/
+		class CallScope {
+		private:
+			Scope saved;
+			bool active;
+
+		public:
+			CallScope(EncFSTraceOp op, LPCWSTR fileName) : active(isEnabled()) {
+				if (this->active) {
+					Scope &scope = getScope();
+					this->saved = scope;
+					scope.op = op;
+					scope.bucket = getBucket(fileName);
+					add(IO_CALLS, 1);
+				}
+			}
+			~CallScope() {
+				if (this->active) {
+					getScope() = this->saved;
+				}
+			}
+
+			CallScope(const CallScope&) = delete;
+			CallScope& operator=(const CallScope&) = delete;
+		};
+	};
+}
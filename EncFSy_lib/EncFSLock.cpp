@@ -0,0 +1,91 @@
+#include "EncFSLock.h"
+
+#include <map>
+#include <memory>
+
+namespace EncFS
+{
+	atomic<bool> EncFSLockStats::enabled(false);
+
+	/**
+	Registry of stats by name. Not destructed, locks of static objects may outlive it.
+	**/
+	static mutex& registryLock() {
+		static mutex* lock = new mutex();
+		return *lock;
+	}
+
+	static map<string, EncFSLockStats*>& registry() {
+		static map<string, EncFSLockStats*>* stats = new map<string, EncFSLockStats*>();
+		return *stats;
+	}
+
+	EncFSLockStats::EncFSLockStats(const string &name) : name(name), acquisitions(0), contended(0), waitNs(0) {
+		for (int i = 0; i < BUCKETS; ++i) {
+			this->histogram[i] = 0;
+		}
+	}
+
+	EncFSLockStats* EncFSLockStats::get(const char* name) {
+		lock_guard<mutex> lock(registryLock());
+		EncFSLockStats* &stats = registry()[name];
+		if (!stats) {
+			stats = new EncFSLockStats(name);
+		}
+		return stats;
+	}
+
+	void EncFSLockStats::setEnabled(bool enable) {
+		enabled.store(enable);
+	}
+
+	void EncFSLockStats::reset() {
+		lock_guard<mutex> lock(registryLock());
+		for (auto &entry : registry()) {
+			EncFSLockStats* stats = entry.second;
+			stats->acquisitions = 0;
+			stats->contended = 0;
+			stats->waitNs = 0;
+			for (int i = 0; i < BUCKETS; ++i) {
+				stats->histogram[i] = 0;
+			}
+		}
+	}
+
+	/**
+	Upper bound of the bucket which holds the percentile of contended waits.
+	**/
+	static uint64_t waitPercentile(const EncFSLockStats &stats, uint64_t contended, double p) {
+		const uint64_t rank = (uint64_t)(contended * p);
+		uint64_t count = 0;
+		for (int i = 0; i < EncFSLockStats::BUCKETS; ++i) {
+			count += stats.histogram[i].load();
+			if (count > rank) {
+				return 2ULL << i;
+			}
+		}
+		return 0;
+	}
+
+	void EncFSLockStats::print(FILE* out) {
+		lock_guard<mutex> lock(registryLock());
+		fprintf(out, "%-28s %14s %12s %8s %12s %12s %12s\n",
+			"lock", "acquisitions", "contended", "%", "wait(ms)", "p50(us)", "p99(us)");
+		for (auto &entry : registry()) {
+			EncFSLockStats* stats = entry.second;
+			const uint64_t acquisitions = stats->acquisitions.load();
+			if (acquisitions == 0) {
+				continue;
+			}
+			const uint64_t contended = stats->contended.load();
+			fprintf(out, "%-28s %14llu %12llu %8.2f %12.3f %12.3f %12.3f\n",
+				stats->name.c_str(),
+				(unsigned long long)acquisitions,
+				(unsigned long long)contended,
+				100.0 * contended / acquisitions,
+				stats->waitNs.load() / 1e6,
+				waitPercentile(*stats, contended, 0.5) / 1e3,
+				waitPercentile(*stats, contended, 0.99) / 1e3);
+		}
+	}
+}
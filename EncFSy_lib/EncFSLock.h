@@ -0,0 +1,129 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+
+/**
+Build with ENCFS_LOCK_PROFILE=0 to compile EncFSMutex down to a plain mutex.
+*/
+#ifndef ENCFS_LOCK_PROFILE
+#define ENCFS_LOCK_PROFILE 1
+#endif
+
+using namespace std;
+
+namespace EncFS
+{
+	/**
+	Contention statistics shared by all locks of the same name.
+	**/
+	class EncFSLockStats {
+	public:
+		/** Wait time histogram buckets, bucket i counts waits in [2^i, 2^(i+1)) ns. */
+		static const int BUCKETS = 40;
+
+		const string name;
+		atomic<uint64_t> acquisitions;
+		atomic<uint64_t> contended;
+		atomic<uint64_t> waitNs;
+		atomic<uint64_t> histogram[BUCKETS];
+
+		EncFSLockStats(const string &name);
+		~EncFSLockStats() {};
+
+		/**
+		Stats of the name, created on first use. The returned object lives until the process exits.
+		**/
+		static EncFSLockStats* get(const char* name);
+
+		static inline bool isEnabled() {
+			return enabled.load(memory_order_relaxed);
+		}
+
+		/**
+		Start or stop recording. Locks are not recorded until enabled.
+		**/
+		static void setEnabled(bool enable);
+
+		/**
+		Clear the counters of all locks.
+		**/
+		static void reset();
+
+		/**
+		Print the counters of all acquired locks.
+		**/
+		static void print(FILE* out);
+
+		inline void record(uint64_t wait) {
+			int bucket = 0;
+			while (bucket < BUCKETS - 1 && (wait >> (bucket + 1)) != 0) {
+				++bucket;
+			}
+			this->contended.fetch_add(1, memory_order_relaxed);
+			this->waitNs.fetch_add(wait, memory_order_relaxed);
+			this->histogram[bucket].fetch_add(1, memory_order_relaxed);
+		}
+
+	private:
+		static atomic<bool> enabled;
+	};
+
+	/**
+	Mutex which records acquisitions and contended waits of its name
+	while EncFSLockStats is enabled. Usable with lock_guard and unique_lock.
+	**/
+	class EncFSMutex {
+	private:
+		mutex m;
+#if ENCFS_LOCK_PROFILE
+		EncFSLockStats* stats;
+#endif
+
+	public:
+		explicit EncFSMutex(const char* name) {
+#if ENCFS_LOCK_PROFILE
+			this->stats = EncFSLockStats::get(name);
+#endif
+		}
+		explicit EncFSMutex(EncFSLockStats* stats) {
+#if ENCFS_LOCK_PROFILE
+			this->stats = stats;
+#endif
+		}
+		~EncFSMutex() {};
+
+		EncFSMutex(const EncFSMutex&) = delete;
+		EncFSMutex& operator=(const EncFSMutex&) = delete;
+
+		inline void lock() {
+#if ENCFS_LOCK_PROFILE
+			if (!EncFSLockStats::isEnabled()) {
+				this->m.lock();
+				return;
+			}
+			this->stats->acquisitions.fetch_add(1, memory_order_relaxed);
+			if (this->m.try_lock()) {
+				return;
+			}
+			const auto start = chrono::steady_clock::now();
+			this->m.lock();
+			this->stats->record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+#else
+			this->m.lock();
+#endif
+		}
+
+		inline bool try_lock() {
+			return this->m.try_lock();
+		}
+
+		inline void unlock() {
+			this->m.unlock();
+		}
+	};
+}
@@ -0,0 +1,191 @@
+#include "EncFSMemory.h"
+
+#include <windows.h>
+
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+
+namespace EncFS
+{
+	/**
+	Registered caches. Not destructed, caches of static objects may outlive it.
+	A cache is trimmed under the lock, so it can't be unregistered while it's trimmed.
+	**/
+	static mutex& registryLock() {
+		static mutex* lock = new mutex();
+		return *lock;
+	}
+
+	static vector<EncFSCache*>& registry() {
+		static vector<EncFSCache*>* caches = new vector<EncFSCache*>();
+		return *caches;
+	}
+
+	static atomic<int64_t> totalUsage(0);
+	static atomic<size_t> budget(0);
+	static atomic<bool> overBudgetSignaled(false);
+	static HANDLE overBudgetEvent = NULL;
+	static HANDLE stopEvent = NULL;
+	static thread governor;
+
+	EncFSCache::EncFSCache(const char* name, const Trimmer &trimmer) : name(name), trimmer(trimmer),
+		usage(0), hits(0), misses(0), trimmedHits(0), trimmedMisses(0) {
+		EncFSMemoryGovernor::registerCache(this);
+	}
+
+	EncFSCache::~EncFSCache() {
+		EncFSMemoryGovernor::unregisterCache(this);
+		totalUsage.fetch_sub(this->usage.load());
+	}
+
+	void EncFSCache::charge(int64_t bytes) {
+		this->usage.fetch_add(bytes, memory_order_relaxed);
+		const int64_t usage = totalUsage.fetch_add(bytes, memory_order_relaxed) + bytes;
+		if (bytes > 0) {
+			EncFSMemoryGovernor::charged(usage);
+		}
+	}
+
+	void EncFSMemoryGovernor::registerCache(EncFSCache* cache) {
+		lock_guard<mutex> lock(registryLock());
+		registry().push_back(cache);
+	}
+
+	void EncFSMemoryGovernor::unregisterCache(EncFSCache* cache) {
+		lock_guard<mutex> lock(registryLock());
+		vector<EncFSCache*> &caches = registry();
+		caches.erase(remove(caches.begin(), caches.end(), cache), caches.end());
+	}
+
+	void EncFSMemoryGovernor::charged(int64_t usage) {
+		const size_t limit = budget.load(memory_order_relaxed);
+		if (limit == 0 || usage <= (int64_t)limit) {
+			return;
+		}
+		// Wake the governor once until it has trimmed.
+		if (!overBudgetSignaled.exchange(true) && overBudgetEvent) {
+			SetEvent(overBudgetEvent);
+		}
+	}
+
+	void EncFSMemoryGovernor::setBudget(size_t bytes) {
+		budget = bytes;
+	}
+
+	size_t EncFSMemoryGovernor::getBudget() {
+		return budget;
+	}
+
+	size_t EncFSMemoryGovernor::trim(size_t bytes) {
+		lock_guard<mutex> lock(registryLock());
+		// Lookups since the last trim tell which caches still pay off.
+		struct Candidate {
+			EncFSCache* cache;
+			double hitRate;
+		};
+		vector<Candidate> candidates;
+		for (EncFSCache* cache : registry()) {
+			if (cache->getUsage() <= 0) {
+				continue;
+			}
+			const uint64_t hits = cache->hits.load() - cache->trimmedHits;
+			const uint64_t lookups = hits + cache->misses.load() - cache->trimmedMisses;
+			candidates.push_back(Candidate{ cache, lookups ? (double)hits / lookups : 0.0 });
+		}
+		stable_sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+			return a.hitRate < b.hitRate;
+		});
+		size_t released = 0;
+		for (const Candidate &candidate : candidates) {
+			if (released >= bytes) {
+				break;
+			}
+			released += candidate.cache->trimmer(bytes - released);
+		}
+		for (EncFSCache* cache : registry()) {
+			cache->trimmedHits = cache->hits.load();
+			cache->trimmedMisses = cache->misses.load();
+		}
+		return released;
+	}
+
+	void EncFSMemoryGovernor::run() {
+		HANDLE lowMemory = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+		HANDLE handles[3] = { stopEvent, overBudgetEvent, lowMemory };
+		const DWORD handleCount = lowMemory ? 3 : 2;
+		for (;;) {
+			const DWORD result = WaitForMultipleObjects(handleCount, handles, FALSE, INFINITE);
+			if (result == WAIT_OBJECT_0 + 1) {
+				overBudgetSignaled = false;
+				const int64_t usage = totalUsage.load();
+				const size_t limit = budget.load();
+				if (limit > 0 && usage > (int64_t)limit) {
+					// Down to 7/8 of the budget, so that the caches don't trim on every charge.
+					trim((size_t)usage - limit + limit / 8);
+				}
+			}
+			else if (result == WAIT_OBJECT_0 + 2) {
+				// Give back half of the caches to the other processes.
+				const int64_t usage = totalUsage.load();
+				if (usage > 0) {
+					trim((size_t)usage / 2);
+				}
+				if (WaitForSingleObject(stopEvent, PRESSURE_INTERVAL_MILLIS) != WAIT_TIMEOUT) {
+					break;
+				}
+			}
+			else {
+				break;
+			}
+		}
+		if (lowMemory) {
+			CloseHandle(lowMemory);
+		}
+	}
+
+	void EncFSMemoryGovernor::start() {
+		if (governor.joinable()) {
+			return;
+		}
+		stopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		overBudgetEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+		if (!stopEvent || !overBudgetEvent) {
+			stop();
+			return;
+		}
+		overBudgetSignaled = false;
+		governor = thread(run);
+	}
+
+	void EncFSMemoryGovernor::stop() {
+		if (governor.joinable()) {
+			SetEvent(stopEvent);
+			governor.join();
+		}
+		HANDLE events[2] = { overBudgetEvent, stopEvent };
+		overBudgetEvent = stopEvent = NULL;
+		for (HANDLE event : events) {
+			if (event) {
+				CloseHandle(event);
+			}
+		}
+	}
+
+	void EncFSMemoryGovernor::print(FILE* out) {
+		lock_guard<mutex> lock(registryLock());
+		fprintf(out, "%-28s %14s %14s %14s %8s\n", "cache", "usage(KiB)", "hits", "misses", "hit %");
+		for (EncFSCache* cache : registry()) {
+			const uint64_t hits = cache->hits.load();
+			const uint64_t misses = cache->misses.load();
+			if (hits + misses == 0 && cache->getUsage() == 0) {
+				continue;
+			}
+			fprintf(out, "%-28s %14.1f %14llu %14llu %8.2f\n", cache->name, cache->getUsage() / 1024.0,
+				(unsigned long long)hits, (unsigned long long)misses,
+				hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+		}
+		fprintf(out, "%-28s %14.1f (budget %.1f)\n", "total", totalUsage.load() / 1024.0, budget.load() / 1024.0);
+	}
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <cstdio>
+#include <cstdint>
+
+using namespace std;
+
+namespace EncFS
+{
+	/**
+	Memory held by a cache, counted against the budget of EncFSMemoryGovernor.
+	The owner declares it as its last member, so that it is unregistered before the rest of the owner
+	is destructed, and releases memory when the governor calls the trimmer.
+	**/
+	class EncFSCache {
+		friend class EncFSMemoryGovernor;
+
+	public:
+		/**
+		Release at least the bytes if possible, the oldest entries first. Returns the bytes released.
+		Called on the governor thread, it may take the locks of the cache.
+		**/
+		typedef function<size_t(size_t bytes)> Trimmer;
+
+	private:
+		const char* name;
+		const Trimmer trimmer;
+		atomic<int64_t> usage;
+		atomic<uint64_t> hits;
+		atomic<uint64_t> misses;
+		/** Lookups counted at the last trim, for the hit rate since then. */
+		uint64_t trimmedHits;
+		uint64_t trimmedMisses;
+
+	public:
+		EncFSCache(const char* name, const Trimmer &trimmer);
+		~EncFSCache();
+
+		EncFSCache(const EncFSCache&) = delete;
+		EncFSCache& operator=(const EncFSCache&) = delete;
+
+		/**
+		Count bytes added to the cache, negative when they are released.
+		**/
+		void charge(int64_t bytes);
+
+		inline void hit() {
+			this->hits.fetch_add(1, memory_order_relaxed);
+		}
+
+		inline void miss() {
+			this->misses.fetch_add(1, memory_order_relaxed);
+		}
+
+		inline int64_t getUsage() {
+			return this->usage.load(memory_order_relaxed);
+		}
+	};
+
+	/**
+	Keeps the caches of all volumes of the process within one budget.
+	A thread trims them when they exceed it and when Windows reports low physical memory,
+	the caches with the lowest hit rate since the last trim first.
+	**/
+	class EncFSMemoryGovernor {
+	public:
+		/** Pause after trimming on low memory, which stays signaled while memory is low. */
+		static const unsigned long PRESSURE_INTERVAL_MILLIS = 1000;
+
+		/**
+		Budget of all caches in bytes, 0 for no limit.
+		**/
+		static void setBudget(size_t bytes);
+		static size_t getBudget();
+
+		/**
+		Start the thread which trims the caches. Without it the budget is not enforced.
+		**/
+		static void start();
+		static void stop();
+
+		/**
+		Release the bytes from the caches now.
+		**/
+		static size_t trim(size_t bytes);
+
+		/**
+		Print the usage and the hit rate of the caches.
+		**/
+		static void print(FILE* out);
+
+	private:
+		friend class EncFSCache;
+
+		static void registerCache(EncFSCache* cache);
+		static void unregisterCache(EncFSCache* cache);
+		static void charged(int64_t usage);
+		static void run();
+	};
+}
@@ -0,0 +1,410 @@
+#include "EncFSNameIndex.h"
+#include "EncFSVolume.h"
+
+#include <windows.h>
+#include <codecvt>
+#include <algorithm>
+
+namespace EncFS
+{
+	static const char INDEX_MAGIC[8] = { 'E', 'N', 'C', 'F', 'S', 'I', 'X', '1' };
+
+	/** Estimated bytes of the nodes of a name in the maps, besides the characters. */
+	static const size_t NAME_OVERHEAD = 128;
+
+	/**
+	The root directory is "" when coding paths and "\" when listing.
+	**/
+	static inline const string& toDirKey(const string &plainDirPath) {
+		static const string root;
+		return plainDirPath == "\\" ? root : plainDirPath;
+	}
+
+	EncFSNameIndex::Stripe& EncFSNameIndex::getStripe(const string &dirKey) {
+		return this->stripes[hash<string>()(dirKey) % STRIPES];
+	}
+
+	void EncFSNameIndex::charge(Directory &directory, size_t bytes) {
+		directory.bytes += bytes;
+		this->cache.charge((int64_t)bytes);
+	}
+
+	void EncFSNameIndex::putName(Directory &directory, const string &encodedFileName, const string &plainFileName, bool listed) {
+		Entry &entry = directory.plainNames[encodedFileName];
+		if (entry.name.empty()) {
+			this->modified = true;
+			this->charge(directory, NAME_OVERHEAD + encodedFileName.size() * 2 + plainFileName.size() * 2);
+		}
+		entry.name = plainFileName;
+		entry.listed = entry.listed || listed;
+		directory.encodedNames[plainFileName] = encodedFileName;
+	}
+
+	void EncFSNameIndex::foldListing(Directory &directory) {
+		wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+		size_t bytes = 0;
+		for (auto &name : directory.foldedNames) {
+			bytes += NAME_OVERHEAD + name.first.size() * sizeof(wchar_t) + name.second.size();
+		}
+		directory.foldedNames.clear();
+		directory.bytes -= bytes;
+		this->cache.charge(-(int64_t)bytes);
+		bytes = 0;
+		for (auto &name : directory.plainNames) {
+			if (name.second.listed) {
+				const wstring folded = foldName(strConv.from_bytes(name.second.name));
+				bytes += NAME_OVERHEAD + folded.size() * sizeof(wchar_t) + name.second.name.size();
+				directory.foldedNames[folded] = name.second.name;
+			}
+		}
+		this->charge(directory, bytes);
+	}
+
+	size_t EncFSNameIndex::trim(size_t bytes) {
+		struct Candidate {
+			uint64_t lastUse;
+			size_t stripe;
+			string dirKey;
+		};
+		vector<Candidate> candidates;
+		for (size_t i = 0; i < STRIPES; ++i) {
+			Stripe &stripe = this->stripes[i];
+			lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+			for (const auto &dir : stripe.directories) {
+				candidates.push_back(Candidate{ dir.second.lastUse, i, dir.first });
+			}
+		}
+		sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+			return a.lastUse < b.lastUse;
+		});
+
+		// Names of a dropped directory are decoded again, and its listing is read again.
+		size_t released = 0;
+		for (const Candidate &candidate : candidates) {
+			if (released >= bytes) {
+				break;
+			}
+			Stripe &stripe = this->stripes[candidate.stripe];
+			lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+			auto dir = stripe.directories.find(candidate.dirKey);
+			if (dir == stripe.directories.end()) {
+				continue;
+			}
+			released += dir->second.bytes;
+			this->cache.charge(-(int64_t)dir->second.bytes);
+			stripe.directories.erase(dir);
+		}
+		return released;
+	}
+
+	bool EncFSNameIndex::findPlainName(const string &plainDirPath, const string &encodedFileName, string &plainFileName) {
+		const string &dirKey = toDirKey(plainDirPath);
+		Stripe &stripe = this->getStripe(dirKey);
+		lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+		auto dir = stripe.directories.find(dirKey);
+		if (dir == stripe.directories.end()) {
+			this->cache.miss();
+			return false;
+		}
+		dir->second.lastUse = GetTickCount64();
+		auto name = dir->second.plainNames.find(encodedFileName);
+		if (name == dir->second.plainNames.end()) {
+			this->cache.miss();
+			return false;
+		}
+		this->cache.hit();
+		plainFileName.append(name->second.name);
+		return true;
+	}
+
+	bool EncFSNameIndex::findEncodedName(const string &plainDirPath, const string &plainFileName, string &encodedFileName) {
+		const string &dirKey = toDirKey(plainDirPath);
+		Stripe &stripe = this->getStripe(dirKey);
+		lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+		auto dir = stripe.directories.find(dirKey);
+		if (dir == stripe.directories.end()) {
+			this->cache.miss();
+			return false;
+		}
+		dir->second.lastUse = GetTickCount64();
+		auto name = dir->second.encodedNames.find(plainFileName);
+		if (name == dir->second.encodedNames.end()) {
+			this->cache.miss();
+			return false;
+		}
+		this->cache.hit();
+		encodedFileName.append(name->second);
+		return true;
+	}
+
+	void EncFSNameIndex::addName(const string &plainDirPath, const string &encodedFileName, const string &plainFileName) {
+		const string &dirKey = toDirKey(plainDirPath);
+		Stripe &stripe = this->getStripe(dirKey);
+		lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+		Directory &directory = stripe.directories[dirKey];
+		directory.lastUse = GetTickCount64();
+		this->putName(directory, encodedFileName, plainFileName, false);
+	}
+
+	void EncFSNameIndex::setListing(const string &plainDirPath, uint64_t lastWriteTime, const vector<pair<string, string>> &names) {
+		const string &dirKey = toDirKey(plainDirPath);
+		Stripe &stripe = this->getStripe(dirKey);
+		lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+		Directory &directory = stripe.directories[dirKey];
+		directory.lastUse = GetTickCount64();
+		for (auto &name : directory.plainNames) {
+			name.second.listed = false;
+		}
+		for (const auto &name : names) {
+			this->putName(directory, name.first, name.second, true);
+		}
+		if (directory.listedTime != lastWriteTime) {
+			directory.listedTime = lastWriteTime;
+			this->modified = true;
+		}
+		this->foldListing(directory);
+	}
+
+	EncFSIndexLookup EncFSNameIndex::findFoldedName(const string &plainDirPath, uint64_t lastWriteTime, const wstring &foldedFileName, string &plainFileName) {
+		const string &dirKey = toDirKey(plainDirPath);
+		Stripe &stripe = this->getStripe(dirKey);
+		lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+		auto dir = stripe.directories.find(dirKey);
+		if (dir == stripe.directories.end() || dir->second.listedTime == 0 || dir->second.listedTime != lastWriteTime) {
+			this->cache.miss();
+			return INDEX_UNKNOWN;
+		}
+		this->cache.hit();
+		dir->second.lastUse = GetTickCount64();
+		auto name = dir->second.foldedNames.find(foldedFileName);
+		if (name == dir->second.foldedNames.end()) {
+			return INDEX_NOT_FOUND;
+		}
+		plainFileName = name->second;
+		return INDEX_FOUND;
+	}
+
+	void EncFSNameIndex::invalidateName(const string &plainDirPath, const string &encodedFileName) {
+		const string &dirKey = toDirKey(plainDirPath);
+		Stripe &stripe = this->getStripe(dirKey);
+		lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+		auto dir = stripe.directories.find(dirKey);
+		if (dir == stripe.directories.end()) {
+			return;
+		}
+		Directory &directory = dir->second;
+		directory.listedTime = 0;
+		auto name = directory.plainNames.find(encodedFileName);
+		if (name != directory.plainNames.end()) {
+			const size_t bytes = NAME_OVERHEAD + encodedFileName.size() * 2 + name->second.name.size() * 2;
+			directory.encodedNames.erase(name->second.name);
+			directory.plainNames.erase(name);
+			directory.bytes -= bytes;
+			this->cache.charge(-(int64_t)bytes);
+			this->foldListing(directory);
+		}
+		this->modified = true;
+	}
+
+	bool EncFSNameIndex::invalidateTree(const string &plainDirPath) {
+		const string &dirKey = toDirKey(plainDirPath);
+		{
+			Stripe &stripe = this->getStripe(dirKey);
+			lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+			if (stripe.directories.find(dirKey) == stripe.directories.end()) {
+				return false;
+			}
+		}
+		const string prefix = dirKey + "\\";
+		for (Stripe &stripe : this->stripes) {
+			lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+			for (auto dir = stripe.directories.begin(); dir != stripe.directories.end();) {
+				if (dir->first == dirKey || dir->first.compare(0, prefix.size(), prefix) == 0) {
+					this->cache.charge(-(int64_t)dir->second.bytes);
+					dir = stripe.directories.erase(dir);
+				}
+				else {
+					++dir;
+				}
+			}
+		}
+		this->modified = true;
+		return true;
+	}
+
+	void EncFSNameIndex::invalidateListings() {
+		for (Stripe &stripe : this->stripes) {
+			lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+			for (auto &dir : stripe.directories) {
+				dir.second.listedTime = 0;
+			}
+		}
+		this->modified = true;
+	}
+
+	wstring EncFSNameIndex::foldName(const wstring &fileName) {
+		wstring folded(fileName);
+		if (!folded.empty()) {
+			CharUpperBuffW(&folded[0], (DWORD)folded.size());
+		}
+		return folded;
+	}
+
+	static inline void putUint32(string &out, uint32_t value) {
+		out.append((const char*)&value, sizeof value);
+	}
+
+	static inline void putString(string &out, const string &value) {
+		putUint32(out, (uint32_t)value.size());
+		out.append(value);
+	}
+
+	class EncFSIndexReader {
+	private:
+		const string &data;
+		size_t pos;
+
+	public:
+		EncFSIndexReader(const string &data, size_t pos) : data(data), pos(pos) {}
+
+		inline bool getUint32(uint32_t &value) {
+			if (this->data.size() - this->pos < sizeof value) {
+				return false;
+			}
+			memcpy(&value, &this->data[this->pos], sizeof value);
+			this->pos += sizeof value;
+			return true;
+		}
+
+		inline bool getUint64(uint64_t &value) {
+			if (this->data.size() - this->pos < sizeof value) {
+				return false;
+			}
+			memcpy(&value, &this->data[this->pos], sizeof value);
+			this->pos += sizeof value;
+			return true;
+		}
+
+		inline bool getString(string &value) {
+			uint32_t size;
+			if (!this->getUint32(size) || this->data.size() - this->pos < size) {
+				return false;
+			}
+			value.assign(this->data, this->pos, size);
+			this->pos += size;
+			return true;
+		}
+	};
+
+	bool EncFSNameIndex::load(EncFSVolume &volume, const wstring &indexFile) {
+		HANDLE handle = CreateFileW(indexFile.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (handle == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(handle, &fileSize) || fileSize.QuadPart == 0) {
+			CloseHandle(handle);
+			return false;
+		}
+		HANDLE mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+		CloseHandle(handle);
+		if (!mapping) {
+			return false;
+		}
+		const char* view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		if (!view) {
+			return false;
+		}
+
+		// Decrypt straight from the mapped file.
+		string data;
+		try {
+			volume.decodeMetadata(view, (size_t)fileSize.QuadPart, data);
+		}
+		catch (const EncFSInvalidBlockException &ex) {
+			UnmapViewOfFile(view);
+			return false;
+		}
+		UnmapViewOfFile(view);
+
+		if (data.size() < sizeof INDEX_MAGIC || memcmp(data.data(), INDEX_MAGIC, sizeof INDEX_MAGIC) != 0) {
+			return false;
+		}
+		EncFSIndexReader reader(data, sizeof INDEX_MAGIC);
+		uint32_t dirCount;
+		if (!reader.getUint32(dirCount)) {
+			return false;
+		}
+		for (uint32_t i = 0; i < dirCount; ++i) {
+			string dirKey;
+			uint64_t listedTime;
+			uint32_t nameCount;
+			if (!reader.getString(dirKey) || !reader.getUint64(listedTime) || !reader.getUint32(nameCount)) {
+				return false;
+			}
+			Stripe &stripe = this->getStripe(dirKey);
+			lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+			Directory &directory = stripe.directories[dirKey];
+			directory.listedTime = listedTime;
+			for (uint32_t j = 0; j < nameCount; ++j) {
+				string encodedName, plainName;
+				uint32_t listed;
+				if (!reader.getString(encodedName) || !reader.getString(plainName) || !reader.getUint32(listed)) {
+					return false;
+				}
+				this->putName(directory, encodedName, plainName, listed != 0);
+			}
+			this->foldListing(directory);
+		}
+		this->modified = false;
+		return true;
+	}
+
+	bool EncFSNameIndex::save(EncFSVolume &volume, const wstring &indexFile) {
+		if (!this->modified) {
+			return true;
+		}
+		string data(INDEX_MAGIC, sizeof INDEX_MAGIC);
+		uint32_t dirCount = 0;
+		putUint32(data, 0);
+		for (size_t i = 0; i < STRIPES; ++i) {
+			Stripe &stripe = this->stripes[i];
+			lock_guard<decltype(stripe.lock)> lock(stripe.lock);
+			for (const auto &dir : stripe.directories) {
+				putString(data, dir.first);
+				data.append((const char*)&dir.second.listedTime, sizeof dir.second.listedTime);
+				putUint32(data, (uint32_t)dir.second.plainNames.size());
+				for (const auto &name : dir.second.plainNames) {
+					putString(data, name.first);
+					putString(data, name.second.name);
+					putUint32(data, name.second.listed ? 1 : 0);
+				}
+				++dirCount;
+			}
+		}
+		memcpy(&data[sizeof INDEX_MAGIC], &dirCount, sizeof dirCount);
+
+		string encodedData;
+		volume.encodeMetadata(data, encodedData);
+
+		// Replace the index at once, a crash never leaves a partial index.
+		const wstring tempFile = indexFile + L".tmp";
+		HANDLE handle = CreateFileW(tempFile.c_str(), GENERIC_WRITE, 0, NULL,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_HIDDEN, NULL);
+		if (handle == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		DWORD writtenLen;
+		BOOL written = WriteFile(handle, encodedData.data(), (DWORD)encodedData.size(), &writtenLen, NULL);
+		CloseHandle(handle);
+		if (!written || writtenLen != encodedData.size() ||
+			!MoveFileExW(tempFile.c_str(), indexFile.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+			DeleteFileW(tempFile.c_str());
+			return false;
+		}
+		this->modified = false;
+		return true;
+	}
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <atomic>
+
+#include "EncFSLock.h"
+#include "EncFSMemory.h"
+
+using namespace std;
+
+namespace EncFS
+{
+	class EncFSVolume;
+
+	enum EncFSIndexLookup {
+		INDEX_FOUND,
+		INDEX_NOT_FOUND,
+		/** The directory was modified since it was listed. */
+		INDEX_UNKNOWN
+	};
+
+	/**
+	Decoded file names by plain directory path.
+	A name depends only on the volume key and the directory path, so cached names never go stale.
+	The last write time of a directory tells whether its cached listing is still complete,
+	which lets case insensitive lookups skip scanning the directory.
+	The index is stored encrypted beside .encfs6.xml, so the next mount starts warm.
+	**/
+	class EncFSNameIndex {
+	private:
+		struct Entry {
+			string name;
+			/** Seen in the last listing of the directory. */
+			bool listed = false;
+		};
+
+		struct Directory {
+			/** Last write time of the encoded directory when it was listed, 0 if never listed. */
+			uint64_t listedTime = 0;
+			/** Plain names by encoded names. */
+			unordered_map<string, Entry> plainNames;
+			/** Encoded names by plain names. */
+			unordered_map<string, string> encodedNames;
+			/** Plain names of the listing by upper cased names. */
+			unordered_map<wstring, string> foldedNames;
+			/** Estimated memory of the names, charged to the cache. */
+			size_t bytes = 0;
+			/** Tick of the last lookup, the least recently used directories are trimmed first. */
+			uint64_t lastUse = 0;
+		};
+
+		/** Directories are spread over stripes to keep path lookups of Dokan threads apart. */
+		static const size_t STRIPES = 16;
+
+		struct Stripe {
+			EncFSMutex lock{ "EncFSNameIndex::lock" };
+			unordered_map<string, Directory> directories;
+		};
+
+		Stripe stripes[STRIPES];
+		atomic<bool> modified;
+		/** Declared last, it's unregistered before the stripes are destructed. */
+		EncFSCache cache;
+
+		Stripe& getStripe(const string &dirKey);
+		void putName(Directory &directory, const string &encodedFileName, const string &plainFileName, bool listed);
+		void foldListing(Directory &directory);
+		void charge(Directory &directory, size_t bytes);
+		size_t trim(size_t bytes);
+
+	public:
+		EncFSNameIndex() : modified(false), cache("EncFSNameIndex", [this](size_t bytes) { return this->trim(bytes); }) {};
+		~EncFSNameIndex() {};
+
+		/**
+		Append the cached plain name of the encoded name.
+		**/
+		bool findPlainName(const string &plainDirPath, const string &encodedFileName, string &plainFileName);
+
+		/**
+		Append the cached encoded name of the plain name.
+		**/
+		bool findEncodedName(const string &plainDirPath, const string &plainFileName, string &encodedFileName);
+
+		void addName(const string &plainDirPath, const string &encodedFileName, const string &plainFileName);
+
+		/**
+		Replace the listing of the directory. Names are pairs of an encoded name and a plain name.
+		**/
+		void setListing(const string &plainDirPath, uint64_t lastWriteTime, const vector<pair<string, string>> &names);
+
+		/**
+		Find the plain name which matches the upper cased name in the listing of the directory,
+		unless the directory was modified since it was listed.
+		**/
+		EncFSIndexLookup findFoldedName(const string &plainDirPath, uint64_t lastWriteTime, const wstring &foldedFileName, string &plainFileName);
+
+		/**
+		Forget the name and the listing of the directory, when another program added, removed or renamed the file.
+		**/
+		void invalidateName(const string &plainDirPath, const string &encodedFileName);
+
+		/**
+		Forget the directory and the directories below. Returns false when the directory was not indexed.
+		**/
+		bool invalidateTree(const string &plainDirPath);
+
+		/**
+		Forget the listings of all directories, when changes of the underlying directories were missed.
+		**/
+		void invalidateListings();
+
+		/**
+		Read the index file. Returns false when it's missing or was not written with the key of the volume.
+		**/
+		bool load(EncFSVolume &volume, const wstring &indexFile);
+
+		/**
+		Write the index file when names were added since it was loaded.
+		**/
+		bool save(EncFSVolume &volume, const wstring &indexFile);
+
+		static wstring foldName(const wstring &fileName);
+	};
+}
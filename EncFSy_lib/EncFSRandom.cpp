@@ -0,0 +1,57 @@
+#include "EncFSRandom.h"
+
+#include <randpool.h>
+#include <osrng.h>
+#include <cpu.h>
+#include <rdrand.h>
+
+using namespace CryptoPP;
+
+namespace EncFS
+{
+	/** Bytes of entropy mixed in on each (re)seed. */
+	static const size_t SEED_SIZE = 32;
+
+	class EncFSThreadRandom {
+	private:
+		RandomPool pool;
+		uint64_t generated;
+
+	public:
+		EncFSThreadRandom() {
+			this->reseed();
+		}
+
+		inline void generate(byte* out, size_t len) {
+			if (this->generated >= EncFSRandom::RESEED_BYTES) {
+				this->reseed();
+			}
+			this->pool.GenerateBlock(out, len);
+			this->generated += len;
+		}
+
+	private:
+		void reseed() {
+			SecByteBlock seed(SEED_SIZE);
+			OS_GenerateRandomBlock(false, seed, seed.size());
+			this->pool.IncorporateEntropy(seed, seed.size());
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64
+			if (HasRDSEED()) {
+				try {
+					RDSEED().GenerateBlock(seed, seed.size());
+					this->pool.IncorporateEntropy(seed, seed.size());
+				}
+				catch (const Exception &ex) {
+					// The OS entropy is enough.
+				}
+			}
+#endif
+			this->generated = 0;
+		}
+	};
+
+	void EncFSRandom::generate(void* out, size_t len) {
+		static thread_local EncFSThreadRandom random;
+		random.generate((byte*)out, len);
+	}
+}
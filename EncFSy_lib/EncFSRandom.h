@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace EncFS
+{
+	/**
+	Cryptographic random bytes for file headers, block nonces, salts and keys.
+	Each thread owns a generator seeded from the OS, mixed with RDSEED when the CPU supports it,
+	and reseeded after RESEED_BYTES bytes. Callers never share a generator, so no lock is needed.
+	**/
+	class EncFSRandom {
+	public:
+		static const uint64_t RESEED_BYTES = 1 << 20;
+
+		static void generate(void* out, size_t len);
+	};
+}
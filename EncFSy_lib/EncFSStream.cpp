@@ -0,0 +1,231 @@
+#include "EncFSStream.h"
+#include "EncFSRandom.h"
+
+#include <thread>
+#include <vector>
+
+namespace EncFS
+{
+	/**
+	Read until len bytes or the end of the stream. A pipe may return less at once.
+	**/
+	static bool readFully(HANDLE handle, char* buff, size_t len, size_t &readLen) {
+		readLen = 0;
+		while (readLen < len) {
+			DWORD chunkLen;
+			if (!ReadFile(handle, buff + readLen, (DWORD)(len - readLen), &chunkLen, NULL)) {
+				// The writer of the pipe closed it.
+				if (GetLastError() == ERROR_BROKEN_PIPE) {
+					return true;
+				}
+				return false;
+			}
+			if (chunkLen == 0) {
+				return true;
+			}
+			readLen += chunkLen;
+		}
+		return true;
+	}
+
+	static bool writeFully(HANDLE handle, const char* buff, size_t len) {
+		while (len > 0) {
+			DWORD writtenLen;
+			if (!WriteFile(handle, buff, (DWORD)len, &writtenLen, NULL)) {
+				return false;
+			}
+			buff += writtenLen;
+			len -= writtenLen;
+		}
+		return true;
+	}
+
+	EncFSStream::EncFSStream(EncFSVolume &volume, int threads) : volume(volume),
+		threads(threads > 0 ? threads : max(1, (int)thread::hardware_concurrency())),
+		endOfInput(false), error(ERROR_SUCCESS) {
+	}
+
+	bool EncFSStream::decode(const string &plainFilePath, HANDLE encodedFile, HANDLE out) {
+		int64_t fileIv = 0;
+		if (this->volume.isUniqueIV()) {
+			string fileHeader;
+			fileHeader.resize(EncFSVolume::HEADER_SIZE);
+			size_t readLen;
+			if (!readFully(encodedFile, &fileHeader[0], fileHeader.size(), readLen)) {
+				return false;
+			}
+			if (readLen == 0) {
+				// Empty file.
+				return true;
+			}
+			if (readLen != fileHeader.size()) {
+				SetLastError(ERROR_FILE_CORRUPT);
+				return false;
+			}
+			fileIv = this->volume.decodeFileIv(plainFilePath, fileHeader);
+		}
+		return this->run(encodedFile, out, fileIv, false, string());
+	}
+
+	bool EncFSStream::encode(const string &plainFilePath, HANDLE in, HANDLE encodedFile) {
+		int64_t fileIv = 0;
+		string fileHeader;
+		if (this->volume.isUniqueIV()) {
+			fileHeader.resize(EncFSVolume::HEADER_SIZE);
+			EncFSRandom::generate(&fileHeader[0], EncFSVolume::HEADER_SIZE);
+			fileIv = this->volume.decodeFileIv(plainFilePath, fileHeader);
+		}
+		return this->run(in, encodedFile, fileIv, true, fileHeader);
+	}
+
+	void EncFSStream::fail(DWORD error) {
+		{
+			lock_guard<decltype(this->lock)> lock(this->lock);
+			if (this->error == ERROR_SUCCESS) {
+				this->error = error != ERROR_SUCCESS ? error : ERROR_GEN_FAILURE;
+			}
+		}
+		this->changed.notify_all();
+	}
+
+	bool EncFSStream::run(HANDLE in, HANDLE out, int64_t fileIv, bool encode, const string &fileHeader) {
+		const size_t blockSize = this->volume.getBlockSize();
+		const size_t inBlockSize = encode ? blockSize - this->volume.getHeaderSize() : blockSize;
+		this->pending.clear();
+		this->ordered.clear();
+		this->endOfInput = false;
+		this->error = ERROR_SUCCESS;
+
+		thread reader(&EncFSStream::readChunks, this, in, inBlockSize);
+		vector<thread> workers;
+		for (int i = 0; i < this->threads; ++i) {
+			workers.emplace_back(&EncFSStream::codeChunks, this, fileIv, encode, inBlockSize);
+		}
+
+		// Write the chunks in the order of the file as they are coded.
+		bool headerWritten = fileHeader.empty();
+		for (;;) {
+			shared_ptr<Chunk> chunk;
+			{
+				unique_lock<decltype(this->lock)> lock(this->lock);
+				this->changed.wait(lock, [this] {
+					return this->error != ERROR_SUCCESS || (!this->ordered.empty() && this->ordered.front()->done)
+						|| (this->ordered.empty() && this->endOfInput);
+				});
+				if (this->error != ERROR_SUCCESS || this->ordered.empty()) {
+					break;
+				}
+				chunk = this->ordered.front();
+				this->ordered.pop_front();
+			}
+			// The reader waits for a free chunk.
+			this->changed.notify_all();
+			if (!headerWritten) {
+				if (!writeFully(out, fileHeader.data(), fileHeader.size())) {
+					this->fail(GetLastError());
+					break;
+				}
+				headerWritten = true;
+			}
+			if (!writeFully(out, chunk->output.data(), chunk->output.size())) {
+				this->fail(GetLastError());
+				break;
+			}
+		}
+
+		reader.join();
+		for (thread &worker : workers) {
+			worker.join();
+		}
+		if (this->error != ERROR_SUCCESS) {
+			SetLastError(this->error);
+			return false;
+		}
+		return true;
+	}
+
+	void EncFSStream::readChunks(HANDLE in, size_t inBlockSize) {
+		const size_t maxChunks = this->threads * 2 + 2;
+		const size_t chunkSize = CHUNK_BLOCKS * inBlockSize;
+		int64_t blockNum = 0;
+		for (;;) {
+			{
+				unique_lock<decltype(this->lock)> lock(this->lock);
+				this->changed.wait(lock, [this, maxChunks] {
+					return this->error != ERROR_SUCCESS || this->ordered.size() < maxChunks;
+				});
+				if (this->error != ERROR_SUCCESS) {
+					return;
+				}
+			}
+
+			shared_ptr<Chunk> chunk = make_shared<Chunk>();
+			chunk->firstBlock = blockNum;
+			chunk->input.resize(chunkSize);
+			size_t readLen;
+			if (!readFully(in, &chunk->input[0], chunkSize, readLen)) {
+				this->fail(GetLastError());
+				return;
+			}
+			chunk->input.resize(readLen);
+			blockNum += CHUNK_BLOCKS;
+
+			{
+				lock_guard<decltype(this->lock)> lock(this->lock);
+				if (readLen > 0) {
+					this->pending.push_back(chunk);
+					this->ordered.push_back(chunk);
+				}
+				if (readLen < chunkSize) {
+					this->endOfInput = true;
+				}
+			}
+			this->changed.notify_all();
+			if (readLen < chunkSize) {
+				return;
+			}
+		}
+	}
+
+	void EncFSStream::codeChunks(int64_t fileIv, bool encode, size_t inBlockSize) {
+		string block, codedBlock;
+		for (;;) {
+			shared_ptr<Chunk> chunk;
+			{
+				unique_lock<decltype(this->lock)> lock(this->lock);
+				this->changed.wait(lock, [this] {
+					return this->error != ERROR_SUCCESS || !this->pending.empty() || this->endOfInput;
+				});
+				if (this->error != ERROR_SUCCESS || this->pending.empty()) {
+					return;
+				}
+				chunk = this->pending.front();
+				this->pending.pop_front();
+			}
+
+			int64_t blockNum = chunk->firstBlock;
+			chunk->output.reserve(chunk->input.size() + CHUNK_BLOCKS * this->volume.getHeaderSize());
+			for (size_t i = 0; i < chunk->input.size(); i += inBlockSize) {
+				block.assign(chunk->input, i, inBlockSize);
+				codedBlock.clear();
+				// The workers would take turns on the locked ciphers of the volume.
+				if (encode) {
+					this->volume.encodeLocalBlock(fileIv, blockNum++, block, codedBlock);
+				}
+				else if (!this->volume.tryDecodeLocalBlock(fileIv, blockNum++, block, codedBlock)) {
+					this->fail(ERROR_FILE_CORRUPT);
+					return;
+				}
+				chunk->output.append(codedBlock);
+			}
+			chunk->input.clear();
+			chunk->input.shrink_to_fit();
+
+			{
+				lock_guard<decltype(this->lock)> lock(this->lock);
+				chunk->done = true;
+			}
+			this->changed.notify_all();
+		}
+	}
+}
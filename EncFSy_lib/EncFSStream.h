@@ -0,0 +1,77 @@
+#pragma once
+#include <windows.h>
+
+#include "EncFSVolume.h"
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+namespace EncFS
+{
+	/**
+	Whole file coding between a plain stream and an encoded file of the volume, without Dokan.
+	A reader thread reads chunks of blocks, worker threads code the blocks of different chunks
+	in parallel and the calling thread writes the coded chunks in order.
+	Memory is bounded by the chunks in flight.
+	**/
+	class EncFSStream {
+	private:
+		/** Blocks read and coded at once. */
+		static const size_t CHUNK_BLOCKS = 256;
+
+		struct Chunk {
+			int64_t firstBlock = 0;
+			string input;
+			string output;
+			bool done = false;
+		};
+
+		EncFSVolume &volume;
+		const int threads;
+
+		mutex lock;
+		condition_variable changed;
+		/** Chunks read and not coded yet. */
+		deque<shared_ptr<Chunk>> pending;
+		/** Chunks in flight in the order of the file. */
+		deque<shared_ptr<Chunk>> ordered;
+		bool endOfInput;
+		/** First error of any stage, stops the pipeline. */
+		DWORD error;
+
+		/** fileHeader is written just before the first coded chunk, so an empty input writes nothing. */
+		bool run(HANDLE in, HANDLE out, int64_t fileIv, bool encode, const string &fileHeader);
+		void readChunks(HANDLE in, size_t inBlockSize);
+		void codeChunks(int64_t fileIv, bool encode, size_t inBlockSize);
+		void fail(DWORD error);
+
+	public:
+		/**
+		threads is the number of crypto threads, 0 for the number of processors.
+		**/
+		EncFSStream(EncFSVolume &volume, int threads = 0);
+		~EncFSStream() {};
+
+		EncFSStream(const EncFSStream&) = delete;
+		EncFSStream& operator=(const EncFSStream&) = delete;
+
+		/**
+		Write the plain content of the encoded file to out.
+		plainFilePath is the path in the volume (ex. \dir\file.txt) which the file IV depends on.
+		Returns false with the last error set.
+		**/
+		bool decode(const string &plainFilePath, HANDLE encodedFile, HANDLE out);
+
+		/**
+		Write the content of in to the empty encoded file, with a new file header.
+		An empty input leaves the file empty, as EncFS has no header for empty files.
+		Returns false with the last error set.
+		**/
+		bool encode(const string &plainFilePath, HANDLE in, HANDLE encodedFile);
+	};
+}
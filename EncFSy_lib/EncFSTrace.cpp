@@ -0,0 +1,504 @@
+#include "EncFSTrace.h"
+
+#include <map>
+#include <cstring>
+#include <mutex>
+#include <codecvt>
+
+namespace EncFS
+{
+	static const char* TRACE_OP_NAMES[TRACE_OP_COUNT] = {
+		"?",
+		"CreateFile",
+		"Cleanup",
+		"CloseFile",
+		"ReadFile",
+		"WriteFile",
+		"FlushFileBuffers",
+		"GetFileInformation",
+		"FindFiles",
+		"SetFileAttributes",
+		"SetFileTime",
+		"DeleteFile",
+		"DeleteDirectory",
+		"MoveFile",
+		"SetEndOfFile",
+		"SetAllocationSize",
+		"LockFile",
+		"UnlockFile",
+		"GetFileSecurity",
+		"SetFileSecurity",
+		"GetDiskFreeSpace",
+		"GetVolumeInformation",
+		"FindStreams"
+	};
+
+	const char* getTraceOpName(uint16_t op) {
+		if (op >= TRACE_OP_COUNT) {
+			return TRACE_OP_NAMES[0];
+		}
+		return TRACE_OP_NAMES[op];
+	}
+
+	/**
+	Serializes records of all Dokan threads into one file.
+	**/
+	class EncFSTraceWriter {
+	private:
+		mutex lock;
+		ofstream out;
+		LARGE_INTEGER frequency;
+		LARGE_INTEGER origin;
+		/** DokanFileInfo->Context to trace local handle id. **/
+		map<ULONG64, uint64_t> handles;
+		uint64_t nextHandle;
+		wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+
+	public:
+		bool open(LPCWSTR traceFile) {
+			lock_guard<decltype(this->lock)> lk(this->lock);
+			this->out.open(traceFile, ios::out | ios::binary | ios::trunc);
+			if (!this->out.is_open()) {
+				return false;
+			}
+			this->out.write(TRACE_MAGIC, sizeof TRACE_MAGIC);
+			this->handles.clear();
+			this->nextHandle = 0;
+			QueryPerformanceFrequency(&this->frequency);
+			QueryPerformanceCounter(&this->origin);
+			return true;
+		}
+
+		void close() {
+			lock_guard<decltype(this->lock)> lk(this->lock);
+			if (this->out.is_open()) {
+				this->out.close();
+			}
+		}
+
+		/**
+		Nanoseconds since the trace was opened.
+		**/
+		int64_t now() {
+			LARGE_INTEGER counter;
+			QueryPerformanceCounter(&counter);
+			const int64_t ticks = counter.QuadPart - this->origin.QuadPart;
+			const int64_t freq = this->frequency.QuadPart;
+			return (ticks / freq) * 1000000000LL + ((ticks % freq) * 1000000000LL) / freq;
+		}
+
+		void write(EncFSTraceRecord &record, const ULONG64 entryContext, PDOKAN_FILE_INFO info, LPCWSTR path, LPCWSTR newPath) {
+			record.duration = this->now() - record.start;
+			record.threadId = GetCurrentThreadId();
+			record.flags = 0;
+			ULONG64 exitContext = 0;
+			if (info) {
+				exitContext = info->Context;
+				if (info->IsDirectory) record.flags |= TRACE_IS_DIRECTORY;
+				if (info->DeleteOnClose) record.flags |= TRACE_DELETE_ON_CLOSE;
+				if (info->PagingIo) record.flags |= TRACE_PAGING_IO;
+				if (info->SynchronousIo) record.flags |= TRACE_SYNCHRONOUS_IO;
+				if (info->Nocache) record.flags |= TRACE_NOCACHE;
+				if (info->WriteToEndOfFile) record.flags |= TRACE_WRITE_TO_END_OF_FILE;
+			}
+
+			lock_guard<decltype(this->lock)> lk(this->lock);
+			if (!this->out.is_open()) {
+				return;
+			}
+
+			// Contexts are pointers which are reused after close, so handles get their own ids.
+			uint64_t id = 0;
+			if (entryContext) {
+				auto i = this->handles.find(entryContext);
+				if (i != this->handles.end()) {
+					id = i->second;
+				}
+			}
+			if (exitContext != entryContext) {
+				if (entryContext) {
+					this->handles.erase(entryContext);
+				}
+				if (exitContext) {
+					if (!id) {
+						id = ++this->nextHandle;
+					}
+					this->handles[exitContext] = id;
+				}
+			}
+			record.handle = id;
+
+			string cPath, cNewPath;
+			if (path) {
+				cPath = this->strConv.to_bytes(path);
+			}
+			if (newPath) {
+				cNewPath = this->strConv.to_bytes(newPath);
+			}
+			record.pathLength = (uint32_t)cPath.size();
+			record.newPathLength = (uint32_t)cNewPath.size();
+			this->out.write((const char*)&record, sizeof record);
+			this->out.write(cPath.data(), cPath.size());
+			this->out.write(cNewPath.data(), cNewPath.size());
+		}
+	};
+
+	static EncFSTraceWriter traceWriter;
+	static DOKAN_OPERATIONS traceTarget;
+
+	static thread_local PFillFindData traceFillFindData;
+	static thread_local PFillFindStreamData traceFillFindStreamData;
+	static thread_local uint32_t traceEntries;
+
+	static inline ULONG64 beginRecord(EncFSTraceRecord &record, EncFSTraceOp op, PDOKAN_FILE_INFO info) {
+		ZeroMemory(&record, sizeof record);
+		record.op = op;
+		record.start = traceWriter.now();
+		return info ? info->Context : 0;
+	}
+
+	static inline int64_t fileTimeToLong(CONST FILETIME *time) {
+		if (!time) {
+			return 0;
+		}
+		return ((int64_t)time->dwHighDateTime << 32) | time->dwLowDateTime;
+	}
+
+	static int WINAPI TraceFillFindData(PWIN32_FIND_DATAW FindData, PDOKAN_FILE_INFO DokanFileInfo) {
+		++traceEntries;
+		return traceFillFindData(FindData, DokanFileInfo);
+	}
+
+	static BOOL WINAPI TraceFillFindStreamData(PWIN32_FIND_STREAM_DATA FindStreamData, PVOID FindStreamContext) {
+		++traceEntries;
+		return traceFillFindStreamData(FindStreamData, FindStreamContext);
+	}
+
+	static NTSTATUS DOKAN_CALLBACK
+	TraceCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
+		ACCESS_MASK DesiredAccess, ULONG FileAttributes,
+		ULONG ShareAccess, ULONG CreateDisposition,
+		ULONG CreateOptions, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_CREATE_FILE, DokanFileInfo);
+		NTSTATUS status = traceTarget.ZwCreateFile(FileName, SecurityContext, DesiredAccess, FileAttributes,
+			ShareAccess, CreateDisposition, CreateOptions, DokanFileInfo);
+		record.status = status;
+		record.args[0] = DesiredAccess;
+		record.args[1] = FileAttributes;
+		record.args[2] = ShareAccess;
+		record.args[3] = CreateDisposition;
+		record.args[4] = CreateOptions;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static void DOKAN_CALLBACK TraceCleanup(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_CLEANUP, DokanFileInfo);
+		traceTarget.Cleanup(FileName, DokanFileInfo);
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+	}
+
+	static void DOKAN_CALLBACK TraceCloseFile(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_CLOSE_FILE, DokanFileInfo);
+		traceTarget.CloseFile(FileName, DokanFileInfo);
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceReadFile(LPCWSTR FileName, LPVOID Buffer,
+		DWORD BufferLength, LPDWORD ReadLength, LONGLONG Offset, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_READ_FILE, DokanFileInfo);
+		NTSTATUS status = traceTarget.ReadFile(FileName, Buffer, BufferLength, ReadLength, Offset, DokanFileInfo);
+		record.status = status;
+		record.offset = Offset;
+		record.length = BufferLength;
+		record.transferred = ReadLength ? *ReadLength : 0;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceWriteFile(LPCWSTR FileName, LPCVOID Buffer,
+		DWORD NumberOfBytesToWrite, LPDWORD NumberOfBytesWritten, LONGLONG Offset, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_WRITE_FILE, DokanFileInfo);
+		NTSTATUS status = traceTarget.WriteFile(FileName, Buffer, NumberOfBytesToWrite, NumberOfBytesWritten, Offset, DokanFileInfo);
+		record.status = status;
+		record.offset = Offset;
+		record.length = NumberOfBytesToWrite;
+		record.transferred = NumberOfBytesWritten ? *NumberOfBytesWritten : 0;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceFlushFileBuffers(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_FLUSH_FILE_BUFFERS, DokanFileInfo);
+		NTSTATUS status = traceTarget.FlushFileBuffers(FileName, DokanFileInfo);
+		record.status = status;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceGetFileInformation(LPCWSTR FileName,
+		LPBY_HANDLE_FILE_INFORMATION HandleFileInformation, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_GET_FILE_INFORMATION, DokanFileInfo);
+		NTSTATUS status = traceTarget.GetFileInformation(FileName, HandleFileInformation, DokanFileInfo);
+		record.status = status;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceFindFiles(LPCWSTR FileName,
+		PFillFindData FillFindData, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_FIND_FILES, DokanFileInfo);
+		traceFillFindData = FillFindData;
+		traceEntries = 0;
+		NTSTATUS status = traceTarget.FindFiles(FileName, TraceFillFindData, DokanFileInfo);
+		record.status = status;
+		record.transferred = traceEntries;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceSetFileAttributes(LPCWSTR FileName,
+		DWORD FileAttributes, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_SET_FILE_ATTRIBUTES, DokanFileInfo);
+		NTSTATUS status = traceTarget.SetFileAttributes(FileName, FileAttributes, DokanFileInfo);
+		record.status = status;
+		record.args[0] = FileAttributes;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceSetFileTime(LPCWSTR FileName, CONST FILETIME *CreationTime,
+		CONST FILETIME *LastAccessTime, CONST FILETIME *LastWriteTime, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_SET_FILE_TIME, DokanFileInfo);
+		NTSTATUS status = traceTarget.SetFileTime(FileName, CreationTime, LastAccessTime, LastWriteTime, DokanFileInfo);
+		record.status = status;
+		record.args[0] = fileTimeToLong(CreationTime);
+		record.args[1] = fileTimeToLong(LastAccessTime);
+		record.args[2] = fileTimeToLong(LastWriteTime);
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceDeleteFile(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_DELETE_FILE, DokanFileInfo);
+		NTSTATUS status = traceTarget.DeleteFile(FileName, DokanFileInfo);
+		record.status = status;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceDeleteDirectory(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_DELETE_DIRECTORY, DokanFileInfo);
+		NTSTATUS status = traceTarget.DeleteDirectory(FileName, DokanFileInfo);
+		record.status = status;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceMoveFile(LPCWSTR FileName, LPCWSTR NewFileName,
+		BOOL ReplaceIfExisting, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_MOVE_FILE, DokanFileInfo);
+		NTSTATUS status = traceTarget.MoveFile(FileName, NewFileName, ReplaceIfExisting, DokanFileInfo);
+		record.status = status;
+		record.args[0] = ReplaceIfExisting;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NewFileName);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceSetEndOfFile(LPCWSTR FileName,
+		LONGLONG ByteOffset, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_SET_END_OF_FILE, DokanFileInfo);
+		NTSTATUS status = traceTarget.SetEndOfFile(FileName, ByteOffset, DokanFileInfo);
+		record.status = status;
+		record.offset = ByteOffset;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceSetAllocationSize(LPCWSTR FileName,
+		LONGLONG AllocSize, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_SET_ALLOCATION_SIZE, DokanFileInfo);
+		NTSTATUS status = traceTarget.SetAllocationSize(FileName, AllocSize, DokanFileInfo);
+		record.status = status;
+		record.offset = AllocSize;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceLockFile(LPCWSTR FileName,
+		LONGLONG ByteOffset, LONGLONG Length, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_LOCK_FILE, DokanFileInfo);
+		NTSTATUS status = traceTarget.LockFile(FileName, ByteOffset, Length, DokanFileInfo);
+		record.status = status;
+		record.offset = ByteOffset;
+		record.args[0] = Length;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceUnlockFile(LPCWSTR FileName,
+		LONGLONG ByteOffset, LONGLONG Length, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_UNLOCK_FILE, DokanFileInfo);
+		NTSTATUS status = traceTarget.UnlockFile(FileName, ByteOffset, Length, DokanFileInfo);
+		record.status = status;
+		record.offset = ByteOffset;
+		record.args[0] = Length;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceGetFileSecurity(LPCWSTR FileName,
+		PSECURITY_INFORMATION SecurityInformation, PSECURITY_DESCRIPTOR SecurityDescriptor,
+		ULONG BufferLength, PULONG LengthNeeded, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_GET_FILE_SECURITY, DokanFileInfo);
+		NTSTATUS status = traceTarget.GetFileSecurity(FileName, SecurityInformation, SecurityDescriptor,
+			BufferLength, LengthNeeded, DokanFileInfo);
+		record.status = status;
+		record.length = BufferLength;
+		record.transferred = LengthNeeded ? *LengthNeeded : 0;
+		record.args[0] = SecurityInformation ? *SecurityInformation : 0;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceSetFileSecurity(LPCWSTR FileName,
+		PSECURITY_INFORMATION SecurityInformation, PSECURITY_DESCRIPTOR SecurityDescriptor,
+		ULONG SecurityDescriptorLength, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_SET_FILE_SECURITY, DokanFileInfo);
+		NTSTATUS status = traceTarget.SetFileSecurity(FileName, SecurityInformation, SecurityDescriptor,
+			SecurityDescriptorLength, DokanFileInfo);
+		record.status = status;
+		record.length = SecurityDescriptorLength;
+		record.args[0] = SecurityInformation ? *SecurityInformation : 0;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceGetDiskFreeSpace(PULONGLONG FreeBytesAvailable,
+		PULONGLONG TotalNumberOfBytes, PULONGLONG TotalNumberOfFreeBytes, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_GET_DISK_FREE_SPACE, DokanFileInfo);
+		NTSTATUS status = traceTarget.GetDiskFreeSpace(FreeBytesAvailable, TotalNumberOfBytes,
+			TotalNumberOfFreeBytes, DokanFileInfo);
+		record.status = status;
+		traceWriter.write(record, context, DokanFileInfo, NULL, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceGetVolumeInformation(LPWSTR VolumeNameBuffer,
+		DWORD VolumeNameSize, LPDWORD VolumeSerialNumber, LPDWORD MaximumComponentLength,
+		LPDWORD FileSystemFlags, LPWSTR FileSystemNameBuffer, DWORD FileSystemNameSize,
+		PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_GET_VOLUME_INFORMATION, DokanFileInfo);
+		NTSTATUS status = traceTarget.GetVolumeInformation(VolumeNameBuffer, VolumeNameSize, VolumeSerialNumber,
+			MaximumComponentLength, FileSystemFlags, FileSystemNameBuffer, FileSystemNameSize, DokanFileInfo);
+		record.status = status;
+		traceWriter.write(record, context, DokanFileInfo, NULL, NULL);
+		return status;
+	}
+
+	static NTSTATUS DOKAN_CALLBACK TraceFindStreams(LPCWSTR FileName, PFillFindStreamData FillFindStreamData,
+		PVOID FindStreamContext, PDOKAN_FILE_INFO DokanFileInfo) {
+		EncFSTraceRecord record;
+		const ULONG64 context = beginRecord(record, TRACE_FIND_STREAMS, DokanFileInfo);
+		traceFillFindStreamData = FillFindStreamData;
+		traceEntries = 0;
+		NTSTATUS status = traceTarget.FindStreams(FileName, TraceFillFindStreamData, FindStreamContext, DokanFileInfo);
+		record.status = status;
+		record.transferred = traceEntries;
+		traceWriter.write(record, context, DokanFileInfo, FileName, NULL);
+		return status;
+	}
+
+	bool startTrace(LPCWSTR traceFile, DOKAN_OPERATIONS &operations) {
+		if (!traceWriter.open(traceFile)) {
+			return false;
+		}
+		traceTarget = operations;
+		// Callbacks which are not implemented stay NULL.
+		if (operations.ZwCreateFile) operations.ZwCreateFile = TraceCreateFile;
+		if (operations.Cleanup) operations.Cleanup = TraceCleanup;
+		if (operations.CloseFile) operations.CloseFile = TraceCloseFile;
+		if (operations.ReadFile) operations.ReadFile = TraceReadFile;
+		if (operations.WriteFile) operations.WriteFile = TraceWriteFile;
+		if (operations.FlushFileBuffers) operations.FlushFileBuffers = TraceFlushFileBuffers;
+		if (operations.GetFileInformation) operations.GetFileInformation = TraceGetFileInformation;
+		if (operations.FindFiles) operations.FindFiles = TraceFindFiles;
+		if (operations.SetFileAttributes) operations.SetFileAttributes = TraceSetFileAttributes;
+		if (operations.SetFileTime) operations.SetFileTime = TraceSetFileTime;
+		if (operations.DeleteFile) operations.DeleteFile = TraceDeleteFile;
+		if (operations.DeleteDirectory) operations.DeleteDirectory = TraceDeleteDirectory;
+		if (operations.MoveFile) operations.MoveFile = TraceMoveFile;
+		if (operations.SetEndOfFile) operations.SetEndOfFile = TraceSetEndOfFile;
+		if (operations.SetAllocationSize) operations.SetAllocationSize = TraceSetAllocationSize;
+		if (operations.LockFile) operations.LockFile = TraceLockFile;
+		if (operations.UnlockFile) operations.UnlockFile = TraceUnlockFile;
+		if (operations.GetFileSecurity) operations.GetFileSecurity = TraceGetFileSecurity;
+		if (operations.SetFileSecurity) operations.SetFileSecurity = TraceSetFileSecurity;
+		if (operations.GetDiskFreeSpace) operations.GetDiskFreeSpace = TraceGetDiskFreeSpace;
+		if (operations.GetVolumeInformation) operations.GetVolumeInformation = TraceGetVolumeInformation;
+		if (operations.FindStreams) operations.FindStreams = TraceFindStreams;
+		return true;
+	}
+
+	void stopTrace() {
+		traceWriter.close();
+	}
+
+	bool EncFSTraceReader::open(const string &traceFile) {
+		this->in.open(traceFile, ios::in | ios::binary);
+		if (!this->in.is_open()) {
+			return false;
+		}
+		char magic[sizeof TRACE_MAGIC];
+		this->in.read(magic, sizeof magic);
+		if (this->in.gcount() != sizeof magic || memcmp(magic, TRACE_MAGIC, sizeof magic) != 0) {
+			this->in.close();
+			return false;
+		}
+		return true;
+	}
+
+	bool EncFSTraceReader::next(EncFSTraceEvent &event) {
+		if (!this->in.is_open()) {
+			return false;
+		}
+		this->in.read((char*)&event.record, sizeof event.record);
+		if (this->in.gcount() != sizeof event.record) {
+			return false;
+		}
+		// Paths are limited by DOKAN_MAX_PATH, anything larger is a broken file.
+		if (event.record.pathLength > 32768 * 3 || event.record.newPathLength > 32768 * 3) {
+			return false;
+		}
+		event.path.resize(event.record.pathLength);
+		event.newPath.resize(event.record.newPathLength);
+		if (event.record.pathLength) {
+			this->in.read(&event.path[0], event.path.size());
+		}
+		if (event.record.newPathLength) {
+			this->in.read(&event.newPath[0], event.newPath.size());
+		}
+		return !this->in.fail();
+	}
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <dokan.h>
+
+#include <string>
+#include <fstream>
+#include <cstdint>
+
+using namespace std;
+
+namespace EncFS
+{
+	/**
+	Dokan callbacks recorded to a trace file.
+	**/
+	enum EncFSTraceOp : uint16_t {
+		TRACE_CREATE_FILE = 1,
+		TRACE_CLEANUP,
+		TRACE_CLOSE_FILE,
+		TRACE_READ_FILE,
+		TRACE_WRITE_FILE,
+		TRACE_FLUSH_FILE_BUFFERS,
+		TRACE_GET_FILE_INFORMATION,
+		TRACE_FIND_FILES,
+		TRACE_SET_FILE_ATTRIBUTES,
+		TRACE_SET_FILE_TIME,
+		TRACE_DELETE_FILE,
+		TRACE_DELETE_DIRECTORY,
+		TRACE_MOVE_FILE,
+		TRACE_SET_END_OF_FILE,
+		TRACE_SET_ALLOCATION_SIZE,
+		TRACE_LOCK_FILE,
+		TRACE_UNLOCK_FILE,
+		TRACE_GET_FILE_SECURITY,
+		TRACE_SET_FILE_SECURITY,
+		TRACE_GET_DISK_FREE_SPACE,
+		TRACE_GET_VOLUME_INFORMATION,
+		TRACE_FIND_STREAMS,
+		TRACE_OP_COUNT
+	};
+
+	/**
+	DOKAN_FILE_INFO flags as seen when the callback returned.
+	**/
+	enum EncFSTraceFlag : uint16_t {
+		TRACE_IS_DIRECTORY = 1,
+		TRACE_DELETE_ON_CLOSE = 2,
+		TRACE_PAGING_IO = 4,
+		TRACE_SYNCHRONOUS_IO = 8,
+		TRACE_NOCACHE = 16,
+		TRACE_WRITE_TO_END_OF_FILE = 32
+	};
+
+	/**
+	Fixed part of a trace record, followed by pathLength bytes of the UTF-8 path
+	and newPathLength bytes of the UTF-8 destination path of MoveFile.
+
+	args by op:
+	CreateFile: DesiredAccess, FileAttributes, ShareAccess, CreateDisposition, CreateOptions
+	SetFileAttributes: FileAttributes
+	SetFileTime: CreationTime, LastAccessTime, LastWriteTime (0 for NULL)
+	MoveFile: ReplaceIfExisting
+	LockFile / UnlockFile: Length
+	GetFileSecurity / SetFileSecurity: SecurityInformation
+	**/
+#pragma pack(push, 1)
+	struct EncFSTraceRecord {
+		uint16_t op;
+		uint16_t flags;
+		uint32_t threadId;
+		/** Trace local id of the open handle, 0 if no context is attached. **/
+		uint64_t handle;
+		/** Nanoseconds since the trace was started. **/
+		int64_t start;
+		int64_t duration;
+		int32_t status;
+		/** Requested buffer length of ReadFile / WriteFile / GetFileSecurity / SetFileSecurity. **/
+		uint32_t length;
+		/** Bytes transferred, or entries returned by FindFiles / FindStreams. **/
+		uint32_t transferred;
+		/** File offset, or the new size of SetEndOfFile / SetAllocationSize. **/
+		int64_t offset;
+		int64_t args[5];
+		uint32_t pathLength;
+		uint32_t newPathLength;
+	};
+#pragma pack(pop)
+
+	/**
+	A trace record with its paths.
+	**/
+	struct EncFSTraceEvent {
+		EncFSTraceRecord record;
+		string path;
+		string newPath;
+	};
+
+	/**
+	Magic and version at the head of a trace file.
+	**/
+	static const char TRACE_MAGIC[8] = { 'E', 'N', 'C', 'F', 'S', 'T', 'R', '1' };
+
+	/**
+	Name of the op for reports.
+	**/
+	const char* getTraceOpName(uint16_t op);
+
+	/**
+	Start recording every callback of the operations. The callbacks of the table are
+	replaced by recording wrappers which call the original ones.
+	Only one trace can be recorded at the same time.
+	**/
+	bool startTrace(LPCWSTR traceFile, DOKAN_OPERATIONS &operations);
+
+	/**
+	Flush and close the trace file.
+	**/
+	void stopTrace();
+
+	/**
+	Sequential reader of a trace file.
+	**/
+	class EncFSTraceReader {
+	private:
+		ifstream in;
+
+	public:
+		EncFSTraceReader() {};
+		~EncFSTraceReader() {};
+
+		bool open(const string &traceFile);
+		bool next(EncFSTraceEvent &event);
+	};
+}
@@ -2,6 +2,8 @@
 
 #include <string>
 #include <mutex>
+#include <algorithm>
+#include <cstring>
 
 #include <modes.h>
 #include <pwdbased.h>
@@ -9,6 +11,9 @@
 #include <osrng.h>
 #include <base64.h>
 
+#include "EncFSLock.h"
+#include "EncFSIoStats.h"
+
 using namespace std;
 using namespace CryptoPP;
 
@@ -62,10 +67,12 @@ namespace EncFS
 		string in;
 		in.resize(encodedName.size());
 		for (size_t i = 0; i < encodedName.size(); i++) {
-			if (lookup[encodedName[i]] == -1) {
+			// Names of other programs may have any byte.
+			const int value = lookup[(byte)encodedName[i]];
+			if (value == -1) {
 				return;
 			}
-			in[i] = (char)lookup[encodedName[i]];
+			in[i] = (char)value;
 		}
 
 		size_t srcIdx = 0;
@@ -182,31 +189,10 @@ namespace EncFS
 		}
 	}
 
-	/**
-	Flip binary string.
-	*/
-	inline void flipBytes(const string src, string &dest) {
-		dest.resize(src.size());
-
-		size_t offset = 0;
-		size_t bytesLeft = src.size();
-
-		while (bytesLeft > 0) {
-			size_t toFlip = bytesLeft > 64 ? 64 : bytesLeft;
-
-			for (size_t i = 0; i < toFlip; i++)
-				dest[offset + i] = src[offset + toFlip - i - 1];
-
-			bytesLeft -= toFlip;
-			offset += toFlip;
-		}
-
-	}
-
 	/**
 	Generate initialization vector.
 	*/
-	inline void generateIv(HMAC<SHA1> &hmac, mutex &hmacLock, const string &iv, const string &ivSeed, char* ivResult) {
+	inline void generateIv(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &iv, const string &ivSeed, char* ivResult) {
 		string concat;
 		concat.insert(concat.begin(), iv.begin(), iv.end());
 		concat.resize(iv.size() + 8);
@@ -231,6 +217,7 @@ namespace EncFS
 			hmac.Update((const byte*)concat.data(), concat.size());
 			hmac.Final(d);
 		}
+		EncFSIoStats::count(IO_HMACS);
 
 		memcpy(ivResult, d, 16);
 	}
@@ -238,9 +225,10 @@ namespace EncFS
 	/**
 	Encrypt or decrypt a block of middle in file.
 	*/
-	inline void blockCipher(HMAC<SHA1> &hmac, mutex &hmacLock, const string key, const string iv, const string ivSeed, CipherModeBase &cipher, mutex &cipherLock, const string data, string &result) {
+	inline void blockCipher(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string key, const string iv, const string ivSeed, CipherModeBase &cipher, EncFSMutex &cipherLock, const string data, string &result) {
 		char ivSpec[16];
 		generateIv(hmac, hmacLock, iv, ivSeed, ivSpec);
+		EncFSIoStats::count(IO_AES_BLOCKS, (data.size() + 15) / 16);
 
 		{
 			lock_guard<decltype(cipherLock)> lock(cipherLock);
@@ -252,117 +240,137 @@ namespace EncFS
 	}
 
 	/**
-	Encrypt tail of file or file name.
+	XOR every byte into the next one, 8 bytes at a time.
 	*/
-	inline void streamEncrypt(HMAC<SHA1> &hmac, mutex &hmacLock, const string key, const string iv, const string ivSeed, CFB_Mode<AES>::Encryption &cipher, mutex &cipherLock, const string data, string &result) {
-		// AES / CFB / NoPadding
-		string ivSeedPlusOne;
-		incrementIvSeedByOne(ivSeed, ivSeedPlusOne);
-
-		string firstEncResult;
-		{
-			string buf = data;
-
-			// suffleBytes
-			for (int i = 0; i < buf.size() - 1; ++i) {
-				buf[i + 1] ^= buf[i];
-			}
-
-			char ivSpec[16];
-			generateIv(hmac, hmacLock, iv, ivSeed, ivSpec);
-			{
-				lock_guard<decltype(cipherLock)> lock(cipherLock);
-				cipher.SetKeyWithIV((const byte*)key.data(), key.size(), (const byte*)ivSpec);
-				StreamTransformationFilter dec(cipher, new StringSink(firstEncResult), StreamTransformationFilter::ZEROS_PADDING);
-				dec.Put((byte*)buf.data(), buf.size());
-				dec.MessageEnd();
-			}
+	inline void shuffleBytes(byte* buf, size_t len) {
+		byte carry = 0;
+		size_t i = 0;
+		for (; i + 8 <= len; i += 8) {
+			uint64_t word;
+			memcpy(&word, buf + i, 8);
+			// Prefix XOR within the little endian word, then XOR the last byte of the previous word into all.
+			word ^= word << 8;
+			word ^= word << 16;
+			word ^= word << 32;
+			word ^= carry * 0x0101010101010101ULL;
+			memcpy(buf + i, &word, 8);
+			carry = (byte)(word >> 56);
 		}
+		for (; i < len; ++i) {
+			buf[i] ^= carry;
+			carry = buf[i];
+		}
+	}
 
-		//flip  bytes
-		string flipBytesResult;
-		flipBytes(firstEncResult, flipBytesResult);
-
-		// suffleBytes
-		for (int i = 0; i < flipBytesResult.size() - 1; ++i) {
-			flipBytesResult[i + 1] ^= flipBytesResult[i];
+	/**
+	Reverse of shuffleBytes, 8 bytes at a time.
+	*/
+	inline void unshuffleBytes(byte* buf, size_t len) {
+		byte prev = 0;
+		size_t i = 0;
+		for (; i + 8 <= len; i += 8) {
+			uint64_t word;
+			memcpy(&word, buf + i, 8);
+			const byte last = (byte)(word >> 56);
+			word ^= (word << 8) | prev;
+			memcpy(buf + i, &word, 8);
+			prev = last;
+		}
+		for (; i < len; ++i) {
+			const byte b = buf[i];
+			buf[i] ^= prev;
+			prev = b;
 		}
+	}
 
-		{
-			char ivSpec[16];
-			generateIv(hmac, hmacLock, iv, ivSeedPlusOne, ivSpec);
-
-			{
-				lock_guard<decltype(cipherLock)> lock(cipherLock);
-				cipher.SetKeyWithIV((const byte*)key.data(), key.size(), (const byte*)ivSpec);
-				StreamTransformationFilter dec(cipher, new StringSink(result), StreamTransformationFilter::ZEROS_PADDING);
-				dec.Put((byte*)flipBytesResult.data(), flipBytesResult.size());
-				dec.MessageEnd();
-			}
+	/**
+	Reverse each 64 byte chunk in place.
+	*/
+	inline void flipBytes(byte* buf, size_t len) {
+		for (size_t offset = 0; offset < len; offset += 64) {
+			const size_t toFlip = len - offset > 64 ? 64 : len - offset;
+			reverse(buf + offset, buf + offset + toFlip);
 		}
 	}
 
 	/**
-	Decrypt tail of file or file name.
+	Encrypt tail of file or file name in place.
+	Both passes run under one cipher lock, the key is scheduled once and only the IV changes between them.
 	*/
-	inline void streamDecrypt(HMAC<SHA1> &hmac, mutex &hmacLock, const string key, const string iv, const string ivSeed, CFB_Mode<AES>::Decryption &cipher, mutex &cipherLock, const string data, string &result) {
+	inline void streamEncrypt(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &key, const string &iv, const string &ivSeed, CFB_Mode<AES>::Encryption &cipher, EncFSMutex &cipherLock, byte* buf, size_t len) {
 		// AES / CFB / NoPadding
+		string ivSeedPlusOne;
+		incrementIvSeedByOne(ivSeed, ivSeedPlusOne);
+		char ivSpec1[16], ivSpec2[16];
+		generateIv(hmac, hmacLock, iv, ivSeed, ivSpec1);
+		generateIv(hmac, hmacLock, iv, ivSeedPlusOne, ivSpec2);
+		EncFSIoStats::count(IO_AES_BLOCKS, (len + 15) / 16 * 2);
+
+		lock_guard<decltype(cipherLock)> lock(cipherLock);
+		shuffleBytes(buf, len);
+		cipher.SetKeyWithIV((const byte*)key.data(), key.size(), (const byte*)ivSpec1);
+		cipher.ProcessData(buf, buf, len);
+		flipBytes(buf, len);
+		shuffleBytes(buf, len);
+		cipher.Resynchronize((const byte*)ivSpec2);
+		cipher.ProcessData(buf, buf, len);
+	}
 
-		string firstDecResult;
-		{
-			string ivSeedPlusOne;
-			incrementIvSeedByOne(ivSeed, ivSeedPlusOne);
-
-			char ivSpec[16];
-			generateIv(hmac, hmacLock, iv, ivSeedPlusOne, ivSpec);
-
-			{
-				lock_guard<decltype(cipherLock)> lock(cipherLock);
-				cipher.SetKeyWithIV((const byte*)key.data(), key.size(), (const byte*)ivSpec);
-				StreamTransformationFilter dec(cipher, new StringSink(firstDecResult), StreamTransformationFilter::ZEROS_PADDING);
-				dec.Put((byte*)data.data(), data.size());
-				dec.MessageEnd();
-			}
-		}
-
-		// unsuffleBytes
-		for (size_t i = (firstDecResult.size() - 1); i > 0; i--) {
-			firstDecResult[i] ^= firstDecResult[i - 1];
+	/**
+	Encrypt tail of file or file name, appending to the result.
+	*/
+	inline void streamEncrypt(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &key, const string &iv, const string &ivSeed, CFB_Mode<AES>::Encryption &cipher, EncFSMutex &cipherLock, const string &data, string &result) {
+		const size_t pos = result.size();
+		result.append(data);
+		if (!data.empty()) {
+			streamEncrypt(hmac, hmacLock, key, iv, ivSeed, cipher, cipherLock, (byte*)&result[pos], data.size());
 		}
+	}
 
-		//flip  bytes
-		string flipBytesResult;
-		flipBytes(firstDecResult, flipBytesResult);
-
-		{
-			char ivSpec[16];
-			generateIv(hmac, hmacLock, iv, ivSeed, ivSpec);
-
-			{
-				lock_guard<decltype(cipherLock)> lock(cipherLock);
-				cipher.SetKeyWithIV((const byte*)key.data(), key.size(), (const byte*)ivSpec);
-				StreamTransformationFilter dec(cipher, new StringSink(result), StreamTransformationFilter::ZEROS_PADDING);
-				dec.Put((byte*)flipBytesResult.data(), flipBytesResult.size());
-				dec.MessageEnd();
-			}
-		}
+	/**
+	Decrypt tail of file or file name in place.
+	*/
+	inline void streamDecrypt(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &key, const string &iv, const string &ivSeed, CFB_Mode<AES>::Decryption &cipher, EncFSMutex &cipherLock, byte* buf, size_t len) {
+		// AES / CFB / NoPadding
+		string ivSeedPlusOne;
+		incrementIvSeedByOne(ivSeed, ivSeedPlusOne);
+		char ivSpec1[16], ivSpec2[16];
+		generateIv(hmac, hmacLock, iv, ivSeed, ivSpec1);
+		generateIv(hmac, hmacLock, iv, ivSeedPlusOne, ivSpec2);
+		EncFSIoStats::count(IO_AES_BLOCKS, (len + 15) / 16 * 2);
+
+		lock_guard<decltype(cipherLock)> lock(cipherLock);
+		cipher.SetKeyWithIV((const byte*)key.data(), key.size(), (const byte*)ivSpec2);
+		cipher.ProcessData(buf, buf, len);
+		unshuffleBytes(buf, len);
+		flipBytes(buf, len);
+		cipher.Resynchronize((const byte*)ivSpec1);
+		cipher.ProcessData(buf, buf, len);
+		unshuffleBytes(buf, len);
+	}
 
-		// unsuffleBytes
-		for (size_t i = (result.size() - 1); i > 0; i--) {
-			result[i] ^= result[i - 1];
+	/**
+	Decrypt tail of file or file name, appending to the result.
+	*/
+	inline void streamDecrypt(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &key, const string &iv, const string &ivSeed, CFB_Mode<AES>::Decryption &cipher, EncFSMutex &cipherLock, const string &data, string &result) {
+		const size_t pos = result.size();
+		result.append(data);
+		if (!data.empty()) {
+			streamDecrypt(hmac, hmacLock, key, iv, ivSeed, cipher, cipherLock, (byte*)&result[pos], data.size());
 		}
 	}
 
 	/**
 	Calculate 64bit message authentication code.
 	*/
-	inline void mac64(HMAC<SHA1> &hmac, mutex &hmacLock, const byte* data, const size_t len, char* mac) {
+	inline void mac64(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const byte* data, const size_t len, char* mac) {
 		byte macResult[HMAC<SHA1>::DIGESTSIZE];
 		{
 			lock_guard<decltype(hmacLock)> lock(hmacLock);
 			hmac.Update((const byte*)data, len);
 			hmac.Final(macResult);
 		}
+		EncFSIoStats::count(IO_HMACS);
 
 		for (size_t i = 0; i < 8; ++i) {
 			mac[i] = 0;
@@ -376,7 +384,7 @@ namespace EncFS
 	/**
 	Calculate 64bit message authentication code with initialization vector.
 	*/
-	inline void mac64withIv(HMAC<SHA1> &hmac, mutex &hmacLock, const string &data, const char *chainIv, char* mac) {
+	inline void mac64withIv(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &data, const char *chainIv, char* mac) {
 		string concat;
 		concat.insert(concat.begin(), data.begin(), data.end());
 		concat.resize(data.size() + 8);
@@ -390,7 +398,7 @@ namespace EncFS
 	/**
 	Calculate 32bit message authentication code.
 	*/
-	inline void mac32(HMAC<SHA1> &hmac, mutex &hmacLock, const string &data, char* mac) {
+	inline void mac32(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &data, char* mac) {
 		char mac8b[8];
 		mac64(hmac, hmacLock, (const byte*)data.data(), data.size(), mac8b);
 		mac[0] = (mac8b[4] ^ mac8b[0]);
@@ -402,7 +410,7 @@ namespace EncFS
 	/**
 	Calculate 32bit message authentication code with initialization vector.
 	*/
-	inline void mac32withIv(HMAC<SHA1> &hmac, mutex &hmacLock, const string &data, const char *chainIv, char* mac) {
+	inline void mac32withIv(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &data, const char *chainIv, char* mac) {
 		char mac8b[8];
 		mac64withIv(hmac, hmacLock, data, chainIv, mac8b);
 		mac[0] = (mac8b[4] ^ mac8b[0]);
@@ -414,7 +422,7 @@ namespace EncFS
 	/**
 	Calculate 16bit message authentication code with initialization vector.
 	*/
-	inline void mac16withIv(HMAC<SHA1> &hmac, mutex &hmacLock, const string &data, const char *chainIv, char* mac) {
+	inline void mac16withIv(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &data, const char *chainIv, char* mac) {
 		char mac4b[4];
 		mac32withIv(hmac, hmacLock, data, chainIv, mac4b);
 		mac[0] = (mac4b[2] ^ mac4b[0]);
@@ -424,17 +432,40 @@ namespace EncFS
 	/**
 	Calculate 16bit message authentication code.
 	*/
-	inline void mac16(HMAC<SHA1> &hmac, mutex &hmacLock, const string &data, char* mac) {
+	inline void mac16(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &data, char* mac) {
 		char mac4b[4];
 		mac32(hmac, hmacLock, data, mac4b);
 		mac[0] = (mac4b[2] ^ mac4b[0]);
 		mac[1] = (mac4b[3] ^ mac4b[1]);
 	}
 
+	/**
+	Extend the initialization vector of a directory to its subdirectory.
+	*/
+	inline void extendChainIv(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &dirName, char* chainIv) {
+		// getBytesForBlockAlgorithm
+		string encodeBytes;
+		size_t byteLen = dirName.size();
+		int padLen = 16 - (byteLen % 16);
+		if (padLen == 0) {
+			padLen = 16;
+		}
+		encodeBytes.resize(byteLen + padLen);
+		for (int i = 0; i < byteLen; i++) {
+			encodeBytes[i] = dirName[i];
+		}
+		for (int i = 0; i < padLen; i++) {
+			encodeBytes[byteLen + i] = (char)padLen;
+		}
+
+		// Mac64
+		mac64withIv(hmac, hmacLock, encodeBytes, chainIv, chainIv);
+	}
+
 	/**
 	Calculate initialization vector from plain file path string.
 	*/
-	inline void computeChainIv(HMAC<SHA1> &hmac, mutex &hmacLock, const string &filePath, char* chainIv) {
+	inline void computeChainIv(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, const string &filePath, char* chainIv) {
 		for (int i = 0; i < 8; ++i) {
 			chainIv[i] = 0;
 		}
@@ -447,25 +478,7 @@ namespace EncFS
 				pos2 = filePath.size();
 			}
 			if (pos2 > pos1) {
-				string curPath = filePath.substr(pos1, pos2 - pos1);
-
-				// getBytesForBlockAlgorithm
-				string encodeBytes;
-				size_t byteLen = curPath.size();
-				int padLen = 16 - (byteLen % 16);
-				if (padLen == 0) {
-					padLen = 16;
-				}
-				encodeBytes.resize(byteLen + padLen);
-				for (int i = 0; i < byteLen; i++) {
-					encodeBytes[i] = curPath[i];
-				}
-				for (int i = 0; i < padLen; i++) {
-					encodeBytes[byteLen + i] = (char)padLen;
-				}
-
-				// Mac64
-				mac64withIv(hmac, hmacLock, encodeBytes, chainIv, chainIv);
+				extendChainIv(hmac, hmacLock, filePath.substr(pos1, pos2 - pos1), chainIv);
 			}
 			pos1 = pos2 + 1;
 		} while (pos2 != filePath.size());
@@ -1,18 +1,56 @@
 ﻿#include "EncFSVolume.h"
 #include "EncFSUtils.hpp"
+#include "EncFSRandom.h"
 
 #include "rapidxml.hpp"
 
 #include <aes.h>
 
+#include <atomic>
+
 using namespace std;
 using namespace rapidxml;
 using namespace CryptoPP;
 
-static AutoSeededX917RNG<CryptoPP::AES> random;
 
 namespace EncFS {
-	EncFSVolume::EncFSVolume() {
+	/** Names of content cipher algorithms in .encfs6.xml. */
+	static const char* SSL_AES_NAME = "ssl/aes";
+	static const char* AEAD_AES_GCM_NAME = "aead/aes-gcm";
+
+	/** Size of the GCM authentication tag stored in each block header. */
+	static const int32_t AEAD_TAG_SIZE = 16;
+	/** Size of the random nonce part stored in each block header. */
+	static const int32_t AEAD_NONCE_RAND_SIZE = 8;
+	/** Size of the random nonce stored before encrypted metadata. */
+	static const int32_t METADATA_NONCE_SIZE = 12;
+
+	/** Last key id given by unlock(). */
+	static atomic<uint64_t> lastKeyId(0);
+
+	/*
+	Ciphers of a thread for the blocks of read only volumes, keyed for the volume it coded last.
+	Nothing else takes their locks.
+	*/
+	struct EncFSThreadCiphers {
+		uint64_t keyId = 0;
+		HMAC<SHA1> hmac;
+		EncFSMutex hmacLock{ "EncFSVolume::threadHmacLock" };
+		CBC_Mode<AES>::Encryption aesCbcEnc;
+		EncFSMutex aesCbcEncLock{ "EncFSVolume::threadAesCbcEncLock" };
+		CBC_Mode<AES>::Decryption aesCbcDec;
+		EncFSMutex aesCbcDecLock{ "EncFSVolume::threadAesCbcDecLock" };
+		CFB_Mode<AES>::Encryption aesCfbEnc;
+		EncFSMutex aesCfbEncLock{ "EncFSVolume::threadAesCfbEncLock" };
+		CFB_Mode<AES>::Decryption aesCfbDec;
+		EncFSMutex aesCfbDecLock{ "EncFSVolume::threadAesCfbDecLock" };
+		/** Keyed with the volume key only for AEAD volumes, the nonce is set per block. */
+		GCM<AES>::Decryption aesGcmDec;
+	};
+
+	EncFSVolume::EncFSVolume() : readOnly(false), keyId(0), cipherAlg(SSL_AES), nameIndex(NULL),
+		blockEncoder(&EncFSVolume::encodeGenericBlock), blockDecoder(&EncFSVolume::decodeGenericBlock),
+		localBlockEncoder(&EncFSVolume::encodeGenericBlock), localBlockDecoder(&EncFSVolume::decodeGenericBlock) {
 		Base64Decoder::InitializeDecodingLookupArray(this->base64Lookup, ALPHABET, 64, false);
 	};
 
@@ -31,6 +69,27 @@ namespace EncFS {
 			if (!cfg) {
 				throw EncFSBadConfigurationException("cfg");
 			}
+			{
+				xml_node<> *node = cfg->first_node("cipherAlg");
+				if (!node) {
+					throw EncFSBadConfigurationException("cipherAlg");
+				}
+				xml_node<> *name = node->first_node("name");
+				if (!name) {
+					throw EncFSBadConfigurationException("cipherAlg");
+				}
+				string cipherName(name->value());
+				trim(cipherName);
+				if (cipherName == SSL_AES_NAME) {
+					this->cipherAlg = SSL_AES;
+				}
+				else if (cipherName == AEAD_AES_GCM_NAME) {
+					this->cipherAlg = AEAD_AES_GCM;
+				}
+				else {
+					throw EncFSBadConfigurationException("cipherAlg " + cipherName);
+				}
+			}
 			{
 				xml_node<> *node = cfg->first_node("keySize");
 				if (!node) {
@@ -131,6 +190,19 @@ namespace EncFS {
 				}
 				this->desiredKDFDuration = strtol(node->value(), NULL, 10);
 			}
+			if (this->cipherAlg == AEAD_AES_GCM) {
+				// Tag and random nonce part are stored in each block header.
+				if (this->blockMACBytes != AEAD_TAG_SIZE || this->blockMACRandBytes != AEAD_NONCE_RAND_SIZE) {
+					throw EncFSBadConfigurationException("blockMACBytes");
+				}
+				// A zeroed block would read back as a hole without being authenticated.
+				if (this->allowHoles) {
+					throw EncFSBadConfigurationException("allowHoles");
+				}
+				if (reverse) {
+					throw EncFSBadConfigurationException("aead/aes-gcm cannot be used on reverse mode");
+				}
+			}
 			if (this->reverse = reverse) {
 				// Reverse mode constraints.
 				this->uniqueIV = false;
@@ -144,12 +216,22 @@ namespace EncFS {
 		}
 	}
 
-	void EncFSVolume::create(char* password, EncFSMode mode, bool reverse) {
+	void EncFSVolume::create(char* password, EncFSMode mode, bool reverse, bool aead) {
 		this->blockSize = 1024;
 		this->uniqueIV = true;
-		this->blockMACBytes = 8;
-		this->blockMACRandBytes = 0;
-		this->allowHoles = true;
+		if (aead) {
+			// Every block is authenticated, holes included.
+			this->allowHoles = false;
+			this->cipherAlg = AEAD_AES_GCM;
+			this->blockMACBytes = AEAD_TAG_SIZE;
+			this->blockMACRandBytes = AEAD_NONCE_RAND_SIZE;
+		}
+		else {
+			this->allowHoles = true;
+			this->cipherAlg = SSL_AES;
+			this->blockMACBytes = 8;
+			this->blockMACRandBytes = 0;
+		}
 		switch (mode) {
 			default:
 				this->keySize = 192;
@@ -166,7 +248,7 @@ namespace EncFS {
 		this->saltLen = 20;
 		string salt;
 		salt.resize(this->saltLen);
-		random.GenerateBlock((byte*)salt.data(), salt.size());
+		EncFSRandom::generate(&salt[0], salt.size());
 		{
 			Base64Encoder encoder;
 			encoder.Put((byte*)salt.data(), salt.size());
@@ -178,6 +260,7 @@ namespace EncFS {
 
 		if (this->reverse = reverse) {
 			// Reverse mode constraints.
+			this->cipherAlg = SSL_AES;
 			this->uniqueIV = false;
 			this->chainedNameIV = false;
 			this->blockMACBytes = 0;
@@ -191,7 +274,7 @@ namespace EncFS {
 		// キーを生成
 		string plainKey;
 		plainKey.resize(this->encodedKeySize - 4);
-		random.GenerateBlock((byte*)plainKey.data(), plainKey.size());
+		EncFSRandom::generate(&plainKey[0], plainKey.size());
 
 		string pbkdf2Key;
 		this->deriveKey(password, pbkdf2Key);
@@ -226,8 +309,8 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 	<version>20100713</version>
 	<creator>EncFSy</creator>
 	<cipherAlg class_id="1" tracking_level="0" version="0">
-		<name>ssl/aes</name>
-		<major>3</major>
+		<name>%s</name>
+		<major>%d</major>
 		<minor>0</minor>
 	</cipherAlg>
 	<nameAlg>
@@ -256,8 +339,10 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 </cfg>
 </boost_serialization>
 )";
+		const bool aead = this->cipherAlg == AEAD_AES_GCM;
 		char s[sizeof temp + 400];
-		sprintf_s(s, sizeof s, temp, this->keySize, this->blockSize, this->uniqueIV, this->chainedNameIV, this->externalIVChaining,
+		sprintf_s(s, sizeof s, temp, aead ? AEAD_AES_GCM_NAME : SSL_AES_NAME, aead ? 1 : 3,
+			this->keySize, this->blockSize, this->uniqueIV, this->chainedNameIV, this->externalIVChaining,
 			this->blockMACBytes, this->blockMACRandBytes, this->allowHoles, this->encodedKeySize, this->encodedKeyData.c_str(), this->saltLen, this->saltData.c_str(),
 			this->kdfIterations, this->desiredKDFDuration);
 		xml.assign(s);
@@ -284,7 +369,7 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 		pbkdf2.DeriveKey((byte*)pbkdf2Key.data(), pbkdf2Key.size(), 0, (const byte*)password, passLen, (const byte*)salt.data(), this->saltLen, this->kdfIterations);
 
 		// メモリ中のパスワードをクリア
-		random.GenerateBlock((byte*)password, passLen);
+		SecureWipeBuffer((byte*)password, passLen);
 	}
 
 	void EncFSVolume::unlock(char* password) {
@@ -322,14 +407,28 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 			}
 		}
 
-		this->volumeKey.insert(this->volumeKey.begin(), plainKey.begin(), plainKey.begin() + this->keySize / 8);
-		this->volumeIv.insert(this->volumeIv.begin(), plainKey.begin() + this->keySize / 8, plainKey.end());
+		this->setKey(string(plainKey.begin(), plainKey.begin() + this->keySize / 8), string(plainKey.begin() + this->keySize / 8, plainKey.end()));
+	}
+
+	void EncFSVolume::setKey(const string &volumeKey, const string &volumeIv) {
+		this->volumeKey = volumeKey;
+		this->volumeIv = volumeIv;
 		this->volumeHmac.SetKey((const byte*)this->volumeKey.data(), this->volumeKey.size());
+		this->keyId = ++lastKeyId;
+
+		if (this->cipherAlg == AEAD_AES_GCM) {
+			// The key schedule and GHASH tables are built once, only the nonce changes per block.
+			byte zeroIv[12] = { 0 };
+			this->aesGcmEnc.SetKeyWithIV((const byte*)this->volumeKey.data(), this->volumeKey.size(), zeroIv, sizeof zeroIv);
+			this->aesGcmDec.SetKeyWithIV((const byte*)this->volumeKey.data(), this->volumeKey.size(), zeroIv, sizeof zeroIv);
+		}
+		this->setGenericBlockCodec(false);
 	}
 
-	void EncFSVolume::processFileName(SymmetricCipher &cipher, mutex &cipherLock, const string &fileIv, const string &binFileName, string &fileName) {
+	void EncFSVolume::processFileName(SymmetricCipher &cipher, EncFSMutex &cipherLock, const string &fileIv, const string &binFileName, string &fileName) {
 		char ivSpec[16];
 		generateIv(this->volumeHmac, this->hmacLock, this->volumeIv, fileIv, ivSpec);
+		EncFSIoStats::count(IO_AES_BLOCKS, (binFileName.size() + 15) / 16);
 
 		{
 			lock_guard<decltype(cipherLock)> lock(cipherLock);
@@ -346,6 +445,11 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 			encodedFileName.append(plainFileName);
 			return;
 		}
+		if (this->nameIndex && this->nameIndex->findEncodedName(plainDirPath, plainFileName, encodedFileName)) {
+			return;
+		}
+		EncFSIoStats::count(IO_NAME_ENCODES);
+		const size_t pos = encodedFileName.size();
 
 		// getPaddedDecFilename
 		const size_t padBytesSize = 16;
@@ -391,19 +495,33 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 		this->processFileName(this->aesCbcEnc, this->aesCbcEncLock, fileIv, paddedFileName, binFileName);
 		binFileName.insert(0, iv, 2);
 		encodeBase64FileName(binFileName, encodedFileName);
+		if (this->nameIndex) {
+			this->nameIndex->addName(plainDirPath, encodedFileName.substr(pos), plainFileName);
+		}
 	}
 
 	void EncFSVolume::decodeFileName(const string &encodedFileName, const string &plainDirPath, string &plainFileName) {
+		if (!this->tryDecodeFileName(encodedFileName, plainDirPath, plainFileName)) {
+			throw EncFSInvalidBlockException();
+		}
+	}
+
+	bool EncFSVolume::tryDecodeFileName(const string &encodedFileName, const string &plainDirPath, string &plainFileName) {
 		// 復号する必要のないファイル名
 		if (encodedFileName == "." || encodedFileName == "..") {
 			plainFileName.append(encodedFileName);
-			return;
+			return true;
+		}
+		if (this->nameIndex && this->nameIndex->findPlainName(plainDirPath, encodedFileName, plainFileName)) {
+			return true;
 		}
+		EncFSIoStats::count(IO_NAME_DECODES);
 
 		string binFileName;
 		decodeBase64FileName(this->base64Lookup, encodedFileName, binFileName);
-		if (binFileName.size() < 2 + this->aesCbcDec.MandatoryBlockSize()) {
-			throw EncFSInvalidBlockException();
+		const size_t blockSize = this->aesCbcDec.MandatoryBlockSize();
+		if (binFileName.size() < 2 + blockSize || (binFileName.size() - 2) % blockSize != 0) {
+			return false;
 		}
 
 		char chainIv[8];
@@ -432,7 +550,7 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 		iv1[0] = binFileName[0];
 		iv1[1] = binFileName[1];
 		binFileName.erase(0, 2);
-		size_t pos = plainFileName.size();
+		const size_t pos = plainFileName.size();
 		this->processFileName(this->aesCbcDec, this->aesCbcDecLock, fileIv, binFileName, plainFileName);
 
 		// ivとpadを検証
@@ -446,22 +564,216 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 		for (size_t i = 0; i < sizeof iv2; ++i) {
 			if (iv1[i] != iv2[i]) {
 				// 復号に失敗
-				throw EncFSInvalidBlockException();
+				plainFileName.resize(pos);
+				return false;
 			}
 		}
 	
-		const size_t padLen = plainFileName[plainFileName.size() - 1];
+		const size_t padLen = (byte)plainFileName[plainFileName.size() - 1];
+		if (padLen == 0 || padLen > plainFileName.size() - pos) {
+			// A foreign name which passed the 16 bit check by chance.
+			plainFileName.resize(pos);
+			return false;
+		}
 		for (size_t i = 0; i < padLen; ++i) {
-			if (plainFileName[plainFileName.size() - padLen + i] != padLen) {
-				throw EncFSInvalidBlockException();
+			if ((byte)plainFileName[plainFileName.size() - padLen + i] != padLen) {
+				plainFileName.resize(pos);
+				return false;
 			}
 		}
 
 		plainFileName.erase(plainFileName.size() - padLen, padLen);
+		if (this->nameIndex) {
+			this->nameIndex->addName(plainDirPath, encodedFileName, plainFileName.substr(pos));
+		}
+		return true;
+	}
+
+	void EncFSVolume::encryptFileName(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, CBC_Mode<AES>::Encryption &cipher, const char* chainIv, const string &plainFileName, string &encodedFileName) {
+		// getPaddedDecFilename
+		size_t padLen = 16 - (plainFileName.size() % 16);
+		string paddedFileName(plainFileName);
+		paddedFileName.append(padLen, (char)padLen);
+
+		char iv[2];
+		if (this->chainedNameIV) {
+			mac16withIv(hmac, hmacLock, paddedFileName, chainIv, iv);
+		}
+		else {
+			mac16(hmac, hmacLock, paddedFileName, iv);
+		}
+
+		string fileIv;
+		fileIv.resize(8);
+		for (size_t i = 0; i < 6; ++i) {
+			fileIv[i] = chainIv[i];
+		}
+		fileIv[6] = iv[0] ^ chainIv[6];
+		fileIv[7] = iv[1] ^ chainIv[7];
+		char ivSpec[16];
+		generateIv(hmac, hmacLock, this->volumeIv, fileIv, ivSpec);
+
+		// The key schedule is kept, only the IV changes per name.
+		string binFileName;
+		binFileName.resize(2 + paddedFileName.size());
+		binFileName[0] = iv[0];
+		binFileName[1] = iv[1];
+		cipher.Resynchronize((const byte*)ivSpec);
+		cipher.ProcessData((byte*)&binFileName[2], (const byte*)paddedFileName.data(), paddedFileName.size());
+		EncFSIoStats::count(IO_NAME_ENCODES);
+		EncFSIoStats::count(IO_AES_BLOCKS, paddedFileName.size() / 16);
+		encodeBase64FileName(binFileName, encodedFileName);
+	}
+
+	bool EncFSVolume::decryptFileName(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, CBC_Mode<AES>::Decryption &cipher, const char* chainIv, const string &encodedFileName, string &plainFileName) {
+		string binFileName;
+		decodeBase64FileName(this->base64Lookup, encodedFileName, binFileName);
+		const size_t blockSize = cipher.MandatoryBlockSize();
+		if (binFileName.size() < 2 + blockSize || (binFileName.size() - 2) % blockSize != 0) {
+			return false;
+		}
+
+		string fileIv;
+		fileIv.resize(8);
+		for (size_t i = 0; i < 6; ++i) {
+			fileIv[i] = chainIv[i];
+		}
+		fileIv[6] = binFileName[0] ^ chainIv[6];
+		fileIv[7] = binFileName[1] ^ chainIv[7];
+		char ivSpec[16];
+		generateIv(hmac, hmacLock, this->volumeIv, fileIv, ivSpec);
+
+		// The key schedule is kept, only the IV changes per name.
+		plainFileName.resize(binFileName.size() - 2);
+		cipher.Resynchronize((const byte*)ivSpec);
+		cipher.ProcessData((byte*)&plainFileName[0], (const byte*)binFileName.data() + 2, plainFileName.size());
+		EncFSIoStats::count(IO_NAME_DECODES);
+		EncFSIoStats::count(IO_AES_BLOCKS, plainFileName.size() / blockSize);
+
+		// ivとpadを検証
+		char iv2[2];
+		if (this->chainedNameIV) {
+			mac16withIv(hmac, hmacLock, plainFileName, chainIv, iv2);
+		}
+		else {
+			mac16(hmac, hmacLock, plainFileName, iv2);
+		}
+		if (binFileName[0] != iv2[0] || binFileName[1] != iv2[1]) {
+			return false;
+		}
+
+		const size_t padLen = (byte)plainFileName[plainFileName.size() - 1];
+		if (padLen == 0 || padLen > plainFileName.size()) {
+			return false;
+		}
+		for (size_t i = plainFileName.size() - padLen; i < plainFileName.size(); ++i) {
+			if ((byte)plainFileName[i] != padLen) {
+				return false;
+			}
+		}
+		plainFileName.erase(plainFileName.size() - padLen, padLen);
+		return true;
+	}
+
+	void EncFSVolume::decodeFileNames(const vector<string> &encodedFileNames, const string &plainDirPath, vector<string> &plainFileNames) {
+		DirectoryContext dir(*this, plainDirPath);
+		dir.decodeFileNames(encodedFileNames, plainFileNames);
+	}
+
+	EncFSVolume::DirectoryContext::DirectoryContext(EncFSVolume &volume, const string &plainDirPath) : volume(volume),
+		plainDirPath(plainDirPath), hmac((const byte*)volume.volumeKey.data(), volume.volumeKey.size()),
+		encCipherKeyed(false), decCipherKeyed(false) {
+		if (volume.chainedNameIV) {
+			computeChainIv(this->hmac, this->hmacLock, plainDirPath, this->chainIv);
+		}
+		else {
+			for (size_t i = 0; i < sizeof this->chainIv; ++i) {
+				this->chainIv[i] = 0;
+			}
+		}
+	}
+
+	void EncFSVolume::DirectoryContext::enterDirectory(const string &plainDirName) {
+		this->plainDirPath += g_pathSeparator;
+		this->plainDirPath += plainDirName;
+		if (this->volume.chainedNameIV) {
+			extendChainIv(this->hmac, this->hmacLock, plainDirName, this->chainIv);
+		}
+	}
+
+	void EncFSVolume::DirectoryContext::encodeFileName(const string &plainFileName, string &encodedFileName) {
+		if (plainFileName == "." || plainFileName == "..") {
+			encodedFileName.append(plainFileName);
+			return;
+		}
+		EncFSNameIndex* nameIndex = this->volume.nameIndex;
+		if (nameIndex && nameIndex->findEncodedName(this->plainDirPath, plainFileName, encodedFileName)) {
+			return;
+		}
+		if (!this->encCipherKeyed) {
+			const byte zeroIv[AES::BLOCKSIZE] = { 0 };
+			this->encCipher.SetKeyWithIV((const byte*)this->volume.volumeKey.data(), this->volume.volumeKey.size(), zeroIv);
+			this->encCipherKeyed = true;
+		}
+		const size_t pos = encodedFileName.size();
+		this->volume.encryptFileName(this->hmac, this->hmacLock, this->encCipher, this->chainIv, plainFileName, encodedFileName);
+		if (nameIndex) {
+			nameIndex->addName(this->plainDirPath, encodedFileName.substr(pos), plainFileName);
+		}
 	}
 
-	void EncFSVolume::codeFilePath(const string &srcFilePath, string &destFilePath, bool encode) {
-		string dirPath;
+	void EncFSVolume::DirectoryContext::decodeFileName(const string &encodedFileName, string &plainFileName) {
+		if (!this->tryDecodeFileName(encodedFileName, plainFileName)) {
+			throw EncFSInvalidBlockException();
+		}
+	}
+
+	bool EncFSVolume::DirectoryContext::tryDecodeFileName(const string &encodedFileName, string &plainFileName) {
+		string name;
+		if (!this->decode(encodedFileName, name)) {
+			return false;
+		}
+		plainFileName.append(name);
+		return true;
+	}
+
+	void EncFSVolume::DirectoryContext::decodeFileNames(const vector<string> &encodedFileNames, vector<string> &plainFileNames) {
+		plainFileNames.clear();
+		plainFileNames.resize(encodedFileNames.size());
+		for (size_t i = 0; i < encodedFileNames.size(); ++i) {
+			if (!this->decode(encodedFileNames[i], plainFileNames[i])) {
+				plainFileNames[i].clear();
+			}
+		}
+	}
+
+	bool EncFSVolume::DirectoryContext::decode(const string &encodedFileName, string &plainFileName) {
+		if (encodedFileName == "." || encodedFileName == "..") {
+			plainFileName = encodedFileName;
+			return true;
+		}
+		EncFSNameIndex* nameIndex = this->volume.nameIndex;
+		if (nameIndex && nameIndex->findPlainName(this->plainDirPath, encodedFileName, plainFileName)) {
+			return true;
+		}
+		if (!this->decCipherKeyed) {
+			const byte zeroIv[AES::BLOCKSIZE] = { 0 };
+			this->decCipher.SetKeyWithIV((const byte*)this->volume.volumeKey.data(), this->volume.volumeKey.size(), zeroIv);
+			this->decCipherKeyed = true;
+		}
+		if (!this->volume.decryptFileName(this->hmac, this->hmacLock, this->decCipher, this->chainIv, encodedFileName, plainFileName)) {
+			return false;
+		}
+		if (nameIndex) {
+			nameIndex->addName(this->plainDirPath, encodedFileName, plainFileName);
+		}
+		return true;
+	}
+
+	bool EncFSVolume::codeFilePath(const string &srcFilePath, string &destFilePath, bool encode) {
+		// The chain IV is extended by each directory instead of computed from the root for each name.
+		DirectoryContext dir(*this, "");
+		string parentName;
 		string::size_type pos1 = 0;
 		string::size_type pos2;
 		do {
@@ -485,27 +797,33 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 			}
 			if (pos2 > pos1) {
 				string destName = srcFilePath.substr(pos1, pos2 - pos1);
+				if (!parentName.empty()) {
+					dir.enterDirectory(parentName);
+				}
 				destFilePath += g_pathSeparator;
+				const size_t namePos = destFilePath.size();
 				if (encode) {
-					this->encodeFileName(destName, dirPath, destFilePath);
+					dir.encodeFileName(destName, destFilePath);
+					parentName = destName;
 				}
 				else {
-					this->decodeFileName(destName, dirPath, destFilePath);
+					if (!dir.tryDecodeFileName(destName, destFilePath)) {
+						return false;
+					}
+					parentName = destFilePath.substr(namePos);
 				}
 				if (alt) {
 					string altName = srcFilePath.substr(pos2, srcFilePath.size() - pos2);
 					destFilePath += altName;
-					destName += altName;
 					pos2 = srcFilePath.size();
 				}
-				dirPath += g_pathSeparator;
-				dirPath += destName;
 			}
 			pos1 = pos2 + 1;
 		} while (pos2 != srcFilePath.size());
 		if (destFilePath.size() == 0) {
 			destFilePath += g_pathSeparator;
 		}
+		return true;
 	}
 
 	void EncFSVolume::encodeFilePath(const string &plainFilePath, string &encodedFilePath) {
@@ -513,7 +831,13 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 	}
 
 	void EncFSVolume::decodeFilePath(const string &encodedFilePath, string &plainFilePath) {
-		this->codeFilePath(encodedFilePath, plainFilePath, false);
+		if (!this->codeFilePath(encodedFilePath, plainFilePath, false)) {
+			throw EncFSInvalidBlockException();
+		}
+	}
+
+	bool EncFSVolume::tryDecodeFilePath(const string &encodedFilePath, string &plainFilePath) {
+		return this->codeFilePath(encodedFilePath, plainFilePath, false);
 	}
 
 	int64_t EncFSVolume::toDecodedLength(const int64_t encodedLength) {
@@ -586,16 +910,182 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 		return bytesToLongByBE(decodedFileIv);
 	}
 
-	void EncFSVolume::encodeBlock(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock) {
+	void EncFSVolume::setReadOnly(bool readOnly) {
+		this->readOnly = readOnly;
+		this->setGenericBlockCodec(false);
+	}
+
+	void EncFSVolume::setGenericBlockCodec(bool generic) {
+		this->blockEncoder = this->localBlockEncoder = &EncFSVolume::encodeGenericBlock;
+		this->blockDecoder = this->localBlockDecoder = &EncFSVolume::decodeGenericBlock;
+		if (generic || this->cipherAlg != SSL_AES || this->blockMACRandBytes != 0 || this->blockSize != 1024) {
+			return;
+		}
+		// Standard and paranoia volumes differ only in the key size, which the block layout doesn't depend on.
+		// Reverse volumes have no MAC.
+		if (this->blockMACBytes == 8) {
+			if (this->allowHoles) {
+				this->selectFixedBlockCodec<true, 8, 1024>();
+			}
+			else {
+				this->selectFixedBlockCodec<false, 8, 1024>();
+			}
+		}
+		else if (this->blockMACBytes == 0) {
+			if (this->allowHoles) {
+				this->selectFixedBlockCodec<true, 0, 1024>();
+			}
+			else {
+				this->selectFixedBlockCodec<false, 0, 1024>();
+			}
+		}
+	}
+
+	template<bool HOLES, int32_t MAC_BYTES, int32_t BLOCK_SIZE>
+	void EncFSVolume::selectFixedBlockCodec() {
+		this->localBlockEncoder = &EncFSVolume::encodeFixedBlock<HOLES, MAC_BYTES, BLOCK_SIZE, true>;
+		this->localBlockDecoder = &EncFSVolume::decodeFixedBlock<HOLES, MAC_BYTES, BLOCK_SIZE, true>;
+		if (this->readOnly) {
+			this->blockEncoder = &EncFSVolume::encodeFixedBlock<HOLES, MAC_BYTES, BLOCK_SIZE, true>;
+			this->blockDecoder = &EncFSVolume::decodeFixedBlock<HOLES, MAC_BYTES, BLOCK_SIZE, true>;
+		}
+		else {
+			this->blockEncoder = &EncFSVolume::encodeFixedBlock<HOLES, MAC_BYTES, BLOCK_SIZE, false>;
+			this->blockDecoder = &EncFSVolume::decodeFixedBlock<HOLES, MAC_BYTES, BLOCK_SIZE, false>;
+		}
+	}
+
+	EncFSThreadCiphers& EncFSVolume::getThreadCiphers() {
+		static thread_local EncFSThreadCiphers ciphers;
+		if (ciphers.keyId != this->keyId) {
+			// The cipher keys are set with the IV of each block.
+			ciphers.hmac.SetKey((const byte*)this->volumeKey.data(), this->volumeKey.size());
+			if (this->cipherAlg == AEAD_AES_GCM) {
+				byte zeroIv[12] = { 0 };
+				ciphers.aesGcmDec.SetKeyWithIV((const byte*)this->volumeKey.data(), this->volumeKey.size(), zeroIv, sizeof zeroIv);
+			}
+			ciphers.keyId = this->keyId;
+		}
+		return ciphers;
+	}
+
+	void EncFSVolume::encodeGenericBlock(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock) {
 		this->codeBlock(fileIv, blockNum, true, plainBlock, encodedBlock);
 	}
 
-	void EncFSVolume::decodeBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock) {
-		this->codeBlock(fileIv, blockNum, false, encodedBlock, plainBlock);
+	bool EncFSVolume::decodeGenericBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock) {
+		return this->codeBlock(fileIv, blockNum, false, encodedBlock, plainBlock);
+	}
+
+	template<size_t LEN>
+	static inline bool isZeroBlock(const char* data) {
+		for (size_t i = 0; i < LEN; ++i) {
+			if (data[i] != 0) {
+				return false;
+			}
+		}
+		return true;
 	}
 
+	/*
+	Same layout as codeBlock, with the configuration fixed at compile time:
+	the MAC copy is unrolled, the hole and MAC code is dropped when it doesn't apply
+	and blocks are coded in place in the result without padding filters.
+	LOCAL codes with the ciphers of the calling thread, for read only volumes and the threads of EncFSStream.
+	*/
+	template<bool HOLES, int32_t MAC_BYTES, int32_t BLOCK_SIZE, bool LOCAL>
+	void EncFSVolume::encodeFixedBlock(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock) {
+		static_assert(MAC_BYTES == 0 || MAC_BYTES == 8, "MAC is 64bit");
+		static_assert(BLOCK_SIZE % AES::BLOCKSIZE == 0, "CBC without padding");
+		const size_t blockLen = plainBlock.size() + MAC_BYTES;
+		if (HOLES && blockLen == BLOCK_SIZE && isZeroBlock<BLOCK_SIZE - MAC_BYTES>(plainBlock.data())) {
+			encodedBlock.append(BLOCK_SIZE, (char)0);
+			return;
+		}
 
-	void EncFSVolume::codeBlock(const int64_t fileIv, const int64_t blockNum, const bool encode, const string &srcBlock, string &destBlock) {
+		EncFSThreadCiphers* ciphers = LOCAL ? &this->getThreadCiphers() : NULL;
+		HMAC<SHA1> &hmac = LOCAL ? ciphers->hmac : this->volumeHmac;
+		EncFSMutex &hmacLock = LOCAL ? ciphers->hmacLock : this->hmacLock;
+
+		const size_t pos = encodedBlock.size();
+		encodedBlock.resize(pos + blockLen);
+		byte* block = (byte*)&encodedBlock[pos];
+		if (MAC_BYTES > 0) {
+			char mac[8];
+			mac64(hmac, hmacLock, (const byte*)plainBlock.data(), plainBlock.size(), mac);
+			for (int32_t i = 0; i < MAC_BYTES; ++i) {
+				block[i] = mac[7 - i];
+			}
+		}
+		memcpy(block + MAC_BYTES, plainBlock.data(), plainBlock.size());
+
+		string blockIv;
+		longToBytesByBE(blockIv, blockNum ^ fileIv);
+		if (blockLen == BLOCK_SIZE) {
+			char ivSpec[16];
+			generateIv(hmac, hmacLock, this->volumeIv, blockIv, ivSpec);
+			CBC_Mode<AES>::Encryption &cipher = LOCAL ? ciphers->aesCbcEnc : this->aesCbcEnc;
+			lock_guard<EncFSMutex> lock(LOCAL ? ciphers->aesCbcEncLock : this->aesCbcEncLock);
+			cipher.SetKeyWithIV((const byte*)this->volumeKey.data(), this->volumeKey.size(), (const byte*)ivSpec);
+			cipher.ProcessData(block, block, BLOCK_SIZE);
+			EncFSIoStats::count(IO_AES_BLOCKS, BLOCK_SIZE / AES::BLOCKSIZE);
+		}
+		else if (blockLen > 0) {
+			streamEncrypt(hmac, hmacLock, this->volumeKey, this->volumeIv, blockIv,
+				LOCAL ? ciphers->aesCfbEnc : this->aesCfbEnc, LOCAL ? ciphers->aesCfbEncLock : this->aesCfbEncLock, block, blockLen);
+		}
+	}
+
+	template<bool HOLES, int32_t MAC_BYTES, int32_t BLOCK_SIZE, bool LOCAL>
+	bool EncFSVolume::decodeFixedBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock) {
+		const size_t blockLen = encodedBlock.size();
+		if (HOLES && blockLen == BLOCK_SIZE && isZeroBlock<BLOCK_SIZE>(encodedBlock.data())) {
+			plainBlock.append(BLOCK_SIZE - MAC_BYTES, (char)0);
+			return true;
+		}
+		if (blockLen < (size_t)MAC_BYTES) {
+			return false;
+		}
+
+		EncFSThreadCiphers* ciphers = LOCAL ? &this->getThreadCiphers() : NULL;
+		HMAC<SHA1> &hmac = LOCAL ? ciphers->hmac : this->volumeHmac;
+		EncFSMutex &hmacLock = LOCAL ? ciphers->hmacLock : this->hmacLock;
+
+		const size_t pos = plainBlock.size();
+		plainBlock.append(encodedBlock);
+		byte* block = (byte*)&plainBlock[pos];
+		string blockIv;
+		longToBytesByBE(blockIv, blockNum ^ fileIv);
+		if (blockLen == BLOCK_SIZE) {
+			char ivSpec[16];
+			generateIv(hmac, hmacLock, this->volumeIv, blockIv, ivSpec);
+			CBC_Mode<AES>::Decryption &cipher = LOCAL ? ciphers->aesCbcDec : this->aesCbcDec;
+			lock_guard<EncFSMutex> lock(LOCAL ? ciphers->aesCbcDecLock : this->aesCbcDecLock);
+			cipher.SetKeyWithIV((const byte*)this->volumeKey.data(), this->volumeKey.size(), (const byte*)ivSpec);
+			cipher.ProcessData(block, block, BLOCK_SIZE);
+			EncFSIoStats::count(IO_AES_BLOCKS, BLOCK_SIZE / AES::BLOCKSIZE);
+		}
+		else if (blockLen > 0) {
+			streamDecrypt(hmac, hmacLock, this->volumeKey, this->volumeIv, blockIv,
+				LOCAL ? ciphers->aesCfbDec : this->aesCfbDec, LOCAL ? ciphers->aesCfbDecLock : this->aesCfbDecLock, block, blockLen);
+		}
+
+		if (MAC_BYTES > 0) {
+			char mac[8];
+			mac64(hmac, hmacLock, block + MAC_BYTES, blockLen - MAC_BYTES, mac);
+			for (int32_t i = 0; i < MAC_BYTES; ++i) {
+				if (block[i] != (byte)mac[7 - i]) {
+					plainBlock.resize(pos);
+					return false;
+				}
+			}
+			plainBlock.erase(pos, MAC_BYTES);
+		}
+		return true;
+	}
+
+
+	bool EncFSVolume::codeBlock(const int64_t fileIv, const int64_t blockNum, const bool encode, const string &srcBlock, string &destBlock) {
 		const int64_t iv = blockNum ^ fileIv;
 		const size_t headerSize = this->getHeaderSize();
 
@@ -611,9 +1101,13 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 				}
 				if (zeroBlock) {
 					destBlock.append(this->blockSize, (char)0);
-					return;
+					return true;
 				}
 			}
+			if (this->cipherAlg == AEAD_AES_GCM) {
+				this->aeadEncodeBlock(fileIv, blockNum, srcBlock, destBlock);
+				return true;
+			}
 
 			string block;
 			block.resize(headerSize);
@@ -648,9 +1142,15 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 				}
 				if (zeroBlock) {
 					destBlock.append(this->blockSize - headerSize, (char)0);
-					return;
+					return true;
 				}
 			}
+			if (this->cipherAlg == AEAD_AES_GCM) {
+				return this->aeadDecodeBlock(fileIv, blockNum, srcBlock, destBlock);
+			}
+			if (srcBlock.size() < headerSize) {
+				return false;
+			}
 			string blockIv;
 			longToBytesByBE(blockIv, iv);
 			if (srcBlock.size() == this->blockSize) {
@@ -675,10 +1175,127 @@ R"(<?xml version="1.0" encoding="UTF-8" standalone="yes" ?>
 			}
 			if (!valid) {
 				//printf("Decode Error %d\n", valid);
-				throw EncFSInvalidBlockException();
+				destBlock.clear();
+				return false;
 			}
 			
 			destBlock.assign(destBlock.data() + headerSize, destBlock.size() - headerSize);
 		}
+		return true;
+	}
+
+	/*
+	Block layout: random nonce part (8) | GCM tag (16) | ciphertext.
+	The 12 byte GCM nonce is not derived from (fileIv, blockNum) alone because
+	an in-place rewrite of a block would reuse it; the random part is mixed in
+	through a 24 byte IV which GCM hashes into the initial counter.
+	*/
+	static void aeadBlockIv(const int64_t fileIv, const int64_t blockNum, const char* randPart, byte* iv) {
+		for (int i = 0; i < 8; ++i) {
+			iv[i] = (byte)(fileIv >> (56 - i * 8));
+			iv[8 + i] = (byte)(blockNum >> (56 - i * 8));
+		}
+		memcpy(iv + 16, randPart, AEAD_NONCE_RAND_SIZE);
+	}
+
+	void EncFSVolume::aeadEncodeBlock(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock) {
+		const size_t pos = encodedBlock.size();
+		encodedBlock.resize(pos + AEAD_NONCE_RAND_SIZE + AEAD_TAG_SIZE + plainBlock.size());
+		char* randPart = &encodedBlock[pos];
+		EncFSRandom::generate(randPart, AEAD_NONCE_RAND_SIZE);
+		byte iv[24];
+		aeadBlockIv(fileIv, blockNum, randPart, iv);
+		// The counter blocks and the block of the tag.
+		EncFSIoStats::count(IO_AES_BLOCKS, (plainBlock.size() + 15) / 16 + 1);
+
+		lock_guard<decltype(this->aesGcmEncLock)> lock(this->aesGcmEncLock);
+		this->aesGcmEnc.EncryptAndAuthenticate(
+			(byte*)&encodedBlock[pos + AEAD_NONCE_RAND_SIZE + AEAD_TAG_SIZE],
+			(byte*)&encodedBlock[pos + AEAD_NONCE_RAND_SIZE], AEAD_TAG_SIZE,
+			iv, sizeof iv, NULL, 0,
+			(const byte*)plainBlock.data(), plainBlock.size());
+	}
+
+	bool EncFSVolume::aeadDecodeBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock) {
+		const size_t headerSize = AEAD_NONCE_RAND_SIZE + AEAD_TAG_SIZE;
+		if (encodedBlock.size() <= headerSize) {
+			return false;
+		}
+		byte iv[24];
+		aeadBlockIv(fileIv, blockNum, encodedBlock.data(), iv);
+		EncFSIoStats::count(IO_AES_BLOCKS, (encodedBlock.size() - headerSize + 15) / 16 + 1);
+
+		plainBlock.resize(encodedBlock.size() - headerSize);
+		bool valid;
+		if (this->readOnly) {
+			// Readers of read only volumes decode with the cipher of their thread, without the lock.
+			valid = this->getThreadCiphers().aesGcmDec.DecryptAndVerify(
+				(byte*)&plainBlock[0],
+				(const byte*)encodedBlock.data() + AEAD_NONCE_RAND_SIZE, AEAD_TAG_SIZE,
+				iv, sizeof iv, NULL, 0,
+				(const byte*)encodedBlock.data() + headerSize, plainBlock.size());
+		}
+		else {
+			lock_guard<decltype(this->aesGcmDecLock)> lock(this->aesGcmDecLock);
+			valid = this->aesGcmDec.DecryptAndVerify(
+				(byte*)&plainBlock[0],
+				(const byte*)encodedBlock.data() + AEAD_NONCE_RAND_SIZE, AEAD_TAG_SIZE,
+				iv, sizeof iv, NULL, 0,
+				(const byte*)encodedBlock.data() + headerSize, plainBlock.size());
+		}
+		if (!valid) {
+			plainBlock.clear();
+			return false;
+		}
+		return true;
+	}
+
+	void EncFSVolume::deriveMetadataKey(string &metadataKey) {
+		static const char* LABEL = "encfsy metadata";
+		HMAC<SHA256> hmac((const byte*)this->volumeKey.data(), this->volumeKey.size());
+		hmac.Update((const byte*)LABEL, strlen(LABEL));
+		metadataKey.resize(HMAC<SHA256>::DIGESTSIZE);
+		hmac.Final((byte*)&metadataKey[0]);
+	}
+
+	void EncFSVolume::encodeMetadata(const string &plainData, string &encodedData) {
+		string metadataKey;
+		this->deriveMetadataKey(metadataKey);
+
+		// Layout: nonce (12) | GCM tag (16) | ciphertext.
+		encodedData.resize(METADATA_NONCE_SIZE + AEAD_TAG_SIZE + plainData.size());
+		byte* nonce = (byte*)&encodedData[0];
+		EncFSRandom::generate(nonce, METADATA_NONCE_SIZE);
+		GCM<AES>::Encryption enc;
+		enc.SetKeyWithIV((const byte*)metadataKey.data(), metadataKey.size(), nonce, METADATA_NONCE_SIZE);
+		enc.EncryptAndAuthenticate(
+			(byte*)&encodedData[METADATA_NONCE_SIZE + AEAD_TAG_SIZE],
+			(byte*)&encodedData[METADATA_NONCE_SIZE], AEAD_TAG_SIZE,
+			nonce, METADATA_NONCE_SIZE, NULL, 0,
+			(const byte*)plainData.data(), plainData.size());
+		SecureWipeBuffer((byte*)&metadataKey[0], metadataKey.size());
+	}
+
+	void EncFSVolume::decodeMetadata(const char* encodedData, size_t encodedSize, string &plainData) {
+		if (encodedSize < METADATA_NONCE_SIZE + AEAD_TAG_SIZE) {
+			throw EncFSInvalidBlockException();
+		}
+		string metadataKey;
+		this->deriveMetadataKey(metadataKey);
+
+		const byte* nonce = (const byte*)encodedData;
+		plainData.resize(encodedSize - METADATA_NONCE_SIZE - AEAD_TAG_SIZE);
+		GCM<AES>::Decryption dec;
+		dec.SetKeyWithIV((const byte*)metadataKey.data(), metadataKey.size(), nonce, METADATA_NONCE_SIZE);
+		const bool valid = dec.DecryptAndVerify(
+			plainData.empty() ? NULL : (byte*)&plainData[0],
+			(const byte*)encodedData + METADATA_NONCE_SIZE, AEAD_TAG_SIZE,
+			nonce, METADATA_NONCE_SIZE, NULL, 0,
+			(const byte*)encodedData + METADATA_NONCE_SIZE + AEAD_TAG_SIZE, plainData.size());
+		SecureWipeBuffer((byte*)&metadataKey[0], metadataKey.size());
+		if (!valid) {
+			plainData.clear();
+			throw EncFSInvalidBlockException();
+		}
 	}
 }
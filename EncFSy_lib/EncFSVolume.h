@@ -3,12 +3,17 @@
 #include <string>
 #include <mutex>
 #include <exception>
+#include <vector>
 
 #include <modes.h>
+#include <gcm.h>
 #include <pwdbased.h>
 #include <sha.h>
 #include <osrng.h>
 
+#include "EncFSLock.h"
+#include "EncFSNameIndex.h"
+
 using namespace std;
 using namespace CryptoPP;
 
@@ -19,6 +24,15 @@ namespace EncFS
 		PARANOIA = 2
 	};
 
+	enum EncFSCipherAlg {
+		/** AES-CBC/CFB with HMAC-SHA1 block MAC (ssl/aes). */
+		SSL_AES = 1,
+		/** AES-GCM authenticated encryption per block (aead/aes-gcm). */
+		AEAD_AES_GCM = 2
+	};
+
+	struct EncFSThreadCiphers;
+
 	/**
 	EncFS volume configuration.
 	This class provides foundermental encode/decode functions.
@@ -35,6 +49,13 @@ namespace EncFS
 	private:
 		/** reverse mode */
 		bool reverse;
+		/** Mounted write protected or reverse, nothing is written through the volume. */
+		bool readOnly;
+		/** Identifies the key unlocked last, for the per thread ciphers. */
+		uint64_t keyId;
+
+		/** Content cipher algorithm. */
+		EncFSCipherAlg cipherAlg;
 
 		/** Key size. 192 or 256B */
 		int32_t keySize;
@@ -65,21 +86,39 @@ namespace EncFS
 		string volumeIv;
 
 		HMAC<SHA1> volumeHmac;
-		mutex hmacLock;
+		EncFSMutex hmacLock{ "EncFSVolume::hmacLock" };
 
 		int base64Lookup[256];
 
 		// AES / CBC / NoPadding
 		CBC_Mode<AES>::Encryption aesCbcEnc;
-		mutex aesCbcEncLock;
+		EncFSMutex aesCbcEncLock{ "EncFSVolume::aesCbcEncLock" };
 		CBC_Mode<AES>::Decryption aesCbcDec;
-		mutex aesCbcDecLock;
+		EncFSMutex aesCbcDecLock{ "EncFSVolume::aesCbcDecLock" };
 
 		// AES / CFB / NoPadding
 		CFB_Mode<AES>::Encryption aesCfbEnc;
-		mutex aesCfbEncLock;
+		EncFSMutex aesCfbEncLock{ "EncFSVolume::aesCfbEncLock" };
 		CFB_Mode<AES>::Decryption aesCfbDec;
-		mutex aesCfbDecLock;
+		EncFSMutex aesCfbDecLock{ "EncFSVolume::aesCfbDecLock" };
+
+		// AES / GCM (keyed once on unlock)
+		GCM<AES>::Encryption aesGcmEnc;
+		EncFSMutex aesGcmEncLock{ "EncFSVolume::aesGcmEncLock" };
+		GCM<AES>::Decryption aesGcmDec;
+		EncFSMutex aesGcmDecLock{ "EncFSVolume::aesGcmDecLock" };
+
+		/** Cache of coded file names, NULL if disabled. */
+		EncFSNameIndex* nameIndex;
+
+		typedef void (EncFSVolume::*BlockEncoder)(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock);
+		typedef bool (EncFSVolume::*BlockDecoder)(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock);
+		/** Block codecs for the configuration, selected by unlock(). */
+		BlockEncoder blockEncoder;
+		BlockDecoder blockDecoder;
+		/** Same codecs with the ciphers of the calling thread, whether the volume is read only or not. */
+		BlockEncoder localBlockEncoder;
+		BlockDecoder localBlockDecoder;
 
 	public:
 		EncFSVolume();
@@ -88,12 +127,12 @@ namespace EncFS
 		/**
 		Load EncFS configuration file. There are rectrictions:
 		.encfs6.xml format
-		cipherAlg ssl/aes 3.0
+		cipherAlg ssl/aes 3.0 or aead/aes-gcm 1.0
 		nameAlg nameio/block 3.0
 		**/
 		void load(const string &xml, bool reverse);
 
-		void create(char* password, EncFSMode mode, bool reverse);
+		void create(char* password, EncFSMode mode, bool reverse, bool aead);
 
 		void save(string &xml);
 
@@ -103,6 +142,13 @@ namespace EncFS
 		inline int32_t getBlockSize() {
 			return this->blockSize;
 		}
+		/** Key size in bits. */
+		inline int32_t getKeySize() {
+			return this->keySize;
+		}
+		inline bool isAllowHoles() {
+			return this->allowHoles;
+		}
 		inline bool isChainedNameIV() {
 			return this->chainedNameIV;
 		}
@@ -115,30 +161,175 @@ namespace EncFS
 		inline bool isReverse() {
 			return this->reverse;
 		}
+		inline bool isReadOnly() {
+			return this->readOnly;
+		}
+
+		/**
+		Blocks of a read only volume are coded with ciphers owned by the calling thread,
+		so concurrent reads don't share the cipher and HMAC locks. Set before the volume is used.
+		**/
+		void setReadOnly(bool readOnly);
+		inline EncFSCipherAlg getCipherAlg() {
+			return this->cipherAlg;
+		}
+		inline EncFSNameIndex* getNameIndex() {
+			return this->nameIndex;
+		}
+		inline void setNameIndex(EncFSNameIndex* nameIndex) {
+			this->nameIndex = nameIndex;
+		}
 
 		/**
 		Decode volume key.
 		**/
 		void unlock(char* password);
 
+		/**
+		Key the volume with a key of getKeySize() bits and a 16 byte IV instead of the key of the configuration,
+		for the differential tests of the coding kernels in the bench.
+		**/
+		void setKey(const string &volumeKey, const string &volumeIv);
+
 		void encodeFileName(const string &plainFileName, const string &plainDirPath, string &encodedFileName);
 		void decodeFileName(const string &encodedFileName, const string &plainDirPath, string &plainFileName);
+
+		/**
+		Same as decodeFileName, but returns false instead of throwing when the name was not encoded
+		with the key of this volume, as the names of files put in the directory by others.
+		plainFileName is left unchanged then.
+		**/
+		bool tryDecodeFileName(const string &encodedFileName, const string &plainDirPath, string &plainFileName);
+
+		/**
+		Decode names of the same directory at once with a DirectoryContext.
+		Names which can't be decoded are left empty.
+		**/
+		void decodeFileNames(const vector<string> &encodedFileNames, const string &plainDirPath, vector<string> &plainFileNames);
+
+		/**
+		Codes the names of one directory. The chain IV of the directory is computed once and the names are
+		coded with ciphers and an HMAC keyed for the context, without taking the shared locks per name.
+		Not thread-safe, each thread creates its own.
+		**/
+		class DirectoryContext {
+		private:
+			EncFSVolume &volume;
+			string plainDirPath;
+			char chainIv[8];
+			HMAC<SHA1> hmac;
+			EncFSMutex hmacLock{ "EncFSVolume::DirectoryContext::hmacLock" };
+			/** Keyed on the first name which isn't in the name index. */
+			CBC_Mode<AES>::Encryption encCipher;
+			bool encCipherKeyed;
+			CBC_Mode<AES>::Decryption decCipher;
+			bool decCipherKeyed;
+
+		public:
+			DirectoryContext(EncFSVolume &volume, const string &plainDirPath);
+			~DirectoryContext() {};
+
+			DirectoryContext(const DirectoryContext&) = delete;
+			DirectoryContext& operator=(const DirectoryContext&) = delete;
+
+			inline const string& getPlainDirPath() {
+				return this->plainDirPath;
+			}
+
+			/**
+			Move to the subdirectory, extending the chain IV by one name.
+			**/
+			void enterDirectory(const string &plainDirName);
+
+			/**
+			The coded name is appended as by EncFSVolume::encodeFileName and decodeFileName.
+			**/
+			void encodeFileName(const string &plainFileName, string &encodedFileName);
+			void decodeFileName(const string &encodedFileName, string &plainFileName);
+			bool tryDecodeFileName(const string &encodedFileName, string &plainFileName);
+
+			/**
+			Names which can't be decoded are left empty.
+			**/
+			void decodeFileNames(const vector<string> &encodedFileNames, vector<string> &plainFileNames);
+
+		private:
+			bool decode(const string &encodedFileName, string &plainFileName);
+		};
+
 		void encodeFilePath(const string &plainFilePath, string &encodedFilePath);
-		void decodeFilePath(const string &plainFilePath, string &encodedFilePath);
+		void decodeFilePath(const string &encodedFilePath, string &plainFilePath);
+
+		/**
+		Returns false when a name of the path can't be decoded, as a path of a reverse volume
+		which was not listed by it. plainFilePath is undefined then.
+		**/
+		bool tryDecodeFilePath(const string &encodedFilePath, string &plainFilePath);
 		int64_t toDecodedLength(const int64_t encodedLength);
 		int64_t toEncodedLength(const int64_t decodedLength);
 
 		void encodeFileIv(const string &plainFilePath, const int64_t fileIv, string &encodedFileHeader);
 		int64_t decodeFileIv(const string &plainFilePath, const string &encodedFileHeader);
 
-		void encodeBlock(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock);
-		void decodeBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock);
+		inline void encodeBlock(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock) {
+			(this->*this->blockEncoder)(fileIv, blockNum, plainBlock, encodedBlock);
+		}
+		inline void decodeBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock);
+
+		/**
+		Returns false instead of throwing when the block is corrupt or not encoded with the key of this volume,
+		so reads fail with a status without unwinding.
+		**/
+		inline bool tryDecodeBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock) {
+			return (this->*this->blockDecoder)(fileIv, blockNum, encodedBlock, plainBlock);
+		}
+
+		/**
+		Code with the ciphers of the calling thread instead of the locked ciphers of the volume,
+		for threads which code the blocks of a file in parallel. Only the specialized codecs have them.
+		**/
+		inline void encodeLocalBlock(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock) {
+			(this->*this->localBlockEncoder)(fileIv, blockNum, plainBlock, encodedBlock);
+		}
+		inline bool tryDecodeLocalBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock) {
+			return (this->*this->localBlockDecoder)(fileIv, blockNum, encodedBlock, plainBlock);
+		}
+
+		/**
+		Code blocks with the codec which reads the configuration on every call instead of
+		the one specialized for it, to measure the difference.
+		**/
+		void setGenericBlockCodec(bool generic);
+
+		/**
+		Encrypt and authenticate data stored beside the configuration, with a key derived from the volume key.
+		**/
+		void encodeMetadata(const string &plainData, string &encodedData);
+
+		/**
+		Throws EncFSInvalidBlockException when the data was not encoded with the key of this volume.
+		**/
+		void decodeMetadata(const char* encodedData, size_t encodedSize, string &plainData);
 
 	private:
 		void deriveKey(char* password, string &pbkdf2Key);
-		void processFileName(SymmetricCipher &cipher, mutex &cipherLock, const string &fileIv, const string &binFileName, string &fileName);
-		void codeBlock(const int64_t fileIv, const int64_t blockNum, const bool encode, const string &encodedBlock, string &plainBlock);
-		void codeFilePath(const string &srcFilePath, string &destFilePath, bool encode);
+		void deriveMetadataKey(string &metadataKey);
+		void processFileName(SymmetricCipher &cipher, EncFSMutex &cipherLock, const string &fileIv, const string &binFileName, string &fileName);
+		void encryptFileName(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, CBC_Mode<AES>::Encryption &cipher, const char* chainIv, const string &plainFileName, string &encodedFileName);
+		bool decryptFileName(HMAC<SHA1> &hmac, EncFSMutex &hmacLock, CBC_Mode<AES>::Decryption &cipher, const char* chainIv, const string &encodedFileName, string &plainFileName);
+		bool codeBlock(const int64_t fileIv, const int64_t blockNum, const bool encode, const string &encodedBlock, string &plainBlock);
+		void encodeGenericBlock(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock);
+		bool decodeGenericBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock);
+		template<bool HOLES, int32_t MAC_BYTES, int32_t BLOCK_SIZE>
+		void selectFixedBlockCodec();
+		EncFSThreadCiphers& getThreadCiphers();
+		template<bool HOLES, int32_t MAC_BYTES, int32_t BLOCK_SIZE, bool LOCAL>
+		void encodeFixedBlock(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock);
+		template<bool HOLES, int32_t MAC_BYTES, int32_t BLOCK_SIZE, bool LOCAL>
+		bool decodeFixedBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock);
+		void aeadEncodeBlock(const int64_t fileIv, const int64_t blockNum, const string &plainBlock, string &encodedBlock);
+		bool aeadDecodeBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock);
+		bool codeFilePath(const string &srcFilePath, string &destFilePath, bool encode);
 	};
 
 	class EncFSBadConfigurationException : runtime_error {
@@ -180,4 +371,10 @@ namespace EncFS
 			return "Invalid block.";
 		}
 	};
+
+	inline void EncFSVolume::decodeBlock(const int64_t fileIv, const int64_t blockNum, const string &encodedBlock, string &plainBlock) {
+		if (!(this->*this->blockDecoder)(fileIv, blockNum, encodedBlock, plainBlock)) {
+			throw EncFSInvalidBlockException();
+		}
+	}
 }
\ No newline at end of file
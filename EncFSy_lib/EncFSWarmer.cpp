@@ -0,0 +1,167 @@
+#include "EncFSWarmer.h"
+#include "EncFSDirectory.h"
+
+#include <algorithm>
+#include <codecvt>
+#include <chrono>
+
+namespace EncFS
+{
+	EncFSWarmer::EncFSWarmer(EncFSVolume &volume, EncFSNameIndex &nameIndex, const wstring &rootDirectory,
+		const string &plainDirPaths, int depth, int seconds, int threads) : volume(volume), nameIndex(nameIndex),
+		rootDirectory(rootDirectory), depth(depth), budgetMillis((uint64_t)seconds * 1000),
+		threads(threads > 0 ? threads : 1), busy(0), stopping(false), deadline(0), lastRequest(0) {
+		string::size_type pos1 = 0;
+		for (;;) {
+			string::size_type pos2 = plainDirPaths.find(';', pos1);
+			string path = plainDirPaths.substr(pos1, pos2 == string::npos ? string::npos : pos2 - pos1);
+			if (!path.empty()) {
+				if (path[0] != '\\') {
+					path.insert(path.begin(), '\\');
+				}
+				if (path.size() > 1 && path.back() == '\\') {
+					path.pop_back();
+				}
+				this->plainDirPaths.push_back(path);
+			}
+			if (pos2 == string::npos) {
+				break;
+			}
+			pos1 = pos2 + 1;
+		}
+	}
+
+	void EncFSWarmer::start() {
+		lock_guard<decltype(this->lock)> lock(this->lock);
+		if (!this->workers.empty()) {
+			return;
+		}
+		this->deadline = GetTickCount64() + this->budgetMillis;
+		for (const string &path : this->plainDirPaths) {
+			this->queue.push_back(Directory{ path, this->depth });
+		}
+		for (int i = 0; i < this->threads; ++i) {
+			this->workers.emplace_back(&EncFSWarmer::work, this);
+		}
+	}
+
+	void EncFSWarmer::stop() {
+		{
+			lock_guard<decltype(this->lock)> lock(this->lock);
+			this->stopping = true;
+		}
+		this->changed.notify_all();
+		for (thread &worker : this->workers) {
+			worker.join();
+		}
+		this->workers.clear();
+	}
+
+	void EncFSWarmer::work() {
+		// Lower CPU and I/O priority than the Dokan threads.
+		SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+		vector<string> subDirPaths;
+		for (;;) {
+			Directory dir;
+			{
+				unique_lock<decltype(this->lock)> lock(this->lock);
+				this->changed.wait(lock, [this] {
+					return this->stopping || !this->queue.empty() || this->busy == 0;
+				});
+				if (this->stopping || this->queue.empty()) {
+					// All directories are listed when the queue is empty and no worker is listing.
+					return;
+				}
+				dir = this->queue.front();
+				this->queue.pop_front();
+				++this->busy;
+			}
+
+			subDirPaths.clear();
+			if (this->waitForIdle()) {
+				this->warmDirectory(dir.plainDirPath, subDirPaths);
+			}
+
+			{
+				lock_guard<decltype(this->lock)> lock(this->lock);
+				--this->busy;
+				if (dir.depth > 0) {
+					for (const string &path : subDirPaths) {
+						this->queue.push_back(Directory{ path, dir.depth - 1 });
+					}
+				}
+			}
+			this->changed.notify_all();
+		}
+	}
+
+	bool EncFSWarmer::waitForIdle() {
+		unique_lock<decltype(this->lock)> lock(this->lock);
+		for (;;) {
+			if (this->stopping) {
+				return false;
+			}
+			const uint64_t now = GetTickCount64();
+			if (now >= this->deadline) {
+				this->stopping = true;
+				this->changed.notify_all();
+				return false;
+			}
+			const uint64_t idle = now - this->lastRequest.load(memory_order_relaxed);
+			if (idle >= QUIET_MILLIS) {
+				return true;
+			}
+			this->changed.wait_for(lock, chrono::milliseconds(QUIET_MILLIS - idle));
+		}
+	}
+
+	void EncFSWarmer::warmDirectory(const string &plainDirPath, vector<string> &plainSubDirPaths) {
+		wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+		string encodedDirPath;
+		try {
+			this->volume.encodeFilePath(plainDirPath, encodedDirPath);
+		}
+		catch (const EncFSInvalidBlockException &ex) {
+			return;
+		}
+		const wstring dirPath = this->rootDirectory + strConv.from_bytes(encodedDirPath);
+
+		// As FindFiles, the listing is complete until the directory is modified.
+		WIN32_FILE_ATTRIBUTE_DATA dirData;
+		if (!GetFileAttributesExW(dirPath.c_str(), GetFileExInfoStandard, &dirData)) {
+			return;
+		}
+		const uint64_t listedTime = ((uint64_t)dirData.ftLastWriteTime.dwHighDateTime << 32) | dirData.ftLastWriteTime.dwLowDateTime;
+
+		EncFSDirectoryReader reader(dirPath);
+		if (!reader.isOpen()) {
+			return;
+		}
+		EncFSVolume::DirectoryContext dir(this->volume, plainDirPath);
+		vector<WIN32_FIND_DATAW> batch;
+		vector<string> encodedNames, plainNames;
+		vector<pair<string, string>> listing;
+		while (reader.next(batch)) {
+			batch.erase(remove_if(batch.begin(), batch.end(), EncFSDirectoryReader::isDots), batch.end());
+			encodedNames.clear();
+			for (const WIN32_FIND_DATAW &findData : batch) {
+				encodedNames.push_back(strConv.to_bytes(findData.cFileName));
+			}
+			dir.decodeFileNames(encodedNames, plainNames);
+			for (size_t i = 0; i < batch.size(); ++i) {
+				// Not a name of the volume, as the configuration in the root.
+				if (plainNames[i].empty()) {
+					continue;
+				}
+				listing.emplace_back(encodedNames[i], plainNames[i]);
+				const DWORD attributes = batch[i].dwFileAttributes;
+				if ((attributes & FILE_ATTRIBUTE_DIRECTORY) && !(attributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+					plainSubDirPaths.push_back((plainDirPath.size() > 1 ? plainDirPath : "") + '\\' + plainNames[i]);
+				}
+			}
+		}
+		if (reader.getError() == ERROR_SUCCESS) {
+			this->nameIndex.setListing(plainDirPath, listedTime, listing);
+		}
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <windows.h>
+
+#include "EncFSVolume.h"
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+
+using namespace std;
+
+namespace EncFS
+{
+	/**
+	Lists directories of a mounted volume in the background to fill its name index,
+	so that the first browse of a big share finds the names and listings decoded.
+	Workers run at background priority, breadth first from the configured directories,
+	up to a depth and a time budget. They wait while Dokan requests come in.
+	**/
+	class EncFSWarmer {
+	private:
+		/** Time without a Dokan request before the workers go on. */
+		static const uint64_t QUIET_MILLIS = 100;
+
+		struct Directory {
+			string plainDirPath;
+			int depth;
+		};
+
+		EncFSVolume &volume;
+		EncFSNameIndex &nameIndex;
+		/** Underlying root directory, \\?\ prefixed. */
+		const wstring rootDirectory;
+		vector<string> plainDirPaths;
+		const int depth;
+		const uint64_t budgetMillis;
+		const int threads;
+
+		mutex lock;
+		condition_variable changed;
+		deque<Directory> queue;
+		/** Directories being listed. */
+		int busy;
+		bool stopping;
+		uint64_t deadline;
+		vector<thread> workers;
+
+		/** Tick of the last Dokan request. */
+		atomic<uint64_t> lastRequest;
+
+		void work();
+		bool waitForIdle();
+		void warmDirectory(const string &plainDirPath, vector<string> &plainSubDirPaths);
+
+	public:
+		/**
+		plainDirPaths are directories of the volume separated by ';' (ex. \;\docs).
+		depth is the number of levels listed below them, seconds the time budget of the walk.
+		**/
+		EncFSWarmer(EncFSVolume &volume, EncFSNameIndex &nameIndex, const wstring &rootDirectory,
+			const string &plainDirPaths, int depth, int seconds, int threads = 2);
+		~EncFSWarmer() {
+			this->stop();
+		}
+
+		EncFSWarmer(const EncFSWarmer&) = delete;
+		EncFSWarmer& operator=(const EncFSWarmer&) = delete;
+
+		void start();
+
+		/**
+		Stop and wait for the workers.
+		**/
+		void stop();
+
+		/**
+		Called on each Dokan request to hold the workers back.
+		**/
+		inline void touch() {
+			const uint64_t now = GetTickCount64();
+			// Written at most once per tick, so Dokan threads rarely share the line for writing.
+			if (this->lastRequest.load(memory_order_relaxed) != now) {
+				this->lastRequest.store(now, memory_order_relaxed);
+			}
+		}
+	};
+}
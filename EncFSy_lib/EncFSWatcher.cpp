@@ -0,0 +1,259 @@
+#include "EncFSWatcher.h"
+#include "EncFSFile.h"
+#include "EncFSUtils.hpp"
+
+#include <vector>
+
+namespace EncFS
+{
+	EncFSWatcher::EncFSWatcher(EncFSVolume &volume, EncFSNameIndex* nameIndex, const wstring &rootDirectory,
+		const Listener &listener) : volume(volume), nameIndex(nameIndex), rootDirectory(rootDirectory), listener(listener),
+		directory(INVALID_HANDLE_VALUE), stopEvent(NULL), renamedDirectory(false) {
+	}
+
+	bool EncFSWatcher::start() {
+		if (this->worker.joinable()) {
+			return true;
+		}
+		this->directory = CreateFileW(this->rootDirectory.c_str(), FILE_LIST_DIRECTORY,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+		if (this->directory == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		this->stopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (!this->stopEvent) {
+			const DWORD error = GetLastError();
+			this->stop();
+			SetLastError(error);
+			return false;
+		}
+		this->worker = thread(&EncFSWatcher::run, this);
+		EncFSFileState::watch(true);
+		return true;
+	}
+
+	void EncFSWatcher::stop() {
+		if (this->worker.joinable()) {
+			SetEvent(this->stopEvent);
+			this->worker.join();
+			EncFSFileState::watch(false);
+		}
+		if (this->stopEvent) {
+			CloseHandle(this->stopEvent);
+			this->stopEvent = NULL;
+		}
+		if (this->directory != INVALID_HANDLE_VALUE) {
+			CloseHandle(this->directory);
+			this->directory = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	void EncFSWatcher::run() {
+		// FILE_NOTIFY_INFORMATION is DWORD aligned.
+		vector<DWORD> buffer(BUFFER_SIZE / sizeof(DWORD));
+		OVERLAPPED overlapped;
+		ZeroMemory(&overlapped, sizeof overlapped);
+		overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (!overlapped.hEvent) {
+			return;
+		}
+		// Attributes and times are not cached, sizes are.
+		const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+			FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+		HANDLE handles[2] = { this->stopEvent, overlapped.hEvent };
+		for (;;) {
+			ResetEvent(overlapped.hEvent);
+			if (!ReadDirectoryChangesW(this->directory, buffer.data(), BUFFER_SIZE, TRUE, filter, NULL, &overlapped, NULL)) {
+				break;
+			}
+			DWORD transferred;
+			if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+				CancelIoEx(this->directory, &overlapped);
+				GetOverlappedResult(this->directory, &overlapped, &transferred, TRUE);
+				break;
+			}
+			if (!GetOverlappedResult(this->directory, &overlapped, &transferred, FALSE)) {
+				if (GetLastError() != ERROR_NOTIFY_ENUM_DIR) {
+					// The root was removed.
+					break;
+				}
+				transferred = 0;
+			}
+			if (transferred == 0) {
+				this->overflowed();
+				continue;
+			}
+			const char* p = (const char*)buffer.data();
+			for (;;) {
+				const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)p;
+				this->changed(info->Action, wstring(info->FileName, info->FileNameLength / sizeof(WCHAR)));
+				if (info->NextEntryOffset == 0) {
+					break;
+				}
+				p += info->NextEntryOffset;
+			}
+		}
+		CloseHandle(overlapped.hEvent);
+	}
+
+	void EncFSWatcher::changed(DWORD action, const wstring &relativePath) {
+		// The parents of any reported path are directories.
+		for (wstring::size_type pos = relativePath.find(L'\\'); pos != wstring::npos; pos = relativePath.find(L'\\', pos + 1)) {
+			this->directories.insert(relativePath.substr(0, pos));
+		}
+
+		string cMountPath;
+		const bool ofVolume = this->toMountPath(relativePath, cMountPath);
+		if (action == FILE_ACTION_RENAMED_OLD_NAME) {
+			this->renamedPath.clear();
+			// The index only knows indexed directories, the set the ones seen since the start.
+			this->renamedDirectory = this->forgetDirectory(relativePath);
+			if (ofVolume) {
+				this->renamedDirectory = this->forgetName(relativePath, cMountPath) || this->renamedDirectory;
+				this->renamedPath = this->strConv.from_bytes(cMountPath);
+			}
+			return;
+		}
+		if (action == FILE_ACTION_REMOVED) {
+			const bool isDirectory = this->forgetDirectory(relativePath);
+			if (ofVolume) {
+				const wstring mountPath = this->strConv.from_bytes(cMountPath);
+				this->listener(CHANGE_DELETED, mountPath, wstring(), this->forgetName(relativePath, cMountPath) || isDirectory);
+			}
+			return;
+		}
+		if (action == FILE_ACTION_ADDED || action == FILE_ACTION_RENAMED_NEW_NAME) {
+			this->learnDirectory(relativePath);
+		}
+		if (!ofVolume) {
+			if (action == FILE_ACTION_RENAMED_NEW_NAME && !this->renamedPath.empty()) {
+				// Renamed to a name which is not of the volume, it's gone from the mount.
+				this->listener(CHANGE_DELETED, this->renamedPath, wstring(), this->renamedDirectory);
+				this->renamedPath.clear();
+			}
+			return;
+		}
+
+		const wstring mountPath = this->strConv.from_bytes(cMountPath);
+		const wstring filePath = this->rootDirectory + L'\\' + relativePath;
+		switch (action) {
+		case FILE_ACTION_ADDED:
+			this->forgetName(relativePath, cMountPath);
+			this->listener(CHANGE_CREATED, mountPath, wstring(), this->directories.count(relativePath) != 0);
+			break;
+		case FILE_ACTION_MODIFIED: {
+			HANDLE file = CreateFileW(filePath.c_str(), FILE_READ_ATTRIBUTES,
+				FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+			if (file == INVALID_HANDLE_VALUE) {
+				break;
+			}
+			// A directory is modified by the changes of its entries, which are reported apart.
+			BY_HANDLE_FILE_INFORMATION info;
+			const bool known = GetFileInformationByHandle(file, &info) != FALSE;
+			if (known && (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+				this->directories.insert(relativePath);
+			}
+			const bool updated = known &&
+				!(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && EncFSFileState::invalidate(this->volume, file);
+			CloseHandle(file);
+			if (updated) {
+				this->listener(CHANGE_UPDATED, mountPath, wstring(), false);
+			}
+			break;
+		}
+		case FILE_ACTION_RENAMED_NEW_NAME:
+			this->forgetName(relativePath, cMountPath);
+			if (this->renamedPath.empty()) {
+				// Renamed from a name which is not of the volume.
+				this->listener(CHANGE_CREATED, mountPath, wstring(), this->directories.count(relativePath) != 0);
+			}
+			else {
+				this->listener(CHANGE_RENAMED, this->renamedPath, mountPath, this->renamedDirectory);
+				this->renamedPath.clear();
+			}
+			break;
+		}
+	}
+
+	void EncFSWatcher::overflowed() {
+		// Changes were lost, any listing or open file may be stale.
+		if (this->nameIndex) {
+			this->nameIndex->invalidateListings();
+		}
+		BY_HANDLE_FILE_INFORMATION rootInfo;
+		if (!GetFileInformationByHandle(this->directory, &rootInfo)) {
+			return;
+		}
+		vector<EncFSFileKey> keys;
+		EncFSFileState::getKeys(rootInfo.dwVolumeSerialNumber, keys);
+		for (const EncFSFileKey &key : keys) {
+			HANDLE file;
+			if (!key.path.empty()) {
+				// Keyed by path on volumes without persistent file IDs.
+				file = CreateFileW(key.path.c_str(), FILE_READ_ATTRIBUTES,
+					FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+			}
+			else {
+				FILE_ID_DESCRIPTOR id;
+				ZeroMemory(&id, sizeof id);
+				id.dwSize = sizeof id;
+				id.Type = FileIdType;
+				id.FileId.QuadPart = (LONGLONG)key.fileIndex;
+				file = OpenFileById(this->directory, &id, FILE_READ_ATTRIBUTES,
+					FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, 0);
+			}
+			if (file == INVALID_HANDLE_VALUE) {
+				continue;
+			}
+			EncFSFileState::invalidate(this->volume, file);
+			CloseHandle(file);
+		}
+	}
+
+	bool EncFSWatcher::learnDirectory(const wstring &relativePath) {
+		const DWORD attributes = GetFileAttributesW((this->rootDirectory + L'\\' + relativePath).c_str());
+		if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			this->directories.insert(relativePath);
+			return true;
+		}
+		// A file took the name of a directory removed while events were lost.
+		this->forgetDirectory(relativePath);
+		return false;
+	}
+
+	bool EncFSWatcher::forgetDirectory(const wstring &relativePath) {
+		const bool known = this->directories.erase(relativePath) != 0;
+		const wstring prefix = relativePath + L'\\';
+		auto it = this->directories.lower_bound(prefix);
+		while (it != this->directories.end() && it->compare(0, prefix.size(), prefix) == 0) {
+			it = this->directories.erase(it);
+		}
+		return known;
+	}
+
+	bool EncFSWatcher::toMountPath(const wstring &relativePath, string &mountPath) {
+		const string filePath = g_pathSeparator + this->strConv.to_bytes(relativePath);
+		if (this->volume.isReverse()) {
+			try {
+				this->volume.encodeFilePath(filePath, mountPath);
+			}
+			catch (const EncFSInvalidBlockException &ex) {
+				return false;
+			}
+			return true;
+		}
+		return this->volume.tryDecodeFilePath(filePath, mountPath);
+	}
+
+	bool EncFSWatcher::forgetName(const wstring &relativePath, const string &mountPath) {
+		// The index is only kept by normal volumes, where the mount path is the plain path.
+		if (!this->nameIndex) {
+			return false;
+		}
+		const wstring::size_type pos = relativePath.rfind(L'\\');
+		const string encodedFileName = this->strConv.to_bytes(pos == wstring::npos ? relativePath : relativePath.substr(pos + 1));
+		this->nameIndex->invalidateName(mountPath.substr(0, mountPath.rfind(g_pathSeparator)), encodedFileName);
+		return this->nameIndex->invalidateTree(mountPath);
+	}
+}
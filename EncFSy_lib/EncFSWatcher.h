@@ -0,0 +1,106 @@
+#pragma once
+#include <windows.h>
+
+#include "EncFSVolume.h"
+
+#include <string>
+#include <codecvt>
+#include <thread>
+#include <functional>
+#include <set>
+
+using namespace std;
+
+namespace EncFS
+{
+	enum EncFSChange {
+		CHANGE_CREATED,
+		CHANGE_DELETED,
+		CHANGE_UPDATED,
+		CHANGE_RENAMED
+	};
+
+	/**
+	Watches the underlying root directory for changes made by other programs, as sync clients and restores,
+	and forgets the names, listings and file states they affect, so the caches can keep entries until then.
+	Changes are passed to the listener with the paths of the mount, to notify Dokan.
+	Changes made through the mount are seen too; a file left as the last write through the mount keeps its state.
+	**/
+	class EncFSWatcher {
+	public:
+		/**
+		path and newPath are paths of the mount, newPath is empty but for renames.
+		Called on the watcher thread.
+		**/
+		typedef function<void(EncFSChange change, const wstring &path, const wstring &newPath, bool isDirectory)> Listener;
+
+	private:
+		/** Events of one ReadDirectoryChangesW call, more are lost and all caches of the root are forgotten. */
+		static const DWORD BUFFER_SIZE = 64 * 1024;
+
+		EncFSVolume &volume;
+		EncFSNameIndex* const nameIndex;
+		/** Underlying root directory, \\?\ prefixed. */
+		const wstring rootDirectory;
+		const Listener listener;
+
+		HANDLE directory;
+		HANDLE stopEvent;
+		thread worker;
+		wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+		/** Old name of a rename until its new name comes. */
+		wstring renamedPath;
+		bool renamedDirectory;
+		/**
+		Underlying paths relative to the root known as directories, as a removed path can't be asked.
+		Learned from the paths added, renamed or modified and from the parents of any reported path.
+		Only used by the watcher thread.
+		**/
+		set<wstring> directories;
+
+		void run();
+		void changed(DWORD action, const wstring &relativePath);
+		void overflowed();
+
+		/**
+		Path of the mount of the underlying path relative to the root. Returns false for names
+		which are not of the volume, as its configuration.
+		**/
+		bool toMountPath(const wstring &relativePath, string &mountPath);
+
+		/**
+		Forget the name in the index, the listing of its directory and, when it was a directory, the directories below.
+		Returns true when it was an indexed directory.
+		**/
+		bool forgetName(const wstring &relativePath, const string &mountPath);
+
+		/**
+		Remember whether the path which exists now is a directory. Returns true when it is.
+		**/
+		bool learnDirectory(const wstring &relativePath);
+
+		/**
+		Forget the path and the paths below. Returns true when it was known as a directory.
+		**/
+		bool forgetDirectory(const wstring &relativePath);
+
+	public:
+		EncFSWatcher(EncFSVolume &volume, EncFSNameIndex* nameIndex, const wstring &rootDirectory, const Listener &listener);
+		~EncFSWatcher() {
+			this->stop();
+		}
+
+		EncFSWatcher(const EncFSWatcher&) = delete;
+		EncFSWatcher& operator=(const EncFSWatcher&) = delete;
+
+		/**
+		Returns false with the last error set when the root can't be watched.
+		**/
+		bool start();
+
+		/**
+		Stop and wait for the watcher thread.
+		**/
+		void stop();
+	};
+}
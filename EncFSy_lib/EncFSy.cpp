@@ -30,20 +30,52 @@ THE SOFTWARE.
 #include <winbase.h>
 
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <codecvt>
 #include <mutex>
 #include <fstream>
 #include <streambuf>
 
+#include "EncFSDirectory.h"
 #include "EncFSFile.h"
+#include "EncFSIoStats.h"
+#include "EncFSMemory.h"
+#include "EncFSArena.h"
+#include "EncFSStream.h"
+#include "EncFSTrace.h"
+#include "EncFSWarmer.h"
+#include "EncFSWatcher.h"
 #include "EncFSUtils.hpp"
 
 using namespace std;
 
-EncFS::EncFSVolume encfs;
-EncFSOptions g_efo;
+struct EncFSContext {
+	EncFS::EncFSVolume volume;
+	EncFSOptions options;
+	EncFS::EncFSNameIndex nameIndex;
+	DOKAN_OPTIONS dokanOptions;
+	DOKAN_HANDLE instance;
+	/** Lists directories into the name index after mounting, NULL when not warming. */
+	unique_ptr<EncFS::EncFSWarmer> warmer;
+	/** Watches the root directory for changes by other programs, NULL when not watching. */
+	unique_ptr<EncFS::EncFSWatcher> watcher;
+};
+
+// Debug output is process wide, enabled when any loaded volume asks for it.
+static BOOLEAN g_UseStdErr = FALSE;
+static BOOLEAN g_DebugMode = FALSE;
+
+static inline EncFSContext& GetContext(PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFSContext &context = *(EncFSContext*)DokanFileInfo->DokanOptions->GlobalContext;
+	if (context.warmer) {
+		// The warmer yields to the requests.
+		context.warmer->touch();
+	}
+	return context;
+}
 
-mutex dirMoveLock;
+EncFS::EncFSMutex dirMoveLock("dirMoveLock");
 
 static void PrintF(LPCWSTR format, va_list argp) {
 	const WCHAR* outputString;
@@ -58,7 +90,7 @@ static void PrintF(LPCWSTR format, va_list argp) {
 	else {
 		outputString = format;
 	}
-	if (g_efo.g_UseStdErr) {
+	if (g_UseStdErr) {
 		fputws(L"EncFSy ", stderr);
 		fputws(outputString, stderr);
 	}
@@ -67,7 +99,7 @@ static void PrintF(LPCWSTR format, va_list argp) {
 	}
 	if (buffer)
 		_freea(buffer);
-	if (g_efo.g_UseStdErr)
+	if (g_UseStdErr)
 		fflush(stderr);
 }
 
@@ -79,7 +111,7 @@ static void MyPrint(LPCWSTR format, ...) {
 }
 
 static void DbgPrint(LPCWSTR format, ...) {
-	if (!g_efo.g_DebugMode) {
+	if (!g_DebugMode) {
 		return;
 	}
 	va_list argp;
@@ -95,7 +127,7 @@ static void ErrorPrint(LPCWSTR format, ...) {
 	va_end(argp);
 }
 
-static void ToWFilePath(wstring_convert<codecvt_utf8_utf16<wchar_t>>& strConv,
+static void ToWFilePath(EncFSContext &context, wstring_convert<codecvt_utf8_utf16<wchar_t>>& strConv,
 	string& cEncodedFileName, PWCHAR encodedFilePath) {
 	wstring wFilePath = strConv.from_bytes(cEncodedFileName);
 
@@ -103,9 +135,9 @@ static void ToWFilePath(wstring_convert<codecvt_utf8_utf16<wchar_t>>& strConv,
 	wcscpy_s(filePath, wFilePath.c_str());
 
 	wcsncpy_s(encodedFilePath, DOKAN_MAX_PATH, L"\\\\?\\", 4);
-	wcsncat_s(encodedFilePath, DOKAN_MAX_PATH, g_efo.RootDirectory, wcslen(g_efo.RootDirectory));
-	size_t unclen = wcslen(g_efo.UNCName);
-	if (unclen > 0 && _wcsnicmp(filePath, g_efo.UNCName, unclen) == 0) {
+	wcsncat_s(encodedFilePath, DOKAN_MAX_PATH, context.options.RootDirectory, wcslen(context.options.RootDirectory));
+	size_t unclen = wcslen(context.options.UNCName);
+	if (unclen > 0 && _wcsnicmp(filePath, context.options.UNCName, unclen) == 0) {
 		if (_wcsnicmp(filePath + unclen, L".", 1) != 0) {
 			wcsncat_s(encodedFilePath, DOKAN_MAX_PATH, filePath + unclen,
 				wcslen(filePath) - unclen);
@@ -117,6 +149,10 @@ static void ToWFilePath(wstring_convert<codecvt_utf8_utf16<wchar_t>>& strConv,
 
 }
 
+static inline uint64_t ToFileTime(const FILETIME &time) {
+	return ((uint64_t)time.dwHighDateTime << 32) | time.dwLowDateTime;
+}
+
 static bool FileExists(PWCHAR path) {
 	if (GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES) {
 		return true;
@@ -131,34 +167,31 @@ static bool FileExists(PWCHAR path) {
 /**
  Convert virtual path to real path.
 */
-static void GetFilePath(PWCHAR encodedFilePath, LPCWSTR plainFilePath, bool createNew) {
+static void GetFilePath(EncFSContext &context, PWCHAR encodedFilePath, LPCWSTR plainFilePath, bool createNew) {
 	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
 	wstring wFilePath(plainFilePath);
 	string cFilePath = strConv.to_bytes(wFilePath);
 
 	string cEncodedFileName;
-	if (encfs.isReverse()) {
-		try {
-			encfs.decodeFilePath(cFilePath, cEncodedFileName);
-		}
-		catch (const EncFS::EncFSInvalidBlockException &ex) {
+	if (context.volume.isReverse()) {
+		// Names which were not listed by the volume, as desktop.ini probed by Explorer, are looked up as they are.
+		if (!context.volume.tryDecodeFilePath(cFilePath, cEncodedFileName)) {
 			cEncodedFileName = cFilePath;
 		}
-		ToWFilePath(strConv, cEncodedFileName, encodedFilePath);
+		ToWFilePath(context, strConv, cEncodedFileName, encodedFilePath);
 	}
 	else {
-		encfs.encodeFilePath(cFilePath, cEncodedFileName);
-		ToWFilePath(strConv, cEncodedFileName, encodedFilePath);
+		context.volume.encodeFilePath(cFilePath, cEncodedFileName);
+		ToWFilePath(context, strConv, cEncodedFileName, encodedFilePath);
 
 		// case insensitive
-		if (g_efo.CaseInsensitive && !FileExists(encodedFilePath)) {
+		if (context.options.CaseInsensitive && !FileExists(encodedFilePath)) {
 			WCHAR filePath[DOKAN_MAX_PATH];
 			bool pathChanged = false;
 			string::size_type pos1 = 1;
 			string::size_type pos2;
 			string encPath;
 			string path;
-			WIN32_FIND_DATAW find;
 			for (;;) {
 				pos2 = cFilePath.find(EncFS::g_pathSeparator, pos1);
 				path.clear();
@@ -172,44 +205,61 @@ static void GetFilePath(PWCHAR encodedFilePath, LPCWSTR plainFilePath, bool crea
 					path = cFilePath.substr(0, pos2);
 				}
 				encPath.clear();
-				encfs.encodeFilePath(path, encPath);
+				context.volume.encodeFilePath(path, encPath);
 				string fileName = path.substr(pos1);
 				wstring wsFileName = strConv.from_bytes(fileName);
-				ToWFilePath(strConv, encPath, filePath);
+				ToWFilePath(context, strConv, encPath, filePath);
 				if (!FileExists(filePath)) {
 					bool found = false;
 					string::size_type pos = encPath.find_last_of(EncFS::g_pathSeparator);
 					encPath = encPath.substr(0, pos);
-					path = encPath + EncFS::g_pathSeparator + "*.*";
-					ToWFilePath(strConv, path, filePath);
-					ZeroMemory(&find, sizeof(WIN32_FIND_DATAW));
-					HANDLE hFind = FindFirstFileW(filePath, &find);
-					if (hFind == INVALID_HANDLE_VALUE) {
-						break;
-					}
-					do {
-						if (wcscmp(find.cFileName, L"..") == 0 ||
-							wcscmp(find.cFileName, L".") == 0) {
-							continue;
-						}
-						wstring wcFileName(find.cFileName);
-						string ccFileName = strConv.to_bytes(wcFileName);
-						string cPlainFileName;
-						try {
-							encfs.decodeFileName(ccFileName, encPath, cPlainFileName);
-						}
-						catch (const EncFS::EncFSInvalidBlockException& ex) {
-							continue;
+
+					// A listing of the directory which was not modified since has all the names.
+					EncFS::EncFSIndexLookup lookup = EncFS::INDEX_UNKNOWN;
+					EncFS::EncFSNameIndex* index = context.volume.getNameIndex();
+					if (index) {
+						WIN32_FILE_ATTRIBUTE_DATA dirData;
+						ToWFilePath(context, strConv, encPath, filePath);
+						if (GetFileAttributesExW(filePath, GetFileExInfoStandard, &dirData)) {
+							string cPlainFileName;
+							lookup = index->findFoldedName(cFilePath.substr(0, pos1 - 1), ToFileTime(dirData.ftLastWriteTime),
+								EncFS::EncFSNameIndex::foldName(wsFileName), cPlainFileName);
+							if (lookup == EncFS::INDEX_FOUND) {
+								cFilePath.replace(pos1, pos2 - pos1, cPlainFileName.c_str());
+								pathChanged = true;
+								found = true;
+							}
 						}
-						wstring wFileName = strConv.from_bytes(cPlainFileName);
-						if (lstrcmpiW(wsFileName.c_str(), wFileName.c_str()) == 0) {
-							cFilePath.replace(pos1, pos2 - pos1, cPlainFileName.c_str());
-							pathChanged = true;
-							found = true;
+					}
+
+					if (lookup == EncFS::INDEX_UNKNOWN) {
+						ToWFilePath(context, strConv, encPath, filePath);
+						EncFS::EncFSDirectoryReader reader(filePath);
+						if (!reader.isOpen()) {
 							break;
 						}
-					} while (FindNextFileW(hFind, &find) != 0);
-					FindClose(hFind);
+						vector<WIN32_FIND_DATAW> batch;
+						vector<string> encodedNames, plainNames;
+						while (!found && reader.next(batch)) {
+							encodedNames.clear();
+							for (const WIN32_FIND_DATAW &entry : batch) {
+								encodedNames.push_back(EncFS::EncFSDirectoryReader::isDots(entry) ? "" : strConv.to_bytes(entry.cFileName));
+							}
+							context.volume.decodeFileNames(encodedNames, cFilePath.substr(0, pos1 - 1), plainNames);
+							for (const string &cPlainFileName : plainNames) {
+								if (cPlainFileName.empty()) {
+									continue;
+								}
+								wstring wFileName = strConv.from_bytes(cPlainFileName);
+								if (lstrcmpiW(wsFileName.c_str(), wFileName.c_str()) == 0) {
+									cFilePath.replace(pos1, pos2 - pos1, cPlainFileName.c_str());
+									pathChanged = true;
+									found = true;
+									break;
+								}
+							}
+						}
+					}
 					if (!found) {
 						pathChanged = false;
 						break;
@@ -222,8 +272,8 @@ static void GetFilePath(PWCHAR encodedFilePath, LPCWSTR plainFilePath, bool crea
 			}
 			if (pathChanged) {
 				cEncodedFileName.clear();
-				encfs.encodeFilePath(cFilePath, cEncodedFileName);
-				ToWFilePath(strConv, cEncodedFileName, encodedFilePath);
+				context.volume.encodeFilePath(cFilePath, cEncodedFileName);
+				ToWFilePath(context, strConv, cEncodedFileName, encodedFilePath);
 			}
 		}
 	}
@@ -240,7 +290,7 @@ static void PrintUserName(PDOKAN_FILE_INFO DokanFileInfo) {
 	PTOKEN_USER tokenUser;
 	SID_NAME_USE snu;
 
-	if (!g_efo.g_DebugMode)
+	if (!g_DebugMode)
 		return;
 
 	handle = DokanOpenRequestorToken(DokanFileInfo);
@@ -278,6 +328,8 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 	ACCESS_MASK DesiredAccess, ULONG FileAttributes,
 	ULONG ShareAccess, ULONG CreateDisposition,
 	ULONG CreateOptions, PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_CREATE_FILE, FileName);
+	EncFSContext &context = GetContext(DokanFileInfo);
 
 	WCHAR filePath[DOKAN_MAX_PATH];
 	HANDLE handle;
@@ -300,7 +352,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 		DesiredAccess, FileAttributes, CreateOptions, CreateDisposition,
 		&genericDesiredAccess, &fileAttributesAndFlags, &creationDisposition);
 
-	GetFilePath(filePath, FileName,
+	GetFilePath(context, filePath, FileName,
 		creationDisposition == CREATE_NEW || creationDisposition == CREATE_ALWAYS);
 
 	DbgPrint(L"CreateFile : %s ; %s\n", FileName, filePath);
@@ -400,7 +452,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 	EncFSCheckFlag(fileAttributesAndFlags, SECURITY_EFFECTIVE_ONLY);
 	EncFSCheckFlag(fileAttributesAndFlags, SECURITY_SQOS_PRESENT);
 
-	if (!g_efo.CaseInsensitive) {
+	if (!context.options.CaseInsensitive) {
 		fileAttributesAndFlags |= FILE_FLAG_POSIX_SEMANTICS;
 	}
 
@@ -423,7 +475,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 		DbgPrint(L"\tUNKNOWN creationDisposition!\n");
 	}
 
-	if (g_efo.g_ImpersonateCallerUser) {
+	if (context.options.g_ImpersonateCallerUser) {
 		userTokenHandle = DokanOpenRequestorToken(DokanFileInfo);
 
 		if (userTokenHandle == INVALID_HANDLE_VALUE) {
@@ -437,7 +489,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 		if (creationDisposition == CREATE_NEW ||
 			creationDisposition == OPEN_ALWAYS) {
 
-			if (g_efo.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
+			if (context.options.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
 				// if g_ImpersonateCallerUser option is on, call the ImpersonateLoggedOnUser function.
 				if (!ImpersonateLoggedOnUser(userTokenHandle)) {
 					// handle the error if failed to impersonate
@@ -456,7 +508,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 				}
 			}
 
-			if (g_efo.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
+			if (context.options.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
 				// Clean Up operation for impersonate
 				DWORD lastError = GetLastError();
 				if (status != STATUS_SUCCESS) //Keep the handle open for CreateFile
@@ -474,7 +526,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 				return STATUS_NOT_A_DIRECTORY;
 			}
 
-			if (g_efo.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
+			if (context.options.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
 				// if g_ImpersonateCallerUser option is on, call the ImpersonateLoggedOnUser function.
 				if (!ImpersonateLoggedOnUser(userTokenHandle)) {
 					// handle the error if failed to impersonate
@@ -488,7 +540,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 					&securityAttrib, OPEN_EXISTING,
 					fileAttributesAndFlags | FILE_FLAG_BACKUP_SEMANTICS, NULL);
 
-			if (g_efo.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
+			if (context.options.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
 				// Clean Up operation for impersonate
 				DWORD lastError = GetLastError();
 				CloseHandle(userTokenHandle);
@@ -503,7 +555,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 			}
 			else {
 				DokanFileInfo->Context =
-					(ULONG64)new EncFS::EncFSFile(handle, false); // save the file handle in Context
+					(ULONG64)new EncFS::EncFSFile(context.volume, handle, false); // save the file handle in Context
 																  // Open succeed but we need to inform the driver
 																  // that the dir open and not created by returning STATUS_OBJECT_NAME_COLLISION
 				if (creationDisposition == OPEN_ALWAYS &&
@@ -537,7 +589,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 		if (creationDisposition == TRUNCATE_EXISTING)
 			genericDesiredAccess |= GENERIC_WRITE;
 
-		if (g_efo.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
+		if (context.options.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
 			// if g_ImpersonateCallerUser option is on, call the ImpersonateLoggedOnUser function.
 			if (!ImpersonateLoggedOnUser(userTokenHandle)) {
 				// handle the error if failed to impersonate
@@ -581,7 +633,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 			NULL);                  // template file handle
 		DbgPrint(L"handle = %ld\n", handle);
 
-		if (g_efo.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
+		if (context.options.g_ImpersonateCallerUser && userTokenHandle != INVALID_HANDLE_VALUE) {
 			// Clean Up operation for impersonate
 			DWORD lastError = GetLastError();
 			CloseHandle(userTokenHandle);
@@ -603,8 +655,16 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 				SetFileAttributesW(filePath, fileAttributesAndFlags | fileAttr);
 			}
 
-			DokanFileInfo->Context =
-				(ULONG64)new EncFS::EncFSFile(handle, true); // save the file handle in Context
+			EncFS::EncFSFile* encfsFile = new EncFS::EncFSFile(context.volume, handle, true);
+			DokanFileInfo->Context = (ULONG64)encfsFile; // save the file handle in Context
+
+			// Other handles may still cache the header and size of the truncated file.
+			if (!context.volume.isReverse() && (creationDisposition == TRUNCATE_EXISTING ||
+				(creationDisposition == CREATE_ALWAYS && GetLastError() == ERROR_ALREADY_EXISTS))) {
+				DWORD lastError = GetLastError();
+				encfsFile->invalidateState(FileName);
+				SetLastError(lastError);
+			}
 
 			if (creationDisposition == OPEN_ALWAYS ||
 				creationDisposition == CREATE_ALWAYS) {
@@ -628,6 +688,7 @@ EncFSCreateFile(LPCWSTR FileName, PDOKAN_IO_SECURITY_CONTEXT SecurityContext,
 
 static void DOKAN_CALLBACK EncFSCloseFile(LPCWSTR FileName,
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_CLOSE_FILE, FileName);
 	lock_guard<decltype(dirMoveLock)> dlock(dirMoveLock);
 
 	if (DokanFileInfo->Context) {
@@ -649,6 +710,8 @@ static void DOKAN_CALLBACK EncFSCloseFile(LPCWSTR FileName,
 
 static void DOKAN_CALLBACK EncFSCleanup(LPCWSTR FileName,
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_CLEANUP, FileName);
+	EncFSContext &context = GetContext(DokanFileInfo);
 	lock_guard<decltype(dirMoveLock)> dlock(dirMoveLock);
 	if (DokanFileInfo->Context) {
 		DbgPrint(L"Cleanup: %s\n", FileName);
@@ -666,7 +729,7 @@ static void DOKAN_CALLBACK EncFSCleanup(LPCWSTR FileName,
 
 	if (DokanFileInfo->DeleteOnClose) {
 		WCHAR filePath[DOKAN_MAX_PATH];
-		GetFilePath(filePath, FileName, false);
+		GetFilePath(context, filePath, FileName, false);
 		// Should already be deleted by CloseHandle
 		// if open with FILE_FLAG_DELETE_ON_CLOSE
 		DbgPrint(L"\tDeleteOnClose\n");
@@ -696,13 +759,16 @@ static NTSTATUS DOKAN_CALLBACK EncFSReadFile(LPCWSTR FileName, LPVOID Buffer,
 	LPDWORD ReadLength,
 	LONGLONG Offset,
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_READ_FILE, FileName);
+	EncFS::EncFSIoStats::count(EncFS::IO_LOGICAL_READ, BufferLength);
+	EncFSContext &context = GetContext(DokanFileInfo);
 	ULONG offset = (ULONG)Offset;
 
 	EncFS::EncFSFile* encfsFile;
 	BOOL opened = FALSE;
 	if (!DokanFileInfo->Context) {
 		WCHAR filePath[DOKAN_MAX_PATH];
-		GetFilePath(filePath, FileName, false);
+		GetFilePath(context, filePath, FileName, false);
 		DbgPrint(L"\tinvalid handle, cleanuped?\n");
 		HANDLE handle = CreateFileW(filePath, GENERIC_READ, FILE_SHARE_READ, NULL,
 			OPEN_EXISTING, 0, NULL);
@@ -711,7 +777,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSReadFile(LPCWSTR FileName, LPVOID Buffer,
 			ErrorPrint(L"\tCreateFile error : %d\n", error);
 			return DokanNtStatusFromWin32(error);
 		}
-		encfsFile = new EncFS::EncFSFile(handle, true);
+		encfsFile = new EncFS::EncFSFile(context.volume, handle, true);
 		opened = TRUE;
 	}
 	else {
@@ -723,7 +789,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSReadFile(LPCWSTR FileName, LPVOID Buffer,
 	int32_t readLen;
 
 	bool plain = false;
-	if (encfs.altStream) {
+	if (context.volume.altStream) {
 		// exclude Dropbox attributes
 		const LPCWSTR suffix = L":com.dropbox.attrs:$DATA";
 		size_t str_len = wcslen(FileName);
@@ -733,9 +799,9 @@ static NTSTATUS DOKAN_CALLBACK EncFSReadFile(LPCWSTR FileName, LPVOID Buffer,
 	}
 
 	if (!plain) {
-		if (encfs.isReverse()) {
+		if (context.volume.isReverse()) {
 			WCHAR filePath[DOKAN_MAX_PATH];
-			GetFilePath(filePath, FileName, false);
+			GetFilePath(context, filePath, FileName, false);
 			size_t len = wcslen(filePath);
 			if (len >= 12 && wcscmp(filePath + len - 12, L"\\.encfs6.xml") == 0) {
 				plain = true;
@@ -793,10 +859,23 @@ static NTSTATUS DOKAN_CALLBACK EncFSWriteFile(LPCWSTR FileName, LPCVOID Buffer,
 	LPDWORD NumberOfBytesWritten,
 	LONGLONG Offset,
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_WRITE_FILE, FileName);
+	EncFS::EncFSIoStats::count(EncFS::IO_LOGICAL_WRITTEN, NumberOfBytesToWrite);
+	EncFSContext &context = GetContext(DokanFileInfo);
 
 	DbgPrint(L"WriteFile : %s, offset %I64d, length %d\n", FileName, Offset,
 		NumberOfBytesToWrite);
 
+	bool plain = false;
+	if (context.volume.altStream) {
+		// exclude Dropbox attributes
+		const LPCWSTR suffix = L":com.dropbox.attrs:$DATA";
+		size_t str_len = wcslen(FileName);
+		size_t suffix_len = wcslen(suffix);
+		plain = str_len >= suffix_len &&
+			0 == wcscmp(FileName + str_len - suffix_len, suffix);
+	}
+
 	// reopen the file
 	UINT64 fileSize = 0;
 	EncFS::EncFSFile* encfsFile;
@@ -804,7 +883,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSWriteFile(LPCWSTR FileName, LPCVOID Buffer,
 	{
 		if (!DokanFileInfo->Context) {
 			WCHAR filePath[DOKAN_MAX_PATH];
-			GetFilePath(filePath, FileName, false);
+			GetFilePath(context, filePath, FileName, false);
 			DbgPrint(L"\tinvalid handle, cleanuped?\n");
 			HANDLE handle = CreateFileW(filePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
 				OPEN_EXISTING, 0, NULL);
@@ -813,23 +892,40 @@ static NTSTATUS DOKAN_CALLBACK EncFSWriteFile(LPCWSTR FileName, LPCVOID Buffer,
 				ErrorPrint(L"\tCreateFile error : %d\n", error);
 				return DokanNtStatusFromWin32(error);
 			}
-			encfsFile = new EncFS::EncFSFile(handle, false);
+			encfsFile = new EncFS::EncFSFile(context.volume, handle, false);
 			opened = TRUE;
 		}
 		else {
 			encfsFile = (EncFS::EncFSFile*)DokanFileInfo->Context;
 		}
 
-		LARGE_INTEGER li;
-		if (GetFileSizeEx(encfsFile->getHandle(), &li)) {
-			fileSize = li.QuadPart;
+		if (plain) {
+			LARGE_INTEGER li;
+			if (GetFileSizeEx(encfsFile->getHandle(), &li)) {
+				fileSize = context.volume.toDecodedLength(li.QuadPart);
+			}
+			else {
+				DWORD error = GetLastError();
+				ErrorPrint(L"GetFileSize error code = %d\n", error);
+				if (opened) {
+					delete encfsFile;
+				}
+				return DokanNtStatusFromWin32(error);
+			}
 		}
 		else {
-			DWORD error = GetLastError();
-			ErrorPrint(L"GetFileSize error code = %d\n", error);
-			return DokanNtStatusFromWin32(error);
+			// The size is shared by all handles to the file.
+			size_t size;
+			if (!encfsFile->getFileSize(FileName, &size)) {
+				DWORD error = GetLastError();
+				ErrorPrint(L"GetFileSize error code = %d\n", error);
+				if (opened) {
+					delete encfsFile;
+				}
+				return DokanNtStatusFromWin32(error);
+			}
+			fileSize = size;
 		}
-		fileSize = encfs.toDecodedLength(fileSize);
 	}
 
 	size_t off;
@@ -861,19 +957,9 @@ static NTSTATUS DOKAN_CALLBACK EncFSWriteFile(LPCWSTR FileName, LPCVOID Buffer,
 		off = Offset;
 	}
 
-	bool plain = false;
-	if (encfs.altStream) {
-		// exclude Dropbox attributes
-		const LPCWSTR suffix = L":com.dropbox.attrs:$DATA";
-		size_t str_len = wcslen(FileName);
-		size_t suffix_len = wcslen(suffix);
-		plain = str_len >= suffix_len &&
-			0 == wcscmp(FileName + str_len - suffix_len, suffix);
-	}
-
 	int32_t writtenLen;
 	if (!plain) {
-		writtenLen = encfsFile->write(FileName, fileSize, (char*)Buffer, off, NumberOfBytesToWrite);
+		writtenLen = encfsFile->write(FileName, (char*)Buffer, off, NumberOfBytesToWrite);
 		if (writtenLen == -1) {
 			DWORD error = GetLastError();
 			ErrorPrint(L"\twrite error = %u, buffer length = %d, write length = %d\n",
@@ -918,35 +1004,83 @@ static NTSTATUS DOKAN_CALLBACK EncFSWriteFile(LPCWSTR FileName, LPCVOID Buffer,
 	return STATUS_SUCCESS;
 }
 
+/**
+Pass an entry to Dokan with its plain name and size.
+*/
+static void FillFindEntry(EncFSContext &context, wstring_convert<codecvt_utf8_utf16<wchar_t>>& strConv, WIN32_FIND_DATAW &findData,
+	const string &cPlainFileName, PFillFindData FillFindData, PDOKAN_FILE_INFO DokanFileInfo) {
+	wstring wPlainFileName = strConv.from_bytes(cPlainFileName);
+	wcscpy_s(findData.cFileName, wPlainFileName.c_str());
+	findData.cAlternateFileName[0] = 0;
+
+	// Calculate file size
+	int64_t size = (findData.nFileSizeHigh * ((int64_t)MAXDWORD + 1)) + findData.nFileSizeLow;
+	size = context.volume.isReverse() ? context.volume.toEncodedLength(size) : context.volume.toDecodedLength(size);
+	findData.nFileSizeLow = size & MAXDWORD;
+	findData.nFileSizeHigh = (size >> 32) & MAXDWORD;
+
+	FillFindData(&findData, DokanFileInfo);
+}
+
+/**
+Decode the names of the entries at once and pass the decodable ones to Dokan. The batch is emptied.
+*/
+static void FillFindBatch(EncFSContext &context, wstring_convert<codecvt_utf8_utf16<wchar_t>>& strConv, const string &cPath,
+	vector<WIN32_FIND_DATAW> &batch, PFillFindData FillFindData, PDOKAN_FILE_INFO DokanFileInfo,
+	vector<pair<string, string>> *listing) {
+	if (batch.empty()) {
+		return;
+	}
+	vector<string> encodedNames;
+	encodedNames.reserve(batch.size());
+	for (const auto &findData : batch) {
+		encodedNames.push_back(strConv.to_bytes(findData.cFileName));
+	}
+	vector<string> plainNames;
+	context.volume.decodeFileNames(encodedNames, cPath, plainNames);
+
+	for (size_t i = 0; i < batch.size(); ++i) {
+		const string &cPlainFileName = plainNames[i];
+		if (cPlainFileName.empty()) {
+			continue;
+		}
+		if (listing && cPlainFileName != "." && cPlainFileName != "..") {
+			listing->emplace_back(encodedNames[i], cPlainFileName);
+		}
+		FillFindEntry(context, strConv, batch[i], cPlainFileName, FillFindData, DokanFileInfo);
+	}
+	batch.clear();
+}
+
 static NTSTATUS DOKAN_CALLBACK
 EncFSFindFiles(LPCWSTR FileName,
 	PFillFindData FillFindData, // function pointer
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_FIND_FILES, FileName);
+	EncFSContext &context = GetContext(DokanFileInfo);
 	WCHAR filePath[DOKAN_MAX_PATH];
-	size_t fileLen;
-	HANDLE hFind;
-	WIN32_FIND_DATAW findData;
 	DWORD error;
 	int count = 0;
 
 
-	GetFilePath(filePath, FileName, false);
+	GetFilePath(context, filePath, FileName, false);
 
 	DbgPrint(L"FindFiles : %s ; %s\n", FileName, filePath);
 
-	fileLen = wcslen(filePath);
-	if (filePath[fileLen - 1] != L'\\') {
-		filePath[fileLen++] = L'\\';
+	// The listing completes the name index for case insensitive lookups until the directory is modified.
+	EncFS::EncFSNameIndex* index = context.volume.isReverse() ? NULL : context.volume.getNameIndex();
+	uint64_t listedTime = 0;
+	vector<pair<string, string>> listing;
+	if (index) {
+		WIN32_FILE_ATTRIBUTE_DATA dirData;
+		if (GetFileAttributesExW(filePath, GetFileExInfoStandard, &dirData)) {
+			listedTime = ToFileTime(dirData.ftLastWriteTime);
+		}
 	}
-	if (fileLen + 1 >= DOKAN_MAX_PATH)
-		return STATUS_BUFFER_OVERFLOW;
-	filePath[fileLen] = L'*';
-	filePath[fileLen + 1] = L'\0';
-
-	hFind = FindFirstFileW(filePath, &findData);
 
-	if (hFind == INVALID_HANDLE_VALUE) {
-		error = GetLastError();
+	EncFS::EncFSDirectoryReader reader(filePath);
+	if (!reader.isOpen()) {
+		error = reader.getError();
 		ErrorPrint(L"FindFiles invalid file handle. Error is %u\n\n", error);
 		return DokanNtStatusFromWin32(error);
 	}
@@ -957,53 +1091,48 @@ EncFSFindFiles(LPCWSTR FileName,
 
 	// Root folder does not have . and .. folder - we remove them
 	BOOLEAN rootFolder = (wcscmp(FileName, L"\\") == 0);
-	do {
-		if (!rootFolder || (wcscmp(findData.cFileName, L".") != 0 &&
-			wcscmp(findData.cFileName, L"..") != 0)) {
-
-			// Decrypt file name
+	vector<WIN32_FIND_DATAW> batch;
+	unique_ptr<EncFS::EncFSVolume::DirectoryContext> dir;
+	while (reader.next(batch)) {
+		count += (int)batch.size();
+		if (rootFolder) {
+			batch.erase(remove_if(batch.begin(), batch.end(), EncFS::EncFSDirectoryReader::isDots), batch.end());
+		}
+		if (!context.volume.isReverse()) {
+			FillFindBatch(context, strConv, cPath, batch, FillFindData, DokanFileInfo, listedTime != 0 ? &listing : NULL);
+			continue;
+		}
+		if (!dir) {
+			dir.reset(new EncFS::EncFSVolume::DirectoryContext(context.volume, cPath));
+		}
+		for (WIN32_FIND_DATAW &findData : batch) {
+			// Encrypt when reverse mode.
 			wstring wcFileName(findData.cFileName);
 			string ccFileName = strConv.to_bytes(wcFileName);
 			string cPlainFileName;
 			try {
-				if (encfs.isReverse()) {
-					// Encrypt when reverse mode.
-					if (wcscmp(findData.cFileName, L".encfs6.xml") != 0) {
-						encfs.encodeFileName(ccFileName, cPath, cPlainFileName);
-					}
-					else {
-						cPlainFileName = ccFileName;
-					}
+				if (wcscmp(findData.cFileName, L".encfs6.xml") != 0) {
+					dir->encodeFileName(ccFileName, cPlainFileName);
 				}
 				else {
-					encfs.decodeFileName(ccFileName, cPath, cPlainFileName);
+					cPlainFileName = ccFileName;
 				}
 			}
 			catch (const EncFS::EncFSInvalidBlockException &ex) {
 				continue;
 			}
-			wstring wPlainFileName = strConv.from_bytes(cPlainFileName);
-			wcscpy_s(findData.cFileName, wPlainFileName.c_str());
-			findData.cAlternateFileName[0] = 0;
-
-			// Calculate file size
-			int64_t size = (findData.nFileSizeHigh * ((int64_t)MAXDWORD + 1)) + findData.nFileSizeLow;
-			size = encfs.isReverse() ? encfs.toEncodedLength(size) : encfs.toDecodedLength(size);
-			findData.nFileSizeLow = size & MAXDWORD;
-			findData.nFileSizeHigh = (size >> 32) & MAXDWORD;
-
-			FillFindData(&findData, DokanFileInfo);
+			FillFindEntry(context, strConv, findData, cPlainFileName, FillFindData, DokanFileInfo);
 		}
-		count++;
-	} while (FindNextFileW(hFind, &findData) != 0);
-
-	error = GetLastError();
-	FindClose(hFind);
+	}
 
-	if (error != ERROR_NO_MORE_FILES) {
+	error = reader.getError();
+	if (error != ERROR_SUCCESS) {
 		ErrorPrint(L"\tFindNextFile error. Error is %u\n\n", error);
 		return DokanNtStatusFromWin32(error);
 	}
+	if (listedTime != 0) {
+		index->setListing(cPath, listedTime, listing);
+	}
 
 	DbgPrint(L"\tFindFiles return %d entries in %s\n\n", count, filePath);
 
@@ -1012,13 +1141,12 @@ EncFSFindFiles(LPCWSTR FileName,
 
 static NTSTATUS DOKAN_CALLBACK
 EncFSDeleteDirectory(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_DELETE_DIRECTORY, FileName);
+	EncFSContext &context = GetContext(DokanFileInfo);
 	WCHAR filePath[DOKAN_MAX_PATH];
-	HANDLE hFind;
-	WIN32_FIND_DATAW findData;
-	size_t fileLen;
 
 	ZeroMemory(filePath, sizeof(filePath));
-	GetFilePath(filePath, FileName, false);
+	GetFilePath(context, filePath, FileName, false);
 
 	DbgPrint(L"DeleteDirectory %s ; %s - %d\n", FileName, filePath,
 		DokanFileInfo->DeleteOnClose);
@@ -1027,37 +1155,26 @@ EncFSDeleteDirectory(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
 		//Dokan notify that the file is requested not to be deleted.
 		return STATUS_SUCCESS;
 
-	fileLen = wcslen(filePath);
-	if (filePath[fileLen - 1] != L'\\') {
-		filePath[fileLen++] = L'\\';
-	}
-	if (fileLen + 1 >= DOKAN_MAX_PATH)
-		return STATUS_BUFFER_OVERFLOW;
-	filePath[fileLen] = L'*';
-	filePath[fileLen + 1] = L'\0';
-
-	hFind = FindFirstFileW(filePath, &findData);
-
-	if (hFind == INVALID_HANDLE_VALUE) {
-		DWORD error = GetLastError();
+	// The first entries tell whether it is empty.
+	EncFS::EncFSDirectoryReader reader(filePath);
+	if (!reader.isOpen()) {
+		DWORD error = reader.getError();
 		ErrorPrint(L"DeleteDirectory error code = %d\n\n", error);
 		return DokanNtStatusFromWin32(error);
 	}
 
-	do {
-		if (wcscmp(findData.cFileName, L"..") != 0 &&
-			wcscmp(findData.cFileName, L".") != 0) {
-			FindClose(hFind);
-			DbgPrint(L"\tDirectory is not empty: %s\n", findData.cFileName);
-			return STATUS_DIRECTORY_NOT_EMPTY;
+	vector<WIN32_FIND_DATAW> batch;
+	while (reader.next(batch, 3)) {
+		for (const WIN32_FIND_DATAW &findData : batch) {
+			if (!EncFS::EncFSDirectoryReader::isDots(findData)) {
+				DbgPrint(L"\tDirectory is not empty: %s\n", findData.cFileName);
+				return STATUS_DIRECTORY_NOT_EMPTY;
+			}
 		}
-	} while (FindNextFileW(hFind, &findData) != 0);
-
-	DWORD error = GetLastError();
-
-	FindClose(hFind);
+	}
 
-	if (error != ERROR_NO_MORE_FILES) {
+	DWORD error = reader.getError();
+	if (error != ERROR_SUCCESS) {
 		ErrorPrint(L"DeleteDirectory error code = %d\n\n", error);
 		return DokanNtStatusFromWin32(error);
 	}
@@ -1065,10 +1182,7 @@ EncFSDeleteDirectory(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
 	return STATUS_SUCCESS;
 }
 
-static NTSTATUS changeIVRecursive(LPCWSTR newFilePath, const string cOldPlainDirPath, const string cNewPlainDirPath) {
-	WCHAR findPath[DOKAN_MAX_PATH];
-	wcscpy_s(findPath, newFilePath);
-	wcscat_s(findPath, L"\\*.*");
+static NTSTATUS changeIVRecursive(EncFSContext &context, LPCWSTR newFilePath, const string cOldPlainDirPath, const string cNewPlainDirPath) {
 	WCHAR oldPath[DOKAN_MAX_PATH];
 	wcscpy_s(oldPath, newFilePath);
 	wcscat_s(oldPath, L"\\");
@@ -1078,75 +1192,75 @@ static NTSTATUS changeIVRecursive(LPCWSTR newFilePath, const string cOldPlainDir
 
 	DbgPrint(L"ChangeIV: %s -> %s ; %s -> %s\n", cOldPlainDirPath, cNewPlainDirPath, newPath, oldPath);
 
-	WIN32_FIND_DATAW find;
-	ZeroMemory(&find, sizeof(WIN32_FIND_DATAW));
-	HANDLE findHandle = FindFirstFileW(findPath, &find);
-	if (findHandle == INVALID_HANDLE_VALUE) {
-		DWORD error = GetLastError();
-		return DokanNtStatusFromWin32(error);
+	EncFS::EncFSDirectoryReader reader(newFilePath);
+	if (!reader.isOpen()) {
+		return DokanNtStatusFromWin32(reader.getError());
 	}
 	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
-	do {
-		if (find.cFileName[0] == L'.') {
-			continue;
-		}
-		wstring wOldName(find.cFileName);
-		string cOldName = strConv.to_bytes(wOldName);
-		string plainName;
-		try {
-			encfs.decodeFileName(cOldName, cOldPlainDirPath, plainName);
-		}
-		catch (const EncFS::EncFSInvalidBlockException &ex) {
-			continue;
-		}
-		string cNewName;
-		encfs.encodeFileName(plainName, cNewPlainDirPath, cNewName);
-		wstring wNewName = strConv.from_bytes(cNewName);
-		wcscpy_s((wchar_t*)&oldPath[oldPathLen], DOKAN_MAX_PATH - oldPathLen, find.cFileName);
-		wcscpy_s((wchar_t*)&newPath[oldPathLen], DOKAN_MAX_PATH - oldPathLen, wNewName.c_str());
-		//PrintF(L"A %s %s\n", oldPath, newPath);
-		if (encfs.isChainedNameIV()) {
-			if (!MoveFileW(oldPath, newPath)) {
-				FindClose(findHandle);
-				DWORD error = GetLastError();
-				return DokanNtStatusFromWin32(error);
-			}
-		}
-		string cPlainOldPath = cOldPlainDirPath + "\\" + plainName;
-		wstring wPlainOldPath = strConv.from_bytes(cPlainOldPath);
-		string cPlainNewPath = cNewPlainDirPath + "\\" + plainName;
-		wstring wPlainNewPath = strConv.from_bytes(cPlainNewPath);
-		//PrintF(L"B %s %s\n", wPlainOldPath.c_str(), wPlainNewPath.c_str());
-		if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-			// fBNg
-			NTSTATUS status = changeIVRecursive(newPath, cPlainOldPath, cPlainNewPath);
-			if (status != STATUS_SUCCESS) {
-				//PrintF(L"e %s %s %d\n", wPlainOldPath.c_str(), wPlainNewPath.c_str(), status);
-				FindClose(findHandle);
-				return status;
+	vector<WIN32_FIND_DATAW> batch;
+	vector<string> oldNames, plainNames;
+	// The chain IVs of both directories are computed once for all the entries.
+	EncFS::EncFSVolume::DirectoryContext oldDir(context.volume, cOldPlainDirPath);
+	EncFS::EncFSVolume::DirectoryContext newDir(context.volume, cNewPlainDirPath);
+	while (reader.next(batch)) {
+		oldNames.clear();
+		for (const WIN32_FIND_DATAW &find : batch) {
+			oldNames.push_back(find.cFileName[0] == L'.' ? "" : strConv.to_bytes(find.cFileName));
+		}
+		oldDir.decodeFileNames(oldNames, plainNames);
+		for (size_t i = 0; i < batch.size(); ++i) {
+			const WIN32_FIND_DATAW &find = batch[i];
+			const string &plainName = plainNames[i];
+			if (plainName.empty()) {
+				continue;
 			}
-		}
-		else {
-			// t@C
-			if (encfs.isExternalIVChaining()) {
-				HANDLE handle2 = CreateFileW(newPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
-					OPEN_EXISTING, 0, NULL);
-				if (handle2 == INVALID_HANDLE_VALUE) {
-					FindClose(findHandle);
+			string cNewName;
+			newDir.encodeFileName(plainName, cNewName);
+			wstring wNewName = strConv.from_bytes(cNewName);
+			wcscpy_s((wchar_t*)&oldPath[oldPathLen], DOKAN_MAX_PATH - oldPathLen, find.cFileName);
+			wcscpy_s((wchar_t*)&newPath[oldPathLen], DOKAN_MAX_PATH - oldPathLen, wNewName.c_str());
+			//PrintF(L"A %s %s\n", oldPath, newPath);
+			if (context.volume.isChainedNameIV()) {
+				if (!MoveFileW(oldPath, newPath)) {
 					DWORD error = GetLastError();
 					return DokanNtStatusFromWin32(error);
 				}
+			}
+			string cPlainOldPath = cOldPlainDirPath + "\\" + plainName;
+			wstring wPlainOldPath = strConv.from_bytes(cPlainOldPath);
+			string cPlainNewPath = cNewPlainDirPath + "\\" + plainName;
+			wstring wPlainNewPath = strConv.from_bytes(cPlainNewPath);
+			//PrintF(L"B %s %s\n", wPlainOldPath.c_str(), wPlainNewPath.c_str());
+			if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				// fBNg
+				NTSTATUS status = changeIVRecursive(context, newPath, cPlainOldPath, cPlainNewPath);
+				if (status != STATUS_SUCCESS) {
+					//PrintF(L"e %s %s %d\n", wPlainOldPath.c_str(), wPlainNewPath.c_str(), status);
+					return status;
+				}
+			}
+			else {
+				// t@C
+				if (context.volume.isExternalIVChaining()) {
+					HANDLE handle2 = CreateFileW(newPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
+						OPEN_EXISTING, 0, NULL);
+					if (handle2 == INVALID_HANDLE_VALUE) {
+						DWORD error = GetLastError();
+						return DokanNtStatusFromWin32(error);
+					}
 
-				EncFS::EncFSFile encfsFile2(handle2, false);
-				if (!encfsFile2.changeFileIV(wPlainOldPath.c_str(), wPlainNewPath.c_str())) {
-					FindClose(findHandle);
-					DWORD error = GetLastError();
-					return DokanNtStatusFromWin32(error);
+					EncFS::EncFSFile encfsFile2(context.volume, handle2, false);
+					if (!encfsFile2.changeFileIV(wPlainOldPath.c_str(), wPlainNewPath.c_str())) {
+						DWORD error = GetLastError();
+						return DokanNtStatusFromWin32(error);
+					}
 				}
 			}
 		}
-	} while (FindNextFileW(findHandle, &find));
-	FindClose(findHandle);
+	}
+	if (reader.getError() != ERROR_SUCCESS) {
+		return DokanNtStatusFromWin32(reader.getError());
+	}
 	return STATUS_SUCCESS;
 }
 
@@ -1154,6 +1268,8 @@ static NTSTATUS DOKAN_CALLBACK
 EncFSMoveFile(LPCWSTR FileName, // existing file name
 	LPCWSTR NewFileName, BOOL ReplaceIfExisting,
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_MOVE_FILE, FileName);
+	EncFSContext &context = GetContext(DokanFileInfo);
 	WCHAR filePath[DOKAN_MAX_PATH];
 	WCHAR newFilePath[DOKAN_MAX_PATH];
 	DWORD bufferSize;
@@ -1162,8 +1278,8 @@ EncFSMoveFile(LPCWSTR FileName, // existing file name
 
 	PFILE_RENAME_INFO renameInfo = NULL;
 
-	GetFilePath(filePath, FileName, false);
-	GetFilePath(newFilePath, NewFileName, true);
+	GetFilePath(context, filePath, FileName, false);
+	GetFilePath(context, newFilePath, NewFileName, true);
 
 	DbgPrint(L"MoveFile %s -> %s ; %s -> %s\n", FileName, NewFileName, filePath, newFilePath);
 	//PrintF(L"MoveFile %s -> %s\n", filePath, newFilePath);
@@ -1173,7 +1289,7 @@ EncFSMoveFile(LPCWSTR FileName, // existing file name
 		return STATUS_INVALID_HANDLE;
 	}
 	EncFS::EncFSFile* encfsFile = (EncFS::EncFSFile*)DokanFileInfo->Context;
-	if (encfs.isChainedNameIV() || encfs.isExternalIVChaining()) {
+	if (context.volume.isChainedNameIV() || context.volume.isExternalIVChaining()) {
 		if (DokanFileInfo->IsDirectory) {
 			// fBNĝׂẴt@CɌIV
 			// fBNg̈ړ͎ԂĂPXbhōs
@@ -1192,13 +1308,13 @@ EncFSMoveFile(LPCWSTR FileName, // existing file name
 			string cOldPlainDirPath = strConv.to_bytes(wOldPlainDirPath);
 			wstring wNewPlainDirPath(NewFileName);
 			string cNewPlainDirPath = strConv.to_bytes(wNewPlainDirPath);
-			NTSTATUS status = changeIVRecursive(newFilePath, cOldPlainDirPath, cNewPlainDirPath);
+			NTSTATUS status = changeIVRecursive(context, newFilePath, cOldPlainDirPath, cNewPlainDirPath);
 			//PrintF(L"MoveDirEnd\n");
 			return status;
 		}
 		else {
 			// t@CIV
-			if (encfs.isExternalIVChaining()) {
+			if (context.volume.isExternalIVChaining()) {
 				if (!encfsFile->changeFileIV(FileName, NewFileName)) {
 					DWORD error = GetLastError();
 					return DokanNtStatusFromWin32(error);
@@ -1253,6 +1369,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSLockFile(LPCWSTR FileName,
 	LONGLONG ByteOffset,
 	LONGLONG Length,
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_LOCK_FILE, FileName);
 	LARGE_INTEGER offset;
 	LARGE_INTEGER length;
 
@@ -1340,6 +1457,7 @@ static BOOL AddSeSecurityNamePrivilege() {
 
 static NTSTATUS DOKAN_CALLBACK
 EncFSFlushFileBuffers(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_FLUSH_FILE_BUFFERS, FileName);
 	WCHAR filePath[DOKAN_MAX_PATH];
 
 	DbgPrint(L"FlushFileBuffers: %s\n", FileName);
@@ -1363,6 +1481,7 @@ EncFSFlushFileBuffers(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
 
 static NTSTATUS DOKAN_CALLBACK EncFSSetEndOfFile(
 	LPCWSTR FileName, LONGLONG ByteOffset, PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_SET_END_OF_FILE, FileName);
 
 	DbgPrint(L"SetEndOfFile %s, %I64d\n", FileName, ByteOffset);
 
@@ -1385,6 +1504,8 @@ static NTSTATUS DOKAN_CALLBACK EncFSSetEndOfFile(
 static NTSTATUS DOKAN_CALLBACK EncFSGetFileInformation(
 	LPCWSTR FileName, LPBY_HANDLE_FILE_INFORMATION HandleFileInformation,
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_GET_FILE_INFORMATION, FileName);
+	EncFSContext &context = GetContext(DokanFileInfo);
 
 	DbgPrint(L"GetFileInfo : %s\n", FileName);
 
@@ -1392,7 +1513,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetFileInformation(
 	BOOL opened = FALSE;
 	if (!DokanFileInfo->Context) {
 		WCHAR filePath[DOKAN_MAX_PATH];
-		GetFilePath(filePath, FileName, false);
+		GetFilePath(context, filePath, FileName, false);
 		DbgPrint(L"\tinvalid handle, cleanuped?\n");
 		HANDLE handle = CreateFileW(filePath, GENERIC_READ, FILE_SHARE_READ, NULL,
 			OPEN_EXISTING, 0, NULL);
@@ -1401,7 +1522,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetFileInformation(
 			ErrorPrint(L"\tCreateFile error : %d\n", error);
 			return DokanNtStatusFromWin32(error);
 		}
-		encfsFile = new EncFS::EncFSFile(handle, false);
+		encfsFile = new EncFS::EncFSFile(context.volume, handle, false);
 		opened = TRUE;
 	}
 	else {
@@ -1411,7 +1532,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetFileInformation(
 	if (!GetFileInformationByHandle(encfsFile->getHandle(), HandleFileInformation)) {
 		ErrorPrint(L"GetFileInfo error code = %d\n", GetLastError());
 		WCHAR filePath[DOKAN_MAX_PATH];
-		GetFilePath(filePath, FileName, false);
+		GetFilePath(context, filePath, FileName, false);
 
 		// FileName is a root directory
 		// in this case, FindFirstFile can't get directory information
@@ -1423,7 +1544,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetFileInformation(
 		else {
 			WIN32_FIND_DATAW find;
 			ZeroMemory(&find, sizeof(WIN32_FIND_DATAW));
-			HANDLE findHandle = FindFirstFileW(filePath, &find);
+			HANDLE findHandle = FindFirstFileExW(filePath, FindExInfoBasic, &find, FindExSearchNameMatch, NULL, 0);
 			if (findHandle == INVALID_HANDLE_VALUE) {
 				DWORD error = GetLastError();
 				ErrorPrint(L"\tFindFirstFile error code = %d\n\n", error);
@@ -1450,7 +1571,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetFileInformation(
 	if (!DokanFileInfo->IsDirectory) {
 		// Caluclate file size
 		int64_t size = (HandleFileInformation->nFileSizeHigh * ((int64_t)MAXDWORD + 1)) + HandleFileInformation->nFileSizeLow;
-		size = encfs.isReverse() ? encfs.toEncodedLength(size) : encfs.toDecodedLength(size);
+		size = context.volume.isReverse() ? context.volume.toEncodedLength(size) : context.volume.toDecodedLength(size);
 		HandleFileInformation->nFileSizeLow = size & MAXDWORD;
 		HandleFileInformation->nFileSizeHigh = (size >> 32) & MAXDWORD;
 	}
@@ -1468,9 +1589,11 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetFileInformation(
 
 static NTSTATUS DOKAN_CALLBACK
 EncFSDeleteFile(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_DELETE_FILE, FileName);
+	EncFSContext &context = GetContext(DokanFileInfo);
 	WCHAR filePath[DOKAN_MAX_PATH];
 
-	GetFilePath(filePath, FileName, false);
+	GetFilePath(context, filePath, FileName, false);
 	DbgPrint(L"DeleteFile %s ; %s - %d\n", FileName, filePath, DokanFileInfo->DeleteOnClose);
 
 	DWORD dwAttrib = GetFileAttributesW(filePath);
@@ -1493,6 +1616,7 @@ EncFSDeleteFile(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo) {
 
 static NTSTATUS DOKAN_CALLBACK EncFSSetAllocationSize(
 	LPCWSTR FileName, LONGLONG AllocSize, PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_SET_ALLOCATION_SIZE, FileName);
 
 	DbgPrint(L"SetAllocationSize %s, %I64d\n", FileName, AllocSize);
 
@@ -1502,9 +1626,8 @@ static NTSTATUS DOKAN_CALLBACK EncFSSetAllocationSize(
 	}
 
 	EncFS::EncFSFile* encfsFile = (EncFS::EncFSFile*)DokanFileInfo->Context;
-	LARGE_INTEGER encodedFileSize;
-	if (GetFileSizeEx(encfsFile->getHandle(), &encodedFileSize)) {
-		size_t decodedFileSize = encfs.toDecodedLength(encodedFileSize.QuadPart);
+	size_t decodedFileSize;
+	if (encfsFile->getFileSize(FileName, &decodedFileSize)) {
 		if (AllocSize < (int64_t)decodedFileSize) {
 			if (!encfsFile->setLength(FileName, AllocSize)) {
 				DWORD error = GetLastError();
@@ -1525,13 +1648,14 @@ static NTSTATUS DOKAN_CALLBACK EncFSSetAllocationSize(
 
 static NTSTATUS DOKAN_CALLBACK EncFSSetFileAttributes(
 	LPCWSTR FileName, DWORD FileAttributes, PDOKAN_FILE_INFO DokanFileInfo) {
-	UNREFERENCED_PARAMETER(DokanFileInfo);
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_SET_FILE_ATTRIBUTES, FileName);
+	EncFSContext &context = GetContext(DokanFileInfo);
 
 	DbgPrint(L"SetFileAttributes %s 0x%x\n", FileName, FileAttributes);
 
 	if (FileAttributes != 0) {
 		WCHAR filePath[DOKAN_MAX_PATH];
-		GetFilePath(filePath, FileName, false);
+		GetFilePath(context, filePath, FileName, false);
 		if (!SetFileAttributesW(filePath, FileAttributes)) {
 			DWORD error = GetLastError();
 			DbgPrint(L"\terror code = %d\n\n", error);
@@ -1554,6 +1678,7 @@ static NTSTATUS DOKAN_CALLBACK
 EncFSSetFileTime(LPCWSTR FileName, CONST FILETIME *CreationTime,
 	CONST FILETIME *LastAccessTime, CONST FILETIME *LastWriteTime,
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_SET_FILE_TIME, FileName);
 
 	DbgPrint(L"SetFileTime %s\n", FileName);
 
@@ -1576,6 +1701,7 @@ EncFSSetFileTime(LPCWSTR FileName, CONST FILETIME *CreationTime,
 static NTSTATUS DOKAN_CALLBACK
 EncFSUnlockFile(LPCWSTR FileName, LONGLONG ByteOffset, LONGLONG Length,
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_UNLOCK_FILE, FileName);
 	LARGE_INTEGER length;
 	LARGE_INTEGER offset;
 
@@ -1606,12 +1732,12 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetFileSecurity(
 	LPCWSTR FileName, PSECURITY_INFORMATION SecurityInformation,
 	PSECURITY_DESCRIPTOR SecurityDescriptor, ULONG BufferLength,
 	PULONG LengthNeeded, PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_GET_FILE_SECURITY, FileName);
+	EncFSContext &context = GetContext(DokanFileInfo);
 	WCHAR filePath[DOKAN_MAX_PATH];
 	BOOLEAN requestingSaclInfo;
 
-	UNREFERENCED_PARAMETER(DokanFileInfo);
-
-	GetFilePath(filePath, FileName, false);
+	GetFilePath(context, filePath, FileName, false);
 
 	DbgPrint(L"GetFileSecurity %s ; %s\n", FileName, filePath);
 
@@ -1634,7 +1760,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetFileSecurity(
 	requestingSaclInfo = ((*SecurityInformation & SACL_SECURITY_INFORMATION) ||
 		(*SecurityInformation & BACKUP_SECURITY_INFORMATION));
 
-	if (!g_efo.g_HasSeSecurityPrivilege) {
+	if (!context.options.g_HasSeSecurityPrivilege) {
 		*SecurityInformation &= ~SACL_SECURITY_INFORMATION;
 		*SecurityInformation &= ~BACKUP_SECURITY_INFORMATION;
 	}
@@ -1642,7 +1768,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetFileSecurity(
 	DbgPrint(L"  Opening new handle with READ_CONTROL access\n");
 	HANDLE handle = CreateFileW(
 		filePath,
-		READ_CONTROL | ((requestingSaclInfo && g_efo.g_HasSeSecurityPrivilege)
+		READ_CONTROL | ((requestingSaclInfo && context.options.g_HasSeSecurityPrivilege)
 			? ACCESS_SYSTEM_SECURITY
 			: 0),
 		FILE_SHARE_WRITE | FILE_SHARE_READ | FILE_SHARE_DELETE,
@@ -1688,6 +1814,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSSetFileSecurity(
 	LPCWSTR FileName, PSECURITY_INFORMATION SecurityInformation,
 	PSECURITY_DESCRIPTOR SecurityDescriptor, ULONG SecurityDescriptorLength,
 	PDOKAN_FILE_INFO DokanFileInfo) {
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_SET_FILE_SECURITY, FileName);
 
 	UNREFERENCED_PARAMETER(SecurityDescriptorLength);
 	DbgPrint(L"SetFileSecurity %s\n", FileName);
@@ -1717,7 +1844,8 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetVolumeInformation(
 	LPDWORD MaximumComponentLength, LPDWORD FileSystemFlags,
 	LPWSTR FileSystemNameBuffer, DWORD FileSystemNameSize,
 	PDOKAN_FILE_INFO DokanFileInfo) {
-	UNREFERENCED_PARAMETER(DokanFileInfo);
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_GET_VOLUME_INFORMATION, NULL);
+	EncFSContext &context = GetContext(DokanFileInfo);
 
 	WCHAR volumeRoot[4];
 	DWORD fsFlags = 0;
@@ -1733,7 +1861,7 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetVolumeInformation(
 		FILE_SUPPORTS_REMOTE_STORAGE | FILE_UNICODE_ON_DISK |
 		FILE_PERSISTENT_ACLS | FILE_NAMED_STREAMS;
 
-	volumeRoot[0] = g_efo.RootDirectory[0];
+	volumeRoot[0] = context.options.RootDirectory[0];
 	volumeRoot[1] = ':';
 	volumeRoot[2] = '\\';
 	volumeRoot[3] = '\0';
@@ -1777,10 +1905,11 @@ static NTSTATUS DOKAN_CALLBACK EncFSGetVolumeInformation(
 static NTSTATUS DOKAN_CALLBACK EncFSDokanGetDiskFreeSpace(
 	PULONGLONG FreeBytesAvailable, PULONGLONG TotalNumberOfBytes,
 	PULONGLONG TotalNumberOfFreeBytes, PDOKAN_FILE_INFO DokanFileInfo) {
-	UNREFERENCED_PARAMETER(DokanFileInfo);
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_GET_DISK_FREE_SPACE, NULL);
+	EncFSContext &context = GetContext(DokanFileInfo);
 
 	WCHAR volumeRoot[4];
-	volumeRoot[0] = g_efo.RootDirectory[0];
+	volumeRoot[0] = context.options.RootDirectory[0];
 	volumeRoot[1] = ':';
 	volumeRoot[2] = '\\';
 	volumeRoot[3] = '\0';
@@ -1833,7 +1962,8 @@ NTSTATUS DOKAN_CALLBACK
 EncFSFindStreams(LPCWSTR FileName, PFillFindStreamData FillFindStreamData,
 	PVOID FindStreamContext,
 	PDOKAN_FILE_INFO DokanFileInfo) {
-	UNREFERENCED_PARAMETER(DokanFileInfo);
+	EncFS::EncFSIoStats::CallScope scope(EncFS::TRACE_FIND_STREAMS, FileName);
+	EncFSContext &context = GetContext(DokanFileInfo);
 
 	WCHAR filePath[DOKAN_MAX_PATH];
 	HANDLE hFind;
@@ -1841,7 +1971,7 @@ EncFSFindStreams(LPCWSTR FileName, PFillFindStreamData FillFindStreamData,
 	DWORD error;
 	int count = 0;
 
-	GetFilePath(filePath, FileName, false);
+	GetFilePath(context, filePath, FileName, false);
 
 	DbgPrint(L"FindStreams :%s ; %s\n", FileName, filePath);
 
@@ -1887,11 +2017,18 @@ EncFSFindStreams(LPCWSTR FileName, PFillFindStreamData FillFindStreamData,
 
 static NTSTATUS DOKAN_CALLBACK EncFSMounted(LPCWSTR MountPoint,
 	PDOKAN_FILE_INFO DokanFileInfo) {
-	UNREFERENCED_PARAMETER(DokanFileInfo);
+	EncFSContext &context = GetContext(DokanFileInfo);
 
 	DbgPrint(L"Mounted as %s\n", MountPoint);
 
-	if (!g_efo.g_DebugMode) {
+	if (context.warmer) {
+		context.warmer->start();
+	}
+	if (context.watcher && !context.watcher->start()) {
+		DbgPrint(L"Can't watch %s: %d\n", context.options.RootDirectory, GetLastError());
+	}
+
+	if (!context.options.g_DebugMode) {
 		const unsigned int buffSize = 20;
 		wchar_t buff[buffSize];
 		if (swprintf_s(buff, buffSize, L"%s:\\", MountPoint) != -1) {
@@ -1911,22 +2048,67 @@ static NTSTATUS DOKAN_CALLBACK EncFSUnmounted(PDOKAN_FILE_INFO DokanFileInfo) {
 
 #pragma warning(pop)
 
+static EncFS::EncFSMutex mountedLock("mountedLock");
+static vector<EncFSContext*> mounted;
+
 BOOL WINAPI CtrlHandler(DWORD dwCtrlType) {
 	switch (dwCtrlType) {
 	case CTRL_C_EVENT:
 	case CTRL_BREAK_EVENT:
 	case CTRL_CLOSE_EVENT:
 	case CTRL_LOGOFF_EVENT:
-	case CTRL_SHUTDOWN_EVENT:
+	case CTRL_SHUTDOWN_EVENT: {
 		SetConsoleCtrlHandler(CtrlHandler, FALSE);
-		DokanRemoveMountPoint(g_efo.MountPoint);
+		lock_guard<decltype(mountedLock)> lock(mountedLock);
+		for (EncFSContext* context : mounted) {
+			DokanRemoveMountPoint(context->options.MountPoint);
+		}
 		return TRUE;
+	}
 	default:
 		return FALSE;
 	}
 }
 
+/**
+Tell Dokan, which tells Explorer and the other watchers of the mount, about a change of the root directory.
+**/
+static void NotifyChange(EncFSContext &context, EncFS::EncFSChange change, const wstring &path, const wstring &newPath,
+	bool isDirectory) {
+	lock_guard<decltype(mountedLock)> lock(mountedLock);
+	if (!context.instance) {
+		return;
+	}
+	// Dokan takes paths with the mount point, as M:\dir\file.
+	wstring mountPoint(context.options.MountPoint);
+	if (mountPoint.size() == 1) {
+		mountPoint += L':';
+	}
+	else if (!mountPoint.empty() && mountPoint.back() == L'\\') {
+		mountPoint.pop_back();
+	}
+	const wstring filePath = mountPoint + path;
+	switch (change) {
+	case EncFS::CHANGE_CREATED:
+		DokanNotifyCreate(context.instance, filePath.c_str(), isDirectory);
+		break;
+	case EncFS::CHANGE_DELETED:
+		DokanNotifyDelete(context.instance, filePath.c_str(), isDirectory);
+		break;
+	case EncFS::CHANGE_UPDATED:
+		DokanNotifyUpdate(context.instance, filePath.c_str());
+		break;
+	case EncFS::CHANGE_RENAMED: {
+		const wstring newFilePath = mountPoint + newPath;
+		const bool sameDirectory = path.substr(0, path.rfind(L'\\')) == newPath.substr(0, newPath.rfind(L'\\'));
+		DokanNotifyRename(context.instance, filePath.c_str(), newFilePath.c_str(), isDirectory, sameDirectory);
+		break;
+	}
+	}
+}
+
 #define CONFIG_XML "\\.encfs6.xml"
+#define NAME_INDEX L"\\.encfs6.index"
 bool IsEncFSExists(LPCWSTR rootDir) {
 	const wstring wRootDir(rootDir);
 	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
@@ -1937,7 +2119,7 @@ bool IsEncFSExists(LPCWSTR rootDir) {
 	return in.is_open();
 }
 
-int CreateEncFS(LPCWSTR rootDir, char *password, EncFSMode mode, bool reverse) {
+int CreateEncFS(LPCWSTR rootDir, char *password, EncFSMode mode, bool reverse, bool aead) {
 	const wstring wRootDir(rootDir);
 	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
 	string cRootDir = strConv.to_bytes(wRootDir);
@@ -1948,20 +2130,21 @@ int CreateEncFS(LPCWSTR rootDir, char *password, EncFSMode mode, bool reverse) {
 		return EXIT_FAILURE;
 	}
 
-	encfs.create(password, (EncFS::EncFSMode)mode, reverse);
+	EncFS::EncFSVolume volume;
+	volume.create(password, (EncFS::EncFSMode)mode, reverse, aead);
 	string xml;
-	encfs.save(xml);
+	volume.save(xml);
 	ofstream out(configFile);
 	out << xml;
 	out.close();
 	return EXIT_SUCCESS;
 }
 
-int StartEncFS(EncFSOptions &efo, char *password) {
-	DOKAN_OPERATIONS dokanOperations;
-	DOKAN_OPTIONS dokanOptions;
-
-	encfs.altStream = efo.AltStream;
+EncFSContext* LoadEncFS(EncFSOptions &efo, char *password) {
+	EncFSContext* context = new EncFSContext();
+	context->options = efo;
+	EncFS::EncFSVolume &volume = context->volume;
+	volume.altStream = efo.AltStream;
 	string configFile;
 	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
 	if (false && efo.ConfigFile) {
@@ -1980,16 +2163,140 @@ int StartEncFS(EncFSOptions &efo, char *password) {
 			string xml((istreambuf_iterator<char>(in)),
 				istreambuf_iterator<char>());
 			in.close();
-			encfs.load(xml, efo.Reverse);
+			volume.load(xml, efo.Reverse);
 		}
 		else {
-			return EXIT_FAILURE;
+			delete context;
+			return NULL;
 		}
 	}
 	catch (const EncFS::EncFSBadConfigurationException &ex) {
 		printf("%s\n", ex.what());
+		delete context;
+		return NULL;
+	}
+
+	// EncFS
+	try {
+		volume.unlock(password);
+	}
+	catch (const EncFS::EncFSUnlockFailedException &ex) {
+		printf("%s\n", ex.what());
+		delete context;
+		return NULL;
+	}
+
+	if (efo.NameIndex && !efo.Reverse) {
+		context->nameIndex.load(volume, wstring(efo.RootDirectory) + NAME_INDEX);
+		volume.setNameIndex(&context->nameIndex);
+	}
+	if (efo.WarmDirectories && volume.getNameIndex()) {
+		context->warmer.reset(new EncFS::EncFSWarmer(volume, context->nameIndex,
+			wstring(L"\\\\?\\") + efo.RootDirectory, strConv.to_bytes(efo.WarmDirectories),
+			efo.WarmDepth, efo.WarmSeconds));
+	}
+	if (efo.Watch) {
+		context->watcher.reset(new EncFS::EncFSWatcher(volume, volume.getNameIndex(),
+			wstring(L"\\\\?\\") + efo.RootDirectory,
+			[context](EncFS::EncFSChange change, const wstring &path, const wstring &newPath, bool isDirectory) {
+			NotifyChange(*context, change, path, newPath, isDirectory);
+		}));
+	}
+	// Nothing is written through a write protected or reverse mount.
+	volume.setReadOnly(efo.Reverse || (efo.DokanOptions & DOKAN_OPTION_WRITE_PROTECT) != 0);
+
+	g_UseStdErr = g_UseStdErr || efo.g_UseStdErr;
+	g_DebugMode = g_DebugMode || efo.g_DebugMode;
+	return context;
+}
+
+void FreeEncFS(EncFSContext* context) {
+	delete context;
+}
+
+EncFS::EncFSVolume& GetEncFSVolume(EncFSContext* context) {
+	return context->volume;
+}
+
+int CatEncFS(EncFSContext* context, LPCWSTR plainFilePath, HANDLE out) {
+	WCHAR filePath[DOKAN_MAX_PATH];
+	GetFilePath(*context, filePath, plainFilePath, false);
+	HANDLE handle = CreateFileW(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return EXIT_FAILURE;
+	}
+	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+	EncFS::EncFSStream stream(context->volume);
+	bool result = stream.decode(strConv.to_bytes(plainFilePath), handle, out);
+	DWORD error = GetLastError();
+	CloseHandle(handle);
+	SetLastError(error);
+	return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int PutEncFS(EncFSContext* context, LPCWSTR plainFilePath, HANDLE in) {
+	WCHAR filePath[DOKAN_MAX_PATH];
+	GetFilePath(*context, filePath, plainFilePath, true);
+	// Replace the file at once, a failed input never leaves a partial file.
+	// The content is encoded for the final path, the name of the temporary file is not of the volume.
+	const wstring tempFile = wstring(filePath) + L".tmp";
+	HANDLE handle = CreateFileW(tempFile.c_str(), GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
 		return EXIT_FAILURE;
 	}
+	wstring_convert<codecvt_utf8_utf16<wchar_t>> strConv;
+	EncFS::EncFSStream stream(context->volume);
+	bool result = stream.encode(strConv.to_bytes(plainFilePath), in, handle);
+	DWORD error = GetLastError();
+	CloseHandle(handle);
+	if (result && !MoveFileExW(tempFile.c_str(), filePath, MOVEFILE_REPLACE_EXISTING)) {
+		error = GetLastError();
+		result = false;
+	}
+	if (!result) {
+		DeleteFileW(tempFile.c_str());
+	}
+	SetLastError(error);
+	return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void GetEncFSOperations(DOKAN_OPERATIONS &dokanOperations) {
+	ZeroMemory(&dokanOperations, sizeof(DOKAN_OPERATIONS));
+	dokanOperations.ZwCreateFile = EncFSCreateFile;
+	dokanOperations.Cleanup = EncFSCleanup;
+	dokanOperations.CloseFile = EncFSCloseFile;
+	dokanOperations.ReadFile = EncFSReadFile;
+	dokanOperations.WriteFile = EncFSWriteFile;
+	dokanOperations.FlushFileBuffers = EncFSFlushFileBuffers;
+	dokanOperations.GetFileInformation = EncFSGetFileInformation;
+	dokanOperations.FindFiles = EncFSFindFiles;
+	dokanOperations.FindFilesWithPattern = NULL;
+	dokanOperations.SetFileAttributes = EncFSSetFileAttributes;
+	dokanOperations.SetFileTime = EncFSSetFileTime;
+	dokanOperations.DeleteFile = EncFSDeleteFile;
+	dokanOperations.DeleteDirectory = EncFSDeleteDirectory;
+	dokanOperations.MoveFile = EncFSMoveFile;
+	dokanOperations.SetEndOfFile = EncFSSetEndOfFile;
+	dokanOperations.SetAllocationSize = EncFSSetAllocationSize;
+	dokanOperations.LockFile = EncFSLockFile;
+	dokanOperations.UnlockFile = EncFSUnlockFile;
+	dokanOperations.GetFileSecurity = EncFSGetFileSecurity;
+	dokanOperations.SetFileSecurity = EncFSSetFileSecurity;
+	dokanOperations.GetDiskFreeSpace = EncFSDokanGetDiskFreeSpace;
+	dokanOperations.GetVolumeInformation = EncFSGetVolumeInformation;
+	dokanOperations.Unmounted = EncFSUnmounted;
+	dokanOperations.FindStreams = EncFSFindStreams;
+	dokanOperations.Mounted = EncFSMounted;
+}
+
+/**
+Fill the Dokan options of the volume. Returns false when the options conflict.
+*/
+static bool InitDokanOptions(EncFSContext &context) {
+	EncFSOptions &efo = context.options;
+	DOKAN_OPTIONS &dokanOptions = context.dokanOptions;
 
 	ZeroMemory(&dokanOptions, sizeof(DOKAN_OPTIONS));
 	dokanOptions.Version = DOKAN_VERSION;
@@ -1999,6 +2306,7 @@ int StartEncFS(EncFSOptions &efo, char *password) {
 	dokanOptions.Options = efo.DokanOptions;
 	dokanOptions.AllocationUnitSize = efo.AllocationUnitSize;
 	dokanOptions.SectorSize = efo.SectorSize;
+	dokanOptions.GlobalContext = (ULONG64)&context;
 
 	if (efo.UNCName && wcscmp(efo.UNCName, L"") != 0 &&
 		!(dokanOptions.Options & DOKAN_OPTION_NETWORK)) {
@@ -2014,24 +2322,20 @@ int StartEncFS(EncFSOptions &efo, char *password) {
 	if (dokanOptions.Options & DOKAN_OPTION_NETWORK &&
 		dokanOptions.Options & DOKAN_OPTION_MOUNT_MANAGER) {
 		fwprintf(stderr, L"Mount manager cannot be used on network drive.\n");
-		return EXIT_FAILURE;
+		return false;
 	}
 
 	if (!(dokanOptions.Options & DOKAN_OPTION_MOUNT_MANAGER) &&
 		wcscmp(efo.MountPoint, L"") == 0) {
 		fwprintf(stderr, L"Mount Point required.\n");
-		return EXIT_FAILURE;
+		return false;
 	}
 
 	if ((dokanOptions.Options & DOKAN_OPTION_MOUNT_MANAGER) &&
 		(dokanOptions.Options & DOKAN_OPTION_CURRENT_SESSION)) {
 		fwprintf(stderr,
 			L"Mount Manager always mount the drive for all user sessions.\n");
-		return EXIT_FAILURE;
-	}
-
-	if (!SetConsoleCtrlHandler(CtrlHandler, TRUE)) {
-		fwprintf(stderr, L"Control Handler is not set.\n");
+		return false;
 	}
 
 	// Add security name privilege. Required here to handle GetFileSecurity
@@ -2070,47 +2374,10 @@ int StartEncFS(EncFSOptions &efo, char *password) {
 		dokanOptions.Options |= DOKAN_OPTION_ALT_STREAM;
 	}
 	dokanOptions.Options |= DOKAN_OPTION_CASE_SENSITIVE;
+	return true;
+}
 
-	ZeroMemory(&dokanOperations, sizeof(DOKAN_OPERATIONS));
-	dokanOperations.ZwCreateFile = EncFSCreateFile;
-	dokanOperations.Cleanup = EncFSCleanup;
-	dokanOperations.CloseFile = EncFSCloseFile;
-	dokanOperations.ReadFile = EncFSReadFile;
-	dokanOperations.WriteFile = EncFSWriteFile;
-	dokanOperations.FlushFileBuffers = EncFSFlushFileBuffers;
-	dokanOperations.GetFileInformation = EncFSGetFileInformation;
-	dokanOperations.FindFiles = EncFSFindFiles;
-	dokanOperations.FindFilesWithPattern = NULL;
-	dokanOperations.SetFileAttributes = EncFSSetFileAttributes;
-	dokanOperations.SetFileTime = EncFSSetFileTime;
-	dokanOperations.DeleteFile = EncFSDeleteFile;
-	dokanOperations.DeleteDirectory = EncFSDeleteDirectory;
-	dokanOperations.MoveFile = EncFSMoveFile;
-	dokanOperations.SetEndOfFile = EncFSSetEndOfFile;
-	dokanOperations.SetAllocationSize = EncFSSetAllocationSize;
-	dokanOperations.LockFile = EncFSLockFile;
-	dokanOperations.UnlockFile = EncFSUnlockFile;
-	dokanOperations.GetFileSecurity = EncFSGetFileSecurity;
-	dokanOperations.SetFileSecurity = EncFSSetFileSecurity;
-	dokanOperations.GetDiskFreeSpace = EncFSDokanGetDiskFreeSpace;
-	dokanOperations.GetVolumeInformation = EncFSGetVolumeInformation;
-	dokanOperations.Unmounted = EncFSUnmounted;
-	dokanOperations.FindStreams = EncFSFindStreams;
-	dokanOperations.Mounted = EncFSMounted;
-
-	// EncFS
-	try {
-		encfs.unlock(password);
-	}
-	catch (const EncFS::EncFSUnlockFailedException &ex) {
-		printf("%s\n", ex.what());
-		return EXIT_FAILURE;
-	}
-
-	g_efo = efo;
-	DokanInit();
-	int status = DokanMain(&dokanOptions, &dokanOperations);
-	DokanShutdown();
+static void PrintDokanStatus(int status) {
 	switch (status) {
 	case DOKAN_SUCCESS:
 		fprintf(stderr, "Success\n");
@@ -2140,5 +2407,105 @@ int StartEncFS(EncFSOptions &efo, char *password) {
 		fprintf(stderr, "Unknown error: %d\n", status);
 		break;
 	}
+}
+
+int StartEncFS(EncFSOptions &efo, char *password) {
+	return StartEncFSVolumes(&efo, &password, 1);
+}
+
+int StartEncFSVolumes(EncFSOptions *options, char **passwords, int count) {
+	DOKAN_OPERATIONS dokanOperations;
+	vector<EncFSContext*> contexts;
+	bool stats = false;
+
+	for (int i = 0; i < count; ++i) {
+		EncFSContext* context = LoadEncFS(options[i], passwords[i]);
+		if (!context) {
+			fwprintf(stderr, L"Can't load volume: %s\n", options[i].RootDirectory);
+			continue;
+		}
+		if (!InitDokanOptions(*context)) {
+			FreeEncFS(context);
+			continue;
+		}
+		contexts.push_back(context);
+		stats = stats || options[i].Stats;
+	}
+	if (contexts.empty()) {
+		return EXIT_FAILURE;
+	}
+
+	if (!SetConsoleCtrlHandler(CtrlHandler, TRUE)) {
+		fwprintf(stderr, L"Control Handler is not set.\n");
+	}
+
+	GetEncFSOperations(dokanOperations);
+	// Records have no volume, so a trace is only taken of a single volume.
+	if (options[0].TraceFile && count == 1) {
+		if (!EncFS::startTrace(options[0].TraceFile, dokanOperations)) {
+			fwprintf(stderr, L"Can't open trace file: %s\n", options[0].TraceFile);
+			FreeEncFS(contexts[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (stats) {
+		EncFS::EncFSLockStats::setEnabled(true);
+		EncFS::EncFSIoStats::setEnabled(true);
+	}
+	// The caches are shared by the volumes, so is their budget.
+	EncFS::EncFSMemoryGovernor::setBudget((size_t)options[0].CacheBudget * 1024 * 1024);
+	EncFS::EncFSMemoryGovernor::start();
+
+	// All file systems of the process are served by the same Dokan thread pool.
+	DokanInit();
+	for (EncFSContext* context : contexts) {
+		lock_guard<decltype(mountedLock)> lock(mountedLock);
+		int status = DokanCreateFileSystem(&context->dokanOptions, &dokanOperations, &context->instance);
+		if (status != DOKAN_SUCCESS) {
+			fwprintf(stderr, L"%s: ", context->options.MountPoint);
+			PrintDokanStatus(status);
+			context->instance = NULL;
+			continue;
+		}
+		mounted.push_back(context);
+	}
+	for (EncFSContext* context : contexts) {
+		if (context->instance) {
+			DokanWaitForFileSystemClosed(context->instance, INFINITE);
+			if (context->watcher) {
+				// Nothing is notified to a closed instance.
+				context->watcher->stop();
+			}
+			DokanCloseHandle(context->instance);
+			fwprintf(stderr, L"%s: ", context->options.MountPoint);
+			PrintDokanStatus(DOKAN_SUCCESS);
+		}
+	}
+	DokanShutdown();
+	{
+		lock_guard<decltype(mountedLock)> lock(mountedLock);
+		mounted.clear();
+	}
+	EncFS::stopTrace();
+	EncFS::EncFSMemoryGovernor::stop();
+
+	for (EncFSContext* context : contexts) {
+		if (context->warmer) {
+			// Save what the warmer has listed so far.
+			context->warmer->stop();
+		}
+		if (context->volume.getNameIndex() &&
+			!context->nameIndex.save(context->volume, wstring(context->options.RootDirectory) + NAME_INDEX)) {
+			fwprintf(stderr, L"Can't save name index: %s\n", context->options.RootDirectory);
+		}
+		FreeEncFS(context);
+	}
+	if (stats) {
+		EncFS::EncFSLockStats::print(stderr);
+		EncFS::EncFSMemoryGovernor::print(stderr);
+		EncFS::EncFSArena::print(stderr);
+		EncFS::EncFSIoStats::print(stderr);
+	}
 	return EXIT_SUCCESS;
 }
@@ -3,6 +3,11 @@
 
 #define DOKAN_MAX_PATH 32768
 
+namespace EncFS
+{
+	class EncFSVolume;
+}
+
 enum EncFSMode {
 	STANDARD = 1,
 	PARANOIA = 2
@@ -30,10 +35,69 @@ struct EncFSOptions {
 	BOOLEAN CaseInsensitive;
 	BOOLEAN Reverse;
 	PWCHAR ConfigFile;
+	/** Record every Dokan callback to this file when not NULL. */
+	PWCHAR TraceFile;
+	/** Print statistics on unmount. */
+	BOOLEAN Stats;
+	/** Keep decoded names in .encfs6.index beside the configuration across mounts. */
+	BOOLEAN NameIndex;
+	/** Directories listed into the name index after mounting, separated by ';' (ex. \;\docs), or NULL. */
+	PWCHAR WarmDirectories;
+	/** Levels listed below the warmed directories. */
+	ULONG WarmDepth;
+	/** Time budget of the warming in seconds. */
+	ULONG WarmSeconds;
+	/** Watch the root directory for changes by other programs, to keep the caches coherent and notify Explorer. */
+	BOOLEAN Watch;
+	/** Memory of the caches of all volumes of the process in MiB, 0 for no limit. */
+	ULONG CacheBudget;
 };
 
+/**
+A loaded volume with its options. Dokan passes it to the callbacks as DOKAN_OPTIONS.GlobalContext,
+so any number of volumes can be served by one process.
+*/
+struct EncFSContext;
+
 bool IsEncFSExists(LPCWSTR rootDir);
 
-int CreateEncFS(LPCWSTR rootDir, char *password, EncFSMode mode, bool paranoia);
+int CreateEncFS(LPCWSTR rootDir, char *password, EncFSMode mode, bool reverse, bool aead);
 
 int StartEncFS(EncFSOptions &options, char *password);
+
+/**
+Mount all volumes in this process and wait until all of them are unmounted.
+They are served by the one thread pool of Dokan. Volumes which fail to load are skipped.
+*/
+int StartEncFSVolumes(EncFSOptions *options, char **passwords, int count);
+
+/**
+Load and unlock the volume of options.RootDirectory without mounting it.
+Returns NULL on failure.
+*/
+EncFSContext* LoadEncFS(EncFSOptions &options, char *password);
+
+/**
+Release a volume returned by LoadEncFS which is not mounted.
+*/
+void FreeEncFS(EncFSContext* context);
+
+EncFS::EncFSVolume& GetEncFSVolume(EncFSContext* context);
+
+/**
+Write the plain content of the file at plainFilePath (ex. \dir\file.txt) of a volume returned by LoadEncFS to out,
+without mounting it. Returns EXIT_FAILURE with the last error set on failure.
+*/
+int CatEncFS(EncFSContext* context, LPCWSTR plainFilePath, HANDLE out);
+
+/**
+Replace the file at plainFilePath of a volume returned by LoadEncFS with the content of in.
+The file is left as it was unless all of in was encoded.
+The volume must not be mounted at the same time.
+*/
+int PutEncFS(EncFSContext* context, LPCWSTR plainFilePath, HANDLE in);
+
+/**
+Dokan callbacks of the loaded volumes.
+*/
+void GetEncFSOperations(DOKAN_OPERATIONS &operations);
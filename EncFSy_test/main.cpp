@@ -341,4 +341,90 @@ int main()
 
         CloseHandle(h);
     }
+
+    // two handles
+    {
+        DWORD dwDesiredAccess = GENERIC_READ | GENERIC_WRITE;
+        DWORD dwShareMode = FILE_SHARE_READ | FILE_SHARE_WRITE;
+        DWORD dwFlagsAndAttribute = FILE_ATTRIBUTE_NORMAL;
+        HANDLE h1 = CreateFileW(file, dwDesiredAccess, dwShareMode, NULL,
+            CREATE_ALWAYS, dwFlagsAndAttribute, NULL);
+        if (h1 == INVALID_HANDLE_VALUE) {
+            DWORD lastError = GetLastError();
+            printf("CreateFileW ERROR: %d\n", lastError);
+            return -1;
+        }
+        HANDLE h2 = CreateFileW(file, dwDesiredAccess, dwShareMode, NULL,
+            OPEN_EXISTING, dwFlagsAndAttribute, NULL);
+        if (h2 == INVALID_HANDLE_VALUE) {
+            DWORD lastError = GetLastError();
+            printf("CreateFileW ERROR: %d\n", lastError);
+            return -1;
+        }
+
+        // Each handle writes a part of the same block.
+        DWORD size = 3000;
+        char* buff = (char*)malloc(size);
+        memset(buff, 'A', size);
+        DWORD writtenLen;
+        if (!WriteFile(h1, buff, size, &writtenLen, NULL)) {
+            DWORD lastError = GetLastError();
+            printf("WriteFile ERROR: %d\n", lastError);
+            return -1;
+        }
+        LARGE_INTEGER distanceToMove;
+        distanceToMove.QuadPart = 1000L;
+        if (!SetFilePointerEx(h2, distanceToMove, NULL, FILE_BEGIN)) {
+            DWORD lastError = GetLastError();
+            printf("SetFilePointerEx ERROR: %d\n", lastError);
+            return -1;
+        }
+        memset(buff, 'B', 100);
+        if (!WriteFile(h2, buff, 100, &writtenLen, NULL)) {
+            DWORD lastError = GetLastError();
+            printf("WriteFile ERROR: %d\n", lastError);
+            return -1;
+        }
+        distanceToMove.QuadPart = 1050L;
+        if (!SetFilePointerEx(h1, distanceToMove, NULL, FILE_BEGIN)) {
+            DWORD lastError = GetLastError();
+            printf("SetFilePointerEx ERROR: %d\n", lastError);
+            return -1;
+        }
+        memset(buff, 'C', 100);
+        if (!WriteFile(h1, buff, 100, &writtenLen, NULL)) {
+            DWORD lastError = GetLastError();
+            printf("WriteFile ERROR: %d\n", lastError);
+            return -1;
+        }
+
+        // Both writes are visible from the other handle.
+        distanceToMove.QuadPart = 0L;
+        if (!SetFilePointerEx(h2, distanceToMove, NULL, FILE_BEGIN)) {
+            DWORD lastError = GetLastError();
+            printf("SetFilePointerEx ERROR: %d\n", lastError);
+            return -1;
+        }
+        DWORD readLen;
+        if (!ReadFile(h2, buff, size, &readLen, NULL)) {
+            DWORD lastError = GetLastError();
+            printf("ReadFile ERROR: %d\n", lastError);
+            return -1;
+        }
+        if (readLen != size) {
+            printf("two handles ERROR: size %d\n", readLen);
+            return -1;
+        }
+        for (DWORD i = 0; i < size; ++i) {
+            char c = i < 1000 ? 'A' : i < 1050 ? 'B' : i < 1150 ? 'C' : 'A';
+            if (buff[i] != c) {
+                printf("two handles ERROR: %d %c\n", i, buff[i]);
+                return -1;
+            }
+        }
+        free(buff);
+
+        CloseHandle(h2);
+        CloseHandle(h1);
+    }
 }